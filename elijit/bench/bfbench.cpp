@@ -0,0 +1,463 @@
+// bfbench: runs every elijit engine over a corpus of BF programs and reports
+// how long they take.
+//
+// Each engine binary is run as a child process with --report-times, first
+// --warmup times untimed and then --trials times timed. For every run bfbench
+// records the wall time, the engine's own compile/run split and, where the
+// kernel allows it, the user-space instructions retired (from a perf counter
+// that is enabled on exec, so bfbench's own work is not counted). Results are
+// summarized as median and p99 per engine and program, and can be written as
+// JSON for scripts that compare two builds.
+//
+// Build from the elijit directory:
+//
+// g++ -O2 bench/bfbench.cpp bench/engine_runner.cpp libbfir/utils.cpp -o bench/bfbench
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <glob.h>
+#include <unistd.h>
+
+#include "engine_runner.h"
+#include "../libbfir/utils.h"
+
+namespace
+{
+
+    // Left out of the default corpus because they never halt: nick.bf only
+    // exercises compiler output, and echo.bf reads EOF as -1 and keeps going.
+
+    const char *const kDefaultCorpus[] = {"samples/*.bf", "../bfjitexp/simple/tests/*.bf"};
+    const std::vector<std::string> kExcludedFromCorpus = {"echo.bf", "nick.bf"};
+
+    struct BenchOptions
+    {
+        std::vector<Engine> engines;
+        std::vector<std::string> programs;
+        std::vector<std::string> engine_flags;
+        int warmup = 1;
+        int trials = 5;
+        double timeout = 60;
+        std::string input_path = "/dev/null";
+        std::string json_path;
+    };
+
+    // One run of an engine on a program. compile and run come from the
+    // engine's --report-times line; instructions is -1 if no perf counter
+    // could be opened.
+
+    struct Sample
+    {
+        double wall = 0;
+        double compile = 0;
+        double run = 0;
+        int64_t instructions = -1;
+    };
+
+    struct Result
+    {
+        const Engine *engine;
+        std::string program;
+        std::vector<Sample> samples;
+
+        // Why the engine failed on this program; empty if all runs succeeded.
+        std::string error;
+    };
+
+    struct Summary
+    {
+        double median;
+        double p99;
+    };
+
+    void usage_and_exit(const std::string &progname)
+    {
+        std::cout << "Expecting " << progname << " [flags] [<BF file>...]\n";
+        std::cout << "\nWithout files, runs the programs in samples/ and ../bfjitexp/simple/tests/.\n";
+        std::cout << "\nSupported flags:\n";
+        std::cout << " --engine=NAME=PATH   benchmark the engine binary at PATH; repeat for\n";
+        std::cout << "                      more engines (default: every engine found in the tree)\n";
+        std::cout << " --engine-flag=FLAG   pass FLAG to every engine, e.g. --cell-bits=16\n";
+        std::cout << " --warmup=N           untimed runs before measuring (default 1)\n";
+        std::cout << " --trials=N           timed runs per engine and program (default 5)\n";
+        std::cout << " --timeout=SECONDS    kill runs that take longer (default 60)\n";
+        std::cout << " --input=FILE         standard input for the programs (default /dev/null)\n";
+        std::cout << " --json=FILE          also write the results as JSON ('-' for stdout)\n";
+        exit(EXIT_SUCCESS);
+    }
+
+    bool has_prefix(const std::string &s, const std::string &prefix)
+    {
+        return s.compare(0, prefix.size(), prefix) == 0;
+    }
+
+    int parse_count(const std::string &flag, const std::string &value, int min)
+    {
+        char *end;
+        long n = strtol(value.c_str(), &end, 10);
+        if (value.empty() || *end || n < min || n > 1000000)
+        {
+            DIE << flag << " expects a number >= " << min << ", got '" << value << "'";
+        }
+        return static_cast<int>(n);
+    }
+
+    BenchOptions parse_bench_command_line(int argc, const char **argv)
+    {
+        BenchOptions options;
+        for (int arg_i = 1; arg_i < argc; ++arg_i)
+        {
+            std::string arg = argv[arg_i];
+            if (has_prefix(arg, "--engine="))
+            {
+                std::string spec = arg.substr(9);
+                size_t eq = spec.find('=');
+                if (eq == std::string::npos || eq == 0 || eq + 1 == spec.size())
+                {
+                    DIE << "--engine expects NAME=PATH, got '" << spec << "'";
+                }
+                options.engines.push_back({spec.substr(0, eq), spec.substr(eq + 1), ""});
+            }
+            else if (has_prefix(arg, "--engine-flag="))
+            {
+                options.engine_flags.push_back(arg.substr(14));
+            }
+            else if (has_prefix(arg, "--warmup="))
+            {
+                options.warmup = parse_count("--warmup", arg.substr(9), 0);
+            }
+            else if (has_prefix(arg, "--trials="))
+            {
+                options.trials = parse_count("--trials", arg.substr(9), 1);
+            }
+            else if (has_prefix(arg, "--timeout="))
+            {
+                options.timeout = parse_count("--timeout", arg.substr(10), 1);
+            }
+            else if (has_prefix(arg, "--input="))
+            {
+                options.input_path = arg.substr(8);
+            }
+            else if (has_prefix(arg, "--json="))
+            {
+                options.json_path = arg.substr(7);
+            }
+            else if (has_prefix(arg, "--"))
+            {
+                usage_and_exit(argv[0]);
+            }
+            else
+            {
+                options.programs.push_back(arg);
+            }
+        }
+
+        if (options.engines.empty())
+        {
+            options.engines = built_default_engines("bfbench");
+        }
+
+        if (options.programs.empty())
+        {
+            for (const char *pattern : kDefaultCorpus)
+            {
+                glob_t matches;
+                if (glob(pattern, 0, nullptr, &matches) == 0)
+                {
+                    for (size_t i = 0; i < matches.gl_pathc; ++i)
+                    {
+                        std::string path = matches.gl_pathv[i];
+                        std::string name = path.substr(path.find_last_of('/') + 1);
+                        if (std::find(kExcludedFromCorpus.begin(), kExcludedFromCorpus.end(),
+                                      name) == kExcludedFromCorpus.end())
+                        {
+                            options.programs.push_back(path);
+                        }
+                    }
+                }
+                globfree(&matches);
+            }
+        }
+
+        if (options.engines.empty() || options.programs.empty())
+        {
+            DIE << "nothing to benchmark: no engines or no programs found (run bfbench from the "
+                   "elijit directory, or pass them explicitly)";
+        }
+        return options;
+    }
+
+    // Runs engine on program once. Returns an empty string on success, and
+    // otherwise what went wrong.
+
+    std::string run_once(const BenchOptions &options, const Engine &engine,
+                         const std::string &program, Sample *sample)
+    {
+        std::vector<std::string> argv = {engine.path, "--report-times"};
+        argv.insert(argv.end(), options.engine_flags.begin(), options.engine_flags.end());
+        argv.push_back(program);
+
+        EngineRun run = run_engine(argv, options.input_path, options.timeout, false);
+        sample->wall = run.wall;
+        sample->instructions = run.instructions;
+
+        std::string failure = run.failure();
+        if (!failure.empty())
+        {
+            return failure;
+        }
+        if (!parse_phase_times(run.err, &sample->compile, &sample->run))
+        {
+            return "no --report-times output (engine built from an older tree?)";
+        }
+        return "";
+    }
+
+    // Nearest-rank percentile, p in (0, 100].
+
+    double percentile(std::vector<double> values, double p)
+    {
+        std::sort(values.begin(), values.end());
+        size_t rank = static_cast<size_t>(std::ceil(p / 100 * values.size()));
+        return values[std::max<size_t>(rank, 1) - 1];
+    }
+
+    template <typename Field>
+    Summary summarize(const std::vector<Sample> &samples, Field field)
+    {
+        std::vector<double> values;
+        for (const Sample &s : samples)
+        {
+            values.push_back(field(s));
+        }
+        return {percentile(values, 50), percentile(values, 99)};
+    }
+
+    bool has_instructions(const std::vector<Sample> &samples)
+    {
+        for (const Sample &s : samples)
+        {
+            if (s.instructions < 0)
+            {
+                return false;
+            }
+        }
+        return !samples.empty();
+    }
+
+    std::string json_string(const std::string &s)
+    {
+        std::ostringstream out;
+        out << '"';
+        for (unsigned char c : s)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out << '\\' << c;
+            }
+            else if (c < 0x20)
+            {
+                out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c)
+                    << std::dec << std::setfill(' ');
+            }
+            else
+            {
+                out << c;
+            }
+        }
+        out << '"';
+        return out.str();
+    }
+
+    void write_json_summary(std::ostream &out, const char *name, Summary summary)
+    {
+        out << json_string(name) << ": {\"median\": " << summary.median << ", \"p99\": "
+            << summary.p99 << "}";
+    }
+
+    void write_json(std::ostream &out, const BenchOptions &options,
+                    const std::vector<Result> &results)
+    {
+        out << std::setprecision(9);
+        out << "{\n  \"warmup\": " << options.warmup << ",\n  \"trials\": " << options.trials
+            << ",\n  \"engine_flags\": [";
+        for (size_t i = 0; i < options.engine_flags.size(); ++i)
+        {
+            out << (i ? ", " : "") << json_string(options.engine_flags[i]);
+        }
+        out << "],\n  \"results\": [";
+
+        for (size_t r = 0; r < results.size(); ++r)
+        {
+            const Result &result = results[r];
+            out << (r ? "," : "") << "\n    {\"engine\": " << json_string(result.engine->name)
+                << ", \"engine_path\": " << json_string(result.engine->path)
+                << ", \"program\": " << json_string(result.program) << ", \"ok\": "
+                << (result.error.empty() ? "true" : "false");
+
+            if (!result.error.empty())
+            {
+                out << ", \"error\": " << json_string(result.error) << "}";
+                continue;
+            }
+
+            out << ",\n     ";
+            write_json_summary(out, "wall_seconds", summarize(result.samples, [](const Sample &s) { return s.wall; }));
+            out << ",\n     ";
+            write_json_summary(out, "compile_seconds", summarize(result.samples, [](const Sample &s) { return s.compile; }));
+            out << ",\n     ";
+            write_json_summary(out, "run_seconds", summarize(result.samples, [](const Sample &s) { return s.run; }));
+            out << ",\n     \"instructions\": ";
+            if (has_instructions(result.samples))
+            {
+                Summary instructions = summarize(result.samples, [](const Sample &s) { return static_cast<double>(s.instructions); });
+                out << "{\"median\": " << static_cast<int64_t>(instructions.median)
+                    << ", \"p99\": " << static_cast<int64_t>(instructions.p99) << "}";
+            }
+            else
+            {
+                out << "null";
+            }
+
+            out << ",\n     \"samples\": [";
+            for (size_t i = 0; i < result.samples.size(); ++i)
+            {
+                const Sample &s = result.samples[i];
+                out << (i ? ", " : "") << "{\"wall\": " << s.wall << ", \"compile\": " << s.compile
+                    << ", \"run\": " << s.run << ", \"instructions\": ";
+                if (s.instructions >= 0)
+                {
+                    out << s.instructions;
+                }
+                else
+                {
+                    out << "null";
+                }
+                out << "}";
+            }
+            out << "]}";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+    std::string format_seconds(double seconds)
+    {
+        std::ostringstream out;
+        out << std::fixed;
+        if (seconds < 1e-3)
+        {
+            out << std::setprecision(1) << seconds * 1e6 << "us";
+        }
+        else if (seconds < 1)
+        {
+            out << std::setprecision(2) << seconds * 1e3 << "ms";
+        }
+        else
+        {
+            out << std::setprecision(3) << seconds << "s";
+        }
+        return out.str();
+    }
+
+    void print_table(const std::vector<Result> &results)
+    {
+        std::cout << std::left << std::setw(14) << "engine" << std::setw(28) << "program"
+                  << std::right << std::setw(11) << "wall med" << std::setw(11) << "wall p99"
+                  << std::setw(11) << "compile" << std::setw(11) << "run" << std::setw(16)
+                  << "instructions"
+                  << "\n";
+
+        for (const Result &result : results)
+        {
+            std::string program = result.program.substr(result.program.find_last_of('/') + 1);
+            std::cout << std::left << std::setw(14) << result.engine->name << std::setw(28)
+                      << program << std::right;
+
+            if (!result.error.empty())
+            {
+                std::cout << "  FAILED: " << result.error << "\n";
+                continue;
+            }
+
+            Summary wall = summarize(result.samples, [](const Sample &s) { return s.wall; });
+            Summary compile = summarize(result.samples, [](const Sample &s) { return s.compile; });
+            Summary run = summarize(result.samples, [](const Sample &s) { return s.run; });
+            std::cout << std::setw(11) << format_seconds(wall.median) << std::setw(11)
+                      << format_seconds(wall.p99) << std::setw(11) << format_seconds(compile.median)
+                      << std::setw(11) << format_seconds(run.median) << std::setw(16);
+            if (has_instructions(result.samples))
+            {
+                std::cout << static_cast<int64_t>(
+                    summarize(result.samples, [](const Sample &s) { return static_cast<double>(s.instructions); }).median);
+            }
+            else
+            {
+                std::cout << "n/a";
+            }
+            std::cout << "\n";
+        }
+    }
+} // namespace
+
+int main(int argc, const char **argv)
+{
+    BenchOptions options = parse_bench_command_line(argc, argv);
+
+    std::vector<Result> results;
+    bool all_ok = true;
+
+    for (const Engine &engine : options.engines)
+    {
+        for (const std::string &program : options.programs)
+        {
+            Result result{&engine, program, {}, ""};
+            for (int i = 0; i < options.warmup + options.trials && result.error.empty(); ++i)
+            {
+                Sample sample;
+                result.error = run_once(options, engine, program, &sample);
+                if (i >= options.warmup)
+                {
+                    result.samples.push_back(sample);
+                }
+            }
+            if (!result.error.empty())
+            {
+                result.samples.clear();
+                all_ok = false;
+                std::cerr << "bfbench: " << engine.name << " failed on " << program << ": "
+                          << result.error << "\n";
+            }
+            results.push_back(result);
+        }
+    }
+
+    if (options.json_path == "-")
+    {
+        write_json(std::cout, options, results);
+    }
+    else
+    {
+        print_table(results);
+        if (!options.json_path.empty())
+        {
+            std::ofstream json(options.json_path);
+            if (!json)
+            {
+                DIE << "unable to open " << options.json_path;
+            }
+            write_json(json, options, results);
+        }
+    }
+
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,691 @@
+// bffuzz: differential fuzzer for the elijit engines.
+//
+// Generates random well-nested BF programs, heavy on the loop shapes the
+// optimizers rewrite (clears, scans, multiply-adds, nested counters), and runs
+// each one with random input on every engine. An engine's output, final data
+// pointer and final tape (from --dump-state) must match those of the
+// reference interpreter built into bffuzz. Before that, a step-limited run of
+// the reference interpreter discards programs that don't halt quickly or move
+// off the start of the tape, so every engine only gets programs with bounded
+// runtime.
+//
+// bffuzz also watches speed: an engine with a baseline (see default_engines)
+// is flagged when it is more than --slowdown times slower than its baseline
+// on a program, comparing instructions retired when perf counters are
+// available and the engines' --report-times run time otherwise.
+//
+// Every failing program is saved to --out-dir together with its input, and
+// program N of a session can be regenerated with --seed=<seed + N>
+// --iterations=1.
+//
+// Build from the elijit directory:
+//
+// g++ -O2 bench/bffuzz.cpp bench/engine_runner.cpp libbfir/utils.cpp -o bench/bffuzz
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "engine_runner.h"
+#include "../libbfir/utils.h"
+
+namespace
+{
+
+    // Programs must keep the data pointer within this many cells.
+
+    constexpr size_t kMaxCells = 4096;
+
+    // Run times are only compared when the baseline ran for at least this
+    // long; below it, noise dominates.
+
+    constexpr double kMinComparedRunSeconds = 10e-3;
+
+    // A slowdown seen in run times is only reported if it holds for the best
+    // of this many more runs of both engines.
+
+    constexpr int kConfirmationRuns = 3;
+
+    struct FuzzOptions
+    {
+        std::vector<Engine> engines;
+        uint64_t seed = 0;
+        int iterations = 1000;
+        uint64_t max_steps = 2000000;
+        int cell_bits = 8;
+        double slowdown = 1.5;
+        double timeout = 10;
+        std::string out_dir = "bffuzz-failures";
+    };
+
+    void usage_and_exit(const std::string &progname)
+    {
+        std::cout << "Expecting " << progname << " [flags]\n";
+        std::cout << "\nSupported flags:\n";
+        std::cout << " --engine=NAME=PATH[:BASELINE]\n";
+        std::cout << "                      fuzz the engine binary at PATH, flagging it when it is\n";
+        std::cout << "                      slower than engine BASELINE; repeat for more engines\n";
+        std::cout << "                      (default: every engine found in the tree)\n";
+        std::cout << " --seed=N             seed of the first program (default: the time)\n";
+        std::cout << " --iterations=N       number of programs to try (default 1000)\n";
+        std::cout << " --max-steps=N        discard programs running longer in the reference\n";
+        std::cout << "                      interpreter (default 2000000)\n";
+        std::cout << " --cell-bits=N        cell width passed to the engines (default 8)\n";
+        std::cout << " --slowdown=X         flag engines X times slower than their baseline\n";
+        std::cout << "                      (default 1.5)\n";
+        std::cout << " --timeout=SECONDS    time limit per engine run (default 10)\n";
+        std::cout << " --out-dir=DIR        where to save failing programs (default bffuzz-failures)\n";
+        exit(EXIT_SUCCESS);
+    }
+
+    bool has_prefix(const std::string &s, const std::string &prefix)
+    {
+        return s.compare(0, prefix.size(), prefix) == 0;
+    }
+
+    uint64_t parse_number(const std::string &flag, const std::string &value)
+    {
+        char *end;
+        errno = 0;
+        unsigned long long n = strtoull(value.c_str(), &end, 10);
+        if (value.empty() || *end || errno)
+        {
+            DIE << flag << " expects a number, got '" << value << "'";
+        }
+        return n;
+    }
+
+    FuzzOptions parse_fuzz_command_line(int argc, const char **argv)
+    {
+        FuzzOptions options;
+        options.seed = std::chrono::system_clock::now().time_since_epoch().count();
+
+        for (int arg_i = 1; arg_i < argc; ++arg_i)
+        {
+            std::string arg = argv[arg_i];
+            if (has_prefix(arg, "--engine="))
+            {
+                std::string spec = arg.substr(9);
+                size_t eq = spec.find('=');
+                if (eq == std::string::npos || eq == 0 || eq + 1 == spec.size())
+                {
+                    DIE << "--engine expects NAME=PATH[:BASELINE], got '" << spec << "'";
+                }
+                Engine engine{spec.substr(0, eq), spec.substr(eq + 1), ""};
+                size_t colon = engine.path.find(':');
+                if (colon != std::string::npos)
+                {
+                    engine.baseline = engine.path.substr(colon + 1);
+                    engine.path.resize(colon);
+                }
+                options.engines.push_back(engine);
+            }
+            else if (has_prefix(arg, "--seed="))
+            {
+                options.seed = parse_number("--seed", arg.substr(7));
+            }
+            else if (has_prefix(arg, "--iterations="))
+            {
+                options.iterations = static_cast<int>(parse_number("--iterations", arg.substr(13)));
+            }
+            else if (has_prefix(arg, "--max-steps="))
+            {
+                options.max_steps = parse_number("--max-steps", arg.substr(12));
+            }
+            else if (has_prefix(arg, "--cell-bits="))
+            {
+                options.cell_bits = static_cast<int>(parse_number("--cell-bits", arg.substr(12)));
+                if (options.cell_bits != 8 && options.cell_bits != 16 && options.cell_bits != 32)
+                {
+                    DIE << "--cell-bits must be 8, 16 or 32";
+                }
+            }
+            else if (has_prefix(arg, "--slowdown="))
+            {
+                options.slowdown = atof(arg.substr(11).c_str());
+                if (options.slowdown <= 1)
+                {
+                    DIE << "--slowdown must be greater than 1";
+                }
+            }
+            else if (has_prefix(arg, "--timeout="))
+            {
+                options.timeout = static_cast<double>(parse_number("--timeout", arg.substr(10)));
+            }
+            else if (has_prefix(arg, "--out-dir="))
+            {
+                options.out_dir = arg.substr(10);
+            }
+            else
+            {
+                usage_and_exit(argv[0]);
+            }
+        }
+
+        if (options.engines.empty())
+        {
+            options.engines = built_default_engines("bffuzz");
+        }
+        if (options.engines.empty())
+        {
+            DIE << "no engines to fuzz (run bffuzz from the elijit directory, or pass --engine)";
+        }
+        return options;
+    }
+
+    // Random program generation. Loops mostly have a shape that terminates:
+    // a counter cell decremented once per iteration around a body that
+    // returns to it, or one of the idioms the optimizers recognize. Anything
+    // else is left to the step limit.
+
+    class ProgramGenerator
+    {
+    public:
+        explicit ProgramGenerator(uint64_t seed) : rng_(seed) {}
+
+        // Programs start a few cells into the tape, so that the generated
+        // moves to the left seldom run off it.
+
+        std::string generate()
+        {
+            std::string program(pick(4, 16), '>');
+            block(&program, 0, pick(4, 24));
+            return program;
+        }
+
+        std::string input()
+        {
+            std::string bytes(pick(0, 16), '\0');
+            for (char &c : bytes)
+            {
+                c = static_cast<char>(pick(0, 255));
+            }
+            return bytes;
+        }
+
+    private:
+        int pick(int lo, int hi)
+        {
+            return std::uniform_int_distribution<int>(lo, hi)(rng_);
+        }
+
+        void repeat(std::string *out, char c, int n)
+        {
+            out->append(n, c);
+        }
+
+        // Pointer moves and arithmetic that leave the pointer where it started.
+
+        void balanced_body(std::string *out, int depth)
+        {
+            int offset = 0;
+            for (int i = pick(1, 4); i > 0; --i)
+            {
+                int move = pick(-3, 3);
+                if (offset + move == 0)
+                {
+                    // Keep off the counter.
+                    ++move;
+                }
+                repeat(out, move < 0 ? '<' : '>', std::abs(move));
+                offset += move;
+                if (depth < 3 && pick(0, 5) == 0)
+                {
+                    counted_loop(out, depth + 1);
+                }
+                else
+                {
+                    repeat(out, pick(0, 1) ? '+' : '-', pick(1, 5));
+                }
+                if (pick(0, 9) == 0)
+                {
+                    out->push_back('.');
+                }
+            }
+            repeat(out, offset < 0 ? '>' : '<', std::abs(offset));
+        }
+
+        // [- body] with the counter decremented once per iteration.
+
+        void counted_loop(std::string *out, int depth)
+        {
+            repeat(out, '+', pick(1, 12));
+            out->push_back('[');
+            if (pick(0, 1))
+            {
+                out->push_back('-');
+                balanced_body(out, depth);
+            }
+            else
+            {
+                balanced_body(out, depth);
+                out->push_back('-');
+            }
+            out->push_back(']');
+        }
+
+        void idiom(std::string *out)
+        {
+            switch (pick(0, 6))
+            {
+            case 0:
+                out->append(pick(0, 1) ? "[-]" : "[+]");
+                break;
+            case 1:
+            {
+                // Multiply-add loop: [->++>+++<<] and friends.
+                out->append(pick(0, 1) ? "[-" : "[");
+                bool decremented = out->back() == '-';
+                int offset = 0;
+                for (int i = pick(1, 3); i > 0; --i)
+                {
+                    int move = pick(-2, 2);
+                    if (move == 0)
+                    {
+                        move = 1;
+                    }
+                    repeat(out, move < 0 ? '<' : '>', std::abs(move));
+                    offset += move;
+                    repeat(out, pick(0, 1) ? '+' : '-', pick(1, 4));
+                }
+                repeat(out, offset < 0 ? '>' : '<', std::abs(offset));
+                if (!decremented)
+                {
+                    out->push_back('-');
+                }
+                out->push_back(']');
+                break;
+            }
+            case 2:
+            {
+                // Scans over a few set cells to the next zero.
+                int stride = pick(1, 3);
+                char dir = pick(0, 3) ? '>' : '<';
+                out->push_back('[');
+                repeat(out, dir, stride);
+                out->push_back(']');
+                break;
+            }
+            case 3:
+                out->append(",");
+                break;
+            case 4:
+                out->append(".");
+                break;
+            default:
+                counted_loop(out, 0);
+                break;
+            }
+        }
+
+        void block(std::string *out, int depth, int length)
+        {
+            for (int i = 0; i < length; ++i)
+            {
+                switch (pick(0, 9))
+                {
+                case 0:
+                case 1:
+                    repeat(out, pick(0, 1) ? '+' : '-', pick(1, 20));
+                    break;
+                case 2:
+                case 3:
+                    repeat(out, pick(0, 2) ? '>' : '<', pick(1, 4));
+                    break;
+                case 4:
+                case 5:
+                case 6:
+                case 7:
+                    idiom(out);
+                    break;
+                case 8:
+                    counted_loop(out, depth);
+                    break;
+                default:
+                    if (depth < 4)
+                    {
+                        // A free-form loop; the step limit weeds out the ones
+                        // that never finish.
+                        out->push_back('[');
+                        block(out, depth + 1, pick(1, 5));
+                        out->push_back(']');
+                    }
+                    break;
+                }
+            }
+        }
+
+        std::mt19937_64 rng_;
+    };
+
+    // The expected result of running a program, in the format of
+    // Tape::write_state for the state.
+
+    struct Outcome
+    {
+        std::string output;
+        std::string state;
+    };
+
+    // Reference semantics, kept as plain as possible. Returns false if the
+    // program exceeds max_steps or leaves [0, kMaxCells).
+
+    bool reference_run(const std::string &program, const std::string &input, int cell_bits,
+                       uint64_t max_steps, Outcome *outcome)
+    {
+        std::vector<size_t> partner(program.size());
+        std::vector<size_t> open;
+        for (size_t pc = 0; pc < program.size(); ++pc)
+        {
+            if (program[pc] == '[')
+            {
+                open.push_back(pc);
+            }
+            else if (program[pc] == ']')
+            {
+                partner[pc] = open.back();
+                partner[open.back()] = pc;
+                open.pop_back();
+            }
+        }
+
+        uint32_t mask = cell_bits == 32 ? 0xFFFFFFFFu : (1u << cell_bits) - 1;
+        std::vector<uint32_t> tape(kMaxCells, 0);
+        size_t dataptr = 0;
+        size_t input_pos = 0;
+        uint64_t steps = 0;
+
+        for (size_t pc = 0; pc < program.size(); ++pc, ++steps)
+        {
+            if (steps > max_steps)
+            {
+                return false;
+            }
+            switch (program[pc])
+            {
+            case '>':
+                if (++dataptr == kMaxCells)
+                {
+                    return false;
+                }
+                break;
+            case '<':
+                if (dataptr-- == 0)
+                {
+                    return false;
+                }
+                break;
+            case '+':
+                tape[dataptr] = (tape[dataptr] + 1) & mask;
+                break;
+            case '-':
+                tape[dataptr] = (tape[dataptr] - 1) & mask;
+                break;
+            case '.':
+                outcome->output.push_back(static_cast<char>(tape[dataptr]));
+                break;
+            case ',':
+                tape[dataptr] = input_pos < input.size()
+                                    ? static_cast<uint8_t>(input[input_pos++])
+                                    : mask;
+                break;
+            case '[':
+                if (!tape[dataptr])
+                {
+                    pc = partner[pc];
+                }
+                break;
+            case ']':
+                if (tape[dataptr])
+                {
+                    pc = partner[pc];
+                }
+                break;
+            }
+        }
+
+        std::ostringstream state;
+        state << "dataptr " << dataptr << "\n";
+        for (size_t i = 0; i < kMaxCells; ++i)
+        {
+            if (tape[i])
+            {
+                state << i << " " << tape[i] << "\n";
+            }
+        }
+        outcome->state = state.str();
+        return true;
+    }
+
+    std::string read_file(const std::string &path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        std::ostringstream contents;
+        contents << in.rdbuf();
+        return contents.str();
+    }
+
+    void write_file(const std::string &path, const std::string &contents)
+    {
+        std::ofstream out(path, std::ios::binary);
+        out << contents;
+        if (!out)
+        {
+            DIE << "unable to write " << path;
+        }
+    }
+
+    // Describes where two outputs first differ.
+
+    std::string first_difference(const std::string &expected, const std::string &actual)
+    {
+        size_t i = 0;
+        while (i < expected.size() && i < actual.size() && expected[i] == actual[i])
+        {
+            ++i;
+        }
+        std::ostringstream out;
+        out << "differs at byte " << i << " (expected " << expected.size() << " bytes, got "
+            << actual.size() << ")";
+        return out.str();
+    }
+
+    // Returns the first line that differs between two state dumps.
+
+    std::string first_state_difference(const std::string &expected, const std::string &actual)
+    {
+        std::istringstream e(expected), a(actual);
+        std::string el, al;
+        while (true)
+        {
+            bool more_e = static_cast<bool>(std::getline(e, el));
+            bool more_a = static_cast<bool>(std::getline(a, al));
+            if (!more_e && !more_a)
+            {
+                return "";
+            }
+            if (!more_e || !more_a || el != al)
+            {
+                return "expected '" + (more_e ? el : "<end>") + "', got '" +
+                       (more_a ? al : "<end>") + "'";
+            }
+        }
+    }
+
+    // What an engine did with one program.
+
+    struct EngineResult
+    {
+        bool ok = false;
+        double run_seconds = 0;
+        int64_t instructions = -1;
+    };
+} // namespace
+
+int main(int argc, const char **argv)
+{
+    FuzzOptions options = parse_fuzz_command_line(argc, argv);
+
+    char work_template[] = "/tmp/bffuzz.XXXXXX";
+    if (!mkdtemp(work_template))
+    {
+        DIE << "mkdtemp: " << strerror(errno);
+    }
+    std::string work_dir = work_template;
+    std::string program_path = work_dir + "/program.bf";
+    std::string input_path = work_dir + "/input";
+    std::string state_path = work_dir + "/state";
+
+    std::cout << "bffuzz: seed " << options.seed << ", " << options.engines.size()
+              << " engines, " << options.cell_bits << "-bit cells\n";
+
+    int tried = 0, skipped = 0, mismatches = 0, slowdowns = 0;
+
+    // Saves the program and its input for a report, once per program.
+
+    uint64_t saved_seed = 0;
+    bool saved = false;
+    auto save_failure = [&](uint64_t seed, const std::string &program, const std::string &input) {
+        std::string base = options.out_dir + "/" + std::to_string(seed);
+        if (!saved || saved_seed != seed)
+        {
+            mkdir(options.out_dir.c_str(), 0755);
+            write_file(base + ".bf", program);
+            write_file(base + ".in", input);
+            saved = true;
+            saved_seed = seed;
+        }
+        return base + ".bf";
+    };
+
+    for (int iteration = 0; iteration < options.iterations; ++iteration)
+    {
+        uint64_t seed = options.seed + iteration;
+        ProgramGenerator generator(seed);
+        std::string program = generator.generate();
+        std::string input = generator.input();
+
+        Outcome expected;
+        if (!reference_run(program, input, options.cell_bits, options.max_steps, &expected))
+        {
+            ++skipped;
+            continue;
+        }
+        ++tried;
+
+        write_file(program_path, program);
+        write_file(input_path, input);
+
+        std::map<std::string, EngineResult> results;
+        for (const Engine &engine : options.engines)
+        {
+            unlink(state_path.c_str());
+            std::vector<std::string> engine_argv = {
+                engine.path, "--report-times", "--cell-bits=" + std::to_string(options.cell_bits),
+                "--dump-state=" + state_path, program_path};
+            EngineRun run = run_engine(engine_argv, input_path, options.timeout, true);
+
+            std::string problem = run.failure();
+            if (problem.empty() && run.out != expected.output)
+            {
+                problem = "output " + first_difference(expected.output, run.out);
+            }
+            if (problem.empty())
+            {
+                std::string state_difference = first_state_difference(expected.state, read_file(state_path));
+                if (!state_difference.empty())
+                {
+                    problem = "final state: " + state_difference;
+                }
+            }
+
+            EngineResult &result = results[engine.name];
+            if (!problem.empty())
+            {
+                ++mismatches;
+                std::cout << "MISMATCH " << engine.name << " on "
+                          << save_failure(seed, program, input) << ": " << problem << "\n";
+                continue;
+            }
+
+            double compile_seconds;
+            result.ok = parse_phase_times(run.err, &compile_seconds, &result.run_seconds);
+            result.instructions = run.instructions;
+        }
+
+        // Compare each engine that has one against its baseline.
+
+        auto best_run_seconds = [&](const std::string &name, double seconds) {
+            auto engine = std::find_if(options.engines.begin(), options.engines.end(),
+                                       [&](const Engine &e) { return e.name == name; });
+            for (int i = 0; i < kConfirmationRuns; ++i)
+            {
+                std::vector<std::string> engine_argv = {
+                    engine->path, "--report-times",
+                    "--cell-bits=" + std::to_string(options.cell_bits), program_path};
+                EngineRun run = run_engine(engine_argv, input_path, options.timeout, false);
+                double compile_seconds, run_seconds;
+                if (parse_phase_times(run.err, &compile_seconds, &run_seconds))
+                {
+                    seconds = std::min(seconds, run_seconds);
+                }
+            }
+            return seconds;
+        };
+
+        for (const Engine &engine : options.engines)
+        {
+            auto self = results.find(engine.name);
+            auto base = results.find(engine.baseline);
+            if (engine.baseline.empty() || base == results.end() || !self->second.ok ||
+                !base->second.ok)
+            {
+                continue;
+            }
+
+            bool by_instructions = self->second.instructions >= 0 && base->second.instructions >= 0;
+            double cost = by_instructions ? self->second.instructions : self->second.run_seconds;
+            double base_cost = by_instructions ? base->second.instructions : base->second.run_seconds;
+            if (!by_instructions &&
+                (base_cost < kMinComparedRunSeconds || cost <= options.slowdown * base_cost))
+            {
+                continue;
+            }
+            if (!by_instructions)
+            {
+                cost = best_run_seconds(engine.name, cost);
+                base_cost = best_run_seconds(engine.baseline, base_cost);
+            }
+            if (cost > options.slowdown * base_cost)
+            {
+                ++slowdowns;
+                std::cout << "SLOWER " << engine.name << " than " << engine.baseline << " on "
+                          << save_failure(seed, program, input) << ": " << cost << " vs "
+                          << base_cost << (by_instructions ? " instructions" : "s") << "\n";
+            }
+        }
+    }
+
+    unlink(program_path.c_str());
+    unlink(input_path.c_str());
+    unlink(state_path.c_str());
+    rmdir(work_dir.c_str());
+
+    std::cout << "bffuzz: " << tried << " programs run, " << skipped
+              << " discarded by the reference interpreter, " << mismatches << " mismatches, "
+              << slowdowns << " slowdowns\n";
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,249 @@
+#include "engine_runner.h"
+#include "../libbfir/utils.h"
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace
+{
+
+    // Counts the user-space instructions retired by pid and its children,
+    // starting when it calls exec. Returns -1 if perf events are unavailable.
+
+    int open_instruction_counter(pid_t pid)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        attr.disabled = 1;
+        attr.enable_on_exec = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC));
+    }
+
+    // Runs the empty program with the flags bfbench and bffuzz rely on. An
+    // engine built from an older tree prints its usage instead, and would
+    // otherwise show up as a mismatch on every program.
+
+    bool supports_runner_flags(const Engine &engine)
+    {
+        EngineRun run = run_engine(
+            {engine.path, "--report-times", "--dump-state=/dev/null", "/dev/null"}, "/dev/null",
+            10, false);
+        double compile, run_time;
+        return run.failure().empty() && parse_phase_times(run.err, &compile, &run_time);
+    }
+} // namespace
+
+const std::vector<Engine> &default_engines()
+{
+    static const std::vector<Engine> engines = {
+        {"simpleinterp", "interpreter/simpleinterp", ""},
+        {"optinterp", "interpreter/optinterp", "simpleinterp"},
+        {"optinterp2", "optinterp2/optinterp", "optinterp"},
+        {"simplejit", "jit/simpleJit/simplejit", ""},
+        {"simpleasmjit", "jit/simpleasmjit/simpleasmjit", ""},
+        {"optasmjit", "jit/optasmjit/optasmjit", "simplejit"},
+    };
+    return engines;
+}
+
+std::vector<Engine> built_default_engines(const std::string &tool)
+{
+    std::vector<Engine> built;
+    for (const Engine &engine : default_engines())
+    {
+        if (access(engine.path.c_str(), X_OK) != 0)
+        {
+            std::cerr << tool << ": skipping " << engine.name << ", " << engine.path
+                      << " is not built\n";
+        }
+        else if (!supports_runner_flags(engine))
+        {
+            std::cerr << tool << ": skipping " << engine.name << ", " << engine.path
+                      << " is out of date (no --report-times or --dump-state)\n";
+        }
+        else
+        {
+            built.push_back(engine);
+        }
+    }
+    return built;
+}
+
+std::string EngineRun::failure() const
+{
+    std::string reason;
+    if (timed_out)
+    {
+        reason = "timed out";
+    }
+    else if (WIFSIGNALED(status))
+    {
+        reason = "killed by signal " + std::to_string(WTERMSIG(status));
+    }
+    else if (WEXITSTATUS(status) != 0)
+    {
+        reason = "exited with status " + std::to_string(WEXITSTATUS(status));
+    }
+    else
+    {
+        return "";
+    }
+
+    if (!err.empty())
+    {
+        reason += ": " + err.substr(0, err.find('\n'));
+    }
+    return reason;
+}
+
+EngineRun run_engine(const std::vector<std::string> &argv, const std::string &input_path,
+                     double timeout, bool capture_output)
+{
+    int input_fd = open(input_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (input_fd < 0)
+    {
+        DIE << "unable to open input " << input_path << ": " << strerror(errno);
+    }
+
+    // The child blocks on start_pipe until the perf counter is attached.
+
+    int start_pipe[2];
+    int out_pipe[2];
+    int err_pipe[2];
+    if (pipe2(start_pipe, O_CLOEXEC) != 0 || pipe2(out_pipe, O_CLOEXEC) != 0 ||
+        pipe2(err_pipe, O_CLOEXEC) != 0)
+    {
+        DIE << "pipe: " << strerror(errno);
+    }
+
+    std::vector<std::string> args = argv;
+    std::vector<char *> c_argv;
+    for (std::string &arg : args)
+    {
+        c_argv.push_back(&arg[0]);
+    }
+    c_argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        DIE << "fork: " << strerror(errno);
+    }
+    if (pid == 0)
+    {
+        int out_fd = capture_output ? out_pipe[1] : open("/dev/null", O_WRONLY);
+        char go;
+        if (out_fd < 0 || dup2(input_fd, 0) < 0 || dup2(out_fd, 1) < 0 ||
+            dup2(err_pipe[1], 2) < 0 || read(start_pipe[0], &go, 1) != 1)
+        {
+            _exit(127);
+        }
+        execv(c_argv[0], c_argv.data());
+        dprintf(2, "exec %s: %s\n", c_argv[0], strerror(errno));
+        _exit(127);
+    }
+
+    close(input_fd);
+    close(start_pipe[0]);
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+
+    EngineRun run;
+    int counter_fd = open_instruction_counter(pid);
+    Timer wall_timer;
+    if (write(start_pipe[1], "g", 1) != 1)
+    {
+        DIE << "unable to start " << argv[0];
+    }
+    close(start_pipe[1]);
+
+    // Collect the output until the child closes both pipes, killing it if it
+    // overruns the timeout.
+
+    struct pollfd fds[2] = {{out_pipe[0], POLLIN, 0}, {err_pipe[0], POLLIN, 0}};
+    std::string *sinks[2] = {&run.out, &run.err};
+    int open_fds = 2;
+    char buf[4096];
+    while (open_fds > 0)
+    {
+        double remaining = timeout - wall_timer.elapsed();
+        if (remaining <= 0)
+        {
+            kill(pid, SIGKILL);
+            run.timed_out = true;
+            break;
+        }
+        int ready = poll(fds, 2, static_cast<int>(std::ceil(remaining * 1000)));
+        if (ready <= 0)
+        {
+            continue;
+        }
+        for (int i = 0; i < 2; ++i)
+        {
+            if (fds[i].fd < 0 || !fds[i].revents)
+            {
+                continue;
+            }
+            ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                --open_fds;
+                continue;
+            }
+            sinks[i]->append(buf, n);
+        }
+    }
+    for (const struct pollfd &fd : fds)
+    {
+        if (fd.fd >= 0)
+        {
+            close(fd.fd);
+        }
+    }
+
+    while (waitpid(pid, &run.status, 0) < 0 && errno == EINTR)
+    {
+    }
+    run.wall = wall_timer.elapsed();
+
+    if (counter_fd >= 0)
+    {
+        uint64_t count;
+        if (read(counter_fd, &count, sizeof(count)) == sizeof(count))
+        {
+            run.instructions = static_cast<int64_t>(count);
+        }
+        close(counter_fd);
+    }
+    return run;
+}
+
+bool parse_phase_times(const std::string &err, double *compile, double *run)
+{
+    size_t pos = err.rfind("elijit-times:");
+    return pos != std::string::npos &&
+           sscanf(err.c_str() + pos, "elijit-times: compile=%lf run=%lf", compile, run) == 2;
+}
@@ -0,0 +1,67 @@
+#ifndef ENGINE_RUNNER_H
+#define ENGINE_RUNNER_H
+
+// Runs engine binaries as child processes, for bfbench and bffuzz.
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct Engine
+{
+    std::string name;
+    std::string path;
+
+    // The engine this one is meant to beat, if any; bffuzz flags programs on
+    // which it is slower.
+    std::string baseline;
+};
+
+// The engines that exist in the tree, at the paths the build lines in
+// libbfir/README.md put them, relative to the elijit directory.
+
+const std::vector<Engine> &default_engines();
+
+// The default engines that have been built from this tree, which is checked by
+// running them once on the empty program; tells on stderr, prefixed with tool,
+// which ones are skipped.
+
+std::vector<Engine> built_default_engines(const std::string &tool);
+
+struct EngineRun
+{
+    // What the engine wrote; out stays empty unless it was captured.
+    std::string out;
+    std::string err;
+
+    double wall = 0;
+
+    // User-space instructions retired, or -1 if no perf counter could be
+    // opened.
+    int64_t instructions = -1;
+
+    // As returned by waitpid.
+    int status = 0;
+    bool timed_out = false;
+
+    // Returns an empty string if the engine exited successfully, and
+    // otherwise what went wrong, including the first line it wrote to stderr.
+    std::string failure() const;
+};
+
+// Runs argv[0] with the arguments argv and stdin from input_path, until it
+// exits or timeout seconds have passed, after which it is killed. Stdout is
+// collected into out if capture_output is set and discarded otherwise.
+//
+// The instruction counter is attached before the child execs and counts from
+// exec on, so none of the runner's own work is included.
+
+EngineRun run_engine(const std::vector<std::string> &argv, const std::string &input_path,
+                     double timeout, bool capture_output);
+
+// Parses the "elijit-times: compile=<s> run=<s>" line that engines print to
+// stderr with --report-times.
+
+bool parse_phase_times(const std::string &err, double *compile, double *run);
+
+#endif /*ENGINE_RUNNER_H*/
@@ -6,20 +6,32 @@
 #include <sstream>
 #include <vector>
 
-#include "parser.h"
-#include "utils.h"
+#include "../libbfir/bfio.h"
+#include "../libbfir/parser.h"
+#include "../libbfir/tape.h"
+#include "../libbfir/utils.h"
 
-constexpr int MEMORY_SIZE = 30000;
+// Cell is the type of a tape cell: uint8_t, uint16_t or uint32_t.
 
-void simpleIntrep(const Program &p, bool verbose)
+template <typename Cell>
+void simpleIntrep(const Program &p, const Options &options)
 {
+    bool verbose = options.verbose;
 
     // Initialize state
 
-    std::vector<uint8_t> memory(MEMORY_SIZE, 0);
+    Tape tape(sizeof(Cell), max_pointer_move(p.instructions));
+    Cell *memory = tape.cells<Cell>();
+    std::unique_ptr<BfIo> io(new BfIo);
+    bfio_init(io.get());
+    tape.set_io(io.get());
     size_t pc = 0;
     size_t dataptr = 0;
 
+    // Program output bypasses std::cout, so get the verbose output out first.
+    std::cout.flush();
+    mark_run_start();
+
     while (pc < p.instructions.size())
     {
         char instruction = p.instructions[pc];
@@ -40,10 +52,10 @@ void simpleIntrep(const Program &p, bool verbose)
             memory[dataptr]--;
             break;
         case '.':
-            std::cout.put(memory[dataptr]);
+            bfio_put(io.get(), memory[dataptr]);
             break;
         case ',':
-            memory[dataptr] = std::cin.get();
+            memory[dataptr] = bfio_get(io.get());
             break;
 
         case '[':
@@ -112,6 +124,12 @@ void simpleIntrep(const Program &p, bool verbose)
         }
         pc++;
     }
+    bfio_flush(io.get());
+
+    if (!options.dump_state_path.empty())
+    {
+        tape.write_state(options.dump_state_path, dataptr);
+    }
 
     // Done running the program. Dump satate if verbose.
     if (verbose)
@@ -121,12 +139,12 @@ void simpleIntrep(const Program &p, bool verbose)
         std::cout << " dataptr=" << dataptr << "\n";
         std::cout << "* Memory nonzero locations: \n";
 
-        for (size_t i = 0, pcount = 0; i < memory.size(); ++i)
+        for (size_t i = 0, pcount = 0; i < tape.size() / sizeof(Cell); ++i)
         {
             if (memory[i])
             {
                 std::cout << std::right << "[" << std::setw(3) << std::left
-                          << static_cast<int32_t>(memory[i]) << "     ";
+                          << static_cast<int64_t>(memory[i]) << "     ";
 
                 pcount++;
 
@@ -142,22 +160,19 @@ void simpleIntrep(const Program &p, bool verbose)
 
 int main(int argc, const char **argv)
 {
-    bool verbose = false;
-
-    std::string bf_file_path;
-    parse_command_line(argc, argv, &bf_file_path, &verbose);
+    Options options = parse_command_line(argc, argv);
 
     Timer t1;
-    std::ifstream file(bf_file_path);
+    std::ifstream file(options.bf_file_path);
 
     if (!file)
     {
-        DIE << "unable to open file" << bf_file_path;
+        DIE << "unable to open file" << options.bf_file_path;
     }
 
     Program program = parse_from_stream(file);
 
-    if (verbose)
+    if (options.verbose)
     {
         std::cout << "Parsing took: " << t1.elapsed() << "s\n";
         std::cout << "Length of Program" << program.instructions.size() << "\n";
@@ -165,18 +180,34 @@ int main(int argc, const char **argv)
                   << program.instructions << "\n";
     }
 
-    if (verbose)
+    if (options.verbose)
     {
         std::cout << "[>] Running simple brainfuck interprter.\n";
     }
 
     Timer t2;
-    simpleIntrep(program, verbose);
+    switch (options.cell_bits)
+    {
+    case 16:
+        simpleIntrep<uint16_t>(program, options);
+        break;
+    case 32:
+        simpleIntrep<uint32_t>(program, options);
+        break;
+    default:
+        simpleIntrep<uint8_t>(program, options);
+        break;
+    }
 
-    if (verbose)
+    if (options.verbose)
     {
         std::cout << "[<] Done (elapsed: " << t2.elapsed() << "s)\n";
     }
 
+    if (options.report_times)
+    {
+        report_phase_times();
+    }
+
     return 0;
 }
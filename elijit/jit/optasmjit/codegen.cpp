@@ -0,0 +1,1054 @@
+// Code generation shared by optasmjit and the tiered build of optinterp2.
+
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <stack>
+#include <vector>
+
+#include "codegen.h"
+#include "../../libbfir/utils.h"
+
+namespace{
+
+struct BracketLabels{
+    BracketLabels(const asmjit::Label& ol, const asmjit::Label& cl)
+	: open_label(ol), close_label(cl) {}
+
+    asmjit::Label open_label;
+    asmjit::Label close_label;
+};
+
+// Caller-saved registers the rest of the code leaves alone, for holding cells
+// in a TapeWindow. Calls into the I/O runtime clobber them, so a window is
+// stored before I/O and loaded again after it.
+
+const asmjit::x86::Gp kWindowRegisters[] = {
+    asmjit::x86::rdx, asmjit::x86::rsi, asmjit::x86::rdi, asmjit::x86::r8,
+    asmjit::x86::r9, asmjit::x86::r10, asmjit::x86::r11,
+};
+
+constexpr size_t kNumWindowRegisters = sizeof(kWindowRegisters) / sizeof(kWindowRegisters[0]);
+
+// The cells of an innermost loop that are kept in registers while it runs,
+// instead of being read and written in memory by every op. Only loops that
+// don't nest, only add to, set, read and write cells, and leave the data
+// pointer where it was get one: the data pointer then stays put for the
+// whole loop, and every cell the loop touches is at a fixed offset from it.
+// The cells are loaded on entry and the ones the loop writes are stored back
+// on exit.
+
+struct TapeWindow{
+    // Cell offset, from the data pointer at the '[', to index into
+    // kWindowRegisters.
+    std::map<int64_t, size_t> registers;
+
+    // Offsets of the cells in registers that the loop writes.
+    std::vector<int64_t> written;
+};
+
+// Fills in *window and returns true if the loop opened by ops[open] can keep
+// its cells in registers.
+
+bool find_tape_window(const std::vector<BfOp>& ops, size_t open, TapeWindow* window){
+    // How often each cell is used, and which cells every iteration touches.
+    // The targets of a LOOP_MUL_ADD run are skipped when its source is zero
+    // and may be off the tape, so they only get a register if some other op
+    // touches them anyway; loading them on entry could fault otherwise.
+
+    std::map<int64_t, int> uses;
+    std::map<int64_t, bool> touched;
+    std::map<int64_t, bool> writes;
+    int64_t shift = 0;
+    touched[0] = true;
+
+    for(size_t i = open + 1; ; ++i){
+	if(i == ops.size()){
+	    return false;
+	}
+	const BfOp& op = ops[i];
+	switch(op.kind){
+	    case BfOpKind::JUMP_IF_DATA_NOT_ZERO:
+		if(shift != 0){
+		    return false;
+		}
+		break;
+	    case BfOpKind::INC_PTR:
+		shift += op.argument;
+		continue;
+	    case BfOpKind::DEC_PTR:
+		shift -= op.argument;
+		continue;
+	    case BfOpKind::INC_DATA:
+	    case BfOpKind::DEC_DATA:
+		++uses[shift];
+		touched[shift] = writes[shift] = true;
+		continue;
+	    case BfOpKind::ADD_DATA:
+	    case BfOpKind::SET_DATA:
+	    case BfOpKind::LOOP_SET_TO_ZERO:
+	    case BfOpKind::READ_STDIN:
+		++uses[op.offset + shift];
+		touched[op.offset + shift] = writes[op.offset + shift] = true;
+		continue;
+	    case BfOpKind::WRITE_STDOUT:
+		++uses[op.offset + shift];
+		touched[op.offset + shift] = true;
+		continue;
+	    case BfOpKind::LOOP_MUL_ADD:
+		++uses[shift];
+		++uses[op.offset + shift];
+		touched[shift] = true;
+		writes[op.offset + shift] = true;
+		continue;
+	    default:
+		// Nested loops and LOOP_MOVE_PTR move the data pointer by an
+		// amount only known at run time.
+		return false;
+	}
+	break;
+    }
+
+    // Give registers to the most used cells, the loop's condition cell first
+    // since it is tested on every iteration.
+
+    std::vector<int64_t> cells;
+    for(const auto& cell : touched){
+	cells.push_back(cell.first);
+    }
+    std::stable_sort(cells.begin(), cells.end(), [&](int64_t a, int64_t b){
+	return (a == 0) > (b == 0) || ((a == 0) == (b == 0) && uses[a] > uses[b]);
+    });
+    cells.resize(std::min(cells.size(), kNumWindowRegisters));
+
+    window->registers.clear();
+    window->written.clear();
+    for(int64_t cell : cells){
+	window->registers.emplace(cell, window->registers.size());
+	if(writes[cell]){
+	    window->written.push_back(cell);
+	}
+    }
+    return true;
+}
+
+// Index of the ']' closing the loop opened by ops[open].
+
+size_t matching_close(const std::vector<BfOp>& ops, size_t open){
+    int depth = 0;
+    for(size_t i = open; i < ops.size(); ++i){
+	if(ops[i].kind == BfOpKind::JUMP_IF_DATA_ZERO){
+	    ++depth;
+	}else if(ops[i].kind == BfOpKind::JUMP_IF_DATA_NOT_ZERO && --depth == 0){
+	    return i;
+	}
+    }
+    DIE << "unmatched '[' at pc=" << open;
+    return 0;
+}
+
+// An innermost loop whose body is emitted several times over, so that it
+// takes one branch per copy instead of a compare and a jump back per
+// iteration. Only bodies of straight-line code that add to and set cells
+// qualify: I/O would be repeated along with the rest, and nested loops and
+// scans move the data pointer by amounts only known at run time.
+
+struct Unrolling{
+    // Index of the loop's ']'.
+    size_t close = 0;
+
+    // Cells the data pointer moves per iteration.
+    int64_t shift = 0;
+
+    // For a balanced loop whose condition cell only changes by the same odd
+    // amount on every iteration, that amount; the trip count is then known
+    // when the loop is entered. 0 for other loops.
+    int64_t counter_step = 0;
+};
+
+// Longer bodies gain little from saving a branch, and copies of a body reach
+// further from the data pointer, which has to stay well within the tape's
+// guard regions.
+
+constexpr size_t kMaxUnrolledOps = 16;
+constexpr int64_t kMaxUnrolledReach = 1024;
+
+// Fills in *unrolling and returns true if the loop opened by ops[open] can be
+// unrolled.
+
+bool find_unrolling(const std::vector<BfOp>& ops, size_t open, Unrolling* unrolling){
+    int64_t shift = 0;
+    int64_t step = 0;
+    bool counter = true;
+
+    for(size_t i = open + 1; i < ops.size() && i - open <= kMaxUnrolledOps + 1; ++i){
+	const BfOp& op = ops[i];
+	int64_t cell = op.offset + shift;
+	if(std::abs(cell) > kMaxUnrolledReach){
+	    return false;
+	}
+	switch(op.kind){
+	    case BfOpKind::JUMP_IF_DATA_NOT_ZERO:
+		unrolling->close = i;
+		unrolling->shift = shift;
+		unrolling->counter_step = shift == 0 && counter && (step & 1) ? step : 0;
+		return true;
+	    case BfOpKind::INC_PTR:
+		shift += op.argument;
+		break;
+	    case BfOpKind::DEC_PTR:
+		shift -= op.argument;
+		break;
+	    case BfOpKind::INC_DATA:
+		step += shift == 0 ? op.argument : 0;
+		break;
+	    case BfOpKind::DEC_DATA:
+		step -= shift == 0 ? op.argument : 0;
+		break;
+	    case BfOpKind::ADD_DATA:
+		step += cell == 0 ? op.argument : 0;
+		break;
+	    case BfOpKind::SET_DATA:
+	    case BfOpKind::LOOP_SET_TO_ZERO:
+	    case BfOpKind::LOOP_MUL_ADD:
+		counter = counter && cell != 0;
+		break;
+	    default:
+		return false;
+	}
+	if(std::abs(shift) > kMaxUnrolledReach){
+	    return false;
+	}
+    }
+    return false;
+}
+
+// The inverse of an odd number modulo 2^32, by Newton's iteration: every
+// step doubles the number of correct low bits, starting from 3.
+
+uint32_t inverse_mod_2_32(uint32_t odd){
+    uint32_t inverse = odd;
+    for(int i = 0; i < 4; ++i){
+	inverse *= 2 - odd * inverse;
+    }
+    return inverse;
+}
+
+// Heads of hot loops are aligned to this many bytes, so that the jump back
+// lands at the start of a fetch block.
+
+constexpr uint32_t kLoopAlignment = 16;
+
+// Thresholds for profile_op_hints. Aligning pads the loop entry with nops,
+// so it only pays off for loops that do a fair share of the work and stay
+// in them for a while. Registers are loaded on entry and stored on exit, so
+// they need a couple of iterations to pay for that. The inline loop beats a
+// call to the vector kernel up to about a dozen strides.
+
+constexpr double kAlignMinShare = 0.01;
+constexpr double kAlignMinTrips = 8;
+constexpr double kRegistersMinTrips = 2;
+constexpr double kVectorScanMinStrides = 12;
+
+// Unrolling factors are powers of two up to kMaxUnroll, and no more than a
+// loop's average trip count: copies past the last iteration are never run.
+
+constexpr int kMaxUnroll = 8;
+
+int unroll_for_trips(double trips){
+    int unroll = 1;
+    while(unroll < kMaxUnroll && unroll * 2 <= trips){
+	unroll *= 2;
+    }
+    return unroll;
+}
+
+} // end of namespace declaration.
+
+const uint32_t kCodegenVersion = 1;
+
+std::vector<OpHints> profile_op_hints(const std::vector<BfOp>& ops, const LoopProfile& profile){
+    std::vector<OpHints> hints(ops.size());
+    for(size_t i = 0; i < ops.size(); ++i){
+	const LoopStats* loop = profile.find(ops[i].source);
+	if(ops[i].kind == BfOpKind::JUMP_IF_DATA_ZERO){
+	    if(!loop || loop->iterations == 0){
+		hints[i].out_of_line = true;
+		hints[i].registers = false;
+		hints[i].unroll = 1;
+		continue;
+	    }
+	    hints[i].align = profile.share(*loop) >= kAlignMinShare &&
+		loop->average_trip_count() >= kAlignMinTrips;
+	    hints[i].registers = loop->average_trip_count() >= kRegistersMinTrips;
+	    hints[i].unroll = unroll_for_trips(loop->average_trip_count());
+	}else if(ops[i].kind == BfOpKind::LOOP_MOVE_PTR && loop && loop->entries > 0){
+	    hints[i].vector_scan = loop->average_trip_count() >= kVectorScanMinStrides;
+	}
+    }
+    return hints;
+}
+
+void emit_function(asmjit::x86::Assembler& assm, const Bytecode& bytecode,
+	size_t begin, size_t end, int cell_size, JitOpMap* op_map,
+	const std::vector<OpHints>* hints){
+
+    // Registers used in the program:
+    /*
+	r13: the data pointer
+	r12: the BfIo the program reads and writes through
+	r14: trip count of the unrolled loop being run
+	rax and rcx: used temporarily for some instruction .
+	rdx, rsi, rdi, r8-r11: cells of the loop being run, in a TapeWindow.
+	rdi:: parameter from the host -- the host passes the address
+	    of the current cell here.
+	rsi: parameter from the host -- the address of the BfIo.
+    */
+
+    asmjit::x86::Gp dataptr = asmjit::x86::r13;
+    asmjit::x86::Gp iop = asmjit::x86::r12;
+
+    // Inside a TapeWindow or an unrolled loop, pointer moves only change
+    // window_shift and leave the data pointer register at the cell the loop
+    // (or the copy of its body) started on.
+
+    TapeWindow window;
+    bool in_window = false;
+    bool in_unrolled = false;
+    int64_t window_shift = 0;
+
+    // Cell accesses are emitted at the cell width (byte_ptr, word_ptr or
+    // dword_ptr). Op offsets and pointer moves count cells, so they are
+    // scaled to bytes here. tape_ptr addresses cells relative to the data
+    // pointer register, cell_ptr relative to the program's data pointer.
+
+    auto tape_ptr = [&](int64_t cell){
+	return asmjit::x86::ptr(dataptr, static_cast<int32_t>(cell * cell_size), cell_size);
+    };
+    auto cell_ptr = [&](int64_t offset){
+	return tape_ptr(offset + window_shift);
+    };
+
+    auto at_cell_width = [&](const asmjit::x86::Gp& reg){
+	return cell_size == 1 ? reg.r8() : cell_size == 2 ? reg.r16() : reg.r32();
+    };
+
+    // If the cell at offset is held in a register, sets *reg to it at the cell
+    // width and returns true.
+
+    auto window_reg = [&](int64_t offset, asmjit::x86::Gp* reg){
+	if(!in_window){
+	    return false;
+	}
+	auto it = window.registers.find(offset + window_shift);
+	if(it == window.registers.end()){
+	    return false;
+	}
+	*reg = at_cell_width(kWindowRegisters[it->second]);
+	return true;
+    };
+
+    // Loads the window's cells into their registers, zero-extended so that
+    // no partial register is left behind.
+
+    auto load_window = [&](){
+	for(const auto& cell : window.registers){
+	    asmjit::x86::Gp reg = kWindowRegisters[cell.second].r32();
+	    if(cell_size == 4){
+		assm.mov(reg, tape_ptr(cell.first));
+	    }else{
+		assm.movzx(reg, tape_ptr(cell.first));
+	    }
+	}
+    };
+
+    auto store_window = [&](){
+	for(int64_t cell : window.written){
+	    assm.mov(tape_ptr(cell), at_cell_width(kWindowRegisters[window.registers[cell]]));
+	}
+    };
+
+    // An immediate delta for add/sub, truncated to the cell width.
+
+    auto cell_imm = [&](int64_t value){
+	switch(cell_size){
+	    case 1:
+		return asmjit::imm(static_cast<int8_t>(value));
+	    case 2:
+		return asmjit::imm(static_cast<int16_t>(value));
+	    default:
+		return asmjit::imm(static_cast<int32_t>(value));
+	}
+    };
+
+    // rcx and rax at the cell width.
+
+    asmjit::x86::Gp cell_cx = cell_size == 1 ? asmjit::x86::ecx.r8()
+	: cell_size == 2 ? asmjit::x86::ecx.r16() : asmjit::x86::ecx;
+    asmjit::x86::Gp cell_ax = cell_size == 1 ? asmjit::x86::eax.r8()
+	: cell_size == 2 ? asmjit::x86::eax.r16() : asmjit::x86::eax;
+
+    // Zero-extends the cell at offset into ecx.
+
+    auto load_cell_ecx = [&](int64_t offset){
+	asmjit::x86::Gp reg;
+	if(window_reg(offset, &reg)){
+	    if(cell_size == 4){
+		assm.mov(asmjit::x86::ecx, reg);
+	    }else{
+		assm.movzx(asmjit::x86::ecx, reg);
+	    }
+	}else if(cell_size == 4){
+	    assm.mov(asmjit::x86::ecx, cell_ptr(offset));
+	}else{
+	    assm.movzx(asmjit::x86::ecx, cell_ptr(offset));
+	}
+    };
+
+    // Sets the flags for the cell at offset being zero.
+
+    auto test_cell = [&](int64_t offset){
+	asmjit::x86::Gp reg;
+	if(window_reg(offset, &reg)){
+	    assm.test(reg, reg);
+	}else{
+	    assm.cmp(cell_ptr(offset), 0);
+	}
+    };
+
+    // r12, r13 and r14 are callee-saved in the System V ABI, so preserve them
+    // for the host. Three pushes also leave the stack 16-byte aligned for the
+    // calls into the I/O runtime.
+
+    assm.push(asmjit::x86::r12);
+    assm.push(asmjit::x86::r13);
+    assm.push(asmjit::x86::r14);
+
+    // We pass the data pointer as an argument to the jited functions.
+    // so it's expected to be in rdi.
+
+    // Move it to r13
+
+    assm.mov(dataptr, asmjit::x86::rdi);
+    assm.mov(iop, asmjit::x86::rsi);
+
+    // The code generator consumes the packed bytecode, the same format
+    // optinterp2 executes. Jump arguments are jump_targets indices there, but
+    // asmjit labels take care of jump targets so they aren't needed here.
+
+    // The ops are decoded up front so that loops can be looked at as a whole
+    // when deciding on a TapeWindow.
+
+    std::vector<BfOp> ops;
+    BytecodeReader reader(bytecode, begin);
+    BfOp decoded(BfOpKind::INVALID_OP, 0);
+    while(reader.position() < end && reader.next(&decoded)){
+	ops.push_back(decoded);
+    }
+
+    std::vector<OpHints> default_hints;
+    if(!hints){
+	default_hints.resize(ops.size());
+	hints = &default_hints;
+    }
+    if(hints->size() != ops.size()){
+	DIE << "emit_function: " << hints->size() << " hints for " << ops.size() << " ops";
+    }
+
+    // Out-of-line loops are emitted after the rest, so offsets are filled in
+    // by index.
+
+    size_t map_base = 0;
+    if(op_map){
+	map_base = op_map->op_offsets.size();
+	op_map->op_offsets.resize(map_base + ops.size());
+    }
+
+    struct OutOfLineLoop{
+	size_t open;
+	size_t close;
+
+	// The loop's code, and where it continues in the main code.
+	asmjit::Label code;
+	asmjit::Label resume;
+    };
+
+    std::vector<OutOfLineLoop> out_of_line;
+
+    // Where an unrolled loop whose body moves the data pointer exits between
+    // copies: the stub catches the data pointer up by shift cells and jumps
+    // to the loop's exit. Stubs go after the out-of-line loops.
+
+    struct ExitStub{
+	asmjit::Label code;
+	int64_t shift;
+	asmjit::Label loop_exit;
+    };
+
+    std::vector<ExitStub> exit_stubs;
+
+    // The '[' of the out-of-line loop being emitted; its stub already tested
+    // the cell.
+
+    size_t entered_open = ops.size();
+
+    std::stack<BracketLabels> open_bracket_stack;
+    BfOpKind prev_kind = BfOpKind::INVALID_OP;
+
+    // End of the current run of LOOP_MUL_ADD ops; the run is skipped when
+    // its source cell is zero.
+
+    asmjit::Label mul_add_done;
+
+    auto end_mul_add_run = [&](BfOpKind next_kind){
+	if(prev_kind == BfOpKind::LOOP_MUL_ADD && next_kind != BfOpKind::LOOP_MUL_ADD){
+	    assm.bind(mul_add_done);
+	}
+    };
+
+    // The op map points at the first copy of an unrolled body.
+
+    bool record_offsets = true;
+
+    // Emits ops[pc], or the whole loop if ops[pc] opens an unrolled one, and
+    // returns the index of the last op emitted.
+
+    std::function<size_t(size_t)> emit_op;
+
+    auto emit_body = [&](const Unrolling& unrolling, size_t open){
+	for(size_t i = open + 1; i < unrolling.close; ++i){
+	    emit_op(i);
+	}
+	end_mul_add_run(BfOpKind::JUMP_IF_DATA_NOT_ZERO);
+	prev_kind = BfOpKind::JUMP_IF_DATA_NOT_ZERO;
+	record_offsets = false;
+    };
+
+    // An unrolled loop, after its '[' tested the cell and loaded its window:
+    //
+    // With a trip count known at entry, n iterations are n % copies single
+    // ones and then n / copies runs of all copies, without testing the cell:
+    //
+    //     mov trip_count, %r14d
+    //     test $(copies - 1), %r14d
+    //     jz blocks
+    // remainder:
+    //     body
+    //     dec %r14d
+    //     test $(copies - 1), %r14d
+    //     jnz remainder
+    // blocks:
+    //     test %r14d, %r14d
+    //     jz loop_exit
+    // open_label:
+    //     body * copies
+    //     sub $copies, %r14d
+    //     jnz open_label
+    // loop_exit:
+    //
+    // Otherwise every copy but the last tests the cell and leaves the loop
+    // if it is zero; a body that moves the data pointer does so once per
+    // run of copies, after the last one:
+    //
+    // open_label:
+    //     body
+    //     cmpb 0(%r13 + shift), 0
+    //     jz loop_exit               (or an ExitStub if shift isn't 0)
+    //     ...
+    //     body
+    //     add $(copies * shift), %r13
+    //     cmpb 0(%r13), 0
+    //     jnz open_label
+    // loop_exit:
+
+    auto emit_unrolled_loop = [&](size_t open, const Unrolling& unrolling, int copies,
+	    bool align, const asmjit::Label& close_label){
+	asmjit::Label open_label = assm.newLabel();
+	asmjit::Label loop_exit = assm.newLabel();
+	in_unrolled = true;
+
+	if(unrolling.counter_step != 0){
+	    // The cell reaches zero after (-cell / step) iterations modulo the
+	    // cell range; step is odd, so it has an inverse. The cell isn't
+	    // zero here, so neither is the trip count.
+	    uint32_t factor = -inverse_mod_2_32(static_cast<uint32_t>(unrolling.counter_step));
+	    asmjit::Label remainder = assm.newLabel();
+	    asmjit::Label blocks = assm.newLabel();
+	    load_cell_ecx(0);
+	    if(factor == static_cast<uint32_t>(-1)){
+		assm.neg(asmjit::x86::ecx);
+	    }else if(factor != 1){
+		assm.imul(asmjit::x86::ecx, asmjit::x86::ecx, static_cast<int32_t>(factor));
+	    }
+	    if(cell_size != 4){
+		assm.movzx(asmjit::x86::ecx, cell_cx);
+	    }
+	    assm.mov(asmjit::x86::r14d, asmjit::x86::ecx);
+	    assm.test(asmjit::x86::r14d, copies - 1);
+	    assm.jz(blocks);
+	    assm.bind(remainder);
+	    emit_body(unrolling, open);
+	    assm.dec(asmjit::x86::r14d);
+	    assm.test(asmjit::x86::r14d, copies - 1);
+	    assm.jnz(remainder);
+	    assm.bind(blocks);
+	    assm.test(asmjit::x86::r14d, asmjit::x86::r14d);
+	    assm.jz(loop_exit);
+	    if(align){
+		assm.align(asmjit::AlignMode::kCode, kLoopAlignment);
+	    }
+	    assm.bind(open_label);
+	    for(int copy = 0; copy < copies; ++copy){
+		emit_body(unrolling, open);
+	    }
+	    if(op_map){
+		op_map->op_offsets[map_base + unrolling.close] = static_cast<uint32_t>(assm.offset());
+	    }
+	    assm.sub(asmjit::x86::r14d, copies);
+	    assm.jnz(open_label);
+	}else{
+	    if(align){
+		assm.align(asmjit::AlignMode::kCode, kLoopAlignment);
+	    }
+	    assm.bind(open_label);
+	    for(int copy = 1; copy < copies; ++copy){
+		emit_body(unrolling, open);
+		test_cell(0);
+		if(window_shift == 0){
+		    assm.jz(loop_exit);
+		}else{
+		    ExitStub stub{assm.newLabel(), window_shift, loop_exit};
+		    assm.jz(stub.code);
+		    exit_stubs.push_back(stub);
+		}
+	    }
+	    emit_body(unrolling, open);
+	    if(op_map){
+		op_map->op_offsets[map_base + unrolling.close] = static_cast<uint32_t>(assm.offset());
+	    }
+	    if(window_shift != 0){
+		assm.add(dataptr, window_shift * cell_size);
+		window_shift = 0;
+	    }
+	    test_cell(0);
+	    assm.jnz(open_label);
+	}
+
+	assm.bind(loop_exit);
+	if(in_window){
+	    store_window();
+	    in_window = false;
+	}
+	assm.bind(close_label);
+	in_unrolled = false;
+	record_offsets = true;
+	return unrolling.close;
+    };
+
+    emit_op = [&](size_t pc) -> size_t {
+	const BfOp& op = ops[pc];
+	asmjit::x86::Gp reg;
+	end_mul_add_run(op.kind);
+	if(op_map && record_offsets && pc != entered_open){
+	    op_map->op_offsets[map_base + pc] = static_cast<uint32_t>(assm.offset());
+	}
+
+	switch(op.kind){
+	    case BfOpKind::INC_PTR:
+		if(in_window || in_unrolled){
+		    window_shift += op.argument;
+		}else{
+		    assm.add(dataptr, op.argument * cell_size);
+		}
+		break;
+	    case BfOpKind::DEC_PTR:
+		if(in_window || in_unrolled){
+		    window_shift -= op.argument;
+		}else{
+		    assm.sub(dataptr, op.argument * cell_size);
+		}
+		break;
+	    case BfOpKind::INC_DATA:
+		if(window_reg(0, &reg)){
+		    assm.add(reg, cell_imm(op.argument));
+		}else{
+		    assm.add(cell_ptr(0), cell_imm(op.argument));
+		}
+		break;
+	    case BfOpKind::DEC_DATA:
+		if(window_reg(0, &reg)){
+		    assm.sub(reg, cell_imm(op.argument));
+		}else{
+		    assm.sub(cell_ptr(0), cell_imm(op.argument));
+		}
+		break;
+	    case BfOpKind::ADD_DATA:
+		// addb $argument, offset(%r13); the delta is truncated to the
+		// cell width.
+		if(window_reg(op.offset, &reg)){
+		    assm.add(reg, cell_imm(op.argument));
+		}else{
+		    assm.add(cell_ptr(op.offset), cell_imm(op.argument));
+		}
+		break;
+	    case BfOpKind::SET_DATA:
+		if(window_reg(op.offset, &reg)){
+		    assm.mov(reg, cell_imm(op.argument));
+		}else{
+		    assm.mov(cell_ptr(op.offset), cell_imm(op.argument));
+		}
+		break;
+	    case BfOpKind::WRITE_STDOUT:
+		// The I/O code works on the cells in memory, and may call into
+		// the runtime.
+		if(in_window){
+		    store_window();
+		}
+		for(int i = 0; i < op.argument; ++i){
+		    /*
+			Append the byte to the output buffer inline, only
+			calling into the runtime when the buffer is full. Cells
+			are little endian, so the low byte of a wider cell is
+			the one at its address.
+
+			mov out_cursor(%r12), %rax
+			movb offset(%r13), %cl
+			movb %cl, (%rax)
+			inc %rax
+			mov %rax, out_cursor(%r12)
+			cmp out_end(%r12), %rax
+			jne no_flush
+			call *flush(%r12)       # bfio_flush(%r12)
+		    no_flush:
+		    */
+		    asmjit::Label no_flush = assm.newLabel();
+		    assm.mov(asmjit::x86::rax, asmjit::x86::qword_ptr(iop, kBfIoOutCursor));
+		    assm.mov(asmjit::x86::cl, asmjit::x86::byte_ptr(dataptr, (op.offset + window_shift) * cell_size));
+		    assm.mov(asmjit::x86::byte_ptr(asmjit::x86::rax), asmjit::x86::cl);
+		    assm.inc(asmjit::x86::rax);
+		    assm.mov(asmjit::x86::qword_ptr(iop, kBfIoOutCursor), asmjit::x86::rax);
+		    assm.cmp(asmjit::x86::rax, asmjit::x86::qword_ptr(iop, kBfIoOutEnd));
+		    assm.jne(no_flush);
+		    assm.mov(asmjit::x86::rdi, iop);
+		    assm.call(asmjit::x86::qword_ptr(iop, kBfIoFlush));
+		    assm.bind(no_flush);
+		}
+		if(in_window){
+		    load_window();
+		}
+		break;
+
+	    case BfOpKind::READ_STDIN:
+		if(in_window){
+		    store_window();
+		}
+		for(int i = 0; i < op.argument; ++i){
+		    /*
+			Take the next byte of the input buffer inline; when it
+			is exhausted, bfio_refill returns the byte (or -1) in
+			eax. Store only a cell's worth of ecx to memory to
+			avoid overwriting unrelated data.
+
+			mov in_cursor(%r12), %rax
+			cmp in_end(%r12), %rax
+			je refill
+			movzbl (%rax), %ecx
+			inc %rax
+			mov %rax, in_cursor(%r12)
+			jmp store
+		    refill:
+			call *refill(%r12)      # bfio_refill(%r12)
+			mov %eax, %ecx
+		    store:
+			movb %cl, offset(%r13)    (%cx or %ecx for wider cells)
+		    */
+		    asmjit::Label refill = assm.newLabel();
+		    asmjit::Label store = assm.newLabel();
+		    assm.mov(asmjit::x86::rax, asmjit::x86::qword_ptr(iop, kBfIoInCursor));
+		    assm.cmp(asmjit::x86::rax, asmjit::x86::qword_ptr(iop, kBfIoInEnd));
+		    assm.je(refill);
+		    assm.movzx(asmjit::x86::ecx, asmjit::x86::byte_ptr(asmjit::x86::rax));
+		    assm.inc(asmjit::x86::rax);
+		    assm.mov(asmjit::x86::qword_ptr(iop, kBfIoInCursor), asmjit::x86::rax);
+		    assm.jmp(store);
+		    assm.bind(refill);
+		    assm.mov(asmjit::x86::rdi, iop);
+		    assm.call(asmjit::x86::qword_ptr(iop, kBfIoRefill));
+		    assm.mov(asmjit::x86::ecx, asmjit::x86::eax);
+		    assm.bind(store);
+		    assm.mov(cell_ptr(op.offset), cell_cx);
+		}
+		if(in_window){
+		    load_window();
+		}
+		break;
+	    case BfOpKind::LOOP_SET_TO_ZERO:
+		if(window_reg(op.offset, &reg)){
+		    assm.xor_(reg.r32(), reg.r32());
+		}else{
+		    assm.mov(cell_ptr(op.offset), 0);
+		}
+		break;
+
+	    case BfOpKind::LOOP_MOVE_PTR:
+		{
+		asmjit::Label loop = assm.newLabel();
+		asmjit::Label endloop = assm.newLabel();
+		int64_t stride = op.argument * cell_size;
+
+		// Most scans end where they start, so the first cell is always
+		// tested inline. Short strides then go to the runtime's vector
+		// scan kernel (see scan.h):
+
+		/*
+    cmpb 0(%r13)
+    jz endloop
+    mov %r13, %rdi
+    mov $stride, %rsi
+    call *scan_for_zero(%r12)
+    mov %rax, %r13
+endloop:
+		*/
+
+		if((*hints)[pc].vector_scan && stride >= -kScanMaxVectorStride &&
+			stride <= kScanMaxVectorStride){
+		    int kernel = cell_size == 1 ? 0 : cell_size == 2 ? 1 : 2;
+		    assm.cmp(cell_ptr(0), 0);
+		    assm.jz(endloop);
+		    assm.mov(asmjit::x86::rdi, dataptr);
+		    assm.mov(asmjit::x86::rsi, stride);
+		    assm.call(asmjit::x86::qword_ptr(iop, kBfIoScanForZero + kernel * 8));
+		    assm.mov(dataptr, asmjit::x86::rax);
+		    assm.bind(endloop);
+		    break;
+		}
+
+		// Longer strides see one cell per vector anyway, and short scans
+		// are done before a call would be, so they get a loop that moves
+		// the pointer in jumps of op.argument. It's
+		// important to do an equivalent of while() rather than do..
+		// while() here so that we don't do the first pointer change if
+		// already pointing to a zero.
+
+		/*
+loop:
+    cmpb 0(%r13)
+    jz endloop
+    %r13 += argument
+    jmp loop
+		*/
+
+		assm.bind(loop);
+		assm.cmp(cell_ptr(0), 0);
+		assm.jz(endloop);
+
+		if(op.argument < 0){
+		    assm.sub(dataptr, -stride);
+		}else{
+		    assm.add(dataptr, stride);
+		}
+		assm.jmp(loop);
+		assm.bind(endloop);
+		break;
+	}
+	case BfOpKind::LOOP_MUL_ADD:{
+	    /*
+		movzx (%r13), %ecx
+		imul $argument, %ecx, %eax
+		addb %al, offset(%r13)
+
+		A run of LOOP_MUL_ADD ops comes from a single loop and never
+		writes the source cell, so ecx is only loaded by the first one.
+		If it is zero the loop would not have run, so the whole run is
+		skipped rather than touching target cells that may be off the
+		tape:
+
+		movzx (%r13), %ecx
+		test %ecx, %ecx
+		jz mul_add_done
+	    */
+
+	    if(prev_kind != BfOpKind::LOOP_MUL_ADD){
+		mul_add_done = assm.newLabel();
+		load_cell_ecx(0);
+		assm.test(asmjit::x86::ecx, asmjit::x86::ecx);
+		assm.jz(mul_add_done);
+	    }
+
+	    bool target_in_reg = window_reg(op.offset, &reg);
+	    if(op.argument == 1){
+		if(target_in_reg){
+		    assm.add(reg, cell_cx);
+		}else{
+		    assm.add(cell_ptr(op.offset), cell_cx);
+		}
+	    }else if(op.argument == -1){
+		if(target_in_reg){
+		    assm.sub(reg, cell_cx);
+		}else{
+		    assm.sub(cell_ptr(op.offset), cell_cx);
+		}
+	    }else{
+		assm.imul(asmjit::x86::eax, asmjit::x86::ecx, static_cast<int32_t>(op.argument));
+		if(target_in_reg){
+		    assm.add(reg, cell_ax);
+		}else{
+		    assm.add(cell_ptr(op.offset), cell_ax);
+		}
+	    }
+	    break;
+	}
+	case BfOpKind::JUMP_IF_DATA_ZERO:{
+	    asmjit::Label open_label = assm.newLabel();
+	    asmjit::Label close_label = assm.newLabel();
+
+	    // Jump past the closing ']' if [dataptr] = 0; close_label
+	    // wasn't bound yet (it will be bound when we handle the matching ']')
+	    // but asmjit lets us emit the jump now and will handle the backpatching
+	    // later.
+
+	    if(pc != entered_open){
+		assm.cmp(cell_ptr(0), 0);
+		assm.jz(close_label);
+	    }
+
+	    // open label is bound past the jump all in all, we're emitting
+	    //
+	    // cmpb 0(%r13), 0
+	    // jz close_label
+	    // ...
+	    //
+	    // An innermost loop that can run on registers loads its cells in
+	    // between, so that the loads are skipped along with the loop, and
+	    // aren't repeated on every iteration.
+
+	    if((*hints)[pc].registers && find_tape_window(ops, pc, &window)){
+		in_window = true;
+		window_shift = 0;
+		load_window();
+	    }
+
+	    Unrolling unrolling;
+	    if((*hints)[pc].unroll >= 2 && find_unrolling(ops, pc, &unrolling)){
+		prev_kind = op.kind;
+		return emit_unrolled_loop(pc, unrolling, (*hints)[pc].unroll, (*hints)[pc].align,
+			close_label);
+	    }
+
+	    // Aligning here puts the padding on the way in, where it runs once
+	    // per entry rather than once per iteration.
+
+	    if((*hints)[pc].align){
+		assm.align(asmjit::AlignMode::kCode, kLoopAlignment);
+	    }
+	    assm.bind(open_label);
+	    // Save both labels on the stack
+	    open_bracket_stack.push(BracketLabels(open_label, close_label));
+	    break;
+	}
+
+	case BfOpKind::JUMP_IF_DATA_NOT_ZERO:{
+	    // These ops have to be properly nested.
+
+	    if(open_bracket_stack.empty()){
+		DIE << "unmatched closing ']' at pc=" << pc;
+	    }
+
+	    BracketLabels labels = open_bracket_stack.top();
+	    open_bracket_stack.pop();
+
+	    // cmpb 0, 0(%r13)
+	    // jnz open_label
+	    // close_label:
+	    //..
+	    //
+	    // The end of a TapeWindow loop tests the register and stores the
+	    // cells back when falling through; the jump from '[' bypasses the
+	    // stores as it bypassed the loads.
+
+	    test_cell(0);
+	    assm.jnz(labels.open_label);
+	    if(in_window){
+		store_window();
+		in_window = false;
+	    }
+	    assm.bind(labels.close_label);
+	    break;
+	}
+	case BfOpKind::INVALID_OP:
+	    DIE << "INVALID_OP encountered on pc=" << pc;
+	    break;
+
+	}
+	prev_kind = op.kind;
+	return pc;
+    };
+
+    for(size_t pc = 0; pc < ops.size(); ++pc){
+	if(ops[pc].kind != BfOpKind::JUMP_IF_DATA_ZERO || !(*hints)[pc].out_of_line){
+	    pc = emit_op(pc);
+	    continue;
+	}
+
+	// Leave a stub that enters the loop's code if the cell is nonzero:
+	//
+	// cmpb 0(%r13), 0
+	// jnz code
+	// resume:
+
+	end_mul_add_run(BfOpKind::JUMP_IF_DATA_ZERO);
+	if(op_map){
+	    op_map->op_offsets[map_base + pc] = static_cast<uint32_t>(assm.offset());
+	}
+	OutOfLineLoop loop{pc, matching_close(ops, pc), assm.newLabel(), assm.newLabel()};
+	assm.cmp(cell_ptr(0), 0);
+	assm.jnz(loop.code);
+	assm.bind(loop.resume);
+	out_of_line.push_back(loop);
+	prev_kind = BfOpKind::JUMP_IF_DATA_NOT_ZERO;
+	pc = loop.close;
+    }
+
+    // Hand the final data pointer back to the host.
+
+    assm.mov(asmjit::x86::rax, dataptr);
+    assm.pop(asmjit::x86::r14);
+    assm.pop(asmjit::x86::r13);
+    assm.pop(asmjit::x86::r12);
+    assm.ret();
+
+    // The out-of-line loops, each jumping back to its stub when done.
+
+    for(const OutOfLineLoop& loop : out_of_line){
+	assm.bind(loop.code);
+	entered_open = loop.open;
+	prev_kind = BfOpKind::INVALID_OP;
+	for(size_t pc = loop.open; pc <= loop.close; ++pc){
+	    pc = emit_op(pc);
+	}
+	assm.jmp(loop.resume);
+    }
+
+    for(const ExitStub& stub : exit_stubs){
+	assm.bind(stub.code);
+	assm.add(dataptr, stub.shift * cell_size);
+	assm.jmp(stub.loop_exit);
+    }
+}
+
+JittedFunc compile_function(asmjit::JitRuntime& runtime, const Bytecode& bytecode,
+	size_t begin, size_t end, int cell_size){
+    asmjit::CodeHolder code;
+    code.init(runtime.environment());
+    asmjit::x86::Assembler assm(&code);
+
+    emit_function(assm, bytecode, begin, end, cell_size, nullptr);
+
+    JittedFunc func;
+    asmjit::Error err = runtime.add(&func, &code);
+    if(err){
+	DIE << "error calling jit_runtime.add: " << asmjit::DebugUtils::errorAsString(err);
+    }
+    return func;
+}
@@ -0,0 +1,84 @@
+#ifndef CODEGEN_H
+#define CODEGEN_H
+
+// asmjit code generation for bytecode, shared by optasmjit and the tiered
+// build of optinterp2.
+//
+// The emitted function follows the x64 System V ABI:
+//
+//   uint64_t func(uint64_t dataptr, BfIo* io);
+//
+// dataptr is the address of the current cell; the function returns the
+// address of the cell the data pointer ends up at.
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <asmjit/asmjit.h>
+
+#include "../../libbfir/bfio.h"
+#include "../../libbfir/bytecode.h"
+#include "../../libbfir/profile.h"
+#include "../../libbfir/tape.h"
+
+using JittedFunc = uint64_t (*)(uint64_t, BfIo*);
+
+// Version of the code emit_function generates; bump it with every change to
+// the code it emits for the same bytecode. Code caches key on it.
+
+extern const uint32_t kCodegenVersion;
+
+// Profile-guided choices for one op. The defaults are what emit_function
+// does without a profile.
+
+struct OpHints{
+    // For a '[': align the loop's head, which it jumps back to on every
+    // iteration.
+    bool align = false;
+
+    // For a '[': the loop never ran, so its code goes after the function's
+    // epilogue, out of the way of the code that does run. Only a test of the
+    // cell and a jump to it stay in place.
+    bool out_of_line = false;
+
+    // For a '[': the loop may keep its cells in registers (see TapeWindow in
+    // codegen.cpp).
+    bool registers = true;
+
+    // For a '[': how many copies of the body an innermost loop of simple
+    // enough ops is unrolled to, a power of two up to 8; 1 leaves it
+    // alone. Balanced loops whose trip count is known at entry run the
+    // copies without testing the cell in between.
+    int unroll = 4;
+
+    // For LOOP_MOVE_PTR: short strides call the runtime's vector scan
+    // kernel rather than looping inline.
+    bool vector_scan = true;
+};
+
+// Hints for ops (as compile_to_ops returns them, with their sources) from a
+// profile of the same program: hot loops with long trips get their heads
+// aligned, loops that rarely iterate twice don't get registers, loops are
+// unrolled by no more than their trip count, loops that never ran go out of
+// line, and scans that only move a few strides loop inline instead of calling
+// the vector kernel.
+
+std::vector<OpHints> profile_op_hints(const std::vector<BfOp>& ops, const LoopProfile& profile);
+
+// Emits a function running the ops at bytecode positions [begin, end), which
+// must hold whole loops only. cell_size is the width of a tape cell in bytes
+// (1, 2 or 4). If op_map is given, records where the code of every op starts,
+// counting ops from begin; out-of-line loops leave the offsets out of order.
+// hints, if given, has one entry per op, also counting from begin.
+
+void emit_function(asmjit::x86::Assembler& assm, const Bytecode& bytecode,
+	size_t begin, size_t end, int cell_size, JitOpMap* op_map,
+	const std::vector<OpHints>* hints = nullptr);
+
+// emit_function into a fresh CodeHolder, added to runtime. For callers that
+// don't need the code buffer; dies if asmjit fails.
+
+JittedFunc compile_function(asmjit::JitRuntime& runtime, const Bytecode& bytecode,
+	size_t begin, size_t end, int cell_size);
+
+#endif /* CODEGEN_H */
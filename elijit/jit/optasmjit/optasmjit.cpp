@@ -1,457 +1,276 @@
 
 // optasm jit = optimized jit compiler
 
+#include <cstring>
 #include <iomanip>
 #include <fstream>
-#include <stack>
+#include <memory>
 #include <vector>
 #include <asmjit/asmjit.h>
 
-#include "parser.h"
-#include "utils.h"
-
-constexpr int MEMORY_SIZE = 30000;
-
-namespace{
-
-    // Translation to a sequence of Bfops is taken verbatim from
-    // optimized_interpreter, which I didn't implement, the 3rd one.
-
-    enum class BfOpKind{
-	INVALID_OP = 0,
-	INC_PTR,
-	DEC_PTR,
-	INC_DATA,
-	DEC_DATA,
-	READ_STDIN,
-	WRITE_STDOUT,
-	LOOP_SET_TO_ZERO,
-	LOOP_MOVE_PTR,
-	LOOP_MOVE_DATA,
-	JUMP_IF_DATA_ZERO,
-	JUMP_IF_DATA_NOT_ZERO,
-
-    };
-
-    struct BfOp{
-	BfOp(BfOpKind kind_param, int64_t argument_param)
-	    : kind(kind_param), argument(argument_param) {}
-
-	BfOpKind kind = BfOpKind::INVALID_OP;
-	int64_t argument = 0;
-    };
-
-    const char* BfOpKind_name(BfOpKind kind){
-
-	switch(kind){
-	    case BfOpKind::INC_PTR:
-		return "INC_PTR";
-	    case BfOpKind::DEC_PTR:
-		return "DEC_PTR";
-	    case BfOpKind::INC_DATA:
-		return "INC_DATA";
-	    case BfOpKind::DEC_DATA:
-		return "DEC_DATA";
-	    case BfOpKind::READ_STDIN:
-		return "READ_STDN";
-	    case BfOpKInd::WRITE_STDOUT:
-		return "WRITE_STDOUT";
-	    case BfOpKind::LOOP_SET_TO_ZERO:
-		return "LOOP_SET_TO_ZERO";
-	    case BfOpKind::LOOP_MOVE_PTR:
-		return "LOOP_MOVE_PTR";
-	    case BfOpKind::LOOP_MOVE_DATA:
-		return "LOOP_MOVE_DATA";
-	    case BfOpKind::JUMP_IF_DATA_ZERO:
-		return "JUMP_IF_DATA_ZERO";
-	    case BfOpKind::JUMP_IF_DATA_NOT_ZERO:
-		return "JUMP_IF_DATA_NOT_ZERO";
-	    case BfOpKind::INVALID_OP:
-		return "INVALID_OP";
-	}
+#include "codegen.h"
+#include "../../libbfir/batch.h"
+#include "../../libbfir/bfio.h"
+#include "../../libbfir/bfir.h"
+#include "../../libbfir/bytecode.h"
+#include "../../libbfir/codecache.h"
+#include "../../libbfir/parser.h"
+#include "../../libbfir/perfmap.h"
+#include "../../libbfir/profile.h"
+#include "../../libbfir/scan.h"
+#include "../../libbfir/tape.h"
+#include "../../libbfir/utils.h"
 
-	return nullptr;
-    }
+// function for optimized jit.
+
+void optasmjit(const Program& p, const Options& options){
+    bool verbose = options.verbose;
 
-    // Optimizes a loop that starts at loop_start (the opening JUMP_IF_DATA_ZERO).
-    //The loop runs until the end of ops (implicitly there's a back-jump after the last op in ops)
+    // cell_size is the width of a tape cell in bytes: 1, 2 or 4.
 
-    // If optimization succeeds, returns a sequence of instructions
-    // that replace the loop; otherwise, returns an empty vector.
+    int cell_size = options.cell_bits / 8;
 
-    std::vector<BfOp> optimize_loop(const std::vector<BfOp>& ops, size_t loop_starts){
+    // Initialize state.
 
-	std::vector<BfOp> new_ops;
+    Tape memory(cell_size, max_pointer_move(p.instructions));
+    std::unique_ptr<BfIo> io(new BfIo);
+    bfio_init(io.get());
+    memory.set_io(io.get());
 
-	if(ops.size()-loop_start == 2){
-	    BfOp repeated_op = ops[loop_start + 1];
-	    if(repeated_op.kind == BfOpKind::INC_DATA || repeated_op.kind  == BfOpKind::DEC_DATA){
-		new_ops.push_back(
-		    BfOp(BfOpKind::LOOP_MOVE_PTR, repeated_op.kind == BfOpKind::INC_PTR ? repeated_op.argument : -repeated_op.argument)
-			);
-	    }
-	} else if(ops.size() - loop_start == 5){
-	    // Detect pattern -<+> adn ->+<
-	    if(ops[loops_start + 1].kind == BfOpKind::DEC_DATA &&
-		    ops[loops_start + 3].kind == BfOpKind::INC_DATA &&
-		    ops[loops_start + 1].argument == 1 && ops[loops_start+
-		    3].argument == 1){
+    // --profile: where a run of optinterp2 --loop-profile spent its time,
+    // which steers code generation.
 
-		std::string s;
+    LoopProfile profile;
+    bool use_profile = !options.profile_path.empty();
+    if(use_profile){
+	std::string error;
+	if(!read_loop_profile(options.profile_path, p, &profile, &error)){
+	    DIE << "--profile: " << error;
+	}
+    }
 
-		if(ops[loop_start + 2].kind == BfOpKind::INC_PTR && ops[loop_start + 4].kind == BfOpKind::DEC_PTR && ops[loop_start + 2].argument == ops[loop_start + 4].argument){
+    // A cache hit skips translation and code generation altogether, and runs
+    // the code straight from the mapped entry. Code generated for a profile
+    // is cached for that profile only.
 
-		    new_ops.push_back(BfOp(BfOpKind::LOOP_MOVE_DATA, ops[loop + 2].argument));
-		}
-	    }
+    std::unique_ptr<CodeCache> cache;
+    std::string cache_key;
+    if(!options.code_cache_dir.empty()){
+	std::string engine = "optasmjit " + std::to_string(kCodegenVersion);
+	if(use_profile){
+	    engine += " profile " + loop_profile_hash(profile);
 	}
-	return new_ops;
+	cache.reset(new CodeCache(options.code_cache_dir));
+	cache_key = code_cache_key(p, engine, kDefaultOptLevel, options.cell_bits);
     }
 
-    // Translates the given program into a vector of BfOps that can
-    // be used for fast interpretation.
-
-    std::vector<BfOp> translate_program(const program& p){
-
-	size_t pc = 0;
-	size_t program_size = p.instructions.size();
-	std::vector<BfOp> ops;
-
-	// Throughout the translation loop, this stack contains offsets
-	// in the ops vector of open brackets (jump if data zero ops) waiting
-	//for a closing bracket. since the brackets nest, these neutrality form a stack. The jump if data zero ops get added to ops with their arg
-	// set to 0 until a matching closing bracket is encountered.
-	// at which point the argument can be back patched.
-
-	std::stack<size_t> open_bracket_stack;
-
-	while(pc < program_size){
-	    char instruction = p.instructions[pc];
-	    if(instruction == '['){
-		// Place a jump op with a placeholder 0 offset. It will
-		// be patched up to the right offset
-		// when the matching ']' is found.
-		open_bracket_stack.push(ops.size());
-		ops.push_back(BfOp(BfOpKind::JUMP_IF_DATA_ZERO, 0));
-		pc++;
-	    }else if(instruction == ']'){
-		if(open_bracket_stack.empty()){
-		    DIE<<"unmatched string ']' at pc="<<pc;
-		}
+    asmjit::JitRuntime jit_runtime;
+    CachedCode cached;
+    JittedFunc func = nullptr;
+    std::vector<uint8_t> emitted_code;
 
-		size_t open_bracket_offset = open_bracket_stack.top();
-		open_bracket_stack.pop();
+    // Where each op's code starts, so a tape overflow can be reported
+    // against the op that caused it.
 
-		// Try to optimize this loop, if optimize_loop succeeds, it returns a non
-		// empty vector which we can splice into ops in place of the loop
-		//If the returned vector empty we proceed as usual .
+    JitOpMap op_map;
 
-		std::vector<BfOp> optimized_loop = optimize_loop(ops, open_bracket_offset);
+    // Only filled in on a cache miss, or for --perf-map / --jitdump.
 
-		if(optimized_loop.empty()){
-		    // Loop wasn't optimized, so proceed emitting the
-		    // back jump to ops, we have the offset
-		    // matching '['. We can use it to create a new
-		    // jump op for the ']' we're handling, as well as
-		    // patch up the offset of the matching '['
+    std::vector<BfOp> ops;
 
-		    ops[open_bracket_offset].argument = ops.size();
-		    ops.push_back(
-			    BfOp(BfOpKind::JUMP_IF_DATA_NOT_ZERO, open_bracket_offset));
-		}
-		else{
-		    // Replace this whole loop with optimized loop
+    if(cache && cache->lookup(cache_key, &cached)){
+	op_map.op_offsets = cached.op_offsets();
+	emitted_code.assign(cached.code(), cached.code() + cached.code_size());
+	op_map.code = cached.code();
 
-		    ops.erase(ops.begin() + open_bracket_offset, ops.end());
-		    ops.insert(ops.end(), optimized_loop.begin(), optimized_loop.end());
-		}
-		pc++;
-	    }else{
-		// Not a jump; all the other ops can be repeated, so find where
-		// the repeat ends.
-		size_t start = pc;
-		while(pc < program_size && p.instructions[pc] == instruction){
-		    pc++;
-		}
-		// Here pc points to the first new instruction encountered.
-		// Or to the end of the program.
-
-		size_t num_repeats = pc - start;
-
-		// Figure out which op kind the instruction represents and add it
-		// to the ops.
-
-		BfOpKind kind = BfOpKind::INVALID_OP;
-		switch(instruction){
-		    case '>':
-			kind = BfOpKind::INC_PTR;
-			break;
-		    case '<':
-			kind = BfOpKind::DEC_PTR;
-			break;
-		    case '+':
-			kind = BfOpKind::INC_DATA;
-			break;
-		    case '-':
-			kind = BfOpKind::DEC_DATA;
-			break;
-		    case ',':
-			kind = BfOpKind::READ_STDN;
-			break;
-		    case '.':
-			kind = BfOpKind::WRITE_STDOUT;
-			break;
-		    default:
-			{
-			    DIE << "bad char '" << instruction <<" at pc="<< start;
-			}
+	if(verbose){
+	    std::cout << "* code cache hit: " << cache->entry_path(cache_key) << "\n";
+	}
+    }else{
+	Timer t1;
+	ops = compile_to_ops(p, kDefaultOptLevel, verbose);
+
+	if(verbose){
+	    std::cout << "* translation [elapsed " << t1.elapsed() << "s]:\n";
+	    dump_ops(ops, std::cout);
+	    std::cout << "* LOOP_MOVE_PTR scans: " << scan_for_zero_isa() << "\n";
+	}
+
+	// Initialize asmjits code holder and assembler.
+
+	asmjit::CodeHolder code;
+	code.init(jit_runtime.environment());
+	asmjit::x86::Assembler assm(&code);
+
+	std::vector<OpHints> hints;
+	if(use_profile){
+	    hints = profile_op_hints(ops, profile);
+	    if(verbose){
+		size_t aligned = 0, out_of_line = 0, no_registers = 0, not_unrolled = 0;
+		size_t inline_scans = 0;
+		for(size_t i = 0; i < ops.size(); ++i){
+		    aligned += hints[i].align;
+		    out_of_line += hints[i].out_of_line;
+		    no_registers += ops[i].kind == BfOpKind::JUMP_IF_DATA_ZERO &&
+			!hints[i].registers && !hints[i].out_of_line;
+		    not_unrolled += ops[i].kind == BfOpKind::JUMP_IF_DATA_ZERO &&
+			hints[i].unroll == 1 && !hints[i].out_of_line;
+		    inline_scans += !hints[i].vector_scan;
 		}
-		ops.push_back(BfOp(kind, num_repeats));
+		std::cout << "* profile: " << aligned << " loops aligned, " << out_of_line
+		    << " out of line, " << no_registers << " without registers, "
+		    << not_unrolled << " not unrolled, " << inline_scans << " scans inline\n";
 	    }
 	}
 
-	return ops;
-
-    }
+	Bytecode bytecode = encode_bytecode(ops);
+	op_map.op_offsets.reserve(ops.size());
 
-// This function will be invoked from the jited code; not using putchar
-// directly since it can be a macro on some system, so taking address is
-    //problematic.
+	emit_function(assm, bytecode, 0, bytecode.code.size(), cell_size, &op_map,
+		      use_profile ? &hints : nullptr);
 
-void myputchar(uint8_t c){
-    putchar(c);
-}
+	// Save the emitted code in a vector so we can dump it in verbose mode
+	// and store it in the cache; the code calls the runtime through the
+	// BfIo, so it doesn't depend on where it is loaded.
+	// Note: The first section is always .text so it's safe to use
+	// textSection()
 
-//... wrapper for the same reason as myputchar
+	asmjit::CodeBuffer& buf = code.textSection()->buffer();
+	emitted_code.resize(buf.size());
+	memcpy(emitted_code.data(), buf.data(), buf.size());
 
-void mygetchar(){
-    return getchar();
-}
+	// JIT the emitted function
+	// JittedFunc (see codegen.h) is the cpp type for the jit function emitted
+	// by our jit.
 
-struct BracketLabels{
-    BracketLabels(const asmjit::Label& ol, const asmjit::Label& cl)
-	: open_label(ol), close_label(cl) {}
+	asmjit::Error err = jit_runtime.add(&func, &code);
 
-    asmjit::Label open_label;
-    asmjit:Label close_label;
-};
+	if(err){
+	    DIE << "error calling jit_runtime.add: " << asmjit::DebugUtils::errorAsString(err);
+	}
 
-} // end of namespace declaration.
+	op_map.code = reinterpret_cast<const uint8_t*>(func);
 
-// function for optimized jit
+	if(cache){
+	    bool stored = cache->store(cache_key, emitted_code, op_map.op_offsets);
+	    if(verbose){
+		std::cout << "* code cache miss, " << (stored ? "stored " : "failed to store ")
+		    << cache->entry_path(cache_key) << "\n";
+	    }
+	}
+    }
 
-void optasmjit(const Program& p, bool verbose){
+    op_map.code_size = emitted_code.size();
+    memory.set_fault_locator(jit_op_map_locate, &op_map);
 
-    // Initialize state.
+    if(options.perf_map || options.jitdump){
+	if(ops.empty()){
+	    ops = compile_to_ops(p, kDefaultOptLevel);
+	}
+	perf_register_code(options, op_map, perf_ops_from_ir(ops));
+    }
 
-    std::vector<uint8_t> memory(MEMORY_SIZE, 0);
-    std::stack<BracketLabels> open_bracket_stack;
+    // Batch mode runs the same code on every input instead.
 
-    const std::vector<BfOp> ops = translate_program(p);
+    if(!options.batch_path.empty()){
+	std::cout.flush();
+	mark_run_start();
+	run_batch(options, reinterpret_cast<JittedFunc>(op_map.code), max_pointer_move(p.instructions));
+	if(func){
+	    jit_runtime.release(func);
+	}
+	return;
+    }
 
-    /*
-       Code for verbose option.
-    */
+    // Call it, passing the address of memory and the I/O buffers as
+    // parameters. Program output bypasses std::cout, so get the verbose
+    // output out first.
 
-    // Initialize asmjits jit runtime, code holder and assembler.
+    std::cout.flush();
+    mark_run_start();
+    uint64_t final_dataptr = reinterpret_cast<JittedFunc>(op_map.code)((uint64_t)memory.data(), io.get());
+    bfio_flush(io.get());
+    if(func){
+	jit_runtime.release(func);
+    }
 
-    asmjit::JitRuntime jit_runtime;
-    asmjit::CodeHolder code;
-    code.init(jit_runtime.environment());
-    asmjit::x86::Assembler assm(&code);
-
-    // Registers used in the program:
-    /*
-	r13: the data pointer
-	r14 and rax: used temporarily for some instruction .
-	rdi:: parameter from the host -- the host passes the address
-	    of memory here.
-    */
-
-    asmjit::x86::Gp dataptr = asmjit::x86::r13;
-
-    // We pass the data pointer as an argument to the jited functions.
-    // so it's expected to be in rdi.
-
-    // Move it to r13
-
-    assm.mov(dataptr, asmjit::x86::rdi);
-
-    for(size_t pc = 0; pc < ops.size(); ++pc){
-	BfOp op = ops[pc];
-
-	switch(op.kind){
-	    case BfOpKind::INC_PTR:
-		assm.add(dataptr, op.argument);
-		break;
-	    case BfOpKind::DEC_PTR:
-		assm.sub(dataptr, op.argument);
-		break;
-	    case BfOpKind::INC_DATA:
-		assm.add(asmjit::x86::byte_ptr(dataptr), op.argument);
-		break;
-	    case BfOpKind::DEC_DATA:
-		assm.sub(asmjit::x86::byte_ptr(dataptr), op.argument);
-		break;
-	    case BfOpKind::WRITE_STDOUT:
-		for(int i = 0; i < op.argument; ++i){
-		    // call myputchar [dataptr]
-		    assm.movzx(assmjit::x86::rdi, asmjit::x86::byte_ptr(dataptr));
-		    assm.call(asmjit:imm(myputchar));
-		}
-		break;
+    if(!options.dump_state_path.empty()){
+	memory.write_state(options.dump_state_path, (final_dataptr - (uint64_t)memory.data()) / cell_size);
+    }
 
-	    case BfOpKind::READ_STDN:
-		for(int i = 0; i < op.argument; ++i){
-		    // [dataptr] = call mypuchar
-		    // store only the low byte to memory to avoid overwriting unrelated
-		    //data
+    if(verbose){
+	const char* filename = "/tmp/optasmjit.bin";
+	FILE* outfile = fopen(filename, "wb");
 
-		    assm.call(asmjit::imm(mygetchar));
-		    assm.mov(asmjit::x86::byte_ptr(dataptr), asmjit::x86::al);
-		}
-		break;
-	    case BfOpKind::LOOP_SET_TO_ZERO:
-		assm.mov(asmjit::x86::byte_ptr(dataptr), 0);
-		break;
-
-	    case BfOpKind::LOOP_MOVE_PTR:
-		{
-		asmjit::Label loop = assm.newLabel();
-		asmjit::Label endloop = assm.newLabel();
-
-		// Emit a loop that moves the pointer in jumps of op.argument
-		// it's important to do an equivalent of while() rather
-		// than do.. while() here so that we don't do the first pointer
-		// change if already pointing to a zero.
-
-		/*
-loop:
-    cmpb 0(%r13)
-    jz endloop
-    %r13 += argument
-    jmp loop
-		*/
-
-		assm.bind(loop);
-		assm.cmp(asmjit::x86::byte_ptr(dataptr), 0);
-		assm.jz(endloop);
-
-		if(op.argument < 0){
-		    assm.sub(dataptr, -op.argument);
-		}else{
-		    assm.add(dataptr, op.argument);
-		}
-		assm.jmp(loop);
-		assm.bind(endloop);
-		break;
-	}
-	case BfOpKind::LOOP_MOVE_DATA:{
-	    /*
-	        only move if the current data isn't zero
-
-		cmpb 0(%r13), 0
-		jz skip_move
-		<...> move data
-		skip_move;
-
-	    */
-
-	    asmjit::Label skip_move  = assm.newLabel();
-	    assm.cmp(asmjit::x86::byte_ptr(dataptr), 0);
-	    assm.jz(skip_move);
-
-	    assm.mov(asmjit::x86:r14, dataptr);
-	    if(op.argument < 0){
-		assm.sub(asmjit::x86::r14, -op.argument);
-	    }else{
-		assm.add(asmjit::x86::r14, op.argument);
+	if(outfile){
+	    size_t n = emitted_code.size();
+	    if(fwrite(emitted_code.data(), 1, n, outfile) == n){
+		std::cout << "* emitted code to " << filename << "\n";
 	    }
-	    // Use rax as a temp holding the value of at the original pointer
-	    // then use al to add to the new location, so that only the target
-	    // location is affected: addb %al, 0(%r13)
-
-	    assm.movzx(asmjit::x86::rax, asmjit::x86::byte_ptr(dataptr));
-	    assm.add(asmjit::x86::byte_ptr(asmjit::x86::r14), asmjit::x86::al);
-	    assm.mov(asmjit::x86::byte_ptr(dataptr), 0);
-	    assm.bind(skip_move);
-	    break;
-	}
-	case BfOpKind::JUMP_IF_DATA_ZERO:{
-	    assm.cmp(asmjit::x86::byte_ptr(dataptr), 0);
-	    assmjit.Label open_label = assm.newLabel();
-	    assmjit.Label close_label = assm.newLabel();
-
-	    // Jump past the closing ']' if [dataptr] = 0; close_label
-	    // wasn't bound yet (it will be bound when we handle the matching ']')
-	    // but asmjit lets us emit the jump now and will handle the backpatching
-	    // later.
-
-	    assm.jz(close_label);
-
-	    // open label is bound past the jump all in all, we're emitting
-	    //
-	    // cmpb 0(%r13), 0
-	    // jz close_label
-	    // ...
-	    assm.bind(open_label);
-	    // Save both labels on the stack
-	    open_bracket_stack.push(BracketLabels(open_labels, close_labels));
-	    break;
+	    fclose(outfile);
 	}
 
-	case BfOpKind::JUMP_IF_DATA_NOT_ZERO:{
-	    // These ops have to be properly nested.
+	std::cout << "* Memory nonzero locations:\n";
 
-	    if(open_bracket_stack.empty()){
-		DIE << "unamtched closing ']' at pc=" << pc;
+	auto cell_value = [&](size_t i) -> uint32_t {
+	    switch(cell_size){
+		case 1:
+		    return memory[i];
+		case 2:
+		    return memory.cells<uint16_t>()[i];
+		default:
+		    return memory.cells<uint32_t>()[i];
 	    }
+	};
 
-	    BracketLabels labels = open_bracket_stack.top();
-	    open_bracket_stack.pop();
-
-	    // cmpb 0, 0(%r13)
-	    // jnz open_label
-	    // close_label:
-	    //..
-	    assm.cmp(asmjit::x86::byte_ptr(dataptr), 0);
-	    assm.jnz(labels.open_label);
-	    assm.bind(labels.close_label);
-	    break;
-	}
-	case BfOpKind::INVALID_OP:
-	    DIE << "INVALID_OP encountered on pc=" << pc;
-	    break;
+	for(size_t i = 0, pcount = 0; i < memory.size() / cell_size; ++i){
+	    if(cell_value(i)){
+		std::cout << std::right << "[" << std::setw(3) << i
+		    << "] = " << std::setw(3) << std::left
+		    << cell_value(i) << "	";
+		pcount++;
 
+		if(pcount > 0 && pcount % 4 == 0){
+		    std::cout << "\n";
+		}
+	    }
 	}
+	std::cout << "\n";
     }
+}
 
+int main(int argc, const char** argv){
+    Options options = parse_command_line(argc, argv,
+	kFeatureCodeCache | kFeatureBatch | kFeaturePerf | kFeatureProfile);
 
-    assm.ret();
-
-    if(assm.Error()){
-	DIE << "asmjit error: "<< asmjit::DebugUtils::errorAsString(assm.getLastError());
+    Timer t1;
 
+    std::ifstream file(options.bf_file_path);
+    if(!file){
+	DIE << "unable to open file" << options.bf_file_path;
     }
 
-    // Save the emitted code in a vector so we can dump it in verbose mode
-    // Note: The first section is alwasy .txt so it's safe to just use 0
-    // index
+    Program program = parse_from_stream(file);
 
-    code.sync();
-    asmjit::CodeBuffer& buf = code.getSectionEntry(0)->getBuffer();
-    std::vector<uint8_t> emitted_code(buf.getLength());
-    memcpy(emitted_code.data(), buf.getData(), buf.getLength());
+    if(options.verbose){
+	std::cout << "Parsing took: " << t1.elapsed() << "s\n";
+	std::cout << "Length of program: " << program.instructions.size() << "\n";
+    }
 
-    // JIT the emitted function
-    // Jitted func is the cpp type for the jit function emitted by our jit
-    // The emitted function is callable from cpp and follows the x64 system v abi
+    if(options.verbose){
+	std::cout << "[>] Running optasmjit:\n";
+    }
 
-    using JittedFunc Func;
-    asmjit::Error err = jit_runtime.add(&func, &code);
+    Timer t2;
+    optasmjit(program, options);
+
+    if(options.verbose){
+	std::cout << "[<] Done (elapsed: " << t2.elapsed() << "s)\n";
+    }
 
-    if(err){
-	DIE << "error calling jit_runtime.add";
+    if(options.report_times){
+	report_phase_times();
     }
 
+    return 0;
 }
@@ -0,0 +1,489 @@
+// Minimal ELF writer for simplejit's ahead-of-time mode
+//
+// Note: writes x86-64 Linux binaries only; the runtime stub makes Linux system
+// calls directly.
+
+#include "elf_writer.h"
+#include "jit_utils.h"
+#include "../../libbfir/bfio.h"
+#include "../../libbfir/tape.h"
+#include "../../libbfir/utils.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+
+    // Where the executable's text is mapped; the usual address for static
+    // non-PIE binaries.
+
+    constexpr uint64_t kExeBase = 0x400000;
+    constexpr uint64_t kPageSize = 0x1000;
+
+    // The BfIo of the executable lives in the stack frame of _start, rounded
+    // up to keep the stack 16-byte aligned for the call into the code.
+
+    constexpr uint32_t kIoFrameSize = (sizeof(BfIo) + 15) & ~uint32_t(15);
+
+    // Fields only the runtime stub touches. The cursors and the function
+    // pointers use the offsets the JITs use.
+
+    constexpr uint8_t kOutFd = offsetof(BfIo, out_fd);
+    constexpr uint8_t kInFd = offsetof(BfIo, in_fd);
+    constexpr uint8_t kInEof = offsetof(BfIo, in_eof);
+    constexpr uint32_t kOutBuffer = offsetof(BfIo, out_buffer);
+    constexpr uint32_t kInBuffer = offsetof(BfIo, in_buffer);
+
+    static_assert(offsetof(BfIo, in_eof) < 128, "BfIo fields must be addressable with disp8");
+
+    constexpr uint64_t kSysRead = 0;
+    constexpr uint64_t kSysWrite = 1;
+    constexpr uint64_t kSysExitGroup = 231;
+    constexpr int8_t kEintr = -EINTR;
+
+    uint64_t round_up(uint64_t n, uint64_t alignment)
+    {
+        return (n + alignment - 1) / alignment * alignment;
+    }
+
+    template <typename T>
+    void append(std::vector<uint8_t> *out, const T &value)
+    {
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&value);
+        out->insert(out->end(), bytes, bytes + sizeof(T));
+    }
+
+    void pad_to(std::vector<uint8_t> *out, size_t alignment)
+    {
+        out->resize(round_up(out->size(), alignment));
+    }
+
+    void write_file(const std::string &path, const std::vector<uint8_t> &contents, mode_t mode)
+    {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+        if (fd < 0)
+        {
+            DIE << "unable to create " << path << ": " << strerror(errno);
+        }
+
+        // O_CREAT leaves the mode of an existing file alone.
+        mode_t mask = umask(0);
+        umask(mask);
+        if (fchmod(fd, mode & ~mask) != 0)
+        {
+            DIE << "unable to chmod " << path << ": " << strerror(errno);
+        }
+
+        size_t written = 0;
+        while (written < contents.size())
+        {
+            ssize_t n = write(fd, contents.data() + written, contents.size() - written);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                DIE << "write to " << path << " failed: " << strerror(errno);
+            }
+            written += n;
+        }
+        close(fd);
+    }
+
+    // Emits the runtime of the executable: bfio_flush and bfio_refill on raw
+    // system calls, and _start, which the code follows directly. tape_address
+    // is where cell 0 is mapped. Finalizes emitter and returns the offset of
+    // _start.
+
+    size_t emit_runtime_stub(CodeEmitter *emitter, uint64_t tape_address)
+    {
+        using Label = CodeEmitter::Label;
+
+        Label flush = emitter->NewLabel();
+        Label flush_again = emitter->NewLabel();
+        Label flush_done = emitter->NewLabel();
+        Label fail = emitter->NewLabel();
+        Label refill = emitter->NewLabel();
+        Label refill_again = emitter->NewLabel();
+        Label set_eof = emitter->NewLabel();
+        Label eof = emitter->NewLabel();
+        Label start = emitter->NewLabel();
+        Label code = emitter->NewLabel();
+
+        // flush(%rdi = io): writes out_buffer up to out_cursor, like bfio_flush.
+        // Only touches the registers the ABI lets it clobber.
+        //
+        // mov %rdi, %r8
+        // lea out_buffer(%r8), %rsi
+        // again:
+        // mov out_cursor(%r8), %rdx
+        // sub %rsi, %rdx
+        // jz done
+        // mov out_fd(%r8), %edi
+        // mov $SYS_write, %eax
+        // syscall
+        // cmp $-EINTR, %rax
+        // je again
+        // test %rax, %rax
+        // js fail
+        // add %rax, %rsi
+        // jmp again
+        // done:
+        // lea out_buffer(%r8), %rax
+        // mov %rax, out_cursor(%r8)
+        // ret
+        // fail:
+        // mov $1, %edi
+        // mov $SYS_exit_group, %eax
+        // syscall
+
+        emitter->Bind(flush);
+        emitter->EmitBytes({0x49, 0x89, 0xF8});
+        emitter->EmitBytes({0x49, 0x8D, 0xB0});
+        emitter->EmitUint32(kOutBuffer);
+        emitter->Bind(flush_again);
+        emitter->EmitBytes({0x49, 0x8B, 0x50, kBfIoOutCursor});
+        emitter->EmitBytes({0x48, 0x29, 0xF2});
+        emitter->EmitJump(flush_done, JumpCondition::EQUAL);
+        emitter->EmitBytes({0x41, 0x8B, 0x78, kOutFd});
+        emitter->EmitByte(0xB8);
+        emitter->EmitUint32(kSysWrite);
+        emitter->EmitBytes({0x0F, 0x05});
+        emitter->EmitBytes({0x48, 0x83, 0xF8, static_cast<uint8_t>(kEintr)});
+        emitter->EmitJump(flush_again, JumpCondition::EQUAL);
+        emitter->EmitBytes({0x48, 0x85, 0xC0});
+        emitter->EmitJump(fail, JumpCondition::SIGN);
+        emitter->EmitBytes({0x48, 0x01, 0xC6});
+        emitter->EmitJump(flush_again);
+        emitter->Bind(flush_done);
+        emitter->EmitBytes({0x49, 0x8D, 0x80});
+        emitter->EmitUint32(kOutBuffer);
+        emitter->EmitBytes({0x49, 0x89, 0x40, kBfIoOutCursor});
+        emitter->EmitByte(0xC3);
+        emitter->Bind(fail);
+        emitter->EmitByte(0xBF);
+        emitter->EmitUint32(1);
+        emitter->EmitByte(0xB8);
+        emitter->EmitUint32(kSysExitGroup);
+        emitter->EmitBytes({0x0F, 0x05});
+
+        // refill(%rdi = io): flushes, then reads the next chunk of input and
+        // returns its first byte, or -1 at end of input, like bfio_refill.
+        //
+        // push %rdi
+        // call flush
+        // pop %r8
+        // cmpb $0, in_eof(%r8)
+        // jne eof
+        // again:
+        // xor %eax, %eax (SYS_read)
+        // mov in_fd(%r8), %edi
+        // lea in_buffer(%r8), %rsi
+        // mov $kBfIoBufferSize, %edx
+        // syscall
+        // cmp $-EINTR, %rax
+        // je again
+        // test %rax, %rax
+        // js fail
+        // jz set_eof
+        // lea (%rsi,%rax), %rdx
+        // mov %rdx, in_end(%r8)
+        // lea 1(%rsi), %rdx
+        // mov %rdx, in_cursor(%r8)
+        // movzbl (%rsi), %eax
+        // ret
+        // set_eof:
+        // movb $1, in_eof(%r8)
+        // eof:
+        // mov $-1, %eax
+        // ret
+
+        static_assert(kSysRead == 0, "refill clears %eax for SYS_read");
+
+        emitter->Bind(refill);
+        emitter->EmitByte(0x57);
+        emitter->EmitByte(0xE8);
+        emitter->EmitRel32(flush);
+        emitter->EmitBytes({0x41, 0x58});
+        emitter->EmitBytes({0x41, 0x80, 0x78, kInEof, 0x00});
+        emitter->EmitJump(eof, JumpCondition::NOT_EQUAL);
+        emitter->Bind(refill_again);
+        emitter->EmitBytes({0x31, 0xC0});
+        emitter->EmitBytes({0x41, 0x8B, 0x78, kInFd});
+        emitter->EmitBytes({0x49, 0x8D, 0xB0});
+        emitter->EmitUint32(kInBuffer);
+        emitter->EmitByte(0xBA);
+        emitter->EmitUint32(kBfIoBufferSize);
+        emitter->EmitBytes({0x0F, 0x05});
+        emitter->EmitBytes({0x48, 0x83, 0xF8, static_cast<uint8_t>(kEintr)});
+        emitter->EmitJump(refill_again, JumpCondition::EQUAL);
+        emitter->EmitBytes({0x48, 0x85, 0xC0});
+        emitter->EmitJump(fail, JumpCondition::SIGN);
+        emitter->EmitJump(set_eof, JumpCondition::EQUAL);
+        emitter->EmitBytes({0x48, 0x8D, 0x14, 0x06});
+        emitter->EmitBytes({0x49, 0x89, 0x50, kBfIoInEnd});
+        emitter->EmitBytes({0x48, 0x8D, 0x56, 0x01});
+        emitter->EmitBytes({0x49, 0x89, 0x50, kBfIoInCursor});
+        emitter->EmitBytes({0x0F, 0xB6, 0x06});
+        emitter->EmitByte(0xC3);
+        emitter->Bind(set_eof);
+        emitter->EmitBytes({0x41, 0xC6, 0x40, kInEof, 0x01});
+        emitter->Bind(eof);
+        emitter->EmitByte(0xB8);
+        emitter->EmitUint32(static_cast<uint32_t>(-1));
+        emitter->EmitByte(0xC3);
+
+        // _start: the kernel enters with a 16-byte aligned stack. Everything
+        // in the BfIo but the buffers has to be set, since the stack isn't
+        // zeroed; the scan kernels stay unset, simplejit doesn't call them.
+        //
+        // sub $kIoFrameSize, %rsp
+        // mov %rsp, %rsi
+        // lea out_buffer(%rsi), %rax
+        // mov %rax, out_cursor(%rsi)
+        // add $kBfIoBufferSize, %rax
+        // mov %rax, out_end(%rsi)
+        // lea in_buffer(%rsi), %rax
+        // mov %rax, in_cursor(%rsi)
+        // mov %rax, in_end(%rsi)
+        // lea flush(%rip), %rax
+        // mov %rax, flush(%rsi)
+        // lea refill(%rip), %rax
+        // mov %rax, refill(%rsi)
+        // movl $1, out_fd(%rsi)
+        // movl $0, in_fd(%rsi)
+        // movb $0, in_eof(%rsi)
+        // mov $tape_address, %edi
+        // call code
+        // mov %rsp, %rdi
+        // call flush
+        // xor %edi, %edi
+        // mov $SYS_exit_group, %eax
+        // syscall
+
+        emitter->Bind(start);
+        emitter->EmitBytes({0x48, 0x81, 0xEC});
+        emitter->EmitUint32(kIoFrameSize);
+        emitter->EmitBytes({0x48, 0x89, 0xE6});
+        emitter->EmitBytes({0x48, 0x8D, 0x86});
+        emitter->EmitUint32(kOutBuffer);
+        emitter->EmitBytes({0x48, 0x89, 0x46, kBfIoOutCursor});
+        emitter->EmitBytes({0x48, 0x05});
+        emitter->EmitUint32(kBfIoBufferSize);
+        emitter->EmitBytes({0x48, 0x89, 0x46, kBfIoOutEnd});
+        emitter->EmitBytes({0x48, 0x8D, 0x86});
+        emitter->EmitUint32(kInBuffer);
+        emitter->EmitBytes({0x48, 0x89, 0x46, kBfIoInCursor});
+        emitter->EmitBytes({0x48, 0x89, 0x46, kBfIoInEnd});
+        emitter->EmitBytes({0x48, 0x8D, 0x05});
+        emitter->EmitRel32(flush);
+        emitter->EmitBytes({0x48, 0x89, 0x46, kBfIoFlush});
+        emitter->EmitBytes({0x48, 0x8D, 0x05});
+        emitter->EmitRel32(refill);
+        emitter->EmitBytes({0x48, 0x89, 0x46, kBfIoRefill});
+        emitter->EmitBytes({0xC7, 0x46, kOutFd});
+        emitter->EmitUint32(1);
+        emitter->EmitBytes({0xC7, 0x46, kInFd});
+        emitter->EmitUint32(0);
+        emitter->EmitBytes({0xC6, 0x46, kInEof, 0x00});
+        emitter->EmitByte(0xBF);
+        emitter->EmitUint32(static_cast<uint32_t>(tape_address));
+
+        // The code is appended right after the stub, so the call goes to the
+        // end of it.
+        emitter->EmitByte(0xE8);
+        emitter->EmitRel32(code);
+
+        emitter->EmitBytes({0x48, 0x89, 0xE7});
+        emitter->EmitByte(0xE8);
+        emitter->EmitRel32(flush);
+        emitter->EmitBytes({0x31, 0xFF});
+        emitter->EmitByte(0xB8);
+        emitter->EmitUint32(kSysExitGroup);
+        emitter->EmitBytes({0x0F, 0x05});
+
+        emitter->Bind(code);
+        emitter->Finalize();
+        return emitter->LabelOffset(start);
+    }
+} // namespace
+
+void write_elf_executable(const std::string &path, const std::vector<uint8_t> &code,
+                          size_t tape_guard)
+{
+    // The file is mapped as a whole as the text segment: the headers, the
+    // runtime stub and then the code. The tape is a second, .bss-only
+    // segment that starts tape_guard past the end of the text, so that both
+    // of its ends border unmapped memory.
+
+    constexpr size_t kPhnum = 3;
+    constexpr size_t kHeadersSize = sizeof(Elf64_Ehdr) + kPhnum * sizeof(Elf64_Phdr);
+
+    // The stub's size doesn't depend on the tape address, so emit it once
+    // to measure it.
+
+    CodeEmitter measure;
+    emit_runtime_stub(&measure, 0);
+    uint64_t text_size = kHeadersSize + measure.size() + code.size();
+    uint64_t tape_address = round_up(kExeBase + text_size, kPageSize) + round_up(tape_guard, kPageSize);
+    if (tape_address + kTapeMaxSize > UINT32_MAX)
+    {
+        DIE << "program too large for an executable: " << code.size() << " bytes of code";
+    }
+
+    CodeEmitter stub;
+    size_t start = emit_runtime_stub(&stub, tape_address);
+
+    Elf64_Ehdr ehdr = {};
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr.e_type = ET_EXEC;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_entry = kExeBase + kHeadersSize + start;
+    ehdr.e_phoff = sizeof(Elf64_Ehdr);
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_phentsize = sizeof(Elf64_Phdr);
+    ehdr.e_phnum = kPhnum;
+
+    Elf64_Phdr text = {};
+    text.p_type = PT_LOAD;
+    text.p_flags = PF_R | PF_X;
+    text.p_vaddr = text.p_paddr = kExeBase;
+    text.p_filesz = text.p_memsz = text_size;
+    text.p_align = kPageSize;
+
+    Elf64_Phdr tape = {};
+    tape.p_type = PT_LOAD;
+    tape.p_flags = PF_R | PF_W;
+    tape.p_vaddr = tape.p_paddr = tape_address;
+    tape.p_memsz = kTapeMaxSize;
+    tape.p_align = kPageSize;
+
+    Elf64_Phdr stack = {};
+    stack.p_type = PT_GNU_STACK;
+    stack.p_flags = PF_R | PF_W;
+    stack.p_align = 16;
+
+    std::vector<uint8_t> file;
+    append(&file, ehdr);
+    append(&file, text);
+    append(&file, tape);
+    append(&file, stack);
+    file.insert(file.end(), stub.code().begin(), stub.code().end());
+    file.insert(file.end(), code.begin(), code.end());
+
+    write_file(path, file, 0755);
+}
+
+void write_elf_object(const std::string &path, const std::vector<uint8_t> &code)
+{
+    // Sections: the null section, .text, an empty .note.GNU-stack so the
+    // linker keeps the stack non-executable, and the symbol table with its
+    // strings. There is nothing to relocate.
+
+    enum
+    {
+        kNull,
+        kText,
+        kNoteGnuStack,
+        kSymtab,
+        kStrtab,
+        kShstrtab,
+        kShnum
+    };
+
+    std::string strtab = std::string(1, '\0') + kElfProgramSymbol + '\0';
+    std::string shstrtab(1, '\0');
+    auto add_section_name = [&](const char *name) {
+        size_t offset = shstrtab.size();
+        shstrtab += name;
+        shstrtab += '\0';
+        return static_cast<Elf64_Word>(offset);
+    };
+
+    Elf64_Shdr shdrs[kShnum] = {};
+
+    std::vector<uint8_t> file(sizeof(Elf64_Ehdr));
+
+    pad_to(&file, 16);
+    shdrs[kText].sh_name = add_section_name(".text");
+    shdrs[kText].sh_type = SHT_PROGBITS;
+    shdrs[kText].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+    shdrs[kText].sh_offset = file.size();
+    shdrs[kText].sh_size = code.size();
+    shdrs[kText].sh_addralign = 16;
+    file.insert(file.end(), code.begin(), code.end());
+
+    shdrs[kNoteGnuStack].sh_name = add_section_name(".note.GNU-stack");
+    shdrs[kNoteGnuStack].sh_type = SHT_PROGBITS;
+    shdrs[kNoteGnuStack].sh_offset = file.size();
+    shdrs[kNoteGnuStack].sh_addralign = 1;
+
+    // The null symbol, then the function; there are no local symbols.
+    Elf64_Sym program = {};
+    program.st_name = 1;
+    program.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+    program.st_shndx = kText;
+    program.st_size = code.size();
+
+    pad_to(&file, 8);
+    shdrs[kSymtab].sh_name = add_section_name(".symtab");
+    shdrs[kSymtab].sh_type = SHT_SYMTAB;
+    shdrs[kSymtab].sh_offset = file.size();
+    shdrs[kSymtab].sh_size = 2 * sizeof(Elf64_Sym);
+    shdrs[kSymtab].sh_link = kStrtab;
+    shdrs[kSymtab].sh_info = 1;
+    shdrs[kSymtab].sh_addralign = 8;
+    shdrs[kSymtab].sh_entsize = sizeof(Elf64_Sym);
+    append(&file, Elf64_Sym{});
+    append(&file, program);
+
+    shdrs[kStrtab].sh_name = add_section_name(".strtab");
+    shdrs[kStrtab].sh_type = SHT_STRTAB;
+    shdrs[kStrtab].sh_offset = file.size();
+    shdrs[kStrtab].sh_size = strtab.size();
+    shdrs[kStrtab].sh_addralign = 1;
+    file.insert(file.end(), strtab.begin(), strtab.end());
+
+    shdrs[kShstrtab].sh_name = add_section_name(".shstrtab");
+    shdrs[kShstrtab].sh_type = SHT_STRTAB;
+    shdrs[kShstrtab].sh_offset = file.size();
+    shdrs[kShstrtab].sh_size = shstrtab.size();
+    shdrs[kShstrtab].sh_addralign = 1;
+    file.insert(file.end(), shstrtab.begin(), shstrtab.end());
+
+    pad_to(&file, 8);
+    Elf64_Ehdr ehdr = {};
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr.e_type = ET_REL;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_shoff = file.size();
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_shentsize = sizeof(Elf64_Shdr);
+    ehdr.e_shnum = kShnum;
+    ehdr.e_shstrndx = kShstrtab;
+    memcpy(file.data(), &ehdr, sizeof(ehdr));
+
+    for (const Elf64_Shdr &shdr : shdrs)
+    {
+        append(&file, shdr);
+    }
+
+    write_file(path, file, 0644);
+}
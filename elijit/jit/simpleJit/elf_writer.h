@@ -0,0 +1,41 @@
+#ifndef ELF_WRITER_H
+#define ELF_WRITER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Writes the code emitted by emit_program to disk, ahead of time, so that a
+// BF program can be deployed without paying for its compilation at startup.
+// The code doesn't depend on where it is loaded, so it goes into the file
+// unchanged; only the x86-64 Linux ELF formats are supported.
+
+// Name of the function in the object files written by write_elf_object. It
+// has the signature of the JIT function:
+//
+//   extern "C" uint8_t *bf_program(uint8_t *dataptr, BfIo *io);
+//
+// and returns the final data pointer. The host provides the tape and a BfIo
+// from bfio_init, and calls bfio_flush when it returns.
+
+constexpr const char *kElfProgramSymbol = "bf_program";
+
+// Writes a static executable that runs code on stdin and stdout. A small
+// runtime stub written by hand serves as its _start: it sets up a BfIo on the
+// stack whose flush and refill make the write/read system calls directly, runs
+// the code on a .bss tape of kTapeMaxSize bytes and exits. Nothing else is
+// linked in, so the binary starts in microseconds; in exchange, moving off
+// either end of the tape kills it with SIGSEGV instead of reporting a tape
+// overflow, and an I/O error exits with status 1 without a message.
+// tape_guard is the unmapped gap before the tape, from tape_guard_size.
+
+void write_elf_executable(const std::string &path, const std::vector<uint8_t> &code,
+                          size_t tape_guard);
+
+// Writes a relocatable object with code as kElfProgramSymbol in .text, to be
+// linked into a host program together with the libbfir sources.
+
+void write_elf_object(const std::string &path, const std::vector<uint8_t> &code);
+
+#endif /* ELF_WRITER_H */
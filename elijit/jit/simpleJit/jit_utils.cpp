@@ -4,8 +4,9 @@
 // appropiate flags
 
 #include "jit_utils.h"
-#include "utils.h"
+#include "../../libbfir/utils.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <limits>
@@ -50,6 +51,8 @@ namespace
     }
 } // namespace
 
+const uint32_t kCodeEmitterVersion = 1;
+
 JitProgram::JitProgram(const std::vector<uint8_t>& code)
 {
 
@@ -124,6 +127,177 @@ void CodeEmitter::EmitUint64(uint64_t v)
     EmitUint32((v >> 32) & 0xFFFFFFFF);
 }
 
+CodeEmitter::Label CodeEmitter::NewLabel()
+{
+    labels_.push_back(LabelPosition{0, 0, false});
+    return labels_.size() - 1;
+}
+
+void CodeEmitter::Bind(Label label)
+{
+    assert(!labels_[label].bound && "label bound once.");
+    labels_[label] = LabelPosition{code_.size(), fixups_.size(), true};
+}
+
+void CodeEmitter::EmitJump(Label label, JumpCondition condition)
+{
+    fixups_.push_back(Fixup{Fixup::JUMP, code_.size(), label, condition, 0, false});
+}
+
+void CodeEmitter::EmitRel32(Label label)
+{
+    fixups_.push_back(Fixup{Fixup::REL32, code_.size(), label, JumpCondition::ALWAYS, 0, false});
+}
+
+void CodeEmitter::Align(size_t alignment)
+{
+    fixups_.push_back(Fixup{Fixup::ALIGN, code_.size(), 0, JumpCondition::ALWAYS, alignment, false});
+}
+
+void CodeEmitter::Finalize()
+{
+    assert(!finalized_ && "Finalize called once.");
+
+    // shift[i] is the room taken by the first i fixups, so fixup i starts at
+    // fixups_[i].offset + shift[i].
+    std::vector<size_t> shift(fixups_.size() + 1);
+
+    auto fixup_size = [&](const Fixup &fixup, size_t start) -> size_t {
+        switch (fixup.kind)
+        {
+        case Fixup::JUMP:
+            if (!fixup.long_jump)
+            {
+                return 2;
+            }
+            return fixup.condition == JumpCondition::ALWAYS ? 5 : 6;
+        case Fixup::ALIGN:
+            return (fixup.alignment - start % fixup.alignment) % fixup.alignment;
+        default:
+            return 4;
+        }
+    };
+    auto label_offset = [&](Label label) {
+        assert(labels_[label].bound && "label bound before Finalize.");
+        return labels_[label].offset + shift[labels_[label].fixups_before];
+    };
+
+    // Start with every jump short and lengthen the ones that don't reach,
+    // until they all do. Jumps never get shorter, so this ends, at the latest
+    // when they are all long.
+    for (bool changed = true; changed;)
+    {
+        for (size_t i = 0; i < fixups_.size(); ++i)
+        {
+            shift[i + 1] = shift[i] + fixup_size(fixups_[i], fixups_[i].offset + shift[i]);
+        }
+
+        changed = false;
+        for (size_t i = 0; i < fixups_.size(); ++i)
+        {
+            Fixup &fixup = fixups_[i];
+            if (fixup.kind == Fixup::JUMP && !fixup.long_jump)
+            {
+                int64_t from = static_cast<int64_t>(fixup.offset + shift[i] + 2);
+                int64_t distance = static_cast<int64_t>(label_offset(fixup.label)) - from;
+                if (distance < -128 || distance > 127)
+                {
+                    fixup.long_jump = true;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // Recommended multi-byte nops, 1 to 9 bytes.
+    static const std::vector<std::vector<uint8_t>> nops = {
+        {0x90},
+        {0x66, 0x90},
+        {0x0F, 0x1F, 0x00},
+        {0x0F, 0x1F, 0x40, 0x00},
+        {0x0F, 0x1F, 0x44, 0x00, 0x00},
+        {0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00},
+        {0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00},
+        {0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+        {0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+    };
+
+    std::vector<uint8_t> code;
+    code.reserve(code_.size() + shift.back());
+    auto emit_uint32 = [&](uint32_t v) {
+        for (int i = 0; i < 4; ++i)
+        {
+            code.push_back((v >> (8 * i)) & 0xFF);
+        }
+    };
+
+    size_t copied = 0;
+    for (size_t i = 0; i < fixups_.size(); ++i)
+    {
+        const Fixup &fixup = fixups_[i];
+        code.insert(code.end(), code_.begin() + copied, code_.begin() + fixup.offset);
+        copied = fixup.offset;
+
+        size_t start = code.size();
+        size_t end = start + (shift[i + 1] - shift[i]);
+        switch (fixup.kind)
+        {
+        case Fixup::JUMP:
+        {
+            uint32_t rel = compute_relative_32bit_offset(end, label_offset(fixup.label));
+            if (!fixup.long_jump)
+            {
+                code.push_back(fixup.condition == JumpCondition::ALWAYS
+                                   ? 0xEB
+                                   : 0x70 + static_cast<uint8_t>(fixup.condition));
+                code.push_back(rel & 0xFF);
+            }
+            else
+            {
+                if (fixup.condition == JumpCondition::ALWAYS)
+                {
+                    code.push_back(0xE9);
+                }
+                else
+                {
+                    code.push_back(0x0F);
+                    code.push_back(0x80 + static_cast<uint8_t>(fixup.condition));
+                }
+                emit_uint32(rel);
+            }
+            break;
+        }
+        case Fixup::ALIGN:
+            while (code.size() < end)
+            {
+                const std::vector<uint8_t> &nop = nops[std::min(end - code.size(), nops.size()) - 1];
+                code.insert(code.end(), nop.begin(), nop.end());
+            }
+            break;
+        case Fixup::REL32:
+            emit_uint32(compute_relative_32bit_offset(end, label_offset(fixup.label)));
+            break;
+        }
+        assert(code.size() == end);
+    }
+    code.insert(code.end(), code_.begin() + copied, code_.end());
+
+    for (Label label = 0; label < labels_.size(); ++label)
+    {
+        labels_[label].offset = label_offset(label);
+        labels_[label].fixups_before = 0;
+    }
+    code_.swap(code);
+    fixups_.clear();
+    finalized_ = true;
+}
+
+size_t CodeEmitter::LabelOffset(Label label) const
+{
+    assert(finalized_ && "labels have offsets after Finalize.");
+    return labels_[label].offset;
+}
+
 uint32_t compute_relative_32bit_offset(size_t jump_from, size_t jump_to)
 {
     if (jump_to >= jump_from)
@@ -5,6 +5,15 @@
 #include <cstdint>
 #include <vector>
 
+// Condition codes of the jcc instructions, for CodeEmitter::EmitJump.
+
+enum class JumpCondition : int8_t
+{
+	ALWAYS = -1,
+	EQUAL = 0x4,
+	NOT_EQUAL = 0x5,
+	SIGN = 0x8,
+};
 
 // Represents a JITed program in memory. Create it with a vector of code
 // encoded as a binary sequence
@@ -38,8 +47,20 @@ private:
 	size_t program_size_ = 0;
 };
 
+// Version of the encodings CodeEmitter picks (jump relaxation, padding); bump
+// it with every change to the bytes it produces. Code caches key on it.
+
+extern const uint32_t kCodeEmitterVersion;
+
 // Helps emit a binary stream of code into a buffer. Entites larger than 8  bits
 // are emitted in little endian.
+//
+// Jumps can go to labels that are bound later. They take no room until
+// Finalize() lays out the code: each one gets the short rel8 form if its target
+// is in reach, and the rel32 form otherwise. Until then, size() and the
+// offsets passed to the Replace* functions don't count jumps, alignment
+// padding or EmitRel32 fields; after it, size() and code() are the final code
+// and LabelOffset() says where each label ended up.
 
 
 class CodeEmitter
@@ -64,6 +85,35 @@ public:
 
 	void ReplaceUint32AtOffset(size_t offset, uint32_t v);
 
+	using Label = size_t;
+
+	Label NewLabel();
+
+	// Binds label to the current position. Every label has to be bound once
+	// before Finalize().
+
+	void Bind(Label label);
+
+	// Emits a jump (jmp or jcc) to label.
+
+	void EmitJump(Label label, JumpCondition condition = JumpCondition::ALWAYS);
+
+	// Emits the 32-bit pc-relative offset of label, for the instructions that
+	// end in one (call, rip-relative lea).
+
+	void EmitRel32(Label label);
+
+	// Pads the code with nops up to the next multiple of alignment.
+
+	void Align(size_t alignment);
+
+	// Lays out the code and resolves all jumps; see above. Nothing can be
+	// emitted afterwards.
+
+	void Finalize();
+
+	size_t LabelOffset(Label label) const;
+
 	size_t size() const
 	{
 		return code_.size();
@@ -75,7 +125,41 @@ public:
 	}
 
 private:
+	// A jump, padding or rel32 field at offset in code_.
+
+	struct Fixup
+	{
+		enum Kind
+		{
+			JUMP,
+			ALIGN,
+			REL32,
+		};
+
+		Kind kind;
+		size_t offset;
+		Label label;
+		JumpCondition condition;
+		size_t alignment;
+
+		// Jumps start out short, and only ever become long.
+		bool long_jump;
+	};
+
+	// Where a label is bound: an offset in code_, and how many fixups come
+	// before it (several can be at the same offset).
+
+	struct LabelPosition
+	{
+		size_t offset;
+		size_t fixups_before;
+		bool bound;
+	};
+
 	std::vector<uint8_t> code_;
+	std::vector<Fixup> fixups_;
+	std::vector<LabelPosition> labels_;
+	bool finalized_ = false;
 };
 
 // Compute a 32-bit relative offset for pc-relative jumps. Given an address to
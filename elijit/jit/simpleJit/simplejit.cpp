@@ -1,107 +1,249 @@
 #include <cstdio>
 #include <fstream>
 #include <iomanip>
+#include <memory>
 #include <stack>
 
+#include "elf_writer.h"
 #include "jit_utils.h"
-#include "parser.h"
-#include "utils.h"
+#include "../../libbfir/batch.h"
+#include "../../libbfir/bfio.h"
+#include "../../libbfir/codecache.h"
+#include "../../libbfir/parser.h"
+#include "../../libbfir/perfmap.h"
+#include "../../libbfir/tape.h"
+#include "../../libbfir/utils.h"
 
-constexpr int MEMORY_SIZE = 30000;
+// Version of the code emit_program generates; bump it with every change to the
+// code it emits for the same program.
 
-void simpleJit(const Program &p, bool verbose)
-{
-    // Initialize state.
+constexpr uint32_t kEmitProgramVersion = 1;
 
-    std::vector<uint8_t> memory(MEMORY_SIZE, 0);
+// Translates p to machine code and returns it. cell_size is the width of a
+// tape cell in bytes: 1, 2 or 4. Records where each instruction's code starts
+// in op_map, so a tape overflow can be reported against the instruction that
+// caused it.
 
+std::vector<uint8_t> emit_program(const Program &p, int cell_size, JitOpMap *op_map)
+{
     // Registers used in the program;
     //
-    // r13 the data pointer -- contains the address of memory.data()
+    // rbx the data pointer -- contains the address of memory.data(). As a
+    //     base register it needs no displacement byte, unlike r13, whose
+    //     [r13] encoding means rip-relative.
+    // r13 the address of the BfIo used for buffered I/O
 
-    // rax, rdi, rsi, rdx: used for making system calls, per the ABI
+    // rax, rcx, rdi: scratch, and for calling into the I/O runtime per the ABI
 
     CodeEmitter emitter;
 
-    // Throughout the translation loop, this stack contains offset (in the
-    // emitter code vector) of locations for fixup .
+    // Throughout the translation loop, this stack contains the labels of the
+    // open loops: the start of the body, and the code after the loop.
+
+    std::stack<std::pair<CodeEmitter::Label, CodeEmitter::Label>> open_bracket_stack;
+
+    // Where the code of each instruction starts; offsets are only known once
+    // the jumps are laid out.
+
+    std::vector<CodeEmitter::Label> op_labels;
+
+    // Byte cells use the 8-bit forms of the instructions that access memory;
+    // wider cells use the 32-bit forms, with the 0x66 operand-size prefix for
+    // 16 bits.
+
+    auto emit_operand_size_prefix = [&]() {
+        if (cell_size == 2)
+        {
+            emitter.EmitByte(0x66);
+        }
+    };
+
+    // Emits "<op> (%rbx)" on the current cell, for the one-operand opcodes
+    // (0xFE/0xFF); modrm picks the operation: 0x03 is inc and 0x0B dec.
+
+    auto emit_cell_unary = [&](uint8_t modrm) {
+        emit_operand_size_prefix();
+        emitter.EmitBytes({static_cast<uint8_t>(cell_size == 1 ? 0xFE : 0xFF), modrm});
+    };
+
+    // Emits "cmp $0, (%rbx)".
 
-    std::stack<size_t> open_bracket_stack;
+    auto emit_cell_test = [&]() {
+        emit_operand_size_prefix();
+        emitter.EmitBytes({static_cast<uint8_t>(cell_size == 1 ? 0x80 : 0x83), 0x3B, 0x00});
+    };
 
-    // movabs <address of memory.data>, %r13
-    emitter.EmitBytes({0x49, 0xBD});
-    emitter.EmitUint64((uint64_t)memory.data());
+    // Emits "mov %cl, (%rbx)" (modrm 0x0B) or "mov %al, (%rbx)" (modrm 0x03),
+    // storing %cx/%ecx or %ax/%eax for wider cells.
+
+    auto emit_store_cell = [&](uint8_t modrm) {
+        emit_operand_size_prefix();
+        emitter.EmitBytes({static_cast<uint8_t>(cell_size == 1 ? 0x88 : 0x89), modrm});
+    };
+
+    // Innermost loops are where programs spend their time, so their bodies
+    // start on a 16-byte boundary, which the back-edge jumps to. The padding
+    // runs once per loop entry.
+
+    auto is_innermost_loop = [&](size_t open_pc) {
+        for (size_t pc = open_pc + 1; pc < p.instructions.size(); ++pc)
+        {
+            if (p.instructions[pc] == '[')
+            {
+                return false;
+            }
+            if (p.instructions[pc] == ']')
+            {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    // rbx and r13 are callee-saved, so preserve them for the caller. r12 is
+    // pushed too only to keep the stack 16-byte aligned for the calls.
+    //
+    // push %r12
+    // push %r13
+    // push %rbx
+    emitter.EmitBytes({0x41, 0x54});
+    emitter.EmitBytes({0x41, 0x55});
+    emitter.EmitByte(0x53);
+
+    // The host passes the address of memory in %rdi and the BfIo in %rsi;
+    // nothing in the code depends on where it or its data is loaded.
+    //
+    // mov %rdi, %rbx
+    // mov %rsi, %r13
+    emitter.EmitBytes({0x48, 0x89, 0xFB});
+    emitter.EmitBytes({0x49, 0x89, 0xF5});
 
     for (size_t pc = 0; pc < p.instructions.size(); ++pc)
     {
+        op_labels.push_back(emitter.NewLabel());
+        emitter.Bind(op_labels.back());
 
         char instruction = p.instructions[pc];
 
         switch (instruction)
         {
         case '>':{
-            // inc %r13
-            emitter.EmitBytes({0x49, 0xFF, 0xC5});
+            if (cell_size == 1)
+            {
+                // inc %rbx
+                emitter.EmitBytes({0x48, 0xFF, 0xC3});
+            }
+            else
+            {
+                // add $cell_size, %rbx
+                emitter.EmitBytes({0x48, 0x83, 0xC3, static_cast<uint8_t>(cell_size)});
+            }
             break;
 	}
         case '<':{
-            // dec %r13
-            emitter.EmitBytes({0x49, 0xFF, 0xCD});
+            if (cell_size == 1)
+            {
+                // dec %rbx
+                emitter.EmitBytes({0x48, 0xFF, 0xCB});
+            }
+            else
+            {
+                // sub $cell_size, %rbx
+                emitter.EmitBytes({0x48, 0x83, 0xEB, static_cast<uint8_t>(cell_size)});
+            }
             break;
 		}
         case '+':{
-            // Our memory is byte-addressable, so using addb/subb for modifying it
-            // addb $1, 0(%r13)
-            emitter.EmitBytes({0x41, 0x80, 0x45, 0x00, 0x01});
+            // incb (%rbx) (incw/incl for wider cells)
+            emit_cell_unary(0x03);
             break;
 	    }
         case '-':{
-            // subb $1, 0(%r13)
-            emitter.EmitBytes({0x41, 0x80, 0x6D, 0x00, 0x01});
+            // decb (%rbx) (decw/decl for wider cells)
+            emit_cell_unary(0x0B);
             break;
 	}
         case '.':{
-            // To emit one byte to stdout, call the write syscall with fd = 1
-            // (for stdout), buf=address of byte, count = 1
-            // mov $1, %rax
-            // mov $1, %rdi
-            // mov %r13, %rsi
-            // mov $1, %rdx
-            // syscall
-
-            emitter.EmitBytes({0x48, 0xC7, 0xC0, 0x01, 0x00, 0x00, 0x00});
-            emitter.EmitBytes({0x48, 0xC7, 0xC7, 0x01, 0x00, 0x00, 0x00});
-            emitter.EmitBytes({0x4c, 0x89, 0xEE});
-            emitter.EmitBytes({0x48, 0xC7, 0xC2, 0x01, 0x00, 0x00, 0x00});
-            emitter.EmitBytes({0x0F, 0x05});
+            // Append the byte to the output buffer of the BfIo, and only call
+            // bfio_flush when the buffer is full. Cells are little endian, so
+            // for wider cells this writes their low byte.
+            //
+            // mov out_cursor(%r13), %rax
+            // mov (%rbx), %cl
+            // mov %cl, (%rax)
+            // inc %rax
+            // mov %rax, out_cursor(%r13)
+            // cmp out_end(%r13), %rax
+            // jne no_flush
+            // mov %r13, %rdi
+            // call *flush(%r13)
+            // no_flush:
+
+            CodeEmitter::Label no_flush = emitter.NewLabel();
+            emitter.EmitBytes({0x49, 0x8B, 0x45, kBfIoOutCursor});
+            emitter.EmitBytes({0x8A, 0x0B});
+            emitter.EmitBytes({0x88, 0x08});
+            emitter.EmitBytes({0x48, 0xFF, 0xC0});
+            emitter.EmitBytes({0x49, 0x89, 0x45, kBfIoOutCursor});
+            emitter.EmitBytes({0x49, 0x3B, 0x45, kBfIoOutEnd});
+            emitter.EmitJump(no_flush, JumpCondition::NOT_EQUAL);
+            emitter.EmitBytes({0x4C, 0x89, 0xEF});
+            emitter.EmitBytes({0x41, 0xFF, 0x55, kBfIoFlush});
+            emitter.Bind(no_flush);
             break;
 	}
         case ',':{
-            // To read one byte from stdin, call the read syscall with fd=0
-            // (for stdin),
-            // buf=address of byte, count=1
-
-            emitter.EmitBytes({0x48, 0xC7, 0xC0, 0x00, 0x00, 0x00, 0x00});
-            emitter.EmitBytes({0x48, 0xC7, 0xC7, 0x00, 0x00, 0x00, 0x00});
-            emitter.EmitBytes({0x4C, 0x89, 0xEE});
-            emitter.EmitBytes({0x48, 0xC7, 0xC2, 0x01, 0x00, 0x00, 0x00});
-            emitter.EmitBytes({0x0F, 0x05});
+            // Take the next byte of the input buffer of the BfIo; when it is
+            // exhausted, bfio_refill returns the next byte (or -1) in %eax.
+            //
+            // mov in_cursor(%r13), %rax
+            // cmp in_end(%r13), %rax
+            // je refill
+            // movzbl (%rax), %ecx
+            // inc %rax
+            // mov %rax, in_cursor(%r13)
+            // mov %cl, (%rbx)
+            // jmp done
+            // refill:
+            // mov %r13, %rdi
+            // call *refill(%r13)
+            // mov %al, (%rbx)
+            // done:
+
+            CodeEmitter::Label refill = emitter.NewLabel();
+            CodeEmitter::Label done = emitter.NewLabel();
+            emitter.EmitBytes({0x49, 0x8B, 0x45, kBfIoInCursor});
+            emitter.EmitBytes({0x49, 0x3B, 0x45, kBfIoInEnd});
+            emitter.EmitJump(refill, JumpCondition::EQUAL);
+            emitter.EmitBytes({0x0F, 0xB6, 0x08});
+            emitter.EmitBytes({0x48, 0xFF, 0xC0});
+            emitter.EmitBytes({0x49, 0x89, 0x45, kBfIoInCursor});
+            emit_store_cell(0x0B);
+            emitter.EmitJump(done);
+            emitter.Bind(refill);
+            emitter.EmitBytes({0x4C, 0x89, 0xEF});
+            emitter.EmitBytes({0x41, 0xFF, 0x55, kBfIoRefill});
+            emit_store_cell(0x03);
+            emitter.Bind(done);
             break;
 	    }
         case '[':{
-            // For the jumps we always emit the instruction for 32-bit p-relative
-            // jump, without worrying about potentially  short  jumps and relaxation.
-
-            // cmpb $0, 0(%r13)
-            emitter.EmitBytes({0x41, 0x80, 0x7d, 0x00, 0x00});
+            // The jumps go to labels; the emitter picks the short form for
+            // the ones that reach, which is most of them.
 
-            // Save the location in the stack, and emit JZ
-            // (with 32-bit relative offset)
-            // with 4 placeholder zeros that will be fixed up later.
+            // cmpb $0, (%rbx) (cmpw/cmpl for wider cells)
+            // jz <after the matching ']'>
+            emit_cell_test();
 
-            open_bracket_stack.push(emitter.size());
-            emitter.EmitBytes({0x0F, 0x84});
-            emitter.EmitUint32(0);
+            CodeEmitter::Label body = emitter.NewLabel();
+            CodeEmitter::Label after_loop = emitter.NewLabel();
+            emitter.EmitJump(after_loop, JumpCondition::EQUAL);
+            if (is_innermost_loop(pc))
+            {
+                emitter.Align(16);
+            }
+            emitter.Bind(body);
+            open_bracket_stack.push(std::make_pair(body, after_loop));
             break;
 	}
         case ']':{
@@ -110,65 +252,173 @@ void simpleJit(const Program &p, bool verbose)
             {
                 DIE << "unmatched closing ']' at pc=" << pc;
             }
-            size_t open_bracket_offset = open_bracket_stack.top();
+            std::pair<CodeEmitter::Label, CodeEmitter::Label> loop = open_bracket_stack.top();
             open_bracket_stack.pop();
 
-            // cmpb $0, 0(%r13)
-            emitter.EmitBytes({0x41, 0x80, 0x7d, 0x00, 0x00});
+            // Both [ and ] jump to the instruction *after* the matching
+            // bracket if their condition is fulfilled.
+            //
+            // cmpb $0, (%rbx) (cmpw/cmpl for wider cells)
+            // jnz <body of the loop>
+            emit_cell_test();
+            emitter.EmitJump(loop.first, JumpCondition::NOT_EQUAL);
+            emitter.Bind(loop.second);
+            break;
+	}
+        default:{DIE << "bad char '" << instruction << " ' at pc=" << pc;}
+        }
+    }
+
+    if (!open_bracket_stack.empty())
+    {
+        DIE << "unmatched opening '['";
+    }
+
+    // The emitted code will be called as a function from from C++; therefore it has to
+    // use the proper calling convention. Return the final data pointer, restore
+    // the callee-saved registers and emit a 'ret' for orderly return to the
+    // caller.
+    //
+    // mov %rbx, %rax
+    // pop %rbx
+    // pop %r13
+    // pop %r12
+    // ret
+
+    emitter.EmitBytes({0x48, 0x89, 0xD8});
+    emitter.EmitByte(0x5B);
+    emitter.EmitBytes({0x41, 0x5D});
+    emitter.EmitBytes({0x41, 0x5C});
+    emitter.EmitByte(0xC3);
+
+    emitter.Finalize();
+    for (CodeEmitter::Label label : op_labels)
+    {
+        op_map->op_offsets.push_back(static_cast<uint32_t>(emitter.LabelOffset(label)));
+    }
+    return emitter.code();
+}
 
-            // open_bracket_offset points to the JZ that jumps to this closing
-            // bracket. We'll need to fix up the offset for the JZ, as well as emit a
-            // JNZ with a correct offset back. Note that both [ and ] jump to the
-            // instruction *after* the matching bracket if their condition is
-            // fulfilled
+void simpleJit(const Program &p, const Options &options)
+{
+    bool verbose = options.verbose;
+    int cell_size = options.cell_bits / 8;
 
-            // Compute the offset for this jump. The jump start is computed from after
-            // the jump instruction, and the target is the instruction after the one
-            // saved on the stack
+    // Ahead of time: write the code to a file instead of running it.
 
-            size_t jump_back_from = emitter.size() + 6;
-            size_t jump_back_to = open_bracket_offset + 6;
+    if (!options.emit_exe_path.empty() || !options.emit_obj_path.empty())
+    {
+        JitOpMap op_map;
+        std::vector<uint8_t> emitted_code = emit_program(p, cell_size, &op_map);
+        const std::string &path = options.emit_exe_path.empty() ? options.emit_obj_path : options.emit_exe_path;
+        if (!options.emit_exe_path.empty())
+        {
+            write_elf_executable(path, emitted_code,
+                                 tape_guard_size(max_pointer_move(p.instructions), cell_size));
+        }
+        else
+        {
+            write_elf_object(path, emitted_code);
+        }
 
-            uint32_t pcrel_offset_back = compute_relative_32bit_offset(jump_back_from, jump_back_to);
+        if (verbose)
+        {
+            std::cout << "* wrote " << emitted_code.size() << " bytes of code to " << path << "\n";
+        }
+        return;
+    }
 
-            // jnz <open_bracket_location>
+    // Initialize state.
 
-            emitter.EmitBytes({0x0F, 0x85});
-            emitter.EmitUint32(pcrel_offset_back);
+    Tape memory(cell_size, max_pointer_move(p.instructions));
+    std::unique_ptr<BfIo> io(new BfIo);
+    bfio_init(io.get());
+    memory.set_io(io.get());
 
-            // Also fix up the forward jump at the matching [. Note that here don't
-            // need to add the size of this jmp to the "jump to" offset, since the jmp
-            // was already emitted and the emitter size was bumped forward.
+    // The code runs either from a cache entry mapped by CodeCache::lookup or
+    // from a JitProgram holding freshly emitted code; both have to stay alive
+    // until it returns.
 
-            size_t jump_forward_from = open_bracket_offset + 6;
-            size_t jump_forward_to = emitter.size();
-            uint32_t pcrel_offset_forward = compute_relative_32bit_offset(jump_forward_from, jump_forward_to);
+    std::unique_ptr<CodeCache> cache;
+    std::string cache_key;
+    if (!options.code_cache_dir.empty())
+    {
+        cache.reset(new CodeCache(options.code_cache_dir));
+        std::string engine = "simplejit " + std::to_string(kEmitProgramVersion) + "." +
+                             std::to_string(kCodeEmitterVersion);
+        cache_key = code_cache_key(p, engine, 0, options.cell_bits);
+    }
 
-            emitter.ReplaceUint32AtOffset(open_bracket_offset + 2, pcrel_offset_forward);
-            break;
-	}
-        default:{DIE << "bad char '" << instruction << " ' at pc=" << pc;}
+    CachedCode cached;
+    std::unique_ptr<JitProgram> jit_program;
+    std::vector<uint8_t> emitted_code;
+    JitOpMap op_map;
+
+    if (cache && cache->lookup(cache_key, &cached))
+    {
+        op_map.code = cached.code();
+        op_map.op_offsets = cached.op_offsets();
+        emitted_code.assign(cached.code(), cached.code() + cached.code_size());
+
+        if (verbose)
+        {
+            std::cout << "* code cache hit: " << cache->entry_path(cache_key) << "\n";
         }
     }
+    else
+    {
+        // Load the emitted code to executable memory.
+        emitted_code = emit_program(p, cell_size, &op_map);
+        jit_program.reset(new JitProgram(emitted_code));
+        op_map.code = static_cast<const uint8_t *>(jit_program->program_memory());
 
-    // The emitted code will be called as a function from from C++; therefore it has to
-    // use the proper calling convention. Emit a 'ret' for orderly return to the
-    // caller.
+        if (cache)
+        {
+            bool stored = cache->store(cache_key, emitted_code, op_map.op_offsets);
+            if (verbose)
+            {
+                std::cout << "* code cache miss, " << (stored ? "stored " : "failed to store ")
+                          << cache->entry_path(cache_key) << "\n";
+            }
+        }
+    }
 
-    emitter.EmitByte(0xC3);
+    op_map.code_size = emitted_code.size();
+    memory.set_fault_locator(jit_op_map_locate, &op_map);
 
-    // Load the emitted code to executable memory and run it.
-    std::vector<uint8_t> emitted_code = emitter.code();
-    JitProgram jit_program(emitted_code);
+    if (options.perf_map || options.jitdump)
+    {
+        perf_register_code(options, op_map, perf_ops_from_program(p));
+    }
+
+    // The emitted function has the same signature as BatchEntry.
+
+    if (!options.batch_path.empty())
+    {
+        std::cout.flush();
+        mark_run_start();
+        run_batch(options, reinterpret_cast<BatchEntry>(op_map.code), max_pointer_move(p.instructions));
+        return;
+    }
 
     // JittedFunc is the C++ type for the JIT function emitted here. The emitted
-    // function is callable from the C++ and follows the x86 system abi.
+    // function is callable from the C++ and follows the x86 system abi; it
+    // returns the final data pointer.
 
-    using JittedFunc = void (*)(void);
+    using JittedFunc = uint8_t *(*)(uint8_t *, BfIo *);
 
-    JittedFunc func = (JittedFunc)jit_program.program_memory();
+    JittedFunc func = (JittedFunc)op_map.code;
 
-    func();
+    // Program output bypasses std::cout, so get the verbose output out first.
+    std::cout.flush();
+    mark_run_start();
+    uint8_t *final_dataptr = func(memory.data(), io.get());
+    bfio_flush(io.get());
+
+    if (!options.dump_state_path.empty())
+    {
+        memory.write_state(options.dump_state_path, (final_dataptr - memory.data()) / cell_size);
+    }
 
     if (verbose)
     {
@@ -188,13 +438,25 @@ void simpleJit(const Program &p, bool verbose)
 
         std::cout << "* Memory nonzero locations:\n";
 
-        for (size_t i = 0, pcount = 0; i < memory.size(); ++i)
+        auto cell_value = [&](size_t i) -> uint32_t {
+            switch (cell_size)
+            {
+            case 1:
+                return memory[i];
+            case 2:
+                return memory.cells<uint16_t>()[i];
+            default:
+                return memory.cells<uint32_t>()[i];
+            }
+        };
+
+        for (size_t i = 0, pcount = 0; i < memory.size() / cell_size; ++i)
         {
-            if (memory[i])
+            if (cell_value(i))
             {
                 std::cout << std::right << "[" << std::setw(3) << i
                           << "] = " << std::setw(3) << std::left
-                          << static_cast<int32_t>(memory[i]) << "     ";
+                          << cell_value(i) << "     ";
                 pcount++;
 
                 if (pcount > 0 && pcount % 4 == 0)
@@ -209,22 +471,20 @@ void simpleJit(const Program &p, bool verbose)
 
 int main(int argc,const char **argv)
 {
-
-    bool verbose = true;
-    std::string bf_file_path;
-    parse_command_line(argc, argv, &bf_file_path, &verbose);
+    Options options = parse_command_line(argc, argv,
+                                         kFeatureCodeCache | kFeatureBatch | kFeaturePerf | kFeatureEmit);
 
     Timer t1;
-    std::ifstream file(bf_file_path);
+    std::ifstream file(options.bf_file_path);
 
     if (!file)
     {
-        DIE << "unable to open file" << bf_file_path;
+        DIE << "unable to open file" << options.bf_file_path;
     }
 
     Program program = parse_from_stream(file);
 
-    if (verbose)
+    if (options.verbose)
     {
         std::cout << "Parsing took: " << t1.elapsed() << "s\n";
         std::cout << "Length of the porgram: " << program.instructions.size() << "\n";
@@ -232,17 +492,22 @@ int main(int argc,const char **argv)
                   << program.instructions << "\n";
     }
 
-    if (verbose)
+    if (options.verbose)
     {
         std::cout << "[>] Running simplejit:\n";
     }
 
     Timer t2;
-    simpleJit(program, verbose);
+    simpleJit(program, options);
 
-    if (verbose)
+    if (options.verbose)
     {
         std::cout << "[<] Done (elapsed: " << t2.elapsed() << "s)\n";
     }
+
+    if (options.report_times)
+    {
+        report_phase_times();
+    }
     return 0;
 }
@@ -4,31 +4,35 @@
 #include <iomanip>
 #include <fstream>
 #include <iomanip>
+#include <memory>
 #include <stack>
 #include <asmjit/asmjit.h>
 
 #include <vector>
 
-#include "parser.h"
-#include "utils.h"
+#include "../../libbfir/bfio.h"
+#include "../../libbfir/parser.h"
+#include "../../libbfir/tape.h"
+#include "../../libbfir/utils.h"
 
 #define ASMJIT_STATIC
 
-constexpr int MEMORY_SIZE = 30000;
+// Buffered I/O state used by the wrappers below; set up in simpleasmjit().
 
-// This function will be invoked from JITed code; not using putchar directly
-// since it can be a macro on some systems, so taking its address is
-// problematic.
+static BfIo *program_io;
+
+// This function will be invoked from JITed code; not calling bfio_put
+// directly since it is inline, so taking its address is problematic.
 
 
 void myputchar(uint8_t c){
-    putchar(c);
+    bfio_put(program_io, c);
 }
 
 // ... wrapper for the same reason myputchar
 
-uint8_t mygetchar(){
-    return getchar();
+int mygetchar(){
+    return bfio_get(program_io);
 }
 
 struct BracketLabels{
@@ -39,10 +43,20 @@ struct BracketLabels{
    asmjit::Label close_label;
 };
 
-void simpleasmjit(const Program& p, bool verbose){
+void simpleasmjit(const Program& p, const Options& options){
+    bool verbose = options.verbose;
+
+    // cell_size is the width of a tape cell in bytes: 1, 2 or 4.
+
+    int cell_size = options.cell_bits / 8;
+
 
     // Initialize state
-    std::vector<uint8_t> memory(MEMORY_SIZE, 0);
+    Tape memory(cell_size, max_pointer_move(p.instructions));
+    std::unique_ptr<BfIo> io(new BfIo);
+    bfio_init(io.get());
+    memory.set_io(io.get());
+    program_io = io.get();
 
     std::stack<BracketLabels> open_bracket_stack;
 
@@ -66,25 +80,37 @@ void simpleasmjit(const Program& p, bool verbose){
     asmjit::x86::Gp dataptr = asmjit::x86::r13;
     assm.mov(dataptr, asmjit::x86::rdi);
 
+    // The current cell, as a byte_ptr, word_ptr or dword_ptr.
+
+    asmjit::x86::Mem cell = asmjit::x86::ptr(dataptr, 0, cell_size);
+
     for(size_t pc = 0; pc < p.instructions.size(); ++pc){
 
 	char instruction = p.instructions[pc];
 	switch(instruction){
 	    case '>':
-		// inc %r13
-		assm.inc(dataptr);
+		// inc %r13 (add $cell_size for wider cells)
+		if(cell_size == 1){
+		    assm.inc(dataptr);
+		}else{
+		    assm.add(dataptr, cell_size);
+		}
 		break;
 	    case '<':
-		// dec %r13
-		assm.dec(dataptr);
+		// dec %r13 (sub $cell_size for wider cells)
+		if(cell_size == 1){
+		    assm.dec(dataptr);
+		}else{
+		    assm.sub(dataptr, cell_size);
+		}
 		break;
 	    case '+':
 		// addb $1, 0(%r13)
-		assm.add(asmjit::x86::byte_ptr(dataptr), 1);
+		assm.add(cell, 1);
 		break;
 	    case '-':
 		// subb $1, 0(%r13)
-		assm.sub(asmjit::x86::byte_ptr(dataptr), 1);
+		assm.sub(cell, 1);
 		break;
 	    case '.':
 		// call myputchar [dataptr]
@@ -96,14 +122,21 @@ void simpleasmjit(const Program& p, bool verbose){
 	    case ',':
 		// [dataptr] = call mygetchar
 
-		// Store only the low byte to memory to avoid overwriting unrelated data
+		// Store only a cell's worth of eax to memory to avoid overwriting
+		// unrelated data
 
 		assm.call(asmjit::Imm(mygetchar));
-		assm.mov(asmjit::x86::byte_ptr(dataptr), asmjit::x86::al);
+		if(cell_size == 1){
+		    assm.mov(cell, asmjit::x86::al);
+		}else if(cell_size == 2){
+		    assm.mov(cell, asmjit::x86::ax);
+		}else{
+		    assm.mov(cell, asmjit::x86::eax);
+		}
 		break;
 
 	    case '[':{
-			 assm.cmp(asmjit::x86::byte_ptr(dataptr), 0);
+			 assm.cmp(cell, 0);
 			 asmjit::Label open_label = assm.newLabel();
 			 asmjit::Label close_label = assm.newLabel();
 
@@ -142,7 +175,7 @@ void simpleasmjit(const Program& p, bool verbose){
  		     // close_label:
 		     // ...
 
-		     assm.cmp(asmjit::x86::byte_ptr(dataptr), 0);
+		     assm.cmp(cell, 0);
 		     assm.jnz(labels.open_label);
 		     assm.bind(labels.close_label);
 		     break;
@@ -156,11 +189,14 @@ void simpleasmjit(const Program& p, bool verbose){
 
     }
 
+    // Return the final data pointer.
+
+    assm.mov(asmjit::x86::rax, dataptr);
     assm.ret();
     printf("test1\n");
     // My experimental part starts here.
 
-    using Func = void (*)(uint64_t);
+    using Func = uint64_t (*)(uint64_t);
     Func fn;
     asmjit::Error err = jit_runtime.add(&fn, &code);
 
@@ -172,9 +208,15 @@ void simpleasmjit(const Program& p, bool verbose){
 
     }
 
-    fn((uint64_t)memory.data());
+    mark_run_start();
+    uint64_t final_dataptr = fn((uint64_t)memory.data());
+    bfio_flush(io.get());
     jit_runtime.release(fn);
 
+    if(!options.dump_state_path.empty()){
+	memory.write_state(options.dump_state_path, (final_dataptr - (uint64_t)memory.data()) / cell_size);
+    }
+
     printf("test2\n");
     // My experimental part ends here.
 
@@ -217,7 +259,9 @@ void simpleasmjit(const Program& p, bool verbose){
 
     // Call it, passing the address of memory as a parameter.
 
+    std::cout.flush();
     func((uint64_t)memory.data());
+    bfio_flush(io.get());
     */
     /*if(verbose){
 	const char* filename = "/tmp/bjout.bin";
@@ -251,37 +295,38 @@ void simpleasmjit(const Program& p, bool verbose){
 }
 
 int main(int argc, const char** argv){
-    bool verbose = false;
-
-    std::string bf_file_path;
-    parse_command_line(argc, argv, &bf_file_path, &verbose);
+    Options options = parse_command_line(argc, argv);
 
     Timer t1;
 
-    std::ifstream file(bf_file_path);
+    std::ifstream file(options.bf_file_path);
     if(!file){
-	DIE << "unable to open file" << bf_file_path;
+	DIE << "unable to open file" << options.bf_file_path;
     }
 
     Program program = parse_from_stream(file);
 
-    if(verbose){
+    if(options.verbose){
 	std::cout << "Parsing took: " << t1.elapsed()<< "s\n";
 	std::cout << "Length of program: "<< program.instructions.size()<<"\n";
 	std::cout << "Program:\n" << program.instructions << "\n";
     }
 
-    if(verbose){
+    if(options.verbose){
 	std::cout<<"[>] Running simpleasmjit:\n";
     }
 
     Timer t2;
 
-    simpleasmjit(program, verbose);
+    simpleasmjit(program, options);
 
-    if(verbose){
+    if(options.verbose){
 	std::cout << "[<] Done (elapsed: "<<t2.elapsed()<<"s)\n";
     }
 
+    if(options.report_times){
+	report_phase_times();
+    }
+
     return 0;
 }
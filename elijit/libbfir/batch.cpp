@@ -0,0 +1,293 @@
+#include "batch.h"
+#include "tape.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csetjmp>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+
+    struct Job
+    {
+        std::string input;
+        std::string output;
+        off_t size = 0;
+
+        // Why the job failed; empty if it succeeded.
+        std::string error;
+    };
+
+    std::vector<Job> jobs_from_directory(std::string dir)
+    {
+        while (dir.size() > 1 && dir.back() == '/')
+        {
+            dir.pop_back();
+        }
+        std::string out_dir = dir + ".out";
+        if (mkdir(out_dir.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            DIE << "unable to create " << out_dir << ": " << strerror(errno);
+        }
+
+        DIR *d = opendir(dir.c_str());
+        if (!d)
+        {
+            DIE << "unable to open directory " << dir << ": " << strerror(errno);
+        }
+        std::vector<Job> jobs;
+        while (struct dirent *entry = readdir(d))
+        {
+            std::string name = entry->d_name;
+            struct stat st;
+            if (name[0] != '.' && stat((dir + "/" + name).c_str(), &st) == 0 &&
+                S_ISREG(st.st_mode))
+            {
+                Job job;
+                job.input = dir + "/" + name;
+                job.output = out_dir + "/" + name;
+                jobs.push_back(job);
+            }
+        }
+        closedir(d);
+
+        // readdir order is arbitrary; keep runs reproducible.
+        std::sort(jobs.begin(), jobs.end(),
+                  [](const Job &a, const Job &b) { return a.input < b.input; });
+        return jobs;
+    }
+
+    std::vector<Job> jobs_from_manifest(const std::string &path)
+    {
+        std::ifstream manifest(path);
+        if (!manifest)
+        {
+            DIE << "unable to open manifest " << path;
+        }
+        std::vector<Job> jobs;
+        std::string line;
+        while (std::getline(manifest, line))
+        {
+            std::istringstream fields(line);
+            Job job;
+            if (!(fields >> job.input) || job.input[0] == '#')
+            {
+                continue;
+            }
+            if (!(fields >> job.output))
+            {
+                job.output = job.input + ".out";
+            }
+            jobs.push_back(job);
+        }
+        return jobs;
+    }
+
+    // One deque of job indices per worker. The owner takes from the back and
+    // thieves from the front, so they only meet on the last job in a deque.
+    // Jobs are coarse enough that a mutex per deque costs nothing measurable.
+
+    class JobQueues
+    {
+    public:
+        JobQueues(const std::vector<Job> &jobs, int workers) : deques_(workers)
+        {
+            // Deal the jobs smallest first, so that every deque ends with its
+            // largest jobs: owners start on those, and thieves pick up the
+            // short ones left over at the end.
+
+            std::vector<size_t> order(jobs.size());
+            for (size_t i = 0; i < order.size(); ++i)
+            {
+                order[i] = i;
+            }
+            std::stable_sort(order.begin(), order.end(),
+                             [&](size_t a, size_t b) { return jobs[a].size < jobs[b].size; });
+            for (size_t i = 0; i < order.size(); ++i)
+            {
+                deques_[i % workers].jobs.push_back(order[i]);
+            }
+        }
+
+        // Returns false once there is no job left anywhere. No jobs are
+        // added after construction, so one empty pass means we're done.
+
+        bool next(int worker, size_t *job)
+        {
+            if (take(&deques_[worker], false, job))
+            {
+                return true;
+            }
+            for (size_t i = 1; i < deques_.size(); ++i)
+            {
+                if (take(&deques_[(worker + i) % deques_.size()], true, job))
+                {
+                    ++steals_;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        size_t steals() const
+        {
+            return steals_;
+        }
+
+    private:
+        struct Deque
+        {
+            std::mutex mutex;
+            std::deque<size_t> jobs;
+        };
+
+        static bool take(Deque *deque, bool from_front, size_t *job)
+        {
+            std::lock_guard<std::mutex> lock(deque->mutex);
+            if (deque->jobs.empty())
+            {
+                return false;
+            }
+            if (from_front)
+            {
+                *job = deque->jobs.front();
+                deque->jobs.pop_front();
+            }
+            else
+            {
+                *job = deque->jobs.back();
+                deque->jobs.pop_back();
+            }
+            return true;
+        }
+
+        std::vector<Deque> deques_;
+        std::atomic<size_t> steals_{0};
+    };
+
+    // Returns false if the program overflowed the tape. Kept separate from
+    // the worker loop so that no locals of the loop live across sigsetjmp.
+
+    bool run_on_tape(BatchEntry entry, Tape *tape, BfIo *io)
+    {
+        sigjmp_buf overflow;
+        if (sigsetjmp(overflow, 1) != 0)
+        {
+            set_tape_overflow_jump(nullptr);
+            return false;
+        }
+        set_tape_overflow_jump(&overflow);
+        entry(reinterpret_cast<uint64_t>(tape->data()), io);
+        set_tape_overflow_jump(nullptr);
+        return true;
+    }
+
+    void run_job(BatchEntry entry, int cell_size, size_t max_move, BfIo *io, Job *job)
+    {
+        int in_fd = open(job->input.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in_fd < 0)
+        {
+            job->error = "unable to open input: " + std::string(strerror(errno));
+            return;
+        }
+        int out_fd = open(job->output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out_fd < 0)
+        {
+            job->error = "unable to create " + job->output + ": " + strerror(errno);
+            close(in_fd);
+            return;
+        }
+
+        Tape tape(cell_size, max_move);
+        bfio_init(io, in_fd, out_fd);
+        if (!run_on_tape(entry, &tape, io))
+        {
+            job->error = "tape overflow";
+        }
+
+        // On overflow too: the output so far helps to see what went wrong.
+        bfio_flush(io);
+        close(in_fd);
+        close(out_fd);
+    }
+} // namespace
+
+void run_batch(const Options &options, BatchEntry entry, size_t max_move)
+{
+    struct stat st;
+    if (stat(options.batch_path.c_str(), &st) != 0)
+    {
+        DIE << "unable to stat " << options.batch_path << ": " << strerror(errno);
+    }
+    std::vector<Job> jobs = S_ISDIR(st.st_mode) ? jobs_from_directory(options.batch_path)
+                                                : jobs_from_manifest(options.batch_path);
+    for (Job &job : jobs)
+    {
+        if (stat(job.input.c_str(), &st) == 0)
+        {
+            job.size = st.st_size;
+        }
+    }
+
+    int threads = options.batch_threads;
+    if (threads == 0)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::max(1, std::min<int>(threads, jobs.size()));
+
+    Timer t;
+    JobQueues queues(jobs, threads);
+    std::vector<std::thread> workers;
+    for (int worker = 0; worker < threads; ++worker)
+    {
+        workers.emplace_back([&, worker] {
+            std::unique_ptr<BfIo> io(new BfIo);
+            size_t job;
+            while (queues.next(worker, &job))
+            {
+                run_job(entry, options.cell_bits / 8, max_move, io.get(), &jobs[job]);
+            }
+        });
+    }
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+
+    size_t failed = 0;
+    for (const Job &job : jobs)
+    {
+        if (!job.error.empty())
+        {
+            std::cerr << "batch: " << job.input << ": " << job.error << "\n";
+            ++failed;
+        }
+    }
+    if (options.verbose)
+    {
+        std::cout << "* batch: " << jobs.size() << " jobs on " << threads << " threads, "
+                  << queues.steals() << " stolen, " << failed << " failed [elapsed " << t.elapsed()
+                  << "s]\n";
+    }
+    if (failed)
+    {
+        DIE << failed << " of " << jobs.size() << " batch jobs failed";
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+// Batch mode for the JITs (--batch): runs one compiled program over many
+// independent inputs on all cores, instead of one process per input.
+//
+// The inputs come either from a directory, in which case every regular file
+// in it is a job and its output goes to the file of the same name in
+// <DIR>.out/, or from a manifest, a text file with one job per line:
+//
+//   INPUT [OUTPUT]
+//
+// where OUTPUT defaults to INPUT.out; blank lines and lines starting with #
+// are skipped. Relative paths are taken relative to the working directory.
+//
+// Each job runs with a fresh tape and its own buffered I/O on the input and
+// output files. Jobs are dealt out to per-worker deques, largest input first;
+// a worker that runs out steals from the others, so a few long jobs don't
+// leave the rest of the workers idle. A job that overflows its tape or can't
+// open its files fails on its own; run_batch reports every failure and dies
+// at the end if there were any.
+
+#include <cstddef>
+#include <cstdint>
+
+#include "bfio.h"
+#include "utils.h"
+
+// The compiled program: takes the address of the tape and the I/O, and
+// returns the final data pointer, like the JITs' functions.
+
+using BatchEntry = uint64_t (*)(uint64_t, BfIo *);
+
+// max_move is the program's max_pointer_move, for the jobs' tapes.
+
+void run_batch(const Options &options, BatchEntry entry, size_t max_move);
+
+#endif /*BATCH_H*/
@@ -0,0 +1,453 @@
+#ifndef BFCOMPILE_H
+#define BFCOMPILE_H
+
+// Compile-time BF compiler for programs that are string literals in C++ code;
+// needs C++20. bf::compile<"...">() parses the program, folds runs of
+// instructions and replaces loop idioms the way translate_program and
+// optimize_loops do, all while the host program is being compiled, and
+// returns a function specialized for the result:
+//
+//   auto hello = bf::compile<"++++++++[>++++++++<-]>+.">();
+//   uint8_t *final_dataptr = hello(tape.data(), &io);
+//
+// The function has the signature of the JIT functions, with Cell* for wider
+// cells (bf::compile<"...", uint32_t>()); the host provides the tape and a
+// BfIo from bfio_init, and calls bfio_flush when it returns. Every op becomes
+// a few lines of inline code, and every loop a while loop, so the host
+// compiler sees the whole program and optimizes it like any other code;
+// there is nothing left to parse or translate at run time.
+//
+// The ops are expanded by template instantiation, one level per loop
+// nesting level. Unbalanced brackets fail the build.
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "bfio.h"
+#include "bfir.h"
+
+namespace bf
+{
+
+    // The program text as a template parameter; built implicitly from a
+    // string literal.
+
+    template <size_t N>
+    struct Source
+    {
+        constexpr Source(const char (&literal)[N])
+        {
+            for (size_t i = 0; i < N; ++i)
+            {
+                text[i] = literal[i];
+            }
+        }
+
+        constexpr std::string_view view() const
+        {
+            return std::string_view(text, N - 1);
+        }
+
+        char text[N] = {};
+    };
+
+    // An op as BfOp has it, without the source position. The argument of a
+    // jump is the index of the matching jump.
+
+    struct Op
+    {
+        BfOpKind kind = BfOpKind::INVALID_OP;
+        int32_t offset = 0;
+        int64_t argument = 0;
+    };
+
+    namespace detail
+    {
+
+        constexpr bool is_instruction(char c)
+        {
+            return c == '>' || c == '<' || c == '+' || c == '-' || c == '.' || c == ',' ||
+                   c == '[' || c == ']';
+        }
+
+        constexpr bool brackets_balanced(std::string_view text)
+        {
+            int64_t depth = 0;
+            for (char c : text)
+            {
+                depth += c == '[' ? 1 : c == ']' ? -1 : 0;
+                if (depth < 0)
+                {
+                    return false;
+                }
+            }
+            return depth == 0;
+        }
+
+        constexpr void link_jumps(std::vector<Op> *ops)
+        {
+            std::vector<size_t> open_brackets;
+            for (size_t i = 0; i < ops->size(); ++i)
+            {
+                if ((*ops)[i].kind == BfOpKind::JUMP_IF_DATA_ZERO)
+                {
+                    open_brackets.push_back(i);
+                }
+                else if ((*ops)[i].kind == BfOpKind::JUMP_IF_DATA_NOT_ZERO)
+                {
+                    size_t open = open_brackets.back();
+                    open_brackets.pop_back();
+                    (*ops)[open].argument = static_cast<int64_t>(i);
+                    (*ops)[i].argument = static_cast<int64_t>(open);
+                }
+            }
+        }
+
+        // Like translate_program: one op per run of the same instruction, and
+        // one per bracket. Anything that isn't an instruction is a comment.
+
+        constexpr std::vector<Op> translate(std::string_view text)
+        {
+            std::vector<Op> ops;
+            size_t pc = 0;
+            while (pc < text.size())
+            {
+                char instruction = text[pc];
+                if (!is_instruction(instruction))
+                {
+                    pc++;
+                    continue;
+                }
+                if (instruction == '[' || instruction == ']')
+                {
+                    BfOpKind kind = instruction == '[' ? BfOpKind::JUMP_IF_DATA_ZERO
+                                                       : BfOpKind::JUMP_IF_DATA_NOT_ZERO;
+                    ops.push_back(Op{kind, 0, 0});
+                    pc++;
+                    continue;
+                }
+
+                // Comments don't break a run, as they don't in parse_from_stream.
+                int64_t num_repeats = 0;
+                while (pc < text.size() && (text[pc] == instruction || !is_instruction(text[pc])))
+                {
+                    num_repeats += text[pc] == instruction;
+                    pc++;
+                }
+
+                BfOpKind kind = BfOpKind::INVALID_OP;
+                switch (instruction)
+                {
+                case '>':
+                    kind = BfOpKind::INC_PTR;
+                    break;
+                case '<':
+                    kind = BfOpKind::DEC_PTR;
+                    break;
+                case '+':
+                    kind = BfOpKind::INC_DATA;
+                    break;
+                case '-':
+                    kind = BfOpKind::DEC_DATA;
+                    break;
+                case ',':
+                    kind = BfOpKind::READ_STDIN;
+                    break;
+                default:
+                    kind = BfOpKind::WRITE_STDOUT;
+                    break;
+                }
+                ops.push_back(Op{kind, 0, num_repeats});
+            }
+            link_jumps(&ops);
+            return ops;
+        }
+
+        // optimize_loop from bfir.cpp, on the loop from loop_start to the end
+        // of ops: returns the ops that replace it, or nothing.
+
+        constexpr std::vector<Op> optimize_loop(const std::vector<Op> &ops, size_t loop_start)
+        {
+            std::vector<Op> new_ops;
+            int64_t ptr_offset = 0;
+
+            // (offset, delta) pairs in order of first appearance.
+            std::vector<std::pair<int64_t, int64_t>> deltas;
+
+            for (size_t i = loop_start + 1; i < ops.size(); ++i)
+            {
+                const Op &op = ops[i];
+                if (op.kind == BfOpKind::INC_PTR || op.kind == BfOpKind::DEC_PTR)
+                {
+                    ptr_offset += op.kind == BfOpKind::INC_PTR ? op.argument : -op.argument;
+                    continue;
+                }
+                if (op.kind != BfOpKind::INC_DATA && op.kind != BfOpKind::DEC_DATA)
+                {
+                    return new_ops;
+                }
+
+                int64_t delta = op.kind == BfOpKind::DEC_DATA ? -op.argument : op.argument;
+                bool found = false;
+                for (auto &d : deltas)
+                {
+                    if (d.first == ptr_offset)
+                    {
+                        d.second += delta;
+                        found = true;
+                    }
+                }
+                if (!found)
+                {
+                    deltas.push_back(std::make_pair(ptr_offset, delta));
+                }
+            }
+
+            std::vector<std::pair<int64_t, int64_t>> nonzero_deltas;
+            int64_t counter_delta = 0;
+            for (const auto &d : deltas)
+            {
+                if (d.second != 0)
+                {
+                    nonzero_deltas.push_back(d);
+                    counter_delta = d.first == 0 ? d.second : counter_delta;
+                }
+            }
+
+            if (nonzero_deltas.empty())
+            {
+                if (ptr_offset != 0)
+                {
+                    new_ops.push_back(Op{BfOpKind::LOOP_MOVE_PTR, 0, ptr_offset});
+                }
+                return new_ops;
+            }
+            if (ptr_offset != 0 || counter_delta == 0)
+            {
+                return new_ops;
+            }
+
+            if (nonzero_deltas.size() == 1)
+            {
+                if (counter_delta % 2 != 0)
+                {
+                    new_ops.push_back(Op{BfOpKind::LOOP_SET_TO_ZERO, 0, 0});
+                }
+                return new_ops;
+            }
+            if (counter_delta != -1)
+            {
+                return new_ops;
+            }
+
+            for (const auto &d : nonzero_deltas)
+            {
+                if (d.first != 0)
+                {
+                    new_ops.push_back(
+                        Op{BfOpKind::LOOP_MUL_ADD, static_cast<int32_t>(d.first), d.second});
+                }
+            }
+            new_ops.push_back(Op{BfOpKind::LOOP_SET_TO_ZERO, 0, 0});
+            return new_ops;
+        }
+
+        // optimize_loops from bfir.cpp: inner loops first.
+
+        constexpr std::vector<Op> compile_ops(std::string_view text)
+        {
+            std::vector<Op> ops = translate(text);
+            std::vector<Op> new_ops;
+            std::vector<size_t> open_brackets;
+
+            for (const Op &op : ops)
+            {
+                if (op.kind == BfOpKind::JUMP_IF_DATA_ZERO)
+                {
+                    open_brackets.push_back(new_ops.size());
+                    new_ops.push_back(op);
+                }
+                else if (op.kind == BfOpKind::JUMP_IF_DATA_NOT_ZERO)
+                {
+                    size_t open = open_brackets.back();
+                    open_brackets.pop_back();
+
+                    std::vector<Op> optimized_loop = optimize_loop(new_ops, open);
+                    if (optimized_loop.empty())
+                    {
+                        new_ops.push_back(op);
+                    }
+                    else
+                    {
+                        new_ops.resize(open);
+                        new_ops.insert(new_ops.end(), optimized_loop.begin(), optimized_loop.end());
+                    }
+                }
+                else
+                {
+                    new_ops.push_back(op);
+                }
+            }
+
+            link_jumps(&new_ops);
+            return new_ops;
+        }
+
+        // The ops of program S, in static storage.
+
+        template <Source S>
+        constexpr auto make_ops()
+        {
+            static_assert(brackets_balanced(S.view()), "unbalanced brackets in BF program");
+
+            std::array<Op, compile_ops(S.view()).size()> ops;
+            std::vector<Op> compiled = compile_ops(S.view());
+            for (size_t i = 0; i < ops.size(); ++i)
+            {
+                ops[i] = compiled[i];
+            }
+            return ops;
+        }
+
+        template <Source S>
+        inline constexpr auto kOps = make_ops<S>();
+
+        // The op after the one at pc in its block: a loop counts as one op.
+
+        template <Source S>
+        constexpr size_t next_in_block(size_t pc)
+        {
+            const Op &op = kOps<S>[pc];
+            return op.kind == BfOpKind::JUMP_IF_DATA_ZERO ? static_cast<size_t>(op.argument) + 1
+                                                          : pc + 1;
+        }
+
+        // Indices of the ops of the block [begin, end), i.e. the ops in there
+        // that aren't inside a loop of the block.
+
+        template <Source S, size_t kBegin, size_t kEnd>
+        constexpr auto block_ops()
+        {
+            constexpr size_t n = [] {
+                size_t n = 0;
+                for (size_t pc = kBegin; pc < kEnd; pc = next_in_block<S>(pc))
+                {
+                    n++;
+                }
+                return n;
+            }();
+
+            std::array<size_t, n> block;
+            size_t i = 0;
+            for (size_t pc = kBegin; pc < kEnd; pc = next_in_block<S>(pc))
+            {
+                block[i++] = pc;
+            }
+            return block;
+        }
+
+        template <Source S, typename Cell, size_t kBegin, size_t kEnd>
+        inline void run_block(Cell *&dataptr, BfIo *io);
+
+        // Runs the op at kPc; a loop op runs the whole loop.
+
+        template <Source S, typename Cell, size_t kPc>
+        inline void run_op(Cell *&dataptr, BfIo *io)
+        {
+            constexpr Op op = kOps<S>[kPc];
+            constexpr Cell argument = static_cast<Cell>(op.argument);
+
+            if constexpr (op.kind == BfOpKind::INC_PTR)
+            {
+                dataptr += op.argument;
+            }
+            else if constexpr (op.kind == BfOpKind::DEC_PTR)
+            {
+                dataptr -= op.argument;
+            }
+            else if constexpr (op.kind == BfOpKind::INC_DATA)
+            {
+                *dataptr += argument;
+            }
+            else if constexpr (op.kind == BfOpKind::DEC_DATA)
+            {
+                *dataptr -= argument;
+            }
+            else if constexpr (op.kind == BfOpKind::READ_STDIN)
+            {
+                for (int64_t i = 0; i < op.argument; ++i)
+                {
+                    *dataptr = static_cast<Cell>(bfio_get(io));
+                }
+            }
+            else if constexpr (op.kind == BfOpKind::WRITE_STDOUT)
+            {
+                for (int64_t i = 0; i < op.argument; ++i)
+                {
+                    bfio_put(io, static_cast<uint8_t>(*dataptr));
+                }
+            }
+            else if constexpr (op.kind == BfOpKind::LOOP_SET_TO_ZERO)
+            {
+                *dataptr = 0;
+            }
+            else if constexpr (op.kind == BfOpKind::LOOP_MOVE_PTR)
+            {
+                while (*dataptr)
+                {
+                    dataptr += op.argument;
+                }
+            }
+            else if constexpr (op.kind == BfOpKind::LOOP_MUL_ADD)
+            {
+                // The target must not be touched unless the loop would have
+                // run; see BfOp.
+                if (*dataptr)
+                {
+                    dataptr[op.offset] += static_cast<Cell>(uint32_t(*dataptr) * uint32_t(argument));
+                }
+            }
+            else if constexpr (op.kind == BfOpKind::JUMP_IF_DATA_ZERO)
+            {
+                while (*dataptr)
+                {
+                    run_block<S, Cell, kPc + 1, static_cast<size_t>(op.argument)>(dataptr, io);
+                }
+            }
+            else
+            {
+                static_assert(op.kind == BfOpKind::JUMP_IF_DATA_ZERO, "unexpected op");
+            }
+        }
+
+        template <Source S, typename Cell, size_t kBegin, size_t kEnd>
+        inline void run_block(Cell *&dataptr, BfIo *io)
+        {
+            static constexpr auto block = block_ops<S, kBegin, kEnd>();
+            [&]<size_t... I>(std::index_sequence<I...>) {
+                (run_op<S, Cell, block[I]>(dataptr, io), ...);
+            }(std::make_index_sequence<block.size()>());
+        }
+
+        template <Source S, typename Cell>
+        Cell *run_program(Cell *dataptr, BfIo *io)
+        {
+            run_block<S, Cell, 0, kOps<S>.size()>(dataptr, io);
+            return dataptr;
+        }
+    } // namespace detail
+
+    template <Source S, typename Cell = uint8_t>
+    constexpr auto compile()
+    {
+        static_assert(sizeof(Cell) == 1 || sizeof(Cell) == 2 || sizeof(Cell) == 4,
+                      "cells are 8, 16 or 32 bits wide");
+        return &detail::run_program<S, Cell>;
+    }
+} // namespace bf
+
+#endif /*BFCOMPILE_H*/
@@ -0,0 +1,69 @@
+#include "bfio.h"
+#include "utils.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+
+void bfio_init(BfIo *io, int in_fd, int out_fd)
+{
+    io->out_cursor = io->out_buffer;
+    io->out_end = io->out_buffer + kBfIoBufferSize;
+    io->in_cursor = io->in_buffer;
+    io->in_end = io->in_buffer;
+    io->flush = bfio_flush;
+    io->refill = bfio_refill;
+    io->scan_for_zero[0] = scan_for_zero_kernel(1);
+    io->scan_for_zero[1] = scan_for_zero_kernel(2);
+    io->scan_for_zero[2] = scan_for_zero_kernel(4);
+    io->out_fd = out_fd;
+    io->in_fd = in_fd;
+    io->in_eof = false;
+}
+
+void bfio_flush(BfIo *io)
+{
+    const uint8_t *p = io->out_buffer;
+    while (p < io->out_cursor)
+    {
+        ssize_t n = write(io->out_fd, p, io->out_cursor - p);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            DIE << "write failed: " << strerror(errno);
+        }
+        p += n;
+    }
+    io->out_cursor = io->out_buffer;
+}
+
+int bfio_refill(BfIo *io)
+{
+    bfio_flush(io);
+
+    while (!io->in_eof)
+    {
+        ssize_t n = read(io->in_fd, io->in_buffer, kBfIoBufferSize);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            DIE << "read failed: " << strerror(errno);
+        }
+        if (n == 0)
+        {
+            io->in_eof = true;
+            break;
+        }
+        io->in_cursor = io->in_buffer + 1;
+        io->in_end = io->in_buffer + n;
+        return io->in_buffer[0];
+    }
+    return -1;
+}
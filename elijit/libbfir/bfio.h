@@ -0,0 +1,96 @@
+#ifndef BFIO_H
+#define BFIO_H
+
+// Buffered I/O runtime shared by all engines.
+//
+// Output bytes are appended to out_buffer and written with a single write(2)
+// when the buffer fills up or the program ends; input is read in bulk into
+// in_buffer. Interpreters use bfio_put/bfio_get; the JITs emit the same fast
+// paths inline against the cursor fields (hence the fixed layout at the start
+// of the struct) and only call bfio_flush/bfio_refill on the slow path,
+// through the function pointers in the struct so that JIT code never embeds
+// an absolute address and can be cached on disk. The other runtime code JIT
+// code calls, the LOOP_MOVE_PTR scan kernels, is reached the same way.
+//
+// Pending output is flushed before every refill, so interactive programs see
+// their prompts before the engine blocks on input.
+
+#include <cstddef>
+#include <cstdint>
+
+#include "scan.h"
+
+constexpr size_t kBfIoBufferSize = 64 * 1024;
+
+struct BfIo
+{
+    // Next free byte in out_buffer; bfio_flush must be called once it reaches
+    // out_end.
+    uint8_t *out_cursor;
+    uint8_t *out_end;
+
+    // Next unread byte in in_buffer; bfio_refill must be called once it
+    // reaches in_end.
+    const uint8_t *in_cursor;
+    const uint8_t *in_end;
+
+    // bfio_flush and bfio_refill, for JIT code.
+    void (*flush)(BfIo *io);
+    int (*refill)(BfIo *io);
+
+    // The zero-scan kernels for LOOP_MOVE_PTR (see scan.h), for JIT code;
+    // indexed by log2 of the cell width.
+    ScanForZero scan_for_zero[3];
+
+    int out_fd;
+    int in_fd;
+    bool in_eof;
+
+    uint8_t out_buffer[kBfIoBufferSize];
+    uint8_t in_buffer[kBfIoBufferSize];
+};
+
+// Field offsets used by the JITs, small enough for 8-bit displacements.
+
+constexpr int32_t kBfIoOutCursor = offsetof(BfIo, out_cursor);
+constexpr int32_t kBfIoOutEnd = offsetof(BfIo, out_end);
+constexpr int32_t kBfIoInCursor = offsetof(BfIo, in_cursor);
+constexpr int32_t kBfIoInEnd = offsetof(BfIo, in_end);
+constexpr int32_t kBfIoFlush = offsetof(BfIo, flush);
+constexpr int32_t kBfIoRefill = offsetof(BfIo, refill);
+constexpr int32_t kBfIoScanForZero = offsetof(BfIo, scan_for_zero);
+
+static_assert(kBfIoScanForZero + 2 * sizeof(ScanForZero) < 128,
+              "BfIo JIT fields must be addressable with disp8");
+
+void bfio_init(BfIo *io, int in_fd = 0, int out_fd = 1);
+
+// Writes all buffered output to out_fd and resets out_cursor.
+
+void bfio_flush(BfIo *io);
+
+// Called when in_cursor == in_end. Flushes pending output, reads the next
+// chunk of input and returns its first byte (consuming it). Returns -1 at end
+// of input, like getchar, and keeps returning -1 afterwards.
+
+int bfio_refill(BfIo *io);
+
+inline void bfio_put(BfIo *io, uint8_t c)
+{
+    *io->out_cursor++ = c;
+    if (io->out_cursor == io->out_end)
+    {
+        bfio_flush(io);
+    }
+}
+
+inline int bfio_get(BfIo *io)
+{
+    if (io->in_cursor == io->in_end)
+    {
+        return bfio_refill(io);
+    }
+    return *io->in_cursor++;
+}
+
+#endif /*BFIO_H*/
@@ -0,0 +1,517 @@
+#include "bfir.h"
+#include "cfg.h"
+#include "partialeval.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <stack>
+
+const char *BfOpKind_name(BfOpKind kind)
+{
+    switch (kind)
+    {
+    case BfOpKind::INC_PTR:
+        return "INC_PTR";
+    case BfOpKind::DEC_PTR:
+        return "DEC_PTR";
+    case BfOpKind::INC_DATA:
+        return "INC_DATA";
+    case BfOpKind::DEC_DATA:
+        return "DEC_DATA";
+    case BfOpKind::READ_STDIN:
+        return "READ_STDIN";
+    case BfOpKind::WRITE_STDOUT:
+        return "WRITE_STDOUT";
+    case BfOpKind::ADD_DATA:
+        return "ADD_DATA";
+    case BfOpKind::SET_DATA:
+        return "SET_DATA";
+    case BfOpKind::LOOP_SET_TO_ZERO:
+        return "LOOP_SET_TO_ZERO";
+    case BfOpKind::LOOP_MOVE_PTR:
+        return "LOOP_MOVE_PTR";
+    case BfOpKind::LOOP_MUL_ADD:
+        return "LOOP_MUL_ADD";
+    case BfOpKind::JUMP_IF_DATA_ZERO:
+        return "JUMP_IF_DATA_ZERO";
+    case BfOpKind::JUMP_IF_DATA_NOT_ZERO:
+        return "JUMP_IF_DATA_NOT_ZERO";
+    case BfOpKind::INVALID_OP:
+        return "INVALID_OP";
+    }
+    return nullptr;
+}
+
+namespace
+{
+
+    const char *BfOpKind_symbol(BfOpKind kind)
+    {
+        switch (kind)
+        {
+        case BfOpKind::INC_PTR:
+            return ">";
+        case BfOpKind::DEC_PTR:
+            return "<";
+        case BfOpKind::INC_DATA:
+            return "+";
+        case BfOpKind::DEC_DATA:
+            return "-";
+        case BfOpKind::READ_STDIN:
+            return ",";
+        case BfOpKind::WRITE_STDOUT:
+            return ".";
+        case BfOpKind::ADD_DATA:
+            return "a";
+        case BfOpKind::SET_DATA:
+            return "=";
+        case BfOpKind::LOOP_SET_TO_ZERO:
+            return "s";
+        case BfOpKind::LOOP_MOVE_PTR:
+            return "m";
+        case BfOpKind::LOOP_MUL_ADD:
+            return "*";
+        case BfOpKind::JUMP_IF_DATA_ZERO:
+            return "[";
+        case BfOpKind::JUMP_IF_DATA_NOT_ZERO:
+            return "]";
+        case BfOpKind::INVALID_OP:
+            return "x";
+        }
+        return nullptr;
+    }
+
+    // Optimizes a loop that starts at loop_start (the opening JUMP_IF_DATA_ZERO)
+    // and runs until the end of ops (implicitly there's a back-jump after the
+    // last op in ops).
+    //
+    // The body is interpreted symbolically: pointer moves are tracked as a
+    // running offset and data changes are accumulated as a delta per offset.
+    // Any other op (I/O, nested loops) makes the loop unoptimizable. Then:
+    //
+    // - a body that only moves the pointer is a LOOP_MOVE_PTR ("[>>]", "[<]").
+    // - a body that only changes cell 0 by an odd delta always reaches zero,
+    //   so it is a LOOP_SET_TO_ZERO ("[-]", "[+++]").
+    // - a balanced body (no net pointer movement) that decrements cell 0 by
+    //   exactly 1 runs cell[0] times, so every other touched cell ends up
+    //   incremented by delta * cell[0]. It becomes one LOOP_MUL_ADD per touched
+    //   cell followed by LOOP_SET_TO_ZERO ("[->+>+++<<]").
+    //
+    // If optimization succeeds, returns a sequence of ops that replace the loop;
+    // otherwise, returns an empty vector.
+
+    std::vector<BfOp> optimize_loop(const std::vector<BfOp> &ops, size_t loop_start)
+    {
+        std::vector<BfOp> new_ops;
+
+        int64_t ptr_offset = 0;
+
+        // (offset, delta) pairs in order of first appearance.
+        std::vector<std::pair<int64_t, int64_t>> deltas;
+
+        for (size_t i = loop_start + 1; i < ops.size(); ++i)
+        {
+            const BfOp &op = ops[i];
+            switch (op.kind)
+            {
+            case BfOpKind::INC_PTR:
+                ptr_offset += op.argument;
+                break;
+            case BfOpKind::DEC_PTR:
+                ptr_offset -= op.argument;
+                break;
+            case BfOpKind::INC_DATA:
+            case BfOpKind::DEC_DATA:
+            case BfOpKind::ADD_DATA:
+            {
+                int64_t delta = op.kind == BfOpKind::DEC_DATA ? -op.argument : op.argument;
+                int64_t offset = ptr_offset + op.offset;
+
+                auto it = std::find_if(deltas.begin(), deltas.end(),
+                                       [offset](const std::pair<int64_t, int64_t> &d) {
+                                           return d.first == offset;
+                                       });
+                if (it == deltas.end())
+                {
+                    deltas.push_back(std::make_pair(offset, delta));
+                }
+                else
+                {
+                    it->second += delta;
+                }
+                break;
+            }
+            default:
+                return new_ops;
+            }
+        }
+
+        deltas.erase(std::remove_if(deltas.begin(), deltas.end(),
+                                    [](const std::pair<int64_t, int64_t> &d) {
+                                        return d.second == 0;
+                                    }),
+                     deltas.end());
+
+        if (deltas.empty())
+        {
+            if (ptr_offset != 0)
+            {
+                new_ops.push_back(BfOp(BfOpKind::LOOP_MOVE_PTR, ptr_offset));
+            }
+            return new_ops;
+        }
+
+        if (ptr_offset != 0)
+        {
+            return new_ops;
+        }
+
+        auto counter = std::find_if(deltas.begin(), deltas.end(),
+                                    [](const std::pair<int64_t, int64_t> &d) {
+                                        return d.first == 0;
+                                    });
+        if (counter == deltas.end())
+        {
+            return new_ops;
+        }
+
+        if (deltas.size() == 1)
+        {
+            if (counter->second % 2 != 0)
+            {
+                new_ops.push_back(BfOp(BfOpKind::LOOP_SET_TO_ZERO, 0));
+            }
+            return new_ops;
+        }
+
+        if (counter->second != -1)
+        {
+            return new_ops;
+        }
+
+        for (const auto &d : deltas)
+        {
+            if (d.first != 0)
+            {
+                new_ops.push_back(
+                    BfOp(BfOpKind::LOOP_MUL_ADD, d.second, static_cast<int32_t>(d.first)));
+            }
+        }
+        new_ops.push_back(BfOp(BfOpKind::LOOP_SET_TO_ZERO, 0));
+        return new_ops;
+    }
+} // namespace
+
+void BfOp::serialize(std::string *s) const
+{
+    *s += BfOpKind_symbol(kind) + std::to_string(argument);
+    if (offset != 0)
+    {
+        *s += "@" + std::to_string(offset);
+    }
+}
+
+std::vector<BfOp> translate_program(const Program &p)
+{
+    size_t pc = 0;
+    size_t program_size = p.instructions.size();
+    std::vector<BfOp> ops;
+
+    while (pc < program_size)
+    {
+        char instruction = p.instructions[pc];
+
+        if (instruction == '[')
+        {
+            // The argument is filled in by link_jumps below.
+            ops.push_back(BfOp(BfOpKind::JUMP_IF_DATA_ZERO, 0));
+            ops.back().source = static_cast<int32_t>(pc++);
+        }
+        else if (instruction == ']')
+        {
+            ops.push_back(BfOp(BfOpKind::JUMP_IF_DATA_NOT_ZERO, 0));
+            ops.back().source = static_cast<int32_t>(pc++);
+        }
+        else
+        {
+            // Not a jump; all the other ops can be repeated, so find where the
+            // repeat ends.
+            size_t start = pc++;
+            while (pc < program_size && p.instructions[pc] == instruction)
+            {
+                pc++;
+            }
+            // Here pc points to the first new instruction encountered, or to the
+            // end of the program
+
+            size_t num_repeats = pc - start;
+
+            BfOpKind kind = BfOpKind::INVALID_OP;
+            switch (instruction)
+            {
+            case '>':
+                kind = BfOpKind::INC_PTR;
+                break;
+            case '<':
+                kind = BfOpKind::DEC_PTR;
+                break;
+            case '+':
+                kind = BfOpKind::INC_DATA;
+                break;
+            case '-':
+                kind = BfOpKind::DEC_DATA;
+                break;
+            case ',':
+                kind = BfOpKind::READ_STDIN;
+                break;
+            case '.':
+                kind = BfOpKind::WRITE_STDOUT;
+                break;
+            default:
+            {
+                DIE << "bad char '" << instruction << "' at pc=" << start;
+            }
+            }
+            ops.push_back(BfOp(kind, num_repeats));
+            ops.back().source = static_cast<int32_t>(start);
+        }
+    }
+
+    link_jumps(&ops);
+    return ops;
+}
+
+void link_jumps(std::vector<BfOp> *ops)
+{
+    // Offsets of open brackets waiting for a closing bracket. Since brackets
+    // nest, these naturally form a stack.
+
+    std::stack<size_t> open_bracket_stack;
+
+    for (size_t i = 0; i < ops->size(); ++i)
+    {
+        BfOp &op = (*ops)[i];
+        if (op.kind == BfOpKind::JUMP_IF_DATA_ZERO)
+        {
+            open_bracket_stack.push(i);
+        }
+        else if (op.kind == BfOpKind::JUMP_IF_DATA_NOT_ZERO)
+        {
+            if (open_bracket_stack.empty())
+            {
+                DIE << "unmatched closing ']' at op=" << i;
+            }
+            size_t open_bracket_offset = open_bracket_stack.top();
+            open_bracket_stack.pop();
+
+            (*ops)[open_bracket_offset].argument = i;
+            op.argument = open_bracket_offset;
+        }
+    }
+
+    if (!open_bracket_stack.empty())
+    {
+        DIE << "unmatched opening '[' at op=" << open_bracket_stack.top();
+    }
+}
+
+void optimize_loops(std::vector<BfOp> *ops)
+{
+    std::vector<BfOp> new_ops;
+    new_ops.reserve(ops->size());
+
+    // Offsets (in new_ops) of the open brackets of the loops being built. Inner
+    // loops are closed, and thus optimized, before the loops around them, so
+    // "[[-]>]" becomes "[s>]" before its outer loop is looked at.
+
+    std::stack<size_t> open_bracket_stack;
+
+    for (const BfOp &op : *ops)
+    {
+        if (op.kind == BfOpKind::JUMP_IF_DATA_ZERO)
+        {
+            open_bracket_stack.push(new_ops.size());
+            new_ops.push_back(op);
+        }
+        else if (op.kind == BfOpKind::JUMP_IF_DATA_NOT_ZERO)
+        {
+            size_t open_bracket_offset = open_bracket_stack.top();
+            open_bracket_stack.pop();
+
+            std::vector<BfOp> optimized_loop = optimize_loop(new_ops, open_bracket_offset);
+
+            if (optimized_loop.empty())
+            {
+                new_ops.push_back(op);
+            }
+            else
+            {
+                // Replace this whole loop with the optimized loop.
+                for (BfOp &optimized_op : optimized_loop)
+                {
+                    optimized_op.source = new_ops[open_bracket_offset].source;
+                }
+                new_ops.erase(new_ops.begin() + open_bracket_offset, new_ops.end());
+                new_ops.insert(new_ops.end(), optimized_loop.begin(), optimized_loop.end());
+            }
+        }
+        else
+        {
+            new_ops.push_back(op);
+        }
+    }
+
+    ops->swap(new_ops);
+}
+
+void fold_offsets(std::vector<BfOp> *ops)
+{
+    std::vector<BfOp> new_ops;
+    new_ops.reserve(ops->size());
+
+    // Net pointer movement since the start of the current block.
+    int64_t ptr_offset = 0;
+
+    // ADD_DATA ops of the current block that haven't been emitted yet, one per
+    // offset, in order of first appearance. Adds to different cells commute, so
+    // they only need to be flushed before I/O and at the end of the block.
+    std::vector<BfOp> pending_adds;
+
+    auto flush_adds = [&]() {
+        for (const BfOp &add : pending_adds)
+        {
+            if (add.argument != 0)
+            {
+                new_ops.push_back(add);
+            }
+        }
+        pending_adds.clear();
+    };
+
+    auto flush_block = [&]() {
+        flush_adds();
+        if (ptr_offset > 0)
+        {
+            new_ops.push_back(BfOp(BfOpKind::INC_PTR, ptr_offset));
+        }
+        else if (ptr_offset < 0)
+        {
+            new_ops.push_back(BfOp(BfOpKind::DEC_PTR, -ptr_offset));
+        }
+        ptr_offset = 0;
+    };
+
+    for (const BfOp &op : *ops)
+    {
+        switch (op.kind)
+        {
+        case BfOpKind::INC_PTR:
+            ptr_offset += op.argument;
+            break;
+        case BfOpKind::DEC_PTR:
+            ptr_offset -= op.argument;
+            break;
+        case BfOpKind::INC_DATA:
+        case BfOpKind::DEC_DATA:
+        case BfOpKind::ADD_DATA:
+        {
+            int64_t delta = op.kind == BfOpKind::DEC_DATA ? -op.argument : op.argument;
+            int32_t offset = static_cast<int32_t>(ptr_offset + op.offset);
+
+            auto it = std::find_if(pending_adds.begin(), pending_adds.end(),
+                                   [offset](const BfOp &add) { return add.offset == offset; });
+            if (it == pending_adds.end())
+            {
+                pending_adds.push_back(BfOp(BfOpKind::ADD_DATA, delta, offset));
+                pending_adds.back().source = op.source;
+            }
+            else
+            {
+                it->argument += delta;
+            }
+            break;
+        }
+        case BfOpKind::READ_STDIN:
+        case BfOpKind::WRITE_STDOUT:
+        case BfOpKind::SET_DATA:
+        case BfOpKind::LOOP_SET_TO_ZERO:
+            flush_adds();
+            new_ops.push_back(
+                BfOp(op.kind, op.argument, static_cast<int32_t>(ptr_offset + op.offset)));
+            new_ops.back().source = op.source;
+            break;
+        default:
+            // Loops and jumps look at the cell under the data pointer, so the
+            // pointer has to be up to date before them.
+            flush_block();
+            new_ops.push_back(op);
+            break;
+        }
+    }
+    flush_block();
+
+    ops->swap(new_ops);
+}
+
+void PassManager::add_pass(const std::string &name, BfPass pass)
+{
+    passes_.push_back(NamedPass{name, std::move(pass)});
+}
+
+void PassManager::run(std::vector<BfOp> *ops, bool verbose) const
+{
+    for (const NamedPass &p : passes_)
+    {
+        Timer t;
+        p.pass(ops);
+        link_jumps(ops);
+
+        if (verbose)
+        {
+            std::cout << "* pass " << p.name << ": " << ops->size() << " ops [elapsed "
+                      << t.elapsed() << "s]\n";
+        }
+    }
+}
+
+const uint32_t kPassPipelineVersion = 1;
+
+PassManager default_pass_pipeline(int opt_level)
+{
+    PassManager pm;
+    if (opt_level >= 1)
+    {
+        pm.add_pass("optimize-loops", optimize_loops);
+        pm.add_pass("fold-offsets", fold_offsets);
+    }
+    if (opt_level >= 2)
+    {
+        // Dropping loops can leave pointer moves and adds next to each other
+        // that fold_offsets merges.
+        pm.add_pass("partial-evaluate", partial_evaluate);
+        pm.add_pass("propagate-constants", propagate_constants);
+        pm.add_pass("fold-offsets", fold_offsets);
+        pm.add_pass("eliminate-dead-stores", eliminate_dead_stores);
+    }
+    return pm;
+}
+
+std::vector<BfOp> compile_to_ops(const Program &p, int opt_level, bool verbose)
+{
+    std::vector<BfOp> ops = translate_program(p);
+    default_pass_pipeline(opt_level).run(&ops, verbose);
+    return ops;
+}
+
+void dump_ops(const std::vector<BfOp> &ops, std::ostream &os)
+{
+    for (size_t i = 0; i < ops.size(); ++i)
+    {
+        os << " [" << i << "] " << BfOpKind_name(ops[i].kind) << " " << ops[i].argument;
+        if (ops[i].offset != 0)
+        {
+            os << " @" << ops[i].offset;
+        }
+        os << "\n";
+    }
+}
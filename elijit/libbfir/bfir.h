@@ -0,0 +1,160 @@
+#ifndef BFIR_H
+#define BFIR_H
+
+// libbfir: the BF intermediate representation shared by the optimizing
+// backends (optinterp2, optasmjit, ...).
+//
+// A program is parsed into a Program, translated into a vector of BfOps with
+// translate_program, and then rewritten by a PassManager. Every pass works on
+// the same op vector, so an optimization added here is picked up by every
+// backend that consumes the IR.
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "parser.h"
+
+enum class BfOpKind
+{
+    INVALID_OP = 0,
+    INC_PTR,
+    DEC_PTR,
+    INC_DATA,
+    DEC_DATA,
+    READ_STDIN,
+    WRITE_STDOUT,
+    ADD_DATA,
+    SET_DATA,
+    LOOP_SET_TO_ZERO,
+    LOOP_MOVE_PTR,
+    LOOP_MUL_ADD,
+    JUMP_IF_DATA_ZERO,
+    JUMP_IF_DATA_NOT_ZERO,
+};
+
+// Number of op kinds; handy for sizing per-kind tables.
+
+constexpr int kNumBfOpKinds = static_cast<int>(BfOpKind::JUMP_IF_DATA_NOT_ZERO) + 1;
+
+const char *BfOpKind_name(BfOpKind kind);
+
+// A single IR op. The meaning of argument depends on the kind:
+//
+// INC_PTR, DEC_PTR, INC_DATA, DEC_DATA, READ_STDIN, WRITE_STDOUT: repeat count
+// ADD_DATA: signed delta added to the cell
+// SET_DATA: value stored into the cell, truncated to the cell width
+// LOOP_SET_TO_ZERO: unused
+// LOOP_MOVE_PTR: signed pointer stride of the "[>>]" / "[<]" loop
+// LOOP_MUL_ADD: factor k in cell[offset] += k * cell[0]
+// JUMP_IF_DATA_ZERO, JUMP_IF_DATA_NOT_ZERO: index of the matching jump op
+//
+// offset is the distance of the accessed cell from the data pointer. It is
+// used by ADD_DATA, SET_DATA, READ_STDIN, WRITE_STDOUT and LOOP_SET_TO_ZERO
+// (see fold_offsets) and by LOOP_MUL_ADD for its target cell; it is 0 for every
+// other op. The source cell of LOOP_MUL_ADD is always the one under the data
+// pointer; engines must not touch the target cell when the source is zero,
+// since the loop it came from would not have run and the target may well be
+// off the tape.
+
+struct BfOp
+{
+    BfOp(BfOpKind kind_param, int64_t argument_param, int32_t offset_param = 0)
+        : kind(kind_param), offset(offset_param), argument(argument_param) {}
+
+    // Serialize (emit a short textual representation for) this op onto the
+    // end of s. Used for building traces.
+
+    void serialize(std::string *s) const;
+
+    BfOpKind kind = BfOpKind::INVALID_OP;
+    int32_t offset = 0;
+    int64_t argument = 0;
+
+    // Where the op came from: the position in Program::instructions of the
+    // first instruction it was translated from (for a replaced loop, its
+    // '['), or -1 for ops a pass made up. Lets profilers point at the source
+    // (see perfmap.h).
+    int32_t source = -1;
+};
+
+// Translates the given program into a vector of run-length folded BfOps with
+// linked jumps. No other optimization is done here; that's the job of the
+// passes.
+
+std::vector<BfOp> translate_program(const Program &p);
+
+// Recomputes the arguments of all jump ops so that each one points at its
+// matching bracket. Passes that insert or remove ops leave jump arguments
+// stale; the PassManager calls this after every pass.
+
+void link_jumps(std::vector<BfOp> *ops);
+
+// Replaces loops without I/O whose effect can be computed up front with the
+// LOOP_* ops: "[-]" and friends become LOOP_SET_TO_ZERO, "[>>]" becomes
+// LOOP_MOVE_PTR and balanced copy/multiply loops such as "[->++>+<<]" become
+// a run of LOOP_MUL_ADD ops followed by LOOP_SET_TO_ZERO.
+
+void optimize_loops(std::vector<BfOp> *ops);
+
+// Canonicalizes straight-line code: within every block between loop ops,
+// pointer moves are folded into the offsets of ADD_DATA / SET_DATA /
+// READ_STDIN / WRITE_STDOUT / LOOP_SET_TO_ZERO ops, and a single INC_PTR or DEC_PTR applies the net pointer
+// adjustment at the end of the block. So ">+>+<<-" becomes
+// "ADD_DATA(1,1) ADD_DATA(2,1) ADD_DATA(0,-1)".
+
+void fold_offsets(std::vector<BfOp> *ops);
+
+// A pass rewrites the op vector in place.
+
+using BfPass = std::function<void(std::vector<BfOp> *ops)>;
+
+class PassManager
+{
+public:
+    void add_pass(const std::string &name, BfPass pass);
+
+    // Runs all passes in the order they were added, relinking jumps after
+    // each one. In verbose mode, reports the op count after every pass.
+
+    void run(std::vector<BfOp> *ops, bool verbose = false) const;
+
+private:
+    struct NamedPass
+    {
+        std::string name;
+        BfPass pass;
+    };
+
+    std::vector<NamedPass> passes_;
+};
+
+// The pipeline every backend uses unless it has a reason not to:
+//
+// 0: run-length folding only
+// 1: + loop idiom replacement, offset folding
+// 2: + partial evaluation of the input-independent prefix (see
+//    partialeval.h), constant propagation and dead store elimination (see
+//    cfg.h)
+
+constexpr int kDefaultOptLevel = 2;
+
+PassManager default_pass_pipeline(int opt_level = kDefaultOptLevel);
+
+// Version of translate_program and the passes; bump it with every change to
+// the ops they produce for the same program. Code caches key on it.
+
+extern const uint32_t kPassPipelineVersion;
+
+// Convenience: translate_program followed by default_pass_pipeline.
+
+std::vector<BfOp> compile_to_ops(const Program &p, int opt_level = kDefaultOptLevel,
+                                 bool verbose = false);
+
+// Prints one op per line, prefixed with its index.
+
+void dump_ops(const std::vector<BfOp> &ops, std::ostream &os);
+
+#endif /*BFIR_H*/
@@ -0,0 +1,130 @@
+#include "bytecode.h"
+#include "utils.h"
+
+namespace
+{
+
+    bool is_jump(BfOpKind kind)
+    {
+        return kind == BfOpKind::JUMP_IF_DATA_ZERO || kind == BfOpKind::JUMP_IF_DATA_NOT_ZERO;
+    }
+
+    void write_uleb128(std::vector<uint8_t> *code, uint64_t v)
+    {
+        do
+        {
+            uint8_t byte = v & 0x7F;
+            v >>= 7;
+            if (v != 0)
+            {
+                byte |= 0x80;
+            }
+            code->push_back(byte);
+        } while (v != 0);
+    }
+
+    void write_sleb128(std::vector<uint8_t> *code, int64_t v)
+    {
+        bool more = true;
+        while (more)
+        {
+            uint8_t byte = v & 0x7F;
+            v >>= 7;
+
+            // Done when the remaining bits are all copies of the sign bit of
+            // the byte just produced.
+            if ((v == 0 && !(byte & 0x40)) || (v == -1 && (byte & 0x40)))
+            {
+                more = false;
+            }
+            else
+            {
+                byte |= 0x80;
+            }
+            code->push_back(byte);
+        }
+    }
+} // namespace
+
+Bytecode encode_bytecode(const std::vector<BfOp> &ops)
+{
+    Bytecode bytecode;
+
+    // Code position of every op, plus the position of the trailing halt.
+    std::vector<uint32_t> op_positions;
+    op_positions.reserve(ops.size() + 1);
+
+    // jump_targets index of every jump op, in op order.
+    std::vector<size_t> jump_ops;
+
+    for (size_t i = 0; i < ops.size(); ++i)
+    {
+        const BfOp &op = ops[i];
+        op_positions.push_back(static_cast<uint32_t>(bytecode.code.size()));
+        bytecode.code.push_back(static_cast<uint8_t>(op.kind));
+
+        if (bytecode_has_offset(op.kind))
+        {
+            write_sleb128(&bytecode.code, op.offset);
+        }
+
+        if (is_jump(op.kind))
+        {
+            write_uleb128(&bytecode.code, jump_ops.size());
+            jump_ops.push_back(i);
+        }
+        else if (bytecode_has_argument(op.kind))
+        {
+            write_sleb128(&bytecode.code, op.argument);
+        }
+    }
+    op_positions.push_back(static_cast<uint32_t>(bytecode.code.size()));
+    bytecode.code.push_back(kBytecodeHalt);
+
+    bytecode.jump_targets.reserve(jump_ops.size());
+    for (size_t i : jump_ops)
+    {
+        bytecode.jump_targets.push_back(op_positions[ops[i].argument + 1]);
+    }
+
+    return bytecode;
+}
+
+void decode_bytecode_op(const uint8_t **ip, BfOp *op)
+{
+    uint8_t opcode = *(*ip)++;
+    if (static_cast<int>(opcode) >= kNumBfOpKinds)
+    {
+        DIE << "bad opcode " << static_cast<int>(opcode);
+    }
+    BfOpKind kind = static_cast<BfOpKind>(opcode);
+
+    int32_t offset = 0;
+    int64_t argument = 0;
+
+    if (bytecode_has_offset(kind))
+    {
+        offset = static_cast<int32_t>(read_sleb128(ip));
+    }
+
+    if (is_jump(kind))
+    {
+        argument = static_cast<int64_t>(read_uleb128(ip));
+    }
+    else if (bytecode_has_argument(kind))
+    {
+        argument = read_sleb128(ip);
+    }
+
+    *op = BfOp(kind, argument, offset);
+}
+
+bool BytecodeReader::next(BfOp *op)
+{
+    if (*ip_ == kBytecodeHalt)
+    {
+        return false;
+    }
+    decode_bytecode_op(&ip_, op);
+    return true;
+}
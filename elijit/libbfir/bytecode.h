@@ -0,0 +1,138 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+// Packed encoding of translated BfOps.
+//
+// A BfOp takes 16 bytes, but most arguments and offsets fit in a byte or two.
+// The bytecode stores every op as:
+//
+//   opcode      1 byte, the BfOpKind (kBytecodeHalt terminates the code)
+//   offset      signed LEB128; only for kinds that use an offset
+//   argument    signed LEB128; only for kinds that use an argument. For jumps
+//               it is an unsigned LEB128 index into jump_targets.
+//
+// jump_targets holds, for every jump op, the code position to continue at when
+// the jump is taken (one past the matching bracket). Keeping the targets out of
+// line means the encoder never has to guess the width of a forward jump.
+
+#include <cstdint>
+#include <vector>
+
+#include "bfir.h"
+
+constexpr uint8_t kBytecodeHalt = 0xFF;
+
+struct Bytecode
+{
+    std::vector<uint8_t> code;
+    std::vector<uint32_t> jump_targets;
+};
+
+Bytecode encode_bytecode(const std::vector<BfOp> &ops);
+
+// Which immediates follow the opcode of the given kind.
+
+inline bool bytecode_has_offset(BfOpKind kind)
+{
+    return kind == BfOpKind::ADD_DATA || kind == BfOpKind::SET_DATA ||
+           kind == BfOpKind::READ_STDIN || kind == BfOpKind::WRITE_STDOUT ||
+           kind == BfOpKind::LOOP_SET_TO_ZERO || kind == BfOpKind::LOOP_MUL_ADD;
+}
+
+inline bool bytecode_has_argument(BfOpKind kind)
+{
+    return kind != BfOpKind::LOOP_SET_TO_ZERO && kind != BfOpKind::INVALID_OP;
+}
+
+// LEB128 decoding helpers; advance *ip past the immediate. These sit on the
+// interpreter's hot path, so the single-byte case is kept branch-light.
+
+inline uint64_t read_uleb128(const uint8_t **ip)
+{
+    const uint8_t *p = *ip;
+    uint64_t result = *p & 0x7F;
+    if (*p++ & 0x80)
+    {
+        unsigned shift = 7;
+        uint8_t byte;
+        do
+        {
+            byte = *p++;
+            result |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+    }
+    *ip = p;
+    return result;
+}
+
+inline int64_t read_sleb128(const uint8_t **ip)
+{
+    const uint8_t *p = *ip;
+    uint8_t byte = *p++;
+
+    // Fast path: one byte, sign-extended from bit 6.
+    if (!(byte & 0x80))
+    {
+        *ip = p;
+        return static_cast<int8_t>(byte << 1) >> 1;
+    }
+
+    uint64_t result = byte & 0x7F;
+    unsigned shift = 7;
+    do
+    {
+        byte = *p++;
+        result |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    // Sign-extend from the last byte's sign bit.
+    if (shift < 64 && (byte & 0x40))
+    {
+        result |= ~static_cast<uint64_t>(0) << shift;
+    }
+    *ip = p;
+    return static_cast<int64_t>(result);
+}
+
+// Decodes the op at *ip into *op and advances *ip past it. *ip must not point
+// at kBytecodeHalt. Jump ops come back with argument set to their
+// jump_targets index.
+
+void decode_bytecode_op(const uint8_t **ip, BfOp *op);
+
+// Sequential decoder for consumers that want whole ops back, like the JITs.
+//
+//   BytecodeReader reader(bytecode);
+//   BfOp op(BfOpKind::INVALID_OP, 0);
+//   while (reader.next(&op)) { ... }
+
+class BytecodeReader
+{
+public:
+    explicit BytecodeReader(const Bytecode &bytecode)
+        : bytecode_(bytecode), ip_(bytecode.code.data()) {}
+
+    // Starts decoding at the op at the given code position.
+
+    BytecodeReader(const Bytecode &bytecode, size_t position)
+        : bytecode_(bytecode), ip_(bytecode.code.data() + position) {}
+
+    // Decodes the next op into *op. Returns false at the end of the code.
+
+    bool next(BfOp *op);
+
+    // Position of the next op in the code.
+
+    size_t position() const
+    {
+        return ip_ - bytecode_.code.data();
+    }
+
+private:
+    const Bytecode &bytecode_;
+    const uint8_t *ip_;
+};
+
+#endif /*BYTECODE_H*/
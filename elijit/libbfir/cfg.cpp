@@ -0,0 +1,626 @@
+#include "cfg.h"
+
+#include <map>
+#include <set>
+
+namespace
+{
+
+    bool is_jump(BfOpKind kind)
+    {
+        return kind == BfOpKind::JUMP_IF_DATA_ZERO || kind == BfOpKind::JUMP_IF_DATA_NOT_ZERO;
+    }
+
+    // Cell values are tracked modulo 2^32, which, truncated, is what they are
+    // at every cell width.
+
+    struct CellValue
+    {
+        bool known = false;
+        uint32_t value = 0;
+
+        bool operator==(const CellValue &other) const
+        {
+            return known == other.known && (!known || value == other.value);
+        }
+    };
+
+    CellValue known_value(uint32_t value)
+    {
+        CellValue cell;
+        cell.known = true;
+        cell.value = value;
+        return cell;
+    }
+
+    // Zero at every cell width, and nonzero at every cell width; a cell of
+    // 256 is neither.
+
+    bool is_zero(const CellValue &cell)
+    {
+        return cell.known && cell.value == 0;
+    }
+
+    bool is_nonzero(const CellValue &cell)
+    {
+        return cell.known && (cell.value & 0xFF) != 0;
+    }
+
+    // Only cells from the start of the tape up to here are tracked. Cells
+    // left of it are off the tape, and holding back a store to them would
+    // change where the program dies; cells much further right are hardly
+    // ever reached with a known data pointer.
+
+    constexpr int64_t kMaxTrackedCell = 1 << 16;
+
+    // What is known about the tape at some point of the program, with cells
+    // numbered from the one the program starts on.
+
+    struct TapeState
+    {
+        // Whether the program can get here at all.
+        bool reached = false;
+
+        bool pointer_known = true;
+        int64_t pointer = 0;
+
+        // Cells not in cells are zero if others_zero, and unknown otherwise;
+        // cells only holds the ones that differ from that.
+        std::map<int64_t, CellValue> cells;
+        bool others_zero = true;
+
+        bool tracked(int64_t cell) const
+        {
+            return pointer_known && cell >= 0 && cell < kMaxTrackedCell;
+        }
+
+        CellValue get(int64_t cell) const
+        {
+            if (!tracked(cell))
+            {
+                return CellValue();
+            }
+            auto it = cells.find(cell);
+            if (it != cells.end())
+            {
+                return it->second;
+            }
+            return others_zero ? known_value(0) : CellValue();
+        }
+
+        void set(int64_t cell, const CellValue &value)
+        {
+            if (!tracked(cell))
+            {
+                return;
+            }
+            if (others_zero ? is_zero(value) : !value.known)
+            {
+                cells.erase(cell);
+            }
+            else
+            {
+                cells[cell] = value;
+            }
+        }
+
+        void forget_all()
+        {
+            pointer_known = false;
+            pointer = 0;
+            cells.clear();
+            others_zero = false;
+        }
+
+        bool operator==(const TapeState &other) const
+        {
+            return reached == other.reached && pointer_known == other.pointer_known &&
+                   pointer == other.pointer && others_zero == other.others_zero &&
+                   cells == other.cells;
+        }
+    };
+
+    // Merges the state of another path into *into; returns true if that
+    // changed it.
+
+    bool join(TapeState *into, const TapeState &from)
+    {
+        if (!from.reached)
+        {
+            return false;
+        }
+        if (!into->reached)
+        {
+            *into = from;
+            return true;
+        }
+
+        TapeState old = *into;
+        if (!into->pointer_known || !from.pointer_known || into->pointer != from.pointer)
+        {
+            into->forget_all();
+            return !(old == *into);
+        }
+
+        TapeState joined = *into;
+        joined.cells.clear();
+        joined.others_zero = into->others_zero && from.others_zero;
+        auto merge = [&](int64_t cell) {
+            CellValue a = into->get(cell);
+            joined.set(cell, a == from.get(cell) ? a : CellValue());
+        };
+        for (const auto &cell : into->cells)
+        {
+            merge(cell.first);
+        }
+        for (const auto &cell : from.cells)
+        {
+            merge(cell.first);
+        }
+        *into = joined;
+        return !(old == *into);
+    }
+
+    // Applies the effect of a non-jump op to state.
+
+    void apply(const BfOp &op, TapeState *state)
+    {
+        int64_t here = state->pointer;
+        auto add = [&](int64_t cell, int64_t delta) {
+            CellValue value = state->get(cell);
+            value.value += static_cast<uint32_t>(delta);
+            state->set(cell, value);
+        };
+
+        switch (op.kind)
+        {
+        case BfOpKind::INC_PTR:
+            state->pointer += op.argument;
+            break;
+        case BfOpKind::DEC_PTR:
+            state->pointer -= op.argument;
+            break;
+        case BfOpKind::INC_DATA:
+            add(here, op.argument);
+            break;
+        case BfOpKind::DEC_DATA:
+            add(here, -op.argument);
+            break;
+        case BfOpKind::ADD_DATA:
+            add(here + op.offset, op.argument);
+            break;
+        case BfOpKind::SET_DATA:
+            state->set(here + op.offset, known_value(static_cast<uint32_t>(op.argument)));
+            break;
+        case BfOpKind::LOOP_SET_TO_ZERO:
+            state->set(here + op.offset, known_value(0));
+            break;
+        case BfOpKind::READ_STDIN:
+            state->set(here + op.offset, CellValue());
+            break;
+        case BfOpKind::LOOP_MOVE_PTR:
+            if (!is_zero(state->get(here)))
+            {
+                state->forget_all();
+            }
+            break;
+        case BfOpKind::LOOP_MUL_ADD:
+        {
+            CellValue source = state->get(here);
+            if (is_zero(source))
+            {
+                break;
+            }
+            CellValue target = state->get(here + op.offset);
+            if (source.known && target.known)
+            {
+                target.value += source.value * static_cast<uint32_t>(op.argument);
+            }
+            else
+            {
+                target = CellValue();
+            }
+            state->set(here + op.offset, target);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    struct Solution
+    {
+        // The state at the start of every block.
+        std::vector<TapeState> in;
+
+        // Whether the jump ending a block can find its cell zero, and
+        // nonzero.
+        std::vector<bool> can_be_zero;
+        std::vector<bool> can_be_nonzero;
+    };
+
+    // Iterates to a fixed point. A branch edge is only followed if the cell
+    // can have the value it stands for, and the cell is known to be zero
+    // past an edge taken on zero.
+
+    Solution solve(const std::vector<BfOp> &ops, const ControlFlowGraph &cfg)
+    {
+        Solution solution;
+        std::vector<TapeState> &in = solution.in;
+        in.resize(cfg.blocks.size());
+        solution.can_be_zero.resize(cfg.blocks.size());
+        solution.can_be_nonzero.resize(cfg.blocks.size());
+        if (cfg.blocks.empty())
+        {
+            return solution;
+        }
+        in[0].reached = true;
+
+        // Blocks are in program order, so taking the first one keeps the
+        // iteration roughly in the order the program runs.
+        std::set<size_t> worklist = {0};
+        while (!worklist.empty())
+        {
+            size_t b = *worklist.begin();
+            worklist.erase(worklist.begin());
+            const BasicBlock &block = cfg.blocks[b];
+
+            TapeState state = in[b];
+            for (size_t i = block.begin; i < block.end; ++i)
+            {
+                if (!is_jump(ops[i].kind))
+                {
+                    apply(ops[i], &state);
+                }
+            }
+
+            CellValue cell = state.get(state.pointer);
+            solution.can_be_zero[b] = !is_nonzero(cell);
+            solution.can_be_nonzero[b] = !is_zero(cell);
+            if (block.if_zero != kNoBlock && solution.can_be_zero[b])
+            {
+                TapeState zero = state;
+                zero.set(zero.pointer, known_value(0));
+                if (join(&in[block.if_zero], zero))
+                {
+                    worklist.insert(block.if_zero);
+                }
+            }
+            if (block.if_nonzero != kNoBlock && solution.can_be_nonzero[b] &&
+                join(&in[block.if_nonzero], state))
+            {
+                worklist.insert(block.if_nonzero);
+            }
+        }
+        return solution;
+    }
+
+    // Turns an INC_DATA or DEC_DATA into the equivalent ADD_DATA.
+
+    void make_add(BfOp *op)
+    {
+        if (op->kind == BfOpKind::INC_DATA)
+        {
+            op->kind = BfOpKind::ADD_DATA;
+        }
+        else if (op->kind == BfOpKind::DEC_DATA)
+        {
+            op->kind = BfOpKind::ADD_DATA;
+            op->argument = -op->argument;
+        }
+    }
+} // namespace
+
+ControlFlowGraph build_cfg(const std::vector<BfOp> &ops)
+{
+    ControlFlowGraph cfg;
+    cfg.block_of.resize(ops.size());
+    for (size_t i = 0; i < ops.size(); ++i)
+    {
+        if (i == 0 || is_jump(ops[i - 1].kind))
+        {
+            cfg.blocks.push_back(BasicBlock());
+            cfg.blocks.back().begin = i;
+        }
+        cfg.block_of[i] = cfg.blocks.size() - 1;
+        cfg.blocks.back().end = i + 1;
+    }
+
+    auto block_at = [&](size_t op) { return op < ops.size() ? cfg.block_of[op] : kNoBlock; };
+
+    for (size_t b = 0; b < cfg.blocks.size(); ++b)
+    {
+        BasicBlock &block = cfg.blocks[b];
+        const BfOp &last = ops[block.end - 1];
+        if (last.kind == BfOpKind::JUMP_IF_DATA_ZERO)
+        {
+            block.if_zero = block_at(last.argument + 1);
+            block.if_nonzero = block_at(block.end);
+        }
+        else if (last.kind == BfOpKind::JUMP_IF_DATA_NOT_ZERO)
+        {
+            block.if_zero = block_at(block.end);
+            block.if_nonzero = block_at(last.argument + 1);
+        }
+        for (size_t successor : {block.if_zero, block.if_nonzero})
+        {
+            if (successor != kNoBlock)
+            {
+                cfg.blocks[successor].predecessors.push_back(b);
+            }
+        }
+    }
+    return cfg;
+}
+
+void propagate_constants(std::vector<BfOp> *ops)
+{
+    ControlFlowGraph cfg = build_cfg(*ops);
+    Solution solution = solve(*ops, cfg);
+
+    std::vector<BfOp> new_ops;
+    new_ops.reserve(ops->size());
+    TapeState state;
+
+    // Cells with known values whose writes are held back, with what memory
+    // holds for them and the op that last wrote them. Every block stores
+    // them all before its jump, so none are held at the start of a block.
+    struct HeldCell
+    {
+        CellValue memory;
+        int32_t source;
+    };
+    std::map<int64_t, HeldCell> held;
+
+    auto hold = [&](int64_t cell, int32_t source) {
+        auto it = held.find(cell);
+        if (it == held.end())
+        {
+            held[cell] = HeldCell{state.get(cell), source};
+        }
+        else
+        {
+            it->second.source = source;
+        }
+    };
+
+    auto store = [&](int64_t cell) {
+        auto it = held.find(cell);
+        if (it == held.end())
+        {
+            return;
+        }
+        CellValue value = state.get(cell);
+        if (!(it->second.memory == value))
+        {
+            BfOp set(BfOpKind::SET_DATA, static_cast<int32_t>(value.value),
+                     static_cast<int32_t>(cell - state.pointer));
+            set.source = it->second.source;
+            new_ops.push_back(set);
+        }
+        held.erase(it);
+    };
+
+    auto store_all = [&]() {
+        while (!held.empty())
+        {
+            store(held.begin()->first);
+        }
+    };
+
+    // Set when a dropped bracket carries the state over to the block after
+    // it.
+    bool carry_state = false;
+
+    // The ']' of loops that run exactly once, whose brackets are dropped.
+    std::set<size_t> dropped_closes;
+
+    for (size_t i = 0; i < ops->size(); ++i)
+    {
+        const BfOp &op = (*ops)[i];
+        size_t block = cfg.block_of[i];
+        if (cfg.blocks[block].begin == i && !carry_state)
+        {
+            state = solution.in[block];
+        }
+        carry_state = false;
+
+        if (!state.reached)
+        {
+            new_ops.push_back(op);
+            continue;
+        }
+
+        int64_t here = state.pointer;
+        switch (op.kind)
+        {
+        case BfOpKind::INC_DATA:
+        case BfOpKind::DEC_DATA:
+        case BfOpKind::ADD_DATA:
+        case BfOpKind::SET_DATA:
+        case BfOpKind::LOOP_SET_TO_ZERO:
+        {
+            // Adds to unknown cells go through as they are; everything else
+            // ends up with a known value.
+            int64_t cell = here + op.offset;
+            bool sets = op.kind == BfOpKind::SET_DATA || op.kind == BfOpKind::LOOP_SET_TO_ZERO;
+            if (state.tracked(cell) && (sets || state.get(cell).known))
+            {
+                hold(cell, op.source);
+            }
+            else
+            {
+                new_ops.push_back(op);
+            }
+            break;
+        }
+        case BfOpKind::READ_STDIN:
+            // Overwrites the cell, so a held write to it is dead.
+            held.erase(here + op.offset);
+            new_ops.push_back(op);
+            break;
+        case BfOpKind::WRITE_STDOUT:
+            store(here + op.offset);
+            new_ops.push_back(op);
+            break;
+        case BfOpKind::LOOP_MUL_ADD:
+        {
+            CellValue source = state.get(here);
+            int64_t target = here + op.offset;
+            if (is_zero(source))
+            {
+                break;
+            }
+            if (source.known && state.tracked(target) && state.get(target).known)
+            {
+                hold(target, op.source);
+            }
+            else if (is_nonzero(source))
+            {
+                BfOp add(BfOpKind::ADD_DATA,
+                         static_cast<int32_t>(source.value * static_cast<uint32_t>(op.argument)),
+                         op.offset);
+                add.source = op.source;
+                new_ops.push_back(add);
+            }
+            else
+            {
+                store(here);
+                store(target);
+                new_ops.push_back(op);
+            }
+            break;
+        }
+        case BfOpKind::LOOP_MOVE_PTR:
+            if (!is_zero(state.get(here)))
+            {
+                store_all();
+                new_ops.push_back(op);
+            }
+            break;
+        case BfOpKind::JUMP_IF_DATA_ZERO:
+            if (is_zero(state.get(here)))
+            {
+                // The loop never runs; the block after it starts where this
+                // one left off.
+                i = op.argument;
+                carry_state = true;
+                continue;
+            }
+            if (!solution.can_be_zero[block] &&
+                !solution.can_be_nonzero[cfg.block_of[op.argument]])
+            {
+                // The loop is always entered and never repeats, so its body
+                // runs as part of the code around it.
+                dropped_closes.insert(op.argument);
+                carry_state = true;
+                continue;
+            }
+            store_all();
+            new_ops.push_back(op);
+            continue;
+        case BfOpKind::JUMP_IF_DATA_NOT_ZERO:
+            if (dropped_closes.count(i))
+            {
+                carry_state = true;
+                continue;
+            }
+            store_all();
+            new_ops.push_back(op);
+            continue;
+        default:
+            new_ops.push_back(op);
+            break;
+        }
+        apply(op, &state);
+    }
+    store_all();
+
+    ops->swap(new_ops);
+}
+
+void eliminate_dead_stores(std::vector<BfOp> *ops)
+{
+    std::vector<bool> dead(ops->size());
+
+    // The last write to every cell that nothing has read since, by offset
+    // from the data pointer at the start of the block. I/O ends the block
+    // here as well: a store that isn't made could otherwise have been the
+    // one to run off the tape before the output.
+    std::map<int64_t, size_t> pending;
+    int64_t ptr_offset = 0;
+
+    for (size_t i = 0; i < ops->size(); ++i)
+    {
+        BfOp &op = (*ops)[i];
+        switch (op.kind)
+        {
+        case BfOpKind::INC_PTR:
+            ptr_offset += op.argument;
+            break;
+        case BfOpKind::DEC_PTR:
+            ptr_offset -= op.argument;
+            break;
+        case BfOpKind::INC_DATA:
+        case BfOpKind::DEC_DATA:
+        case BfOpKind::ADD_DATA:
+        {
+            // Fold into the last write, which nothing read in between.
+            int64_t cell = ptr_offset + op.offset;
+            auto it = pending.find(cell);
+            if (it == pending.end())
+            {
+                pending[cell] = i;
+                break;
+            }
+            make_add(&op);
+            BfOp &last = (*ops)[it->second];
+            make_add(&last);
+            if (last.kind == BfOpKind::LOOP_SET_TO_ZERO)
+            {
+                last.kind = BfOpKind::SET_DATA;
+                last.argument = 0;
+            }
+            last.argument += op.argument;
+            dead[i] = true;
+            if (last.kind == BfOpKind::ADD_DATA && last.argument == 0)
+            {
+                dead[it->second] = true;
+                pending.erase(it);
+            }
+            break;
+        }
+        case BfOpKind::SET_DATA:
+        case BfOpKind::LOOP_SET_TO_ZERO:
+        {
+            int64_t cell = ptr_offset + op.offset;
+            auto it = pending.find(cell);
+            if (it != pending.end())
+            {
+                dead[it->second] = true;
+            }
+            pending[cell] = i;
+            break;
+        }
+        case BfOpKind::LOOP_MUL_ADD:
+            pending.erase(ptr_offset);
+            pending.erase(ptr_offset + op.offset);
+            break;
+        default:
+            pending.clear();
+            ptr_offset = 0;
+            break;
+        }
+    }
+
+    std::vector<BfOp> new_ops;
+    new_ops.reserve(ops->size());
+    for (size_t i = 0; i < ops->size(); ++i)
+    {
+        if (!dead[i])
+        {
+            new_ops.push_back((*ops)[i]);
+        }
+    }
+    ops->swap(new_ops);
+}
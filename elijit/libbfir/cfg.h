@@ -0,0 +1,66 @@
+#ifndef CFG_H
+#define CFG_H
+
+// Control-flow graph of the ops, and the passes that look at the program as
+// a whole rather than one loop at a time.
+//
+// The only branches in BF are the brackets, so a basic block ends at every
+// jump op and the op after a jump starts the next one. Every jump tests the
+// cell under the data pointer, and its two edges say whether the cell was
+// zero or not; the passes use that to learn cell values from the branches
+// the program takes.
+
+#include <cstddef>
+#include <vector>
+
+#include "bfir.h"
+
+constexpr size_t kNoBlock = static_cast<size_t>(-1);
+
+struct BasicBlock
+{
+    // The block's ops are ops[begin, end). The last one is a jump, unless
+    // the block ends the program.
+    size_t begin = 0;
+    size_t end = 0;
+
+    // Where control goes after the block when the cell is zero and when it
+    // isn't, or kNoBlock. A block that ends the program has neither; the end
+    // of a loop that ends the program exits to kNoBlock.
+    size_t if_zero = kNoBlock;
+    size_t if_nonzero = kNoBlock;
+
+    std::vector<size_t> predecessors;
+};
+
+struct ControlFlowGraph
+{
+    // In op order; blocks[0] is where the program starts.
+    std::vector<BasicBlock> blocks;
+
+    // Index of the block of every op.
+    std::vector<size_t> block_of;
+};
+
+// Jumps in ops must be linked.
+
+ControlFlowGraph build_cfg(const std::vector<BfOp> &ops);
+
+// Tracks the values of cells through the program, starting from an all-zero
+// tape, for as long as the data pointer is known. Loops whose cell is known
+// to be zero are dropped, loops known to run exactly once lose their
+// brackets, LOOP_MUL_ADD ops with known sources become adds,
+// and writes to cells with known values are held back and only stored, as a
+// SET_DATA of the final value, before something reads the cell or at the end
+// of the block. So "++++++++[->++++<]>+." stores 33 into cell 1 and writes it.
+
+void propagate_constants(std::vector<BfOp> *ops);
+
+// Removes stores to a cell that the same block stores to again before reading
+// it, and folds adds into the store before them: "[-]+++" becomes
+// SET_DATA(3). Works where the data pointer is unknown too, with offsets from
+// wherever it is at the start of the block.
+
+void eliminate_dead_stores(std::vector<BfOp> *ops);
+
+#endif /*CFG_H*/
@@ -0,0 +1,294 @@
+#include "codecache.h"
+#include "bfir.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace
+{
+
+    constexpr char kMagic[8] = {'B', 'F', 'J', 'I', 'T', 'C', 0, 0};
+
+    // Layout of an entry file: this header, the op offsets, then the code at
+    // code_offset, which is page aligned.
+    // checksum is the hash of the op offsets and the code (entry_checksum).
+
+    struct EntryHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        char key[32];
+        char checksum[32];
+        uint64_t num_op_offsets;
+        uint64_t code_offset;
+        uint64_t code_size;
+    };
+
+    // FNV-1a with 128-bit state.
+
+    class Fnv128
+    {
+    public:
+        void add(const void *data, size_t size)
+        {
+            const uint8_t *p = static_cast<const uint8_t *>(data);
+            for (size_t i = 0; i < size; ++i)
+            {
+                state_ ^= p[i];
+                state_ *= prime();
+            }
+        }
+
+        void add(const std::string &s)
+        {
+            // Include the terminator so that consecutive strings can't run
+            // into each other.
+            add(s.c_str(), s.size() + 1);
+        }
+
+        std::string hex() const
+        {
+            static const char digits[] = "0123456789abcdef";
+            std::string out;
+            for (int shift = 124; shift >= 0; shift -= 4)
+            {
+                out += digits[static_cast<int>(state_ >> shift) & 0xF];
+            }
+            return out;
+        }
+
+    private:
+        static unsigned __int128 prime()
+        {
+            return (static_cast<unsigned __int128>(1) << 88) + 0x13B;
+        }
+
+        unsigned __int128 state_ = (static_cast<unsigned __int128>(0x6c62272e07bb0142ULL) << 64) |
+                                   0x62b821756295c58dULL;
+    };
+
+    std::string entry_checksum(const uint32_t *op_offsets, size_t num_op_offsets,
+                               const uint8_t *code, size_t code_size)
+    {
+        Fnv128 hash;
+        hash.add(op_offsets, num_op_offsets * sizeof(uint32_t));
+        hash.add(code, code_size);
+        return hash.hex();
+    }
+
+    // Feature bits of the host CPU that code generators may depend on.
+
+    void add_cpu_features(Fnv128 *hash)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        unsigned regs[4] = {0, 0, 0, 0};
+        if (__get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]))
+        {
+            hash->add(&regs[2], sizeof(regs[2]));
+            hash->add(&regs[3], sizeof(regs[3]));
+        }
+        unsigned leaf7[4] = {0, 0, 0, 0};
+        if (__get_cpuid_count(7, 0, &leaf7[0], &leaf7[1], &leaf7[2], &leaf7[3]))
+        {
+            hash->add(&leaf7[1], 3 * sizeof(unsigned));
+        }
+#else
+        (void)hash;
+#endif
+    }
+
+    bool read_fully(int fd, void *buf, size_t size, off_t offset)
+    {
+        uint8_t *p = static_cast<uint8_t *>(buf);
+        while (size > 0)
+        {
+            ssize_t n = pread(fd, p, size, offset);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return false;
+            }
+            p += n;
+            size -= n;
+            offset += n;
+        }
+        return true;
+    }
+
+    bool write_fully(int fd, const void *buf, size_t size)
+    {
+        const uint8_t *p = static_cast<const uint8_t *>(buf);
+        while (size > 0)
+        {
+            ssize_t n = write(fd, p, size);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return false;
+            }
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    // mkdir -p
+    bool make_dirs(const std::string &dir)
+    {
+        for (size_t slash = dir.find('/', 1); ; slash = dir.find('/', slash + 1))
+        {
+            std::string prefix = dir.substr(0, slash);
+            if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST)
+            {
+                return false;
+            }
+            if (slash == std::string::npos)
+            {
+                return true;
+            }
+        }
+    }
+
+    size_t page_size()
+    {
+        static const size_t size = sysconf(_SC_PAGESIZE);
+        return size;
+    }
+} // namespace
+
+std::string code_cache_key(const Program &p, const std::string &engine, int opt_level,
+                           int cell_bits)
+{
+    Fnv128 hash;
+    hash.add(&kCodeCacheFormatVersion, sizeof(kCodeCacheFormatVersion));
+    hash.add(&kPassPipelineVersion, sizeof(kPassPipelineVersion));
+    hash.add(engine);
+    hash.add(&opt_level, sizeof(opt_level));
+    hash.add(&cell_bits, sizeof(cell_bits));
+    add_cpu_features(&hash);
+    hash.add(p.instructions);
+    return hash.hex();
+}
+
+CachedCode::~CachedCode()
+{
+    if (code_)
+    {
+        munmap(code_, code_size_);
+    }
+}
+
+bool CodeCache::lookup(const std::string &key, CachedCode *entry) const
+{
+    int fd = open(entry_path(key).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    bool ok = false;
+    EntryHeader header;
+    struct stat st;
+    if (read_fully(fd, &header, sizeof(header), 0) &&
+        memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+        header.version == kCodeCacheFormatVersion &&
+        key.size() == sizeof(header.key) && memcmp(header.key, key.data(), key.size()) == 0 &&
+        header.code_offset % page_size() == 0 && header.code_offset >= sizeof(header) &&
+        header.num_op_offsets <= (header.code_offset - sizeof(header)) / sizeof(uint32_t) &&
+        header.code_size > 0 && fstat(fd, &st) == 0 &&
+        header.code_offset <= static_cast<uint64_t>(st.st_size) &&
+        header.code_size <= static_cast<uint64_t>(st.st_size) - header.code_offset)
+    {
+        // The code is checked in a private copy that only becomes executable
+        // once it matches the checksum, so that a corrupted entry never runs
+        // and changes to the file can't reach the checked code.
+
+        std::vector<uint32_t> op_offsets(header.num_op_offsets);
+        void *code = mmap(nullptr, header.code_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        bool loaded = code != MAP_FAILED &&
+                      read_fully(fd, op_offsets.data(), op_offsets.size() * sizeof(uint32_t),
+                                 sizeof(header)) &&
+                      read_fully(fd, code, header.code_size, header.code_offset);
+        if (loaded)
+        {
+            std::string checksum = entry_checksum(op_offsets.data(), op_offsets.size(),
+                                                  static_cast<uint8_t *>(code), header.code_size);
+            loaded = memcmp(checksum.data(), header.checksum, sizeof(header.checksum)) == 0 &&
+                     mprotect(code, header.code_size, PROT_READ | PROT_EXEC) == 0;
+        }
+        if (loaded)
+        {
+            entry->code_ = static_cast<uint8_t *>(code);
+            entry->code_size_ = header.code_size;
+            entry->op_offsets_.swap(op_offsets);
+            ok = true;
+        }
+        else if (code != MAP_FAILED)
+        {
+            munmap(code, header.code_size);
+        }
+    }
+
+    close(fd);
+    return ok;
+}
+
+bool CodeCache::store(const std::string &key, const std::vector<uint8_t> &code,
+                      const std::vector<uint32_t> &op_offsets) const
+{
+    if (code.empty() || key.size() != sizeof(EntryHeader::key) || !make_dirs(dir_))
+    {
+        return false;
+    }
+
+    EntryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kCodeCacheFormatVersion;
+    memcpy(header.key, key.data(), key.size());
+    std::string checksum = entry_checksum(op_offsets.data(), op_offsets.size(), code.data(), code.size());
+    memcpy(header.checksum, checksum.data(), sizeof(header.checksum));
+    header.num_op_offsets = op_offsets.size();
+    size_t metadata_size = sizeof(header) + op_offsets.size() * sizeof(uint32_t);
+    header.code_offset = (metadata_size + page_size() - 1) / page_size() * page_size();
+    header.code_size = code.size();
+
+    std::string path = entry_path(key);
+    std::string tmp_path = dir_ + "/." + key + "." + std::to_string(getpid()) + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    std::vector<uint8_t> padding(header.code_offset - metadata_size, 0);
+    bool ok = write_fully(fd, &header, sizeof(header)) &&
+              write_fully(fd, op_offsets.data(), op_offsets.size() * sizeof(uint32_t)) &&
+              write_fully(fd, padding.data(), padding.size()) &&
+              write_fully(fd, code.data(), code.size());
+    ok = close(fd) == 0 && ok;
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
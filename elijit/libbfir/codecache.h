@@ -0,0 +1,97 @@
+#ifndef CODECACHE_H
+#define CODECACHE_H
+
+// Persistent on-disk cache of JIT-compiled programs.
+//
+// Entries are content-addressed: the key hashes everything the code depends
+// on, i.e. the program text, the engine and the versions of its code
+// generator and of the passes (kPassPipelineVersion), its optimization level,
+// the cell width and the features of the host CPU. An entry holds the machine
+// code together with the JitOpMap offsets and a checksum of both. The JITs
+// only emit relative jumps and reach the runtime through BfIo, so their code
+// is position independent and a hit just loads it back as executable, with no
+// translation or code generation.
+//
+// Entries are written to a temporary file that is renamed into place, so
+// concurrent runs of the same program never see a partial entry, and an entry
+// whose checksum doesn't match is never made executable. Failing to read or
+// write the cache is never fatal; the program just gets compiled.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "parser.h"
+
+// Bump when the entry layout changes.
+
+constexpr uint32_t kCodeCacheFormatVersion = 2;
+
+// 128-bit hash of the key material, as 32 hex digits. engine names the code
+// generator together with its version constants, e.g. "optasmjit 3", so that
+// entries from an older generator miss.
+
+std::string code_cache_key(const Program &p, const std::string &engine, int opt_level,
+                           int cell_bits);
+
+// A cache entry mapped into memory.
+
+class CachedCode
+{
+public:
+    CachedCode() = default;
+    ~CachedCode();
+
+    CachedCode(const CachedCode &) = delete;
+    CachedCode &operator=(const CachedCode &) = delete;
+
+    const uint8_t *code() const
+    {
+        return code_;
+    }
+
+    size_t code_size() const
+    {
+        return code_size_;
+    }
+
+    const std::vector<uint32_t> &op_offsets() const
+    {
+        return op_offsets_;
+    }
+
+private:
+    friend class CodeCache;
+
+    uint8_t *code_ = nullptr;
+    size_t code_size_ = 0;
+    std::vector<uint32_t> op_offsets_;
+};
+
+class CodeCache
+{
+public:
+    explicit CodeCache(const std::string &dir) : dir_(dir) {}
+
+    // Maps the entry for key into *entry. Returns false on a miss, or if the
+    // entry is unusable.
+
+    bool lookup(const std::string &key, CachedCode *entry) const;
+
+    // Stores code under key, creating the cache directory if needed. Returns
+    // false if the entry couldn't be written.
+
+    bool store(const std::string &key, const std::vector<uint8_t> &code,
+               const std::vector<uint32_t> &op_offsets) const;
+
+    std::string entry_path(const std::string &key) const
+    {
+        return dir_ + "/" + key + ".jit";
+    }
+
+private:
+    std::string dir_;
+};
+
+#endif /*CODECACHE_H*/
@@ -0,0 +1,270 @@
+#include "partialeval.h"
+
+#include <cstdint>
+#include <string>
+
+namespace
+{
+
+    // A few milliseconds of compile time at most; plenty for the setup
+    // phases of the sample programs.
+    constexpr uint64_t kMaxSteps = uint64_t(1) << 18;
+
+    // Cells the evaluation may touch, from cell 0 up.
+    constexpr int64_t kMaxCells = int64_t(1) << 16;
+
+    // Output held back for the prologue; more than one runtime buffer full
+    // isn't worth the ops it takes.
+    constexpr size_t kMaxOutput = 64 * 1024;
+
+    // The program's state at compile time. Cells hold their values modulo
+    // 2^32, which, truncated, is what they are at every cell width.
+
+    struct Machine
+    {
+        std::vector<uint32_t> cells;
+        int64_t pointer = 0;
+        std::string output;
+
+        // The next op to run, how many steps have been run and how many loops
+        // are running.
+        size_t pc = 0;
+        uint64_t steps = 0;
+        int64_t depth = 0;
+
+        // The last time no loop was running: the op that was next then, and the
+        // step count.
+        size_t boundary_pc = 0;
+        uint64_t boundary_steps = 0;
+    };
+
+    enum class ZeroTest
+    {
+        ZERO,
+        NONZERO,
+        UNKNOWN
+    };
+
+    // Zero at every cell width, or nonzero at every cell width; a cell of 256
+    // is neither.
+
+    ZeroTest zero_test(uint32_t value)
+    {
+        if (value == 0)
+        {
+            return ZeroTest::ZERO;
+        }
+        return (value & 0xFF) != 0 ? ZeroTest::NONZERO : ZeroTest::UNKNOWN;
+    }
+
+    bool is_tracked(int64_t index)
+    {
+        return index >= 0 && index < kMaxCells;
+    }
+
+    uint32_t &cell(Machine *m, int64_t index)
+    {
+        if (static_cast<size_t>(index) >= m->cells.size())
+        {
+            m->cells.resize(index + 1);
+        }
+        return m->cells[index];
+    }
+
+    // Runs the op at m->pc, or returns false without changing anything if it
+    // can't be run at compile time.
+
+    bool step(const std::vector<BfOp> &ops, Machine *m)
+    {
+        const BfOp &op = ops[m->pc];
+        int64_t index = m->pointer + op.offset;
+        size_t next_pc = m->pc + 1;
+        uint64_t steps = 1;
+
+        switch (op.kind)
+        {
+        case BfOpKind::INC_PTR:
+            m->pointer += op.argument;
+            break;
+        case BfOpKind::DEC_PTR:
+            m->pointer -= op.argument;
+            break;
+        case BfOpKind::INC_DATA:
+        case BfOpKind::DEC_DATA:
+        case BfOpKind::ADD_DATA:
+        case BfOpKind::SET_DATA:
+        case BfOpKind::LOOP_SET_TO_ZERO:
+        {
+            if (!is_tracked(index))
+            {
+                return false;
+            }
+            uint32_t argument = static_cast<uint32_t>(op.argument);
+            uint32_t &value = cell(m, index);
+            if (op.kind == BfOpKind::SET_DATA)
+            {
+                value = argument;
+            }
+            else if (op.kind == BfOpKind::LOOP_SET_TO_ZERO)
+            {
+                value = 0;
+            }
+            else
+            {
+                value += op.kind == BfOpKind::DEC_DATA ? -argument : argument;
+            }
+            break;
+        }
+        case BfOpKind::WRITE_STDOUT:
+            if (!is_tracked(index) || m->output.size() + op.argument > kMaxOutput)
+            {
+                return false;
+            }
+            m->output.append(op.argument, static_cast<char>(cell(m, index)));
+            break;
+        case BfOpKind::LOOP_MOVE_PTR:
+        {
+            int64_t pointer = m->pointer;
+            for (;; pointer += op.argument, ++steps)
+            {
+                if (!is_tracked(pointer))
+                {
+                    return false;
+                }
+                ZeroTest test = zero_test(cell(m, pointer));
+                if (test == ZeroTest::UNKNOWN)
+                {
+                    return false;
+                }
+                if (test == ZeroTest::ZERO)
+                {
+                    break;
+                }
+            }
+            m->pointer = pointer;
+            break;
+        }
+        case BfOpKind::LOOP_MUL_ADD:
+        {
+            if (!is_tracked(m->pointer))
+            {
+                return false;
+            }
+            uint32_t source = cell(m, m->pointer);
+            ZeroTest test = zero_test(source);
+            if (test == ZeroTest::UNKNOWN || (test == ZeroTest::NONZERO && !is_tracked(index)))
+            {
+                return false;
+            }
+            if (test == ZeroTest::NONZERO)
+            {
+                cell(m, index) += source * static_cast<uint32_t>(op.argument);
+            }
+            break;
+        }
+        case BfOpKind::JUMP_IF_DATA_ZERO:
+        case BfOpKind::JUMP_IF_DATA_NOT_ZERO:
+        {
+            if (!is_tracked(m->pointer))
+            {
+                return false;
+            }
+            ZeroTest test = zero_test(cell(m, m->pointer));
+            if (test == ZeroTest::UNKNOWN)
+            {
+                return false;
+            }
+            bool jump = op.kind == BfOpKind::JUMP_IF_DATA_ZERO ? test == ZeroTest::ZERO
+                                                                : test == ZeroTest::NONZERO;
+            if (jump)
+            {
+                next_pc = op.argument + 1;
+            }
+            else
+            {
+                m->depth += op.kind == BfOpKind::JUMP_IF_DATA_ZERO ? 1 : -1;
+            }
+            break;
+        }
+        default:
+            // READ_STDIN, which is where the evaluation is meant to stop.
+            return false;
+        }
+
+        m->pc = next_pc;
+        m->steps += steps;
+        return true;
+    }
+
+    // Runs ops from the start until max_steps have been run, the program ends
+    // or an op can't be run at compile time.
+
+    void run(const std::vector<BfOp> &ops, uint64_t max_steps, Machine *m)
+    {
+        for (;;)
+        {
+            if (m->depth == 0)
+            {
+                m->boundary_pc = m->pc;
+                m->boundary_steps = m->steps;
+            }
+            if (m->pc == ops.size() || m->steps >= max_steps || !step(ops, m))
+            {
+                return;
+            }
+        }
+    }
+} // namespace
+
+void partial_evaluate(std::vector<BfOp> *ops)
+{
+    Machine m;
+    run(*ops, kMaxSteps, &m);
+    if (m.boundary_pc == 0)
+    {
+        return;
+    }
+
+    // Every op costs a step, so running again up to the boundary's step count
+    // stops right at the boundary.
+    if (m.pc != m.boundary_pc)
+    {
+        uint64_t boundary_steps = m.boundary_steps;
+        m = Machine();
+        run(*ops, boundary_steps, &m);
+    }
+
+    std::vector<BfOp> new_ops;
+    for (size_t i = 0; i < m.output.size();)
+    {
+        size_t run_end = i;
+        while (run_end < m.output.size() && m.output[run_end] == m.output[i])
+        {
+            run_end++;
+        }
+        new_ops.push_back(BfOp(BfOpKind::SET_DATA, static_cast<uint8_t>(m.output[i])));
+        new_ops.push_back(BfOp(BfOpKind::WRITE_STDOUT, static_cast<int64_t>(run_end - i)));
+        i = run_end;
+    }
+
+    // Cell 0 is set even when it's zero if the output went through it.
+    for (size_t i = 0; i < m.cells.size(); ++i)
+    {
+        if (m.cells[i] != 0 || (i == 0 && !m.output.empty()))
+        {
+            new_ops.push_back(BfOp(BfOpKind::SET_DATA, m.cells[i], static_cast<int32_t>(i)));
+        }
+    }
+
+    if (m.pointer > 0)
+    {
+        new_ops.push_back(BfOp(BfOpKind::INC_PTR, m.pointer));
+    }
+    else if (m.pointer < 0)
+    {
+        new_ops.push_back(BfOp(BfOpKind::DEC_PTR, -m.pointer));
+    }
+
+    new_ops.insert(new_ops.end(), ops->begin() + m.boundary_pc, ops->end());
+    ops->swap(new_ops);
+}
@@ -0,0 +1,34 @@
+#ifndef PARTIALEVAL_H
+#define PARTIALEVAL_H
+
+// Partial evaluation of the part of a program that doesn't depend on its
+// input.
+//
+// Many programs do a lot of deterministic work before they read anything:
+// hello.bf computes and prints its whole output, mandelbrot.bf builds its
+// constants. partial_evaluate runs the program at compile time, from the
+// all-zero tape, until the first ',' or until a step budget runs out, and
+// replaces everything it ran with the result: the pending output, the tape
+// and the data pointer. An input-free program that finishes within the budget
+// becomes a list of constant writes that the runtime's output buffer turns
+// into a single write(2).
+
+#include <vector>
+
+#include "bfir.h"
+
+// Ops are only evaluated up to the last point where no loop was running, so the
+// rest of the program is a suffix of the ops as they are. The evaluation
+// stops early, before the op in question, for anything that could turn out
+// differently at run time: reading input, a cell whose zero test depends on the
+// cell width (256 is zero in an 8-bit cell only), a cell below cell 0 or far
+// out on the tape (the engine has to report the overflow), and more output
+// than is worth embedding.
+//
+// The result starts with the output, written as SET_DATA and WRITE_STDOUT on
+// cell 0, followed by a SET_DATA for every cell that isn't zero and a pointer
+// move. Jumps in ops must be linked.
+
+void partial_evaluate(std::vector<BfOp> *ops);
+
+#endif /*PARTIALEVAL_H*/
@@ -0,0 +1,395 @@
+#include "perfmap.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <stack>
+#include <string>
+
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+
+    // A stretch of code that gets one symbol.
+
+    struct Symbol
+    {
+        uint32_t start;
+        uint32_t end;
+        std::string name;
+
+        // The ops whose code is in [start, end), in address order.
+        std::vector<size_t> ops;
+    };
+
+    // Cuts the code into symbols, one per run of ops in the same innermost
+    // loop, in address order. Ops that emit no code can leave empty runs;
+    // those are dropped.
+
+    std::vector<Symbol> find_symbols(const JitOpMap &map, const std::vector<PerfOp> &ops)
+    {
+        std::vector<Symbol> symbols;
+
+        // The innermost loop of every op, by the index of the op opening it.
+        std::vector<int64_t> loops(ops.size(), -1);
+        std::stack<size_t> open_loops;
+        for (size_t i = 0; i < ops.size(); ++i)
+        {
+            if (ops[i].loop_end >= 0)
+            {
+                open_loops.push(i);
+            }
+            loops[i] = open_loops.empty() ? -1 : open_loops.top();
+            if (!open_loops.empty() && ops[open_loops.top()].loop_end == static_cast<int64_t>(i))
+            {
+                open_loops.pop();
+            }
+        }
+
+        // JITs may move code out of line, so follow the code rather than
+        // the ops.
+        std::vector<size_t> order(ops.size());
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return map.op_offsets[a] < map.op_offsets[b];
+        });
+
+        auto name_of = [&](int64_t loop) -> std::string {
+            if (loop < 0)
+            {
+                return "bf_program";
+            }
+            if (ops[loop].source < 0)
+            {
+                return "bf_loop_op" + std::to_string(loop);
+            }
+            return "bf_loop_" + std::to_string(ops[loop].source);
+        };
+
+        // The first run also covers the prologue, and the last one the
+        // epilogue.
+        int64_t current = -1;
+        size_t run_start = 0;
+        uint32_t run_code_start = 0;
+        auto close_run = [&](size_t run_end) {
+            uint32_t end = run_end == order.size() ? map.code_size : map.op_offsets[order[run_end]];
+            if (end > run_code_start)
+            {
+                symbols.push_back(Symbol{
+                    run_code_start, end, name_of(current),
+                    std::vector<size_t>(order.begin() + run_start, order.begin() + run_end)});
+            }
+            run_start = run_end;
+            run_code_start = end;
+        };
+
+        for (size_t k = 0; k < order.size(); ++k)
+        {
+            if (loops[order[k]] != current)
+            {
+                close_run(k);
+                current = loops[order[k]];
+            }
+        }
+        close_run(order.size());
+        return symbols;
+    }
+
+    void write_perf_map(const JitOpMap &map, const std::vector<Symbol> &symbols)
+    {
+        std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+        FILE *out = fopen(path.c_str(), "a");
+        if (!out)
+        {
+            std::cerr << "perf map: unable to open " << path << ": " << strerror(errno) << "\n";
+            return;
+        }
+        for (const Symbol &symbol : symbols)
+        {
+            fprintf(out, "%llx %x %s\n",
+                    static_cast<unsigned long long>(reinterpret_cast<uintptr_t>(map.code) +
+                                                    symbol.start),
+                    symbol.end - symbol.start, symbol.name.c_str());
+        }
+        if (fclose(out) != 0)
+        {
+            std::cerr << "perf map: unable to write " << path << "\n";
+        }
+    }
+
+    // The jitdump format, as documented in perf's
+    // tools/perf/Documentation/jitdump-specification.txt.
+
+    constexpr uint32_t kJitDumpMagic = 0x4A695444;
+    constexpr uint32_t kJitDumpVersion = 1;
+    constexpr uint32_t kJitCodeLoad = 0;
+    constexpr uint32_t kJitCodeDebugInfo = 2;
+
+    struct JitDumpHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t total_size;
+        uint32_t elf_mach;
+        uint32_t pad1;
+        uint32_t pid;
+        uint64_t timestamp;
+        uint64_t flags;
+    };
+
+    struct JitDumpRecordHeader
+    {
+        uint32_t id;
+        uint32_t total_size;
+        uint64_t timestamp;
+    };
+
+    struct JitDumpCodeLoad
+    {
+        JitDumpRecordHeader header;
+        uint32_t pid;
+        uint32_t tid;
+        uint64_t vma;
+        uint64_t code_addr;
+        uint64_t code_size;
+        uint64_t code_index;
+        // Followed by the NUL-terminated name and the code.
+    };
+
+    struct JitDumpDebugInfo
+    {
+        JitDumpRecordHeader header;
+        uint64_t code_addr;
+        uint64_t nr_entry;
+        // Followed by nr_entry JitDumpDebugEntry + NUL-terminated file name.
+    };
+
+    struct JitDumpDebugEntry
+    {
+        uint64_t addr;
+        int32_t lineno;
+        int32_t discrim;
+    };
+
+    // perf record -k mono samples with CLOCK_MONOTONIC, and perf inject
+    // matches records to samples by time.
+
+    uint64_t timestamp()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    template <typename T>
+    void append(std::string *out, const T &value)
+    {
+        out->append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    bool write_all(int fd, const std::string &data)
+    {
+        const char *p = data.data();
+        const char *end = p + data.size();
+        while (p < end)
+        {
+            ssize_t n = write(fd, p, end - p);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return false;
+            }
+            p += n;
+        }
+        return true;
+    }
+
+    // The line in the BF file of every instruction, parsed the same way as
+    // parse_from_stream does.
+
+    std::vector<int32_t> instruction_lines(const std::string &path)
+    {
+        std::vector<int32_t> lines;
+        std::ifstream file(path);
+        int32_t lineno = 1;
+        for (std::string line; std::getline(file, line); ++lineno)
+        {
+            for (char c : line)
+            {
+                if (c == '>' || c == '<' || c == '+' || c == '-' || c == '.' || c == ',' ||
+                    c == '[' || c == ']')
+                {
+                    lines.push_back(lineno);
+                }
+            }
+        }
+        return lines;
+    }
+
+    void write_jitdump(const Options &options, const JitOpMap &map, const std::vector<PerfOp> &ops,
+                       const std::vector<Symbol> &symbols)
+    {
+        std::string path = "/tmp/jit-" + std::to_string(getpid()) + ".dump";
+        int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            std::cerr << "jitdump: unable to open " << path << ": " << strerror(errno) << "\n";
+            return;
+        }
+
+        uint32_t pid = getpid();
+        uint32_t tid = static_cast<uint32_t>(syscall(SYS_gettid));
+        std::string dump;
+        JitDumpHeader header = {kJitDumpMagic, kJitDumpVersion, sizeof(JitDumpHeader),
+                                EM_X86_64, 0, pid, timestamp(), 0};
+        append(&dump, header);
+
+        // perf finds the dump through this mapping showing up in perf.data,
+        // so it stays mapped for as long as the process runs.
+
+        if (!write_all(fd, dump) ||
+            mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0) ==
+                MAP_FAILED)
+        {
+            std::cerr << "jitdump: unable to set up " << path << ": " << strerror(errno) << "\n";
+            close(fd);
+            return;
+        }
+
+        char resolved[PATH_MAX];
+        std::string source_path = realpath(options.bf_file_path.c_str(), resolved)
+                                      ? resolved
+                                      : options.bf_file_path;
+        std::vector<int32_t> lines = instruction_lines(options.bf_file_path);
+
+        dump.clear();
+        for (size_t i = 0; i < symbols.size(); ++i)
+        {
+            const Symbol &symbol = symbols[i];
+            uint64_t addr = reinterpret_cast<uintptr_t>(map.code) + symbol.start;
+
+            // One line entry per op that starts a new source line.
+            std::vector<JitDumpDebugEntry> entries;
+            for (size_t op : symbol.ops)
+            {
+                int64_t source = ops[op].source;
+                if (source < 0 || source >= static_cast<int64_t>(lines.size()) ||
+                    (!entries.empty() && entries.back().lineno == lines[source]))
+                {
+                    continue;
+                }
+                uint64_t op_addr = reinterpret_cast<uintptr_t>(map.code) +
+                                   std::max(map.op_offsets[op], symbol.start);
+                entries.push_back(JitDumpDebugEntry{op_addr, lines[source], 0});
+            }
+            if (!entries.empty())
+            {
+                JitDumpDebugInfo info;
+                info.header.id = kJitCodeDebugInfo;
+                info.header.total_size = static_cast<uint32_t>(
+                    sizeof(info) + entries.size() * (sizeof(JitDumpDebugEntry) +
+                                                     source_path.size() + 1));
+                info.header.timestamp = timestamp();
+                info.code_addr = addr;
+                info.nr_entry = entries.size();
+                append(&dump, info);
+                for (const JitDumpDebugEntry &entry : entries)
+                {
+                    append(&dump, entry);
+                    dump.append(source_path.c_str(), source_path.size() + 1);
+                }
+            }
+
+            uint32_t size = symbol.end - symbol.start;
+            JitDumpCodeLoad load;
+            load.header.id = kJitCodeLoad;
+            load.header.total_size =
+                static_cast<uint32_t>(sizeof(load) + symbol.name.size() + 1 + size);
+            load.header.timestamp = timestamp();
+            load.pid = pid;
+            load.tid = tid;
+            load.vma = addr;
+            load.code_addr = addr;
+            load.code_size = size;
+            load.code_index = i;
+            append(&dump, load);
+            dump.append(symbol.name.c_str(), symbol.name.size() + 1);
+            dump.append(reinterpret_cast<const char *>(map.code) + symbol.start, size);
+        }
+
+        if (!write_all(fd, dump))
+        {
+            std::cerr << "jitdump: unable to write " << path << "\n";
+        }
+        close(fd);
+    }
+} // namespace
+
+std::vector<PerfOp> perf_ops_from_program(const Program &p)
+{
+    std::vector<PerfOp> ops(p.instructions.size());
+    std::stack<size_t> open_brackets;
+    for (size_t pc = 0; pc < ops.size(); ++pc)
+    {
+        ops[pc].source = pc;
+        if (p.instructions[pc] == '[')
+        {
+            open_brackets.push(pc);
+        }
+        else if (p.instructions[pc] == ']' && !open_brackets.empty())
+        {
+            ops[open_brackets.top()].loop_end = pc;
+            open_brackets.pop();
+        }
+    }
+    return ops;
+}
+
+std::vector<PerfOp> perf_ops_from_ir(const std::vector<BfOp> &ops)
+{
+    std::vector<PerfOp> perf_ops(ops.size());
+    for (size_t i = 0; i < ops.size(); ++i)
+    {
+        perf_ops[i].source = ops[i].source;
+        if (ops[i].kind == BfOpKind::JUMP_IF_DATA_ZERO)
+        {
+            perf_ops[i].loop_end = ops[i].argument;
+        }
+    }
+    return perf_ops;
+}
+
+void perf_register_code(const Options &options, const JitOpMap &map,
+                        const std::vector<PerfOp> &ops)
+{
+    if (map.op_offsets.size() != ops.size())
+    {
+        DIE << "perf: " << ops.size() << " ops but " << map.op_offsets.size() << " op offsets";
+    }
+    std::vector<Symbol> symbols = find_symbols(map, ops);
+    if (options.perf_map)
+    {
+        write_perf_map(map, symbols);
+    }
+    if (options.jitdump)
+    {
+        write_jitdump(options, map, ops, symbols);
+    }
+}
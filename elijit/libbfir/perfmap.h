@@ -0,0 +1,58 @@
+#ifndef PERFMAP_H
+#define PERFMAP_H
+
+// Describes JIT-compiled BF code to Linux perf, so that profiles show which BF
+// loop is hot instead of an anonymous [unknown] region.
+//
+// The code is cut into symbols that don't overlap, one per stretch of code
+// that belongs to the same innermost loop: bf_loop_<N> for the loop whose '['
+// is instruction N of the program (counting BF instructions only, as in
+// Program::instructions), and bf_program for the code outside all loops. The
+// samples of a loop nest are thus split between its loops.
+//
+// --perf-map appends the symbols to /tmp/perf-<pid>.map, which perf report
+// reads by itself. --jitdump writes /tmp/jit-<pid>.dump in perf's jitdump
+// format, which also carries the code and maps every op back to its line in
+// the BF file, for perf annotate:
+//
+//   perf record -k mono optasmjit --jitdump prog.bf
+//   perf inject --jit -i perf.data -o perf.jit.data
+//   perf report -i perf.jit.data
+//
+// Failing to write either file is reported but not fatal.
+
+#include <cstdint>
+#include <vector>
+
+#include "bfir.h"
+#include "tape.h"
+#include "utils.h"
+
+// What perf is told about one op of the compiled code: op i starts at
+// JitOpMap::op_offsets[i].
+
+struct PerfOp
+{
+    // Position in Program::instructions the op came from, or -1.
+    int64_t source = -1;
+
+    // For an op that opens a loop, the index of the op that closes it;
+    // -1 otherwise.
+    int64_t loop_end = -1;
+};
+
+// One PerfOp per instruction, for JITs that compile the program text directly.
+
+std::vector<PerfOp> perf_ops_from_program(const Program &p);
+
+// One PerfOp per BfOp, for JITs that compile the IR.
+
+std::vector<PerfOp> perf_ops_from_ir(const std::vector<BfOp> &ops);
+
+// Writes whatever options asks for (--perf-map, --jitdump) about the code in
+// map, which must be complete (code, code_size and one offset per op).
+
+void perf_register_code(const Options &options, const JitOpMap &map,
+                        const std::vector<PerfOp> &ops);
+
+#endif /*PERFMAP_H*/
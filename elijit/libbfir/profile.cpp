@@ -0,0 +1,597 @@
+#include "profile.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stack>
+
+namespace
+{
+
+    // The scope of every op: the '[' of its innermost loop, or -1 outside all
+    // loops. The '[' of a loop belongs to the enclosing scope and its ']' to
+    // the loop, so every op runs once per iteration of its scope.
+
+    std::vector<int64_t> op_scopes(const std::vector<BfOp> &ops)
+    {
+        std::vector<int64_t> scopes(ops.size(), -1);
+        std::stack<size_t> open_loops;
+        for (size_t i = 0; i < ops.size(); ++i)
+        {
+            if (ops[i].kind == BfOpKind::JUMP_IF_DATA_NOT_ZERO && !open_loops.empty())
+            {
+                scopes[i] = open_loops.top();
+                open_loops.pop();
+                continue;
+            }
+            scopes[i] = open_loops.empty() ? -1 : open_loops.top();
+            if (ops[i].kind == BfOpKind::JUMP_IF_DATA_ZERO)
+            {
+                open_loops.push(i);
+            }
+        }
+        return scopes;
+    }
+
+    // The body of the loop opened by ops[open] with its inner loops left out,
+    // e.g. "a-1 >1 [..] <1".
+
+    constexpr size_t kMaxBodyLength = 60;
+
+    std::string loop_body(const std::vector<BfOp> &ops, size_t open)
+    {
+        std::string body;
+        size_t close = ops[open].argument;
+        for (size_t i = open + 1; i < close && body.size() < kMaxBodyLength; ++i)
+        {
+            if (!body.empty())
+            {
+                body += ' ';
+            }
+            if (ops[i].kind == BfOpKind::JUMP_IF_DATA_ZERO)
+            {
+                body += "[..]";
+                i = ops[i].argument;
+            }
+            else
+            {
+                ops[i].serialize(&body);
+            }
+        }
+        if (body.size() >= kMaxBodyLength)
+        {
+            body.resize(kMaxBodyLength);
+            body += "...";
+        }
+        return body;
+    }
+
+    // 64-bit FNV-1a, as 16 hex digits.
+
+    std::string fnv1a_hex(const void *data, size_t size)
+    {
+        const uint8_t *p = static_cast<const uint8_t *>(data);
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < size; ++i)
+        {
+            hash ^= p[i];
+            hash *= 0x100000001b3ull;
+        }
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+        return hex;
+    }
+
+    std::string json_string(const std::string &s)
+    {
+        std::string out = "\"";
+        for (char c : s)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+            }
+            out += c;
+        }
+        return out + "\"";
+    }
+
+    // Just enough of a JSON parser for the files write_loop_profile writes,
+    // skipping whatever it doesn't know.
+
+    class JsonReader
+    {
+    public:
+        explicit JsonReader(const std::string &text) : text_(text) {}
+
+        bool failed() const
+        {
+            return !error_.empty();
+        }
+
+        const std::string &error() const
+        {
+            return error_;
+        }
+
+        bool at_end()
+        {
+            return peek() == 0;
+        }
+
+        // Peeks at the next non-blank character; 0 at the end.
+
+        char peek()
+        {
+            while (pos_ < text_.size() && isspace(static_cast<unsigned char>(text_[pos_])))
+            {
+                ++pos_;
+            }
+            return pos_ < text_.size() ? text_[pos_] : 0;
+        }
+
+        bool expect(char c)
+        {
+            if (peek() != c)
+            {
+                fail(std::string("expected '") + c + "'");
+                return false;
+            }
+            ++pos_;
+            return true;
+        }
+
+        // Calls member(key) for every member of an object; member must
+        // consume the value.
+
+        template <typename F>
+        bool object(F member)
+        {
+            if (!expect('{'))
+            {
+                return false;
+            }
+            if (peek() == '}')
+            {
+                ++pos_;
+                return true;
+            }
+            do
+            {
+                std::string key;
+                if (!string(&key) || !expect(':') || !member(key))
+                {
+                    return false;
+                }
+            } while (peek() == ',' && ++pos_);
+            return expect('}');
+        }
+
+        template <typename F>
+        bool array(F element)
+        {
+            if (!expect('['))
+            {
+                return false;
+            }
+            if (peek() == ']')
+            {
+                ++pos_;
+                return true;
+            }
+            do
+            {
+                if (!element())
+                {
+                    return false;
+                }
+            } while (peek() == ',' && ++pos_);
+            return expect(']');
+        }
+
+        bool string(std::string *s)
+        {
+            if (!expect('"'))
+            {
+                return false;
+            }
+            s->clear();
+            while (pos_ < text_.size() && text_[pos_] != '"')
+            {
+                if (text_[pos_] == '\\' && ++pos_ == text_.size())
+                {
+                    break;
+                }
+                *s += text_[pos_++];
+            }
+            return expect('"');
+        }
+
+        template <typename T>
+        bool number(T *n)
+        {
+            peek();
+            size_t start = pos_;
+            if (pos_ < text_.size() && text_[pos_] == '-')
+            {
+                ++pos_;
+            }
+            while (pos_ < text_.size() && isdigit(static_cast<unsigned char>(text_[pos_])))
+            {
+                ++pos_;
+            }
+            std::istringstream is(text_.substr(start, pos_ - start));
+            if (!(is >> *n))
+            {
+                fail("expected an integer");
+                return false;
+            }
+            return true;
+        }
+
+        bool skip()
+        {
+            switch (peek())
+            {
+            case '{':
+                return object([this](const std::string &) { return skip(); });
+            case '[':
+                return array([this]() { return skip(); });
+            case '"':
+            {
+                std::string s;
+                return string(&s);
+            }
+            default:
+                // Numbers, true, false and null.
+                size_t start = pos_;
+                while (pos_ < text_.size() && (isalnum(static_cast<unsigned char>(text_[pos_])) ||
+                                               (text_[pos_] && strchr("+-.", text_[pos_]))))
+                {
+                    ++pos_;
+                }
+                if (pos_ == start)
+                {
+                    fail("unexpected character");
+                    return false;
+                }
+                return true;
+            }
+        }
+
+    private:
+        void fail(const std::string &what)
+        {
+            if (error_.empty())
+            {
+                error_ = what + " at offset " + std::to_string(pos_);
+            }
+        }
+
+        const std::string &text_;
+        size_t pos_ = 0;
+        std::string error_;
+    };
+
+    bool read_loop(JsonReader *json, LoopStats *loop)
+    {
+        return json->object([&](const std::string &key) {
+            if (key == "source")
+            {
+                return json->number(&loop->source);
+            }
+            if (key == "op")
+            {
+                return json->number(&loop->op);
+            }
+            if (key == "entries")
+            {
+                return json->number(&loop->entries);
+            }
+            if (key == "skips")
+            {
+                return json->number(&loop->skips);
+            }
+            if (key == "iterations")
+            {
+                return json->number(&loop->iterations);
+            }
+            if (key == "ops")
+            {
+                return json->number(&loop->ops);
+            }
+            if (key == "body")
+            {
+                return json->string(&loop->body);
+            }
+            return json->skip();
+        });
+    }
+} // namespace
+
+const LoopStats *LoopProfile::find(int64_t source) const
+{
+    for (const LoopStats &loop : loops)
+    {
+        if (loop.source == source)
+        {
+            return &loop;
+        }
+    }
+    return nullptr;
+}
+
+std::string program_hash(const Program &p)
+{
+    return fnv1a_hex(p.instructions.data(), p.instructions.size());
+}
+
+std::string loop_profile_hash(const LoopProfile &profile)
+{
+    std::vector<uint64_t> counts;
+    for (const LoopStats &loop : profile.loops)
+    {
+        counts.insert(counts.end(), {static_cast<uint64_t>(loop.source), loop.entries,
+                                     loop.skips, loop.iterations, loop.ops});
+    }
+    return fnv1a_hex(counts.data(), counts.size() * sizeof(uint64_t));
+}
+
+LoopProfiler::LoopProfiler(const std::vector<BfOp> &ops, uint32_t sample_period)
+    : ops_(ops), counts_(2 * ops.size()), scan_strides_(ops.size()),
+      sample_period_(sample_period)
+{
+    for (size_t i = 0; i < ops.size(); ++i)
+    {
+        if (ops[i].kind == BfOpKind::JUMP_IF_DATA_ZERO ||
+            ops[i].kind == BfOpKind::JUMP_IF_DATA_NOT_ZERO)
+        {
+            jump_ops_.push_back(static_cast<uint32_t>(i));
+        }
+    }
+    if (sample_period_ > 0)
+    {
+        next_interval();
+    }
+}
+
+size_t LoopProfiler::op_at(const Bytecode &bytecode, size_t position) const
+{
+    if (op_positions_.empty())
+    {
+        BytecodeReader reader(bytecode);
+        BfOp op(BfOpKind::INVALID_OP, 0);
+        for (size_t at = 0; reader.next(&op); at = reader.position())
+        {
+            op_positions_.push_back(static_cast<uint32_t>(at));
+        }
+    }
+    return std::upper_bound(op_positions_.begin(), op_positions_.end(), position) -
+           op_positions_.begin() - 1;
+}
+
+void LoopProfiler::sample(size_t op, bool taken, uint64_t strides)
+{
+    // The event that ends an interval stands for all events in it.
+    counts_[2 * op + taken] += interval_;
+    scan_strides_[op] += strides * interval_;
+    next_interval();
+}
+
+void LoopProfiler::next_interval()
+{
+    // Uniform in [1, 2N - 1], so N long on average.
+    random_state_ ^= random_state_ << 13;
+    random_state_ ^= random_state_ >> 7;
+    random_state_ ^= random_state_ << 17;
+    interval_ = 1 + static_cast<uint32_t>(random_state_ % (2 * uint64_t(sample_period_) - 1));
+    countdown_ = interval_;
+}
+
+LoopProfile LoopProfiler::report(const Program &p) const
+{
+    LoopProfile profile;
+    profile.program = program_hash(p);
+    profile.sample_period = sample_period_;
+
+    // How often each loop's body ran; the per-op executions follow from it.
+    std::vector<int64_t> scopes = op_scopes(ops_);
+    auto iterations = [&](size_t open) {
+        size_t close = ops_[open].argument;
+        return counts_[2 * close] + counts_[2 * close + 1];
+    };
+
+    std::vector<uint64_t> loop_ops(ops_.size());
+    for (size_t i = 0; i < ops_.size(); ++i)
+    {
+        uint64_t executed = scopes[i] < 0 ? 1 : iterations(scopes[i]);
+        profile.total_ops += executed;
+        profile.ops_by_kind[static_cast<int>(ops_[i].kind)] += executed;
+        if (scopes[i] >= 0)
+        {
+            loop_ops[scopes[i]] += executed;
+        }
+    }
+
+    for (size_t i = 0; i < ops_.size(); ++i)
+    {
+        bool is_scan = ops_[i].kind == BfOpKind::LOOP_MOVE_PTR;
+        if (ops_[i].kind != BfOpKind::JUMP_IF_DATA_ZERO && !is_scan)
+        {
+            continue;
+        }
+        LoopStats loop;
+        loop.source = ops_[i].source;
+        loop.op = i;
+        loop.entries = counts_[2 * i];
+        loop.skips = counts_[2 * i + 1];
+        loop.iterations = is_scan ? scan_strides_[i] : iterations(i);
+        loop.ops = is_scan ? 0 : loop_ops[i];
+        if (loop.entries + loop.skips + loop.iterations == 0)
+        {
+            continue;
+        }
+        if (is_scan)
+        {
+            ops_[i].serialize(&loop.body);
+        }
+        else
+        {
+            loop.body = loop_body(ops_, i);
+        }
+        profile.loops.push_back(loop);
+    }
+    std::stable_sort(profile.loops.begin(), profile.loops.end(),
+                     [](const LoopStats &a, const LoopStats &b) { return a.ops > b.ops; });
+    return profile;
+}
+
+void print_loop_profile(const LoopProfile &profile, std::ostream &os)
+{
+    constexpr size_t kMaxLoops = 20;
+
+    char line[256];
+    os << "* Loop profile: " << profile.total_ops << " ops, " << profile.loops.size()
+       << " loops reached";
+    if (profile.sample_period > 0)
+    {
+        os << " (estimated from one bracket in ~" << profile.sample_period << ")";
+    }
+    os << "\n";
+    snprintf(line, sizeof(line), "  %7s %14s %10s %14s %10s  %s\n", "% ops", "ops", "entries",
+             "iterations", "avg trip", "loop");
+    os << line;
+    for (size_t i = 0; i < profile.loops.size() && i < kMaxLoops; ++i)
+    {
+        const LoopStats &loop = profile.loops[i];
+        snprintf(line, sizeof(line), "  %6.2f%% %14llu %10llu %14llu %10.1f  bf_loop_%lld  %s\n",
+                 100 * profile.share(loop), static_cast<unsigned long long>(loop.ops),
+                 static_cast<unsigned long long>(loop.entries),
+                 static_cast<unsigned long long>(loop.iterations), loop.average_trip_count(),
+                 static_cast<long long>(loop.source), loop.body.c_str());
+        os << line;
+    }
+    if (profile.loops.size() > kMaxLoops)
+    {
+        os << "  ... and " << profile.loops.size() - kMaxLoops << " more loops\n";
+    }
+
+    os << "* Ops by kind:\n";
+    for (int kind = 0; kind < kNumBfOpKinds; ++kind)
+    {
+        if (profile.ops_by_kind[kind] == 0)
+        {
+            continue;
+        }
+        snprintf(line, sizeof(line), "  %-22s %14llu %6.2f%%\n",
+                 BfOpKind_name(static_cast<BfOpKind>(kind)),
+                 static_cast<unsigned long long>(profile.ops_by_kind[kind]),
+                 profile.total_ops ? 100.0 * profile.ops_by_kind[kind] / profile.total_ops : 0);
+        os << line;
+    }
+}
+
+bool write_loop_profile(const LoopProfile &profile, const std::string &path)
+{
+    std::ofstream out(path);
+    out << "{\n";
+    out << "  \"program\": " << json_string(profile.program) << ",\n";
+    out << "  \"sample_period\": " << profile.sample_period << ",\n";
+    out << "  \"total_ops\": " << profile.total_ops << ",\n";
+    out << "  \"ops_by_kind\": {";
+    const char *separator = "";
+    for (int kind = 0; kind < kNumBfOpKinds; ++kind)
+    {
+        if (profile.ops_by_kind[kind] > 0)
+        {
+            out << separator << json_string(BfOpKind_name(static_cast<BfOpKind>(kind))) << ": "
+                << profile.ops_by_kind[kind];
+            separator = ", ";
+        }
+    }
+    out << "},\n";
+    out << "  \"loops\": [";
+    separator = "\n";
+    for (const LoopStats &loop : profile.loops)
+    {
+        out << separator << "    {\"source\": " << loop.source << ", \"op\": " << loop.op
+            << ", \"entries\": " << loop.entries << ", \"skips\": " << loop.skips
+            << ", \"iterations\": " << loop.iterations << ", \"ops\": " << loop.ops
+            << ", \"body\": " << json_string(loop.body) << "}";
+        separator = ",\n";
+    }
+    out << "\n  ]\n}\n";
+    out.close();
+    return !out.fail();
+}
+
+bool read_loop_profile(const std::string &path, const Program &p, LoopProfile *profile,
+                       std::string *error)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        *error = "unable to open " + path;
+        return false;
+    }
+    std::stringstream contents;
+    contents << file.rdbuf();
+    std::string text = contents.str();
+
+    *profile = LoopProfile();
+    JsonReader json(text);
+    json.object([&](const std::string &key) {
+        if (key == "program")
+        {
+            return json.string(&profile->program);
+        }
+        if (key == "sample_period")
+        {
+            return json.number(&profile->sample_period);
+        }
+        if (key == "total_ops")
+        {
+            return json.number(&profile->total_ops);
+        }
+        if (key == "ops_by_kind")
+        {
+            return json.object([&](const std::string &name) {
+                uint64_t count;
+                if (!json.number(&count))
+                {
+                    return false;
+                }
+                for (int kind = 0; kind < kNumBfOpKinds; ++kind)
+                {
+                    if (name == BfOpKind_name(static_cast<BfOpKind>(kind)))
+                    {
+                        profile->ops_by_kind[kind] = count;
+                    }
+                }
+                return true;
+            });
+        }
+        if (key == "loops")
+        {
+            return json.array([&]() {
+                profile->loops.emplace_back();
+                return read_loop(&json, &profile->loops.back());
+            });
+        }
+        return json.skip();
+    });
+    if (json.failed() || !json.at_end())
+    {
+        *error = path + ": " + (json.failed() ? json.error() : "trailing garbage");
+        return false;
+    }
+    if (profile->program != program_hash(p))
+    {
+        *error = path + " is a profile of another program";
+        return false;
+    }
+    return true;
+}
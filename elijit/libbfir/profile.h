@@ -0,0 +1,192 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+// Loop profiler (--loop-profile), and the loop profiles it writes for
+// profile-guided optimization.
+//
+// The engine reports every bracket it executes to a LoopProfiler, which keeps
+// a taken and a not-taken counter per jump op in a flat array indexed by op,
+// and every LOOP_MOVE_PTR scan with the number of strides it moved. Nothing
+// else is counted per op: the body of a loop without its inner loops is
+// straight-line code, so how many ops a loop executes itself, and of which
+// kinds, follows from its counters and its body. With a sample period N
+// (--loop-profile-sample=N) only about one bracket in N is counted, with a
+// weight of N; the intervals between samples are randomized so that they
+// don't lock onto the period of a loop.
+//
+// The report lists the loops hottest first, by the share of all executed ops
+// that they execute themselves. It is printed as text, and written as JSON
+// for later runs to read back:
+//
+//   {
+//     "program": "<program_hash(p)>",
+//     "sample_period": 0,
+//     "total_ops": 1234,
+//     "ops_by_kind": {"INC_PTR": 10, ...},
+//     "loops": [
+//       {"source": 40, "op": 12, "entries": 3, "skips": 0, "iterations": 300,
+//        "ops": 900, "body": "a1@1 a-1"},
+//       ...
+//     ]
+//   }
+//
+// Loops are known by "source", the position of their '[' in
+// Program::instructions, so that a profile still applies when the optimizer
+// numbers the ops differently from the run that wrote it. Loops the optimizer
+// replaced by a LOOP_MOVE_PTR scan are listed as well, with the strides
+// moved as their iterations; their op counts toward the enclosing loop.
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "bfir.h"
+#include "bytecode.h"
+#include "parser.h"
+
+// What the profile says about one loop.
+
+struct LoopStats
+{
+    // Position of the loop's '[' in Program::instructions, and its index in
+    // the ops of the profiled run.
+    int64_t source = -1;
+    int64_t op = -1;
+
+    // Times the loop was entered, times its '[' found the cell zero and
+    // skipped it, and times its body ran.
+    uint64_t entries = 0;
+    uint64_t skips = 0;
+    uint64_t iterations = 0;
+
+    // Ops the loop executed itself, i.e. not counting its inner loops; 0 for
+    // scans.
+    uint64_t ops = 0;
+
+    // The body, one BfOp::serialize per op, with inner loops as "[..]".
+    std::string body;
+
+    double average_trip_count() const
+    {
+        return entries ? static_cast<double>(iterations) / entries : 0;
+    }
+};
+
+struct LoopProfile
+{
+    // program_hash() of the profiled program.
+    std::string program;
+
+    uint64_t sample_period = 0;
+    uint64_t total_ops = 0;
+    uint64_t ops_by_kind[kNumBfOpKinds] = {};
+
+    // Hottest first, scans last.
+    std::vector<LoopStats> loops;
+
+    // The loop whose '[' is at source, or nullptr if it never ran.
+    const LoopStats *find(int64_t source) const;
+
+    // Share of all executed ops executed by the given loop, from 0 to 1.
+    double share(const LoopStats &loop) const
+    {
+        return total_ops ? static_cast<double>(loop.ops) / total_ops : 0;
+    }
+};
+
+// Identifies a program, so a profile isn't applied to a different one.
+
+std::string program_hash(const Program &p);
+
+// Identifies the counts in a profile, e.g. for code cache keys.
+
+std::string loop_profile_hash(const LoopProfile &profile);
+
+class LoopProfiler
+{
+public:
+    // ops are the ops the engine runs; sample_period 0 counts every bracket.
+
+    LoopProfiler(const std::vector<BfOp> &ops, uint32_t sample_period);
+
+    // Called for every bracket the engine executes: op is its index in ops,
+    // taken whether it jumped. On the engine's hot path, hence inline.
+
+    void branch(size_t op, bool taken)
+    {
+        if (sample_period_ == 0)
+        {
+            ++counts_[2 * op + taken];
+        }
+        else if (--countdown_ == 0)
+        {
+            sample(op, taken);
+        }
+    }
+
+    // Called for every LOOP_MOVE_PTR the engine executes, with the number of
+    // strides it moved the data pointer.
+
+    void scan(size_t op, uint64_t strides)
+    {
+        if (sample_period_ == 0)
+        {
+            ++counts_[2 * op + (strides == 0)];
+            scan_strides_[op] += strides;
+        }
+        else if (--countdown_ == 0)
+        {
+            sample(op, strides == 0, strides);
+        }
+    }
+
+    // The index in ops of the jump op with the given jump_targets index, for
+    // engines that run bytecode.
+
+    size_t jump_op(uint64_t jump) const
+    {
+        return jump_ops_[jump];
+    }
+
+    // The index in ops of the op at the given position in bytecode, the
+    // encoding of ops. Slower than jump_op, so only for scans.
+
+    size_t op_at(const Bytecode &bytecode, size_t position) const;
+
+    LoopProfile report(const Program &p) const;
+
+private:
+    void sample(size_t op, bool taken, uint64_t strides = 0);
+    void next_interval();
+
+    std::vector<BfOp> ops_;
+    std::vector<uint32_t> jump_ops_;
+
+    // counts_[2 * op + taken], where a scan is taken if it doesn't move.
+    std::vector<uint64_t> counts_;
+    std::vector<uint64_t> scan_strides_;
+    mutable std::vector<uint32_t> op_positions_;
+
+    uint32_t sample_period_;
+    uint32_t countdown_ = 0;
+    uint32_t interval_ = 0;
+    uint64_t random_state_ = 0x9E3779B97F4A7C15ull;
+};
+
+// Prints the hottest loops and the ops by kind.
+
+void print_loop_profile(const LoopProfile &profile, std::ostream &os);
+
+// Returns false if path can't be written.
+
+bool write_loop_profile(const LoopProfile &profile, const std::string &path);
+
+// Reads a profile written by write_loop_profile for the program p. Returns
+// false, with the reason in *error, if the file can't be read or parsed or
+// was written for another program.
+
+bool read_loop_profile(const std::string &path, const Program &p, LoopProfile *profile,
+                       std::string *error);
+
+#endif /*PROFILE_H*/
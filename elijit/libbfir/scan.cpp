@@ -0,0 +1,208 @@
+#include "scan.h"
+#include "utils.h"
+
+#include <cstddef>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace
+{
+
+    template <typename Cell>
+    uint8_t *scan_scalar(uint8_t *p, int64_t stride)
+    {
+        while (*reinterpret_cast<Cell *>(p))
+        {
+            p += stride;
+        }
+        return p;
+    }
+
+#if defined(__x86_64__)
+
+    // bits[step] has every bit whose index is a multiple of step set.
+
+    struct StridePatterns
+    {
+        uint64_t bits[33];
+    };
+
+    constexpr StridePatterns make_stride_patterns()
+    {
+        StridePatterns patterns{};
+        for (int step = 1; step <= 32; ++step)
+        {
+            for (int i = 0; i < 64; i += step)
+            {
+                patterns.bits[step] |= uint64_t(1) << i;
+            }
+        }
+        return patterns;
+    }
+
+    constexpr StridePatterns kStridePatterns = make_stride_patterns();
+
+    // Walks a scan one aligned chunk of kWidth bytes at a time. The cells the
+    // scan visits are the bits of candidates_, a pattern that repeats every
+    // step_ bits; moving to the next chunk only shifts its phase.
+
+    template <int kWidth, int kCellSize>
+    class ScanCursor
+    {
+    public:
+        ScanCursor(uint8_t *p, int64_t stride)
+            : forward_(stride > 0), step_(static_cast<int>(forward_ ? stride : -stride))
+        {
+            chunk_ = reinterpret_cast<uint8_t *>(reinterpret_cast<uintptr_t>(p) &
+                                                 ~static_cast<uintptr_t>(kWidth - 1));
+            int first = static_cast<int>(p - chunk_);
+            phase_ = first % step_;
+
+            // The bit positions of the cells drop by kWidth from one chunk
+            // to the next going forward, and rise by kWidth going back.
+            phase_step_ = forward_ ? (step_ - kWidth % step_) % step_ : kWidth % step_;
+
+            // In the first chunk only the cells from p on count.
+            uint64_t from_p = forward_ ? ~uint64_t(0) << first : (uint64_t(2) << first) - 1;
+            candidates_ = (kStridePatterns.bits[step_] << phase_) & from_p & kChunkMask;
+        }
+
+        const uint8_t *chunk() const
+        {
+            return chunk_;
+        }
+
+        // Takes the mask of the zero bytes in the chunk and returns the first
+        // cell the scan visits that is zero, or nullptr if there is none.
+
+        uint8_t *match(uint32_t zero_bytes) const
+        {
+            // Bit i of zero is set if the cell starting at byte i is zero.
+            uint64_t zero = zero_bytes;
+            if (kCellSize >= 2)
+            {
+                zero &= zero >> 1;
+            }
+            if (kCellSize == 4)
+            {
+                zero &= zero >> 2;
+            }
+
+            uint64_t hits = zero & candidates_;
+            if (!hits)
+            {
+                return nullptr;
+            }
+            return chunk_ + (forward_ ? __builtin_ctzll(hits) : 63 - __builtin_clzll(hits));
+        }
+
+        void advance()
+        {
+            chunk_ += forward_ ? kWidth : -kWidth;
+            phase_ += phase_step_;
+            if (phase_ >= step_)
+            {
+                phase_ -= step_;
+            }
+            candidates_ = (kStridePatterns.bits[step_] << phase_) & kChunkMask;
+        }
+
+    private:
+        static constexpr uint64_t kChunkMask = (uint64_t(1) << kWidth) - 1;
+
+        bool forward_;
+        int step_;
+        int phase_;
+        int phase_step_;
+        uint8_t *chunk_;
+        uint64_t candidates_;
+    };
+
+    template <typename Cell>
+    uint8_t *scan_sse2(uint8_t *p, int64_t stride)
+    {
+        if (stride > 16 || stride < -16)
+        {
+            return scan_scalar<Cell>(p, stride);
+        }
+        ScanCursor<16, sizeof(Cell)> cursor(p, stride);
+        for (;;)
+        {
+            __m128i cells = _mm_load_si128(reinterpret_cast<const __m128i *>(cursor.chunk()));
+            uint32_t zero = _mm_movemask_epi8(_mm_cmpeq_epi8(cells, _mm_setzero_si128()));
+            if (uint8_t *hit = cursor.match(zero))
+            {
+                return hit;
+            }
+            cursor.advance();
+        }
+    }
+
+    template <typename Cell>
+    __attribute__((target("avx2"))) uint8_t *scan_avx2(uint8_t *p, int64_t stride)
+    {
+        if (stride > kScanMaxVectorStride || stride < -kScanMaxVectorStride)
+        {
+            return scan_scalar<Cell>(p, stride);
+        }
+        ScanCursor<32, sizeof(Cell)> cursor(p, stride);
+        for (;;)
+        {
+            __m256i cells = _mm256_load_si256(reinterpret_cast<const __m256i *>(cursor.chunk()));
+            uint32_t zero = _mm256_movemask_epi8(_mm256_cmpeq_epi8(cells, _mm256_setzero_si256()));
+            if (uint8_t *hit = cursor.match(zero))
+            {
+                return hit;
+            }
+            cursor.advance();
+        }
+    }
+
+    bool has_avx2()
+    {
+        static const bool avx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+        return avx2;
+    }
+
+    template <typename Cell>
+    ScanForZero pick_kernel()
+    {
+        return has_avx2() ? scan_avx2<Cell> : scan_sse2<Cell>;
+    }
+
+#else
+
+    template <typename Cell>
+    ScanForZero pick_kernel()
+    {
+        return scan_scalar<Cell>;
+    }
+
+#endif
+} // namespace
+
+ScanForZero scan_for_zero_kernel(int cell_size)
+{
+    switch (cell_size)
+    {
+    case 1:
+        return pick_kernel<uint8_t>();
+    case 2:
+        return pick_kernel<uint16_t>();
+    case 4:
+        return pick_kernel<uint32_t>();
+    }
+    DIE << "no scan kernel for " << cell_size << "-byte cells";
+    return nullptr;
+}
+
+const char *scan_for_zero_isa()
+{
+#if defined(__x86_64__)
+    return has_avx2() ? "avx2" : "sse2";
+#else
+    return "scalar";
+#endif
+}
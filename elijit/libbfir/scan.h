@@ -0,0 +1,59 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+// Zero search for LOOP_MOVE_PTR ("[>]", "[<<<<]"), shared by optinterp2 and
+// the JITs.
+//
+// Instead of moving one stride at a time, the kernels compare a whole vector
+// of cells against zero (pcmpeqb + pmovmskb) and pick the first zero cell
+// that the loop would have stopped on out of the resulting bit mask. Strides
+// of up to a vector are handled this way; longer ones only see one cell per
+// vector anyway and use the scalar loop. The kernel is picked once, at run
+// time, for the host CPU: AVX2 (32 bytes) if available, SSE2 (16 bytes)
+// otherwise, and scalar code on anything that isn't x86-64.
+//
+// Loads are aligned to the vector width, so they never cross a page: a load
+// only touches the page of a cell that the scalar loop would have read as
+// well. That keeps the tape's guards and on-demand growth (see tape.h)
+// working as for scalar code, without padding around the tape; the only
+// difference is that a scan running off the tape reports the first cell of
+// the vector that hit the guard.
+
+#include <cstdint>
+
+// Returns the address of the first cell at p, p + stride, p + 2 * stride, ...
+// that is zero. The stride is in bytes, nonzero and a multiple of the cell
+// width, and p must be aligned to the cell width.
+
+using ScanForZero = uint8_t *(*)(uint8_t *p, int64_t stride);
+
+// Longest stride, in bytes, that any kernel scans with vectors. Longer scans
+// visit one cell per load at best, so JITs may as well inline those.
+
+constexpr int64_t kScanMaxVectorStride = 32;
+
+// The kernel for cells of cell_size (1, 2 or 4) bytes on this CPU.
+
+ScanForZero scan_for_zero_kernel(int cell_size);
+
+// Name of the instruction set the kernels use ("avx2", "sse2" or "scalar"),
+// for verbose output.
+
+const char *scan_for_zero_isa();
+
+// Typed entry point for the interpreters; stride counts cells. Most scans end
+// where they start, so that is checked before calling the kernel.
+
+template <typename Cell>
+Cell *scan_for_zero(Cell *p, int64_t stride)
+{
+    if (!*p)
+    {
+        return p;
+    }
+    static const ScanForZero kernel = scan_for_zero_kernel(sizeof(Cell));
+    return reinterpret_cast<Cell *>(
+        kernel(reinterpret_cast<uint8_t *>(p), stride * static_cast<int64_t>(sizeof(Cell))));
+}
+
+#endif /*SCAN_H*/
@@ -0,0 +1,388 @@
+#include "tape.h"
+#include "bfio.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+namespace
+{
+
+    // Tapes the SIGSEGV handler knows about, in chunks of slots that are
+    // added as more tapes are alive at once and never freed, so the handler
+    // can walk them without locks or allocation. A tape takes any free slot.
+
+    constexpr int kSlotsPerChunk = 64;
+
+    struct TapeSlots
+    {
+        std::atomic<Tape *> tapes[kSlotsPerChunk] = {};
+        std::atomic<TapeSlots *> next{nullptr};
+    };
+
+    TapeSlots live_tapes;
+
+    void register_tape(Tape *tape)
+    {
+        for (TapeSlots *chunk = &live_tapes;;)
+        {
+            for (auto &slot : chunk->tapes)
+            {
+                Tape *expected = nullptr;
+                if (slot.load(std::memory_order_relaxed) == nullptr &&
+                    slot.compare_exchange_strong(expected, tape, std::memory_order_release))
+                {
+                    return;
+                }
+            }
+
+            TapeSlots *next = chunk->next.load(std::memory_order_acquire);
+            if (!next)
+            {
+                // Another thread may add the chunk first; then use its chunk.
+                TapeSlots *added = new TapeSlots;
+                if (chunk->next.compare_exchange_strong(next, added, std::memory_order_acq_rel))
+                {
+                    next = added;
+                }
+                else
+                {
+                    delete added;
+                }
+            }
+            chunk = next;
+        }
+    }
+
+    void unregister_tape(Tape *tape)
+    {
+        for (TapeSlots *chunk = &live_tapes; chunk; chunk = chunk->next.load(std::memory_order_acquire))
+        {
+            for (auto &slot : chunk->tapes)
+            {
+                Tape *expected = tape;
+                if (slot.compare_exchange_strong(expected, nullptr))
+                {
+                    return;
+                }
+            }
+        }
+    }
+
+    struct sigaction previous_action;
+
+    thread_local sigjmp_buf *overflow_jump = nullptr;
+
+    size_t page_size()
+    {
+        static const size_t size = sysconf(_SC_PAGESIZE);
+        return size;
+    }
+
+    size_t round_up(size_t n, size_t align)
+    {
+        return (n + align - 1) / align * align;
+    }
+
+    // Formats into buf without touching the heap; returns the end.
+
+    char *append(char *p, const char *s)
+    {
+        while (*s)
+        {
+            *p++ = *s++;
+        }
+        return p;
+    }
+
+    char *append_int(char *p, int64_t v)
+    {
+        char digits[24];
+        int n = 0;
+        uint64_t u = v < 0 ? -static_cast<uint64_t>(v) : v;
+        do
+        {
+            digits[n++] = '0' + u % 10;
+            u /= 10;
+        } while (u);
+        if (v < 0)
+        {
+            *p++ = '-';
+        }
+        while (n)
+        {
+            *p++ = digits[--n];
+        }
+        return p;
+    }
+
+    // bfio_flush without the error handling, which may allocate.
+
+    void write_pending_output(BfIo *io)
+    {
+        const uint8_t *p = io->out_buffer;
+        while (p < io->out_cursor)
+        {
+            ssize_t n = write(io->out_fd, p, io->out_cursor - p);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return;
+            }
+            p += n;
+        }
+    }
+
+    const void *faulting_pc(void *ucontext)
+    {
+#if defined(__x86_64__)
+        return reinterpret_cast<const void *>(
+            static_cast<ucontext_t *>(ucontext)->uc_mcontext.gregs[REG_RIP]);
+#else
+        (void)ucontext;
+        return nullptr;
+#endif
+    }
+
+    void chain_to_previous(int sig, siginfo_t *info, void *ucontext)
+    {
+        if (previous_action.sa_flags & SA_SIGINFO)
+        {
+            previous_action.sa_sigaction(sig, info, ucontext);
+            return;
+        }
+        if (previous_action.sa_handler == SIG_IGN)
+        {
+            return;
+        }
+        if (previous_action.sa_handler != SIG_DFL)
+        {
+            previous_action.sa_handler(sig);
+            return;
+        }
+        // Returning re-executes the faulting instruction, which now crashes
+        // the process the usual way.
+        signal(sig, SIG_DFL);
+    }
+} // namespace
+
+struct TapeFaultHandler
+{
+    static void report_overflow(Tape *tape, uint8_t *addr, void *ucontext)
+    {
+        if (overflow_jump)
+        {
+            siglongjmp(*overflow_jump, kTapeOverflowJump);
+        }
+
+        if (tape->io_)
+        {
+            write_pending_output(tape->io_);
+        }
+
+        char buf[128];
+        char *p = append(buf, "tape overflow at ");
+
+        int64_t op = -1;
+        if (tape->locator_)
+        {
+            op = tape->locator_(faulting_pc(ucontext), tape->locator_context_);
+        }
+        if (op >= 0)
+        {
+            p = append(p, "op ");
+            p = append_int(p, op);
+            p = append(p, ", ");
+        }
+        // Round towards the cell below for addresses left of the tape.
+        int64_t byte = addr - tape->cells_;
+        int64_t cell_size = tape->cell_size_;
+        int64_t cell = byte >= 0 ? byte / cell_size : -((-byte + cell_size - 1) / cell_size);
+
+        p = append(p, "cell ");
+        p = append_int(p, cell);
+        p = append(p, "\n");
+
+        ssize_t unused = write(2, buf, p - buf);
+        (void)unused;
+        _exit(1);
+    }
+
+    // Commits enough pages to cover addr; false if it is beyond kTapeMaxSize.
+
+    static bool grow(Tape *tape, uint8_t *addr)
+    {
+        size_t needed = addr - tape->cells_ + 1;
+        if (needed > kTapeMaxSize)
+        {
+            return false;
+        }
+
+        size_t new_size = tape->size_;
+        while (new_size < needed)
+        {
+            new_size *= 2;
+        }
+        new_size = std::min(round_up(new_size, page_size()), kTapeMaxSize);
+
+        if (mprotect(tape->cells_ + tape->size_, new_size - tape->size_,
+                     PROT_READ | PROT_WRITE) != 0)
+        {
+            return false;
+        }
+        tape->size_ = new_size;
+        return true;
+    }
+
+    static void handle(int sig, siginfo_t *info, void *ucontext)
+    {
+        uint8_t *addr = static_cast<uint8_t *>(info->si_addr);
+
+        for (TapeSlots *chunk = &live_tapes; chunk; chunk = chunk->next.load(std::memory_order_acquire))
+        {
+            for (auto &slot : chunk->tapes)
+            {
+                Tape *tape = slot.load(std::memory_order_acquire);
+                if (!tape || addr < tape->reservation_ ||
+                    addr >= tape->reservation_ + tape->reservation_size_)
+                {
+                    continue;
+                }
+
+                if (addr >= tape->cells_ + tape->size_ && grow(tape, addr))
+                {
+                    return;
+                }
+                report_overflow(tape, addr, ucontext);
+            }
+        }
+
+        chain_to_previous(sig, info, ucontext);
+    }
+
+    // Installs the handler once, the first time a tape is created.
+
+    static void install()
+    {
+        static bool installed = (install_handler(), true);
+        (void)installed;
+    }
+
+    static void install_handler()
+    {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = handle;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGSEGV, &action, &previous_action) != 0)
+        {
+            DIE << "sigaction failed: " << strerror(errno);
+        }
+    }
+};
+
+size_t max_pointer_move(const std::string &instructions)
+{
+    return std::count_if(instructions.begin(), instructions.end(),
+                         [](char c) { return c == '<' || c == '>'; });
+}
+
+size_t tape_guard_size(size_t max_move, size_t cell_size)
+{
+    return std::max(kTapeGuardSize, 2 * max_move * cell_size);
+}
+
+Tape::Tape(size_t cell_size, size_t max_move) : cell_size_(cell_size)
+{
+    size_t guard = round_up(tape_guard_size(max_move, cell_size), page_size());
+    reservation_size_ = guard + kTapeMaxSize + guard;
+
+    void *p = mmap(nullptr, reservation_size_, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        DIE << "unable to reserve tape: " << strerror(errno);
+    }
+    reservation_ = static_cast<uint8_t *>(p);
+    cells_ = reservation_ + guard;
+    size_ = round_up(kTapeInitialSize, page_size());
+
+    if (mprotect(cells_, size_, PROT_READ | PROT_WRITE) != 0)
+    {
+        DIE << "unable to commit tape: " << strerror(errno);
+    }
+
+    TapeFaultHandler::install();
+    register_tape(this);
+}
+
+Tape::~Tape()
+{
+    unregister_tape(this);
+    munmap(reservation_, reservation_size_);
+}
+
+void Tape::write_state(const std::string &path, size_t dataptr) const
+{
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out)
+    {
+        DIE << "unable to open " << path << ": " << strerror(errno);
+    }
+
+    fprintf(out, "dataptr %zu\n", dataptr);
+    for (size_t i = 0; i < size_ / cell_size_; ++i)
+    {
+        uint32_t value = 0;
+        memcpy(&value, cells_ + i * cell_size_, cell_size_);
+        if (value)
+        {
+            fprintf(out, "%zu %u\n", i, value);
+        }
+    }
+
+    if (fclose(out) != 0)
+    {
+        DIE << "unable to write " << path;
+    }
+}
+
+void set_tape_overflow_jump(sigjmp_buf *jump)
+{
+    overflow_jump = jump;
+}
+
+int64_t jit_op_map_locate(const void *pc, const void *context)
+{
+    const JitOpMap *map = static_cast<const JitOpMap *>(context);
+    const uint8_t *addr = static_cast<const uint8_t *>(pc);
+    if (addr < map->code || addr >= map->code + map->code_size)
+    {
+        return -1;
+    }
+
+    // The op whose code starts last at or before addr; of ops that emit no
+    // code, the last one.
+    uint32_t offset = addr - map->code;
+    int64_t op = -1;
+    for (size_t i = 0; i < map->op_offsets.size(); ++i)
+    {
+        if (map->op_offsets[i] <= offset && (op < 0 || map->op_offsets[i] >= map->op_offsets[op]))
+        {
+            op = i;
+        }
+    }
+    return op;
+}
@@ -0,0 +1,162 @@
+#ifndef TAPE_H
+#define TAPE_H
+
+// The data tape of a running BF program.
+//
+// The tape reserves a large range of address space up front and only makes
+// the beginning of it accessible:
+//
+//   [ left guard | committed cells ... | reserved, PROT_NONE ... | right guard ]
+//                ^ data()
+//
+// Engines access cells without any bounds checks. A SIGSEGV handler catches
+// accesses outside the committed cells: past the end it commits more pages
+// and lets the faulting instruction retry, so the tape grows on demand up to
+// kTapeMaxSize; in either guard it reports a tape overflow and exits, or jumps
+// back to the host (see set_tape_overflow_jump). Since the reservation never
+// moves, pointers into the tape stay valid as it grows.
+
+#include <csetjmp>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Cells accessible from the start; covers the classic 30000 cell tape.
+
+constexpr size_t kTapeInitialSize = 32 * 1024;
+
+// Growth stops here; a pointer running past it is a tape overflow.
+
+constexpr size_t kTapeMaxSize = size_t(256) << 20;
+
+// The smallest guard on either side of a tape; large enough to catch folded op
+// offsets that point far below cell 0 in most programs.
+
+constexpr size_t kTapeGuardSize = 1024 * 1024;
+
+// The farthest, in cells, a program can move the data pointer between two
+// accesses to the tape: all its '<' and '>' together, however an engine folds
+// them into pointer moves, op offsets and scan strides. Every loop iteration
+// tests a cell, so no move runs twice without an access in between.
+
+size_t max_pointer_move(const std::string &instructions);
+
+// The guard size in bytes for a program whose moves are bounded by max_move
+// cells of cell_size bytes. A move that is larger than the guard could jump
+// over it without a fault, so the guard is twice that, to leave room for
+// engines that reorder accesses within a block, and never less than
+// kTapeGuardSize.
+
+size_t tape_guard_size(size_t max_move, size_t cell_size);
+
+// Maps the address of a faulting instruction to the index of the op that was
+// executing, or returns -1 when it doesn't know. Called from the signal
+// handler, so it must not allocate.
+
+using TapeFaultLocator = int64_t (*)(const void *pc, const void *context);
+
+struct BfIo;
+
+class Tape
+{
+public:
+    // cell_size is the width of a cell in bytes; it only affects how
+    // overflows are reported and how large the guards are. Sizes are always
+    // in bytes. max_move is the program's max_pointer_move; the guards are
+    // sized so that the program can't move past them without touching them.
+
+    explicit Tape(size_t cell_size = 1, size_t max_move = 0);
+    ~Tape();
+
+    Tape(const Tape &) = delete;
+    Tape &operator=(const Tape &) = delete;
+
+    uint8_t *data()
+    {
+        return cells_;
+    }
+
+    // Number of cells committed so far; all of them are accessible.
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    uint8_t &operator[](size_t i)
+    {
+        return cells_[i];
+    }
+
+    // The tape as an array of wider cells.
+
+    template <typename Cell>
+    Cell *cells()
+    {
+        return reinterpret_cast<Cell *>(cells_);
+    }
+
+    // Lets JITs report which op overflowed the tape.
+
+    void set_fault_locator(TapeFaultLocator locator, const void *context)
+    {
+        locator_ = locator;
+        locator_context_ = context;
+    }
+
+    // The I/O of the program running on the tape. Output it has buffered is
+    // written out before an overflow is reported, so that exiting doesn't
+    // lose it.
+
+    void set_io(BfIo *io)
+    {
+        io_ = io;
+    }
+
+    // Writes the state a program ended in to path (--dump-state), so bffuzz
+    // can compare engines: "dataptr N" on the first line, then "I V" for
+    // every nonzero cell I, in order. Cells are numbered from where the
+    // program started.
+
+    void write_state(const std::string &path, size_t dataptr) const;
+
+private:
+    friend struct TapeFaultHandler;
+
+    uint8_t *reservation_;
+    size_t reservation_size_;
+    uint8_t *cells_;
+    volatile size_t size_;
+    size_t cell_size_;
+    TapeFaultLocator locator_ = nullptr;
+    const void *locator_context_ = nullptr;
+    BfIo *io_ = nullptr;
+};
+
+// Maps JIT code back to ops: op_offsets[i] is where the code of op i starts,
+// relative to code, and it runs up to the next op's code in address order.
+// The offsets are usually ascending, but JITs may move code out of line. JITs
+// fill it in while emitting and pass it to Tape::set_fault_locator together
+// with jit_op_map_locate.
+
+struct JitOpMap
+{
+    const uint8_t *code = nullptr;
+    size_t code_size = 0;
+    std::vector<uint32_t> op_offsets;
+};
+
+int64_t jit_op_map_locate(const void *pc, const void *context);
+
+// Lets a long-running host survive tape overflows. While a jump buffer is set
+// for the calling thread, an overflow of a tape on that thread siglongjmps to
+// it with kTapeOverflowJump instead of reporting and exiting. The buffer must
+// be filled in by sigsetjmp(buf, 1) in a frame that is still live; pass
+// nullptr to go back to exiting.
+
+constexpr int kTapeOverflowJump = 1;
+
+void set_tape_overflow_jump(sigjmp_buf *jump);
+
+#endif /*TAPE_H*/
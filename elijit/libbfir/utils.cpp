@@ -0,0 +1,294 @@
+// Some simple C++ utils
+
+#include "utils.h"
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+namespace internal
+{
+
+    FatalLogMessage::~FatalLogMessage()
+    {
+        fprintf(stderr, "Fatal error: %s\n", str().c_str());
+        exit(EXIT_FAILURE);
+    }
+} // namespace internal
+
+Timer::Timer() : t1_(std::chrono::high_resolution_clock::now()) {}
+
+double Timer::elapsed()
+{
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<double> elapsed = t2 - t1_;
+
+    return elapsed.count();
+}
+
+namespace
+{
+
+    // Constructed during static initialization, i.e. about when the process
+    // started.
+    Timer process_timer;
+    double run_start_seconds = -1;
+
+    void usage_and_exit(const std::string &progname, uint32_t features)
+    {
+        std::cout << "Expecting" << progname << " [flags] <BF file>\n";
+        std::cout << "\nSupported flags:\n";
+        std::cout << " --verbose        enable verbose output\n";
+        std::cout << " --cell-bits=N    width of a tape cell: 8 (default), 16 or 32\n";
+        std::cout << " --report-times   print compile and run time to stderr\n";
+        std::cout << " --dump-state=FILE\n";
+        std::cout << "                  write the final data pointer and tape to FILE\n";
+        if (features & kFeatureCodeCache)
+        {
+            std::cout << " --code-cache[=DIR]\n";
+            std::cout << "                  reuse JIT-compiled code across runs, stored in DIR\n";
+            std::cout << "                  (default: $XDG_CACHE_HOME/elijit or ~/.cache/elijit)\n";
+        }
+        if (features & kFeatureBatch)
+        {
+            std::cout << " --batch=DIR|MANIFEST\n";
+            std::cout << "                  run the program on every input in DIR (output to\n";
+            std::cout << "                  DIR.out/) or listed in MANIFEST, in parallel\n";
+            std::cout << " --threads=N      worker threads for --batch (default: one per CPU)\n";
+        }
+        if (features & kFeaturePerf)
+        {
+            std::cout << " --perf-map       list the JIT code's BF loops in /tmp/perf-<pid>.map\n";
+            std::cout << " --jitdump        write the JIT code with line info to /tmp/jit-<pid>.dump,\n";
+            std::cout << "                  for perf inject --jit\n";
+        }
+        if (features & kFeatureLoopProfile)
+        {
+            std::cout << " --loop-profile[=FILE]\n";
+            std::cout << "                  print the hottest loops to stderr, and write them to FILE\n";
+            std::cout << "                  as JSON\n";
+            std::cout << " --loop-profile-sample=N\n";
+            std::cout << "                  profile loops by sampling one bracket in about N\n";
+        }
+        if (features & kFeatureProfile)
+        {
+            std::cout << " --profile=FILE   optimize for the loop profile in FILE\n";
+        }
+        if (features & kFeatureEmit)
+        {
+            std::cout << " --emit-exe=FILE  write the program as a static executable instead of\n";
+            std::cout << "                  running it\n";
+            std::cout << " --emit-obj=FILE  write the program as an object file defining bf_program\n";
+            std::cout << "                  instead of running it\n";
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    // Dies if flag belongs to a feature the engine doesn't support.
+
+    void require_feature(uint32_t features, uint32_t feature, const std::string &flag,
+                         const std::string &progname)
+    {
+        if (!(features & feature))
+        {
+            DIE << flag << " is not supported by " << progname;
+        }
+    }
+
+    int parse_cell_bits(const std::string &value)
+    {
+        if (value == "8" || value == "16" || value == "32")
+        {
+            return std::stoi(value);
+        }
+        DIE << "--cell-bits must be 8, 16 or 32, got '" << value << "'";
+        return 0;
+    }
+
+    int parse_batch_threads(const std::string &value)
+    {
+        char *end;
+        long n = strtol(value.c_str(), &end, 10);
+        if (value.empty() || *end || n < 1 || n > 65536)
+        {
+            DIE << "--threads must be between 1 and 65536, got '" << value << "'";
+        }
+        return static_cast<int>(n);
+    }
+
+    uint32_t parse_loop_profile_sample(const std::string &value)
+    {
+        char *end;
+        long n = strtol(value.c_str(), &end, 10);
+        if (value.empty() || *end || n < 1 || n > 1000000)
+        {
+            DIE << "--loop-profile-sample must be between 1 and 1000000, got '" << value << "'";
+        }
+        return static_cast<uint32_t>(n);
+    }
+
+    std::string default_code_cache_dir()
+    {
+        const char *xdg_cache_home = getenv("XDG_CACHE_HOME");
+        if (xdg_cache_home && *xdg_cache_home)
+        {
+            return std::string(xdg_cache_home) + "/elijit";
+        }
+        const char *home = getenv("HOME");
+        if (!home || !*home)
+        {
+            DIE << "--code-cache needs a DIR when neither $XDG_CACHE_HOME nor $HOME is set";
+        }
+        return std::string(home) + "/.cache/elijit";
+    }
+} // namespace
+
+Options parse_command_line(int argc, const char **argv, uint32_t features)
+{
+    Options options;
+    std::string progname = argv[0];
+
+    // This loop handles flags that optionally come before the actual argument
+    // When it's done, arg_i will point to the first non-flag argument
+
+    int arg_i = 1;
+    for (; arg_i < argc; ++arg_i)
+    {
+        std::string arg = argv[arg_i];
+        if (!(arg.size() > 2 && arg[0] == '-' && arg[1] == '-'))
+        {
+            // If this arg doesn't start with a --, it's not a flag. So we expect it
+            // to be the BF program
+
+            break;
+        }
+        else if (arg == "--verbose")
+        {
+            options.verbose = true;
+        }
+        else if (arg.compare(0, 12, "--cell-bits=") == 0)
+        {
+            options.cell_bits = parse_cell_bits(arg.substr(12));
+        }
+        else if (arg == "--cell-bits" && arg_i + 1 < argc)
+        {
+            options.cell_bits = parse_cell_bits(argv[++arg_i]);
+        }
+        else if (arg == "--report-times")
+        {
+            options.report_times = true;
+        }
+        else if (arg.compare(0, 13, "--dump-state=") == 0 && arg.size() > 13)
+        {
+            options.dump_state_path = arg.substr(13);
+        }
+        else if (arg == "--code-cache")
+        {
+            require_feature(features, kFeatureCodeCache, "--code-cache", progname);
+            options.code_cache_dir = default_code_cache_dir();
+        }
+        else if (arg.compare(0, 13, "--code-cache=") == 0 && arg.size() > 13)
+        {
+            require_feature(features, kFeatureCodeCache, "--code-cache", progname);
+            options.code_cache_dir = arg.substr(13);
+        }
+        else if (arg.compare(0, 8, "--batch=") == 0 && arg.size() > 8)
+        {
+            require_feature(features, kFeatureBatch, "--batch", progname);
+            options.batch_path = arg.substr(8);
+        }
+        else if (arg.compare(0, 10, "--threads=") == 0)
+        {
+            require_feature(features, kFeatureBatch, "--threads", progname);
+            options.batch_threads = parse_batch_threads(arg.substr(10));
+        }
+        else if (arg == "--perf-map")
+        {
+            require_feature(features, kFeaturePerf, "--perf-map", progname);
+            options.perf_map = true;
+        }
+        else if (arg == "--jitdump")
+        {
+            require_feature(features, kFeaturePerf, "--jitdump", progname);
+            options.jitdump = true;
+        }
+        else if (arg == "--loop-profile")
+        {
+            require_feature(features, kFeatureLoopProfile, "--loop-profile", progname);
+            options.loop_profile = true;
+        }
+        else if (arg.compare(0, 15, "--loop-profile=") == 0 && arg.size() > 15)
+        {
+            require_feature(features, kFeatureLoopProfile, "--loop-profile", progname);
+            options.loop_profile = true;
+            options.loop_profile_path = arg.substr(15);
+        }
+        else if (arg.compare(0, 22, "--loop-profile-sample=") == 0)
+        {
+            require_feature(features, kFeatureLoopProfile, "--loop-profile-sample", progname);
+            options.loop_profile = true;
+            options.loop_profile_sample = parse_loop_profile_sample(arg.substr(22));
+        }
+        else if (arg.compare(0, 10, "--profile=") == 0 && arg.size() > 10)
+        {
+            require_feature(features, kFeatureProfile, "--profile", progname);
+            options.profile_path = arg.substr(10);
+        }
+        else if (arg == "--profile" && arg_i + 1 < argc)
+        {
+            require_feature(features, kFeatureProfile, "--profile", progname);
+            options.profile_path = argv[++arg_i];
+        }
+        else if (arg.compare(0, 11, "--emit-exe=") == 0 && arg.size() > 11)
+        {
+            require_feature(features, kFeatureEmit, "--emit-exe", progname);
+            options.emit_exe_path = arg.substr(11);
+        }
+        else if (arg.compare(0, 11, "--emit-obj=") == 0 && arg.size() > 11)
+        {
+            require_feature(features, kFeatureEmit, "--emit-obj", progname);
+            options.emit_obj_path = arg.substr(11);
+        }
+        else if (arg == "--help")
+        {
+            usage_and_exit(progname, features);
+        }
+        else
+        {
+            usage_and_exit(progname, features);
+        }
+    }
+
+    if (arg_i >= argc)
+    {
+        usage_and_exit(progname, features);
+    }
+
+    options.bf_file_path = argv[arg_i];
+    if (!options.batch_path.empty() && !options.dump_state_path.empty())
+    {
+        DIE << "--dump-state can't be combined with --batch";
+    }
+    if (!options.emit_exe_path.empty() && !options.emit_obj_path.empty())
+    {
+        DIE << "--emit-exe can't be combined with --emit-obj";
+    }
+    if ((!options.emit_exe_path.empty() || !options.emit_obj_path.empty()) &&
+        (!options.batch_path.empty() || !options.dump_state_path.empty()))
+    {
+        DIE << "--emit-exe and --emit-obj can't be combined with --batch or --dump-state";
+    }
+    return options;
+}
+
+void mark_run_start()
+{
+    run_start_seconds = process_timer.elapsed();
+}
+
+void report_phase_times()
+{
+    double total = process_timer.elapsed();
+    double compile = run_start_seconds < 0 ? total : run_start_seconds;
+    fprintf(stderr, "elijit-times: compile=%.9f run=%.9f\n", compile, total - compile);
+}
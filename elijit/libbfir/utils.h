@@ -0,0 +1,121 @@
+#ifndef UTILS_H
+#define UTILS_H
+
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+namespace internal
+{
+
+    // Helper class to impleement DIE
+
+    class FatalLogMessage : public std::basic_ostringstream<char>
+    {
+    public:
+        ~FatalLogMessage();
+    };
+}
+
+#define DIE internal::FatalLogMessage()
+
+// Simple timer for high-precision timing measurements. Usage:
+//
+// Timer t;
+//.... code to measure
+// t.elapsed() returns the number of seconds elapsed since t was created
+
+class Timer
+{
+public:
+    Timer();
+
+    // Returns the number of seconds (as a high precision floating point number)
+    // elapsed since the construction of this Timer object
+
+    double elapsed();
+
+private:
+    std::chrono::time_point<std::chrono::high_resolution_clock> t1_;
+};
+
+// Settings shared by all engines, filled in from the command line.
+
+struct Options
+{
+    std::string bf_file_path;
+    bool verbose = false;
+
+    // Width of a tape cell in bits: 8, 16 or 32 (--cell-bits).
+    int cell_bits = 8;
+
+    // Directory of the JITs' on-disk code cache (--code-cache[=DIR]); empty
+    // when caching is off.
+    std::string code_cache_dir;
+
+    // Print the compile/run split of the wall time to stderr when done
+    // (--report-times).
+    bool report_times = false;
+
+    // Where to write the final tape state (--dump-state=FILE); see
+    // Tape::write_state.
+    std::string dump_state_path;
+
+    // Run the program once per input listed by a directory or manifest
+    // (--batch=PATH) instead of on stdin; JITs only. See batch.h.
+    std::string batch_path;
+
+    // Worker threads for --batch (--threads=N); 0 means one per CPU.
+    int batch_threads = 0;
+
+    // Describe the JIT code to perf in /tmp/perf-<pid>.map (--perf-map)
+    // and/or /tmp/jit-<pid>.dump (--jitdump); JITs only. See perfmap.h.
+    bool perf_map = false;
+    bool jitdump = false;
+
+    // Count how often every loop runs and print the hottest ones to stderr
+    // when done (--loop-profile[=FILE]), also writing them to FILE as JSON
+    // for --profile; optinterp2 only. See profile.h.
+    bool loop_profile = false;
+    std::string loop_profile_path;
+
+    // Only count about one bracket in N (--loop-profile-sample=N, implies
+    // --loop-profile); 0 counts all of them.
+    uint32_t loop_profile_sample = 0;
+
+    // A profile written by --loop-profile=FILE to optimize with
+    // (--profile=FILE); optasmjit only.
+    std::string profile_path;
+
+    // Write the program's code as a static executable (--emit-exe=FILE) or a
+    // relocatable object (--emit-obj=FILE) instead of running it; simplejit
+    // only. See jit/simpleJit/elf_writer.h.
+    std::string emit_exe_path;
+    std::string emit_obj_path;
+};
+
+// Optional features of an engine. Each engine passes the ones it supports to
+// parse_command_line, which rejects the flags of all others and leaves them
+// out of the usage text.
+
+constexpr uint32_t kFeatureCodeCache = 1 << 0;   // --code-cache
+constexpr uint32_t kFeatureBatch = 1 << 1;       // --batch, --threads
+constexpr uint32_t kFeaturePerf = 1 << 2;        // --perf-map, --jitdump
+constexpr uint32_t kFeatureLoopProfile = 1 << 3; // --loop-profile[-sample]
+constexpr uint32_t kFeatureProfile = 1 << 4;     // --profile
+constexpr uint32_t kFeatureEmit = 1 << 5;        // --emit-exe, --emit-obj
+
+Options parse_command_line(int argc, const char **argv, uint32_t features = 0);
+
+// Phase timing for --report-times, which bfbench uses to tell compile time
+// from run time. Engines call mark_run_start() right before they start
+// executing the program; everything since process startup until then
+// (reading and parsing the file, translation, code generation) counts as
+// compile time. report_phase_times() prints
+// "elijit-times: compile=<seconds> run=<seconds>" to stderr.
+
+void mark_run_start();
+void report_phase_times();
+
+#endif /*UTILS_H*/
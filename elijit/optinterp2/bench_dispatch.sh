@@ -0,0 +1,51 @@
+#!/bin/bash
+#
+# Compares the switch and the direct-threaded (-DBFTHREADED) dispatch engines
+# of optinterp2. Builds both variants with the same flags and reports the best
+# wall time of N runs for every sample.
+#
+# Usage: ./bench_dispatch.sh [runs] [bf files...]
+# Defaults to 5 runs over ../samples/*.bf.
+
+set -e
+
+cd "$(dirname "$0")"
+
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:--O3 -march=native}
+RUNS=${1:-5}
+shift || true
+FILES=("$@")
+if [ ${#FILES[@]} -eq 0 ]; then
+    FILES=(../samples/*.bf)
+fi
+
+BUILD_DIR=$(mktemp -d)
+trap 'rm -rf "$BUILD_DIR"' EXIT
+
+$CXX $CXXFLAGS optinterp2.cpp ../libbfir/*.cpp -o "$BUILD_DIR/switch"
+$CXX $CXXFLAGS -DBFTHREADED optinterp2.cpp ../libbfir/*.cpp -o "$BUILD_DIR/threaded"
+
+# Prints the best of RUNS wall times (in seconds) of running $1 on $2.
+best_time() {
+    local best=""
+    for ((i = 0; i < RUNS; i++)); do
+        local start end t
+        start=$(date +%s.%N)
+        "$1" "$2" < /dev/null > /dev/null
+        end=$(date +%s.%N)
+        t=$(awk -v s="$start" -v e="$end" 'BEGIN { print e - s }')
+        if [ -z "$best" ] || awk -v t="$t" -v b="$best" 'BEGIN { exit !(t < b) }'; then
+            best=$t
+        fi
+    done
+    echo "$best"
+}
+
+printf "%-24s %12s %12s %8s\n" "program" "switch (s)" "threaded (s)" "speedup"
+for f in "${FILES[@]}"; do
+    s=$(best_time "$BUILD_DIR/switch" "$f")
+    t=$(best_time "$BUILD_DIR/threaded" "$f")
+    speedup=$(awk -v s="$s" -v t="$t" 'BEGIN { printf "%.2f", s / t }')
+    printf "%-24s %12.4f %12.4f %7sx\n" "$(basename "$f")" "$s" "$t" "$speedup"
+done
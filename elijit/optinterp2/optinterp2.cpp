@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstdint>
 #include <fstream>
 #include <iomanip>
@@ -6,246 +7,480 @@
 #include <sstream>
 #include <vector>
 
-#include "parser.h"
-#include "utils.h"
-
-constexpr int MEMORY_SIZE = 30000;
-
-enum class BfOpKind{
-    INVALID_OP = 0,
-    INC_PTR,
-    DEC_PTR,
-    INC_DATA,
-    DEC_DATA,
-    READ_STDIN,
-    WRITE_STDOUT,
-    JUMP_IF_DATA_ZERO,
-    JUMP_IF_DATA_NOT_ZERO
+#include "../libbfir/bfio.h"
+#include "../libbfir/bfir.h"
+#include "../libbfir/bytecode.h"
+#include "../libbfir/parser.h"
+#include "../libbfir/profile.h"
+#include "../libbfir/scan.h"
+#include "../libbfir/tape.h"
+#include "../libbfir/utils.h"
+
+#ifdef BFTIERED
+#include "../jit/optasmjit/codegen.h"
+#endif
+
+#ifdef BFTHREADED
+
+// Direct-threaded engine, selected at build time with -DBFTHREADED. Needs the
+// GCC/clang "labels as values" extension.
+//
+// Every op is pre-resolved to the address of its handler when the ops are
+// translated to ThreadedOps, and every handler ends with its own indirect
+// jump to the next op's handler. Compared to the switch engine this drops the
+// shared dispatch branch, the pc < ops_size check (a HALT op terminates the
+// code) and the per-step BfOp copy, and gives the branch predictor one jump
+// site per handler.
+
+struct ThreadedOp{
+    const void* handler;
+    int32_t offset;
+
+    // For jumps, the index of the op to continue at when the jump is taken,
+    // i.e. one past the matching bracket.
+    int64_t argument;
 };
 
-const char* BfOpKind_name(BfOpKind kind){
-    switch(kind){
-	case BfOpKind::INC_PTR:
-	    return ">";
-	case BfOpKind::DEC_PTR:
-	    return "<";
-	case BfOpKind::INC_DATA:
-	    return "+";
-	case BfOpKind::DEC_DATA:
-	    return "-";
-	case BfOpKind::READ_STDIN:
-	    return ",";
-	case BfOpKind::WRITE_STDOUT:
-	    return ".";
-	case BfOpKind::JUMP_IF_DATA_ZERO:
-	    return "[";
-	case BfOpKind::JUMP_IF_DATA_NOT_ZERO:
-	    return "]";
-	case BfOpKind::INVALID_OP:
-	    return "x";
+// Runs ops on memory starting at *dataptr, doing I/O through io and reporting
+// brackets to profiler unless it is null. Returns the pc the program stopped
+// at (ops.size() unless it died), and updates *dataptr.
+
+template <typename Cell>
+size_t run_threaded(const std::vector<BfOp>& ops, Cell* memory, size_t* dataptr_inout, BfIo* io,
+		    LoopProfiler* profiler){
+    // Indexed by BfOpKind.
+    static const void* const handlers[kNumBfOpKinds] = {
+	&&op_invalid,
+	&&op_inc_ptr,
+	&&op_dec_ptr,
+	&&op_inc_data,
+	&&op_dec_data,
+	&&op_read_stdin,
+	&&op_write_stdout,
+	&&op_add_data,
+	&&op_set_data,
+	&&op_loop_set_to_zero,
+	&&op_loop_move_ptr,
+	&&op_loop_mul_add,
+	&&op_jump_if_data_zero,
+	&&op_jump_if_data_not_zero,
+    };
+
+    std::vector<ThreadedOp> code;
+    code.reserve(ops.size() + 1);
+
+    for(const BfOp& op : ops){
+	int64_t argument = op.argument;
+	if(op.kind == BfOpKind::JUMP_IF_DATA_ZERO || op.kind == BfOpKind::JUMP_IF_DATA_NOT_ZERO){
+	    argument++;
+	}
+	code.push_back(ThreadedOp{handlers[static_cast<int>(op.kind)], op.offset, argument});
+    }
+    code.push_back(ThreadedOp{&&op_halt, 0, 0});
+
+    const ThreadedOp* const base = code.data();
+    const ThreadedOp* ip = base;
+    size_t dataptr = *dataptr_inout;
+
+#define DISPATCH() goto *ip->handler
+#define NEXT() do { ++ip; DISPATCH(); } while(0)
+
+    DISPATCH();
+
+op_inc_ptr:
+    dataptr += ip->argument;
+    NEXT();
+op_dec_ptr:
+    dataptr -= ip->argument;
+    NEXT();
+op_inc_data:
+    memory[dataptr] += ip->argument;
+    NEXT();
+op_dec_data:
+    memory[dataptr] -= ip->argument;
+    NEXT();
+op_read_stdin:
+    for(int64_t i = 0; i < ip->argument; ++i){
+	memory[dataptr + ip->offset] = bfio_get(io);
     }
-    return nullptr;
+    NEXT();
+op_write_stdout:
+    for(int64_t i = 0; i < ip->argument; ++i){
+	bfio_put(io, memory[dataptr + ip->offset]);
+    }
+    NEXT();
+op_add_data:
+    memory[dataptr + ip->offset] += ip->argument;
+    NEXT();
+op_set_data:
+    memory[dataptr + ip->offset] = ip->argument;
+    NEXT();
+op_loop_set_to_zero:
+    memory[dataptr + ip->offset] = 0;
+    NEXT();
+op_loop_move_ptr:{
+    size_t end = scan_for_zero(memory + dataptr, ip->argument) - memory;
+    if(profiler){
+	profiler->scan(ip - base, static_cast<int64_t>(end - dataptr) / ip->argument);
+    }
+    dataptr = end;
+    NEXT();
 }
+op_loop_mul_add:
+    if(memory[dataptr]){
+	memory[dataptr + ip->offset] += memory[dataptr] * ip->argument;
+    }
+    NEXT();
+op_jump_if_data_zero:
+    if(profiler){
+	profiler->branch(ip - base, !memory[dataptr]);
+    }
+    if(!memory[dataptr]){
+	ip = base + ip->argument;
+	DISPATCH();
+    }
+    NEXT();
+op_jump_if_data_not_zero:
+    if(profiler){
+	profiler->branch(ip - base, memory[dataptr] != 0);
+    }
+    if(memory[dataptr]){
+	ip = base + ip->argument;
+	DISPATCH();
+    }
+    NEXT();
+op_invalid:
+    DIE << "INVALID_OP encountered on pc=" << (ip - base);
+op_halt:
 
-struct BfOp{
-    BfOp(BfOpKind kind_param, size_t argument_param)
-	: kind(kind_param), argument(argument_param) {}
+#undef NEXT
+#undef DISPATCH
 
-    // Serialize (emit textual representation for) this op onto the end of s.
+    *dataptr_inout = dataptr;
+    return ip - base;
+}
 
-    void serialize(std::string* s)const{
-	*s += BfOpKind_name(kind) + std::to_string(argument);
-    }
+#endif /* BFTHREADED */
 
-    BfOpKind kind = BfOpKind::INVALID_OP;
-    size_t argument = 0;
-};
+#ifdef BFTIERED
 
-std::vector<BfOp> translate_program(const Program& p){
-    size_t pc = 0;
-    size_t program_size = p.instructions.size();
-    std::vector<BfOp> ops;
+#ifdef BFTHREADED
+#error "BFTIERED is only supported by the switch engine"
+#endif
 
-    // Throughout the translation loop, this stack contains offsets (in the ops vector)
-    // of open brackets (JUMP_IF_DATA_ZERO ops) waiting for a closing
-    // bracket. Since brackets nest, these naturally form a stack. The JUMP_IF_DATA_ZERO .
-    // The JUMP_IF_DATA_ZERO ops get added to ops with their argument set to 0 until a
-    // Matching closing bracket is encountered, at which point the argument can be
-    // back-patched
+// Tiered execution, selected at build time with -DBFTIERED; link with
+// jit/optasmjit/codegen.cpp and asmjit.
+//
+// The switch engine starts interpreting right away and counts the back-edges
+// every loop takes. When a loop reaches kTierUpThreshold of them, just that
+// loop is compiled with the optasmjit code generator and both of its brackets
+// are patched to kBytecodeNativeLoop, so from then on the loop runs as native
+// code whenever it is entered. Short programs never pay for compilation.
 
-    std::stack<size_t> open_bracket_stack;
+constexpr uint32_t kTierUpThreshold = 1000;
 
-    while(pc < program_size){
+// Not a BfOpKind: a patched bracket. Its operand is still the bracket's
+// jump_targets index.
 
-	char instruction = p.instructions[pc];
+constexpr uint8_t kBytecodeNativeLoop = 0xFE;
 
-	if(instruction == '['){
-	    // Place a jump op with a placeholder 0 offset. It will be patched-up to
-	    // the right offset when the matching ']' is found
-	    open_bracket_stack.push(ops.size());
-	    ops.push_back(BfOp(BfOpKind::JUMP_IF_DATA_ZERO, 0));
-	    pc++;
-	}
-	else if(instruction == ']'){
-	    if(open_bracket_stack.empty()){
-		DIE << "unmatched closing ']' at pc=" << pc;
-	    }
+class LoopTiering{
+public:
+    // bytecode is what the code generator reads; the engine executes, and
+    // tiering patches, a copy of it.
 
-	    size_t open_bracket_offset = open_bracket_stack.top();
-	    open_bracket_stack.pop();
-
-	    // Now we have the matching '['. We can use to create a
-	    // new jump op for the ']' we're handling, as well as patch up the
-	    //offset of the matching '['
-
-	    ops[open_bracket_offset].argument = ops.size();
-	    ops.push_back(BfOp(BfOpKind::JUMP_IF_DATA_NOT_ZERO, open_bracket_offset));
-	    pc++;
-	}else{
-	    // Not a jump; all the other ops can be repeated, so find where the repeat
-	    // ends.
-	    size_t start = pc++;
-	    while(pc < program_size && p.instructions[pc] == instruction){
-		pc++;
-	    }
-	    // Here pc points to the first new instruction encountered, or to the end
-	    // of the program
-
-	    size_t num_repeats = pc - start;
-
-	    // Figure out which op kind the instruction represents and add it to
-	    // the ops.
-
-	    BfOpKind kind = BfOpKind::INVALID_OP;
-
-	    switch(instruction){
-		case '>':
-		    kind = BfOpKind::INC_PTR;
-		    break;
-		case '<':
-		    kind = BfOpKind::DEC_PTR;
-		    break;
-		case '+':
-		    kind = BfOpKind::INC_DATA;
-		    break;
-		case '-':
-		    kind = BfOpKind::DEC_DATA;
-		    break;
-		case ',':
-		    kind = BfOpKind::READ_STDIN;
-		    break;
-		case '.':
-		    kind = BfOpKind::WRITE_STDOUT;
-		    break;
-		default:
-		    {
-			DIE << "bad char '"<< instruction <<"' at pc=" << start;
-		    }
+    LoopTiering(const Bytecode& bytecode, int cell_size);
 
-	    }
-	    ops.push_back(BfOp(kind, num_repeats));
+    // Counts a back-edge taken by the ']' with the given jump_targets index.
+    // Returns true when this compiled the loop and patched it into code.
+
+    bool count_back_edge(uint64_t jump, uint8_t* code);
+
+    // For a patched bracket: the loop's native code, and the code position
+    // to continue at once it returns (one past the ']').
+
+    JittedFunc native_loop(uint64_t jump) const{
+	return native_[jump];
+    }
+
+    uint32_t exit_position(uint64_t jump) const{
+	return exits_[jump];
+    }
+
+    size_t loops_compiled() const{
+	return loops_compiled_;
+    }
+
+    double compile_time() const{
+	return compile_time_;
+    }
+
+private:
+    const Bytecode& bytecode_;
+    int cell_size_;
+
+    // Per jump_targets index: where the jump op starts, the index of the
+    // matching bracket, and one past the loop's ']'.
+    std::vector<uint32_t> positions_;
+    std::vector<uint32_t> partners_;
+    std::vector<uint32_t> exits_;
+
+    std::vector<uint32_t> back_edges_;
+    std::vector<JittedFunc> native_;
+    asmjit::JitRuntime runtime_;
+    size_t loops_compiled_ = 0;
+    double compile_time_ = 0;
+};
+
+LoopTiering::LoopTiering(const Bytecode& bytecode, int cell_size)
+    : bytecode_(bytecode), cell_size_(cell_size){
+    size_t num_jumps = bytecode.jump_targets.size();
+    positions_.resize(num_jumps);
+    partners_.resize(num_jumps);
+    exits_.resize(num_jumps);
+    back_edges_.resize(num_jumps);
+    native_.resize(num_jumps);
+
+    // Jump indices are handed out in op order, so pair the brackets up with
+    // a stack like link_jumps does.
+    std::vector<uint32_t> open_brackets;
+    BytecodeReader reader(bytecode);
+    BfOp op(BfOpKind::INVALID_OP, 0);
+    for(size_t position = reader.position(); reader.next(&op); position = reader.position()){
+	if(op.kind == BfOpKind::JUMP_IF_DATA_ZERO){
+	    positions_[op.argument] = position;
+	    open_brackets.push_back(op.argument);
+	}else if(op.kind == BfOpKind::JUMP_IF_DATA_NOT_ZERO){
+	    uint32_t open = open_brackets.back();
+	    open_brackets.pop_back();
+	    positions_[op.argument] = position;
+	    partners_[op.argument] = open;
+	    partners_[open] = op.argument;
+	    exits_[op.argument] = exits_[open] = bytecode.jump_targets[open];
 	}
+    }
+}
 
+bool LoopTiering::count_back_edge(uint64_t jump, uint8_t* code){
+    if(++back_edges_[jump] != kTierUpThreshold){
+	return false;
     }
-    return ops;
+
+    Timer t;
+    uint32_t open = partners_[jump];
+    JittedFunc func = compile_function(runtime_, bytecode_, positions_[open], exits_[open], cell_size_);
+    native_[open] = native_[jump] = func;
+    code[positions_[open]] = kBytecodeNativeLoop;
+    code[positions_[jump]] = kBytecodeNativeLoop;
+    loops_compiled_++;
+    compile_time_ += t.elapsed();
+    return true;
 }
 
-void optInterp2(const Program& p, bool verbose){
+#endif /* BFTIERED */
+
+// Cell is the type of a tape cell: uint8_t, uint16_t or uint32_t. Output
+// writes the low byte of a cell; input stores a byte, or -1 truncated to the
+// cell width at end of input.
+
+template <typename Cell>
+void optInterp2(const Program& p, const Options& options){
+    bool verbose = options.verbose;
+
     // Initialize state.
-    std::vector<uint8_t> memory(MEMORY_SIZE, 0);
+    Tape tape(sizeof(Cell), max_pointer_move(p.instructions));
+    Cell* memory = tape.cells<Cell>();
+    std::unique_ptr<BfIo> io(new BfIo);
+    bfio_init(io.get());
+    tape.set_io(io.get());
 
     size_t pc = 0;
     size_t dataptr = 0;
 
-#ifdef BFTRACE
-    std::unordered_map<int, size_t> op_exec_count;
-    std::string current_trace;
-    std::unordered_map<std::string, size_t> trace_count;
-#endif
-
     Timer t1;
-    std::vector<BfOp> ops = translate_program(p);
+    std::vector<BfOp> ops = compile_to_ops(p, kDefaultOptLevel, verbose);
 
     if(verbose){
-	std::count <<"* translation [elapsed "<< t1.elapsed() <<"s]:\n";
+	std::cout <<"* translation [elapsed "<< t1.elapsed() <<"s]:\n";
+	dump_ops(ops, std::cout);
+	std::cout << "* LOOP_MOVE_PTR scans: " << scan_for_zero_isa() << "\n";
+    }
 
-	for(size_t i = 0; i < ops.size(); ++i){
-	    std::cout<<" ["<< i << "] "<< BfOpKind_name(ops[i].kind) << " "<< ops[i].argument << "\n";
-	}
+    // --loop-profile counts brackets by their index in ops.
+    std::unique_ptr<LoopProfiler> profiler;
+    if(options.loop_profile){
+	profiler.reset(new LoopProfiler(ops, options.loop_profile_sample));
     }
 
+    // Program output bypasses std::cout, so get the verbose output out first.
+    std::cout.flush();
+
     // Execute the translated ops; pc points into ops, not into the program now.
-    size_t ops_size = ops.size();
+#ifdef BFTHREADED
+    mark_run_start();
+    pc = run_threaded(ops, memory, &dataptr, io.get(), profiler.get());
+#else
+    // The switch engine runs the packed bytecode, so from here on pc is a
+    // position in bytecode.code.
+    Bytecode bytecode = encode_bytecode(ops);
+
+    if(verbose){
+	std::cout << "* bytecode: " << bytecode.code.size() << " bytes + "
+	    << bytecode.jump_targets.size() * sizeof(uint32_t) << " bytes of jump targets ("
+	    << ops.size() * sizeof(BfOp) << " bytes as BfOps)\n";
+    }
 
-    while(pc < ops_size){
-	BfOp op = ops[pc];
-	BfOpKind kind = op.kind;
-#ifdef BFTRACE
-	op_exec_count[static_cast<int>(kind)]++;
+#ifdef BFTIERED
+    std::vector<uint8_t> executed_code = bytecode.code;
+    LoopTiering tiering(bytecode, sizeof(Cell));
+    const uint8_t* const code = executed_code.data();
+#else
+    const uint8_t* const code = bytecode.code.data();
 #endif
+    const uint32_t* const jump_targets = bytecode.jump_targets.data();
+    const uint8_t* ip = code;
+
+    mark_run_start();
+    for(;;){
+	const uint8_t* op_start = ip;
+	uint8_t opcode = *ip++;
+	if(opcode == kBytecodeHalt){
+	    break;
+	}
+#ifdef BFTIERED
+	if(opcode == kBytecodeNativeLoop){
+	    uint64_t jump = read_uleb128(&ip);
+	    uint64_t cell = tiering.native_loop(jump)(reinterpret_cast<uint64_t>(memory + dataptr), io.get());
+	    dataptr = reinterpret_cast<Cell*>(cell) - memory;
+	    ip = code + tiering.exit_position(jump);
+	    continue;
+	}
+#endif
+	BfOpKind kind = static_cast<BfOpKind>(opcode);
 
 	switch(kind){
 	    case BfOpKind::INC_PTR:
-		dataptr += op.argument;
+		dataptr += read_sleb128(&ip);
 		break;
 	    case BfOpKind::DEC_PTR:
-		dataptr -= op.argument;
+		dataptr -= read_sleb128(&ip);
 		break;
 	    case BfOpKind::INC_DATA:
-		memory[dataptr] += op.argument;
+		memory[dataptr] += read_sleb128(&ip);
 		break;
 	    case BfOpKind::DEC_DATA:
-		memory[dataptr] -= op.argument;
+		memory[dataptr] -= read_sleb128(&ip);
+		break;
+	    case BfOpKind::READ_STDIN:{
+		int64_t offset = read_sleb128(&ip);
+		int64_t count = read_sleb128(&ip);
+		for(int64_t i = 0; i < count; ++i){
+		    memory[dataptr + offset] = bfio_get(io.get());
+		}
 		break;
-	    case BfOpKind::READ_STDIN:
-		for(size_t i = 0; i < op.argument; ++i){
-		    memory[dataptr] = std::cin.get();
+	    }
+	    case BfOpKind::WRITE_STDOUT:{
+		int64_t offset = read_sleb128(&ip);
+		int64_t count = read_sleb128(&ip);
+		for(int64_t i = 0; i < count; ++i){
+		    bfio_put(io.get(), memory[dataptr + offset]);
 		}
 		break;
-	    case BfOpKind::WRITE_STDOUT:
-		for(size_t i = 0; i < op.argument; ++i){
-		    std::cout.put(memory[dataptr]);
+	    }
+	    case BfOpKind::ADD_DATA:{
+		int64_t offset = read_sleb128(&ip);
+		memory[dataptr + offset] += read_sleb128(&ip);
+		break;
+	    }
+	    case BfOpKind::SET_DATA:{
+		int64_t offset = read_sleb128(&ip);
+		memory[dataptr + offset] = read_sleb128(&ip);
+		break;
+	    }
+	    case BfOpKind::LOOP_SET_TO_ZERO:
+		memory[dataptr + read_sleb128(&ip)] = 0;
+		break;
+	    case BfOpKind::LOOP_MOVE_PTR:{
+		int64_t stride = read_sleb128(&ip);
+		size_t end = scan_for_zero(memory + dataptr, stride) - memory;
+		if(profiler){
+		    profiler->scan(profiler->op_at(bytecode, op_start - code),
+			static_cast<int64_t>(end - dataptr) / stride);
+		}
+		dataptr = end;
+		break;
+	    }
+	    case BfOpKind::LOOP_MUL_ADD:{
+		int64_t offset = read_sleb128(&ip);
+		int64_t factor = read_sleb128(&ip);
+		if(memory[dataptr]){
+		    memory[dataptr + offset] += memory[dataptr] * factor;
 		}
 		break;
-	    case BfOpKind::JUMP_IF_DATA_ZERO:
+	    }
+	    case BfOpKind::JUMP_IF_DATA_ZERO:{
+		uint64_t target = read_uleb128(&ip);
+		if(profiler){
+		    profiler->branch(profiler->jump_op(target), !memory[dataptr]);
+		}
 		if(!memory[dataptr]){
-		    pc = op.argument;
+		    ip = code + jump_targets[target];
 		}
 		break;
-	    case BfOpKind::JUMP_IF_DATA_NOT_ZERO:
+	    }
+	    case BfOpKind::JUMP_IF_DATA_NOT_ZERO:{
+		uint64_t target = read_uleb128(&ip);
+		if(profiler){
+		    profiler->branch(profiler->jump_op(target), memory[dataptr] != 0);
+		}
 		if(memory[dataptr] != 0){
-		    pc = op.argument;
+#ifdef BFTIERED
+		    // Native loops don't report to the profiler, so it keeps
+		    // everything in the interpreter.
+		    if(!profiler && tiering.count_back_edge(target, executed_code.data())){
+			// Dispatch the op again; it enters native code now.
+			ip = op_start;
+			break;
+		    }
+#endif
+		    ip = code + jump_targets[target];
 		}
 		break;
+	    }
 	    case BfOpKind::INVALID_OP:
-		DIE << "INVALID_OP encountered on pc=" << pc;
+		DIE << "INVALID_OP encountered on pc=" << (op_start - code);
 
 	}
+    }
+    pc = ip - 1 - code;
+#endif
+    bfio_flush(io.get());
 
-#ifdef BFTRACE
-	if(kind == BfOpKind::JUMP_IF_DATA_ZERO){
-	    current_trace = "";
-	}else if(kind == BfOpKind::JUMP_IF_DATA_NOT_ZERO){
-	    if(current_trace.size() > 0){
-		trace_count[current_trace] += 1;
-		current_trace = "";
-	    }
-	}else{
-	    op.serialize(&current_trace);
+    if(!options.dump_state_path.empty()){
+	tape.write_state(options.dump_state_path, dataptr);
+    }
+
+    if(profiler){
+	LoopProfile profile = profiler->report(p);
+	print_loop_profile(profile, std::cerr);
+	if(!options.loop_profile_path.empty() && !write_loop_profile(profile, options.loop_profile_path)){
+	    std::cerr << "loop profile: unable to write " << options.loop_profile_path << "\n";
 	}
-#endif
-	pc++;
     }
 
     if(verbose){
 	std::cout << "* pc=" << pc << "\n";
-	std::cout << "* dataptr=" << "\n";
+	std::cout << "* dataptr=" << dataptr << "\n";
+#ifdef BFTIERED
+	std::cout << "* tiering: " << tiering.loops_compiled() << " loops compiled [elapsed "
+	    << tiering.compile_time() << "s]\n";
+#endif
 	std::cout << "* Memory nonzero locations:\n";
 
-	for(size_t i = 0, pcount = 0; i < memory.size(); ++i){
+	for(size_t i = 0, pcount = 0; i < tape.size() / sizeof(Cell); ++i){
 	    if(memory[i]){
 		std::cout<< std::right << "[" << std::setw(3) << i << "] = "<< std::setw(3) << std::left
-		    << static_cast <int32_t> (memory[i]) << "	";
+		    << static_cast <int64_t> (memory[i]) << "	";
 		pcount++;
 
 		if(pcount > 0 && pcount % 4 == 0){
@@ -254,72 +489,57 @@ void optInterp2(const Program& p, bool verbose){
 	    }
 	}
 	std::cout<< "\n";
-
-    #ifdef BFTRACE
-	std::cout << "* Tracing:\n";
-	std::cout.imbue(std::locale(""));
-	size_t total = 0;
-
-	for(auto i: op_exec_count){
-	    std::cout<< BfOpKind_name(static_cast<BfOpKind>(i.first)) << " --> "
-		<<i.second << "\n";
-	    total += i.second;
-	}
-
-	std::cout << ".. Total: "<< total << "\n\n";
-
-
-	using TracePair = std::pair<std::string, size_t>;
-
-	std::vector<TracePair> tracevec;
-
-	std::copy(trace_count.begin(), trace_count.end(), std::back_inserter<std::vector<TracePair>>(tracevec));
-
-	std::sort(tracevec.begin(), tracevec.end(),
-		[](const TracePair a, const TracePair& b){
-		return a.second > b.second;
-		}
-		);
-
-	for(auto const& t : tracevec){
-	    std::cout << std::setw(15) << std::left << t.first << " --> " << t.second << "\n";
-
-	}
-
-
-    #endif
     }
 }
 
 int main(int argc, const char** argv)
 {
-    bool verbose = false;
-
-    std::string bf_file_path;
-    parse_command_line(argc, argv, &bf_file_path, &verbose);
+    Options options = parse_command_line(argc, argv, kFeatureLoopProfile);
 
     Timer t1;
-    std::ifstream file(bf_file_path);
+    std::ifstream file(options.bf_file_path);
 
     if (!file)
     {
-        DIE << "unable to open file" << bf_file_path;
+        DIE << "unable to open file" << options.bf_file_path;
     }
 
     Program program = parse_from_stream(file);
 
-    if (verbose)
+    if (options.verbose)
     {
+#if defined(BFTHREADED)
+        std::cout << "[>] Running optInterp2 (threaded):\n";
+#elif defined(BFTIERED)
+        std::cout << "[>] Running optInterp2 (tiered):\n";
+#else
         std::cout << "[>] Running optInterp2:\n";
+#endif
     }
 
     Timer t2;
-    optInterp2(program, verbose);
+    switch (options.cell_bits)
+    {
+    case 16:
+        optInterp2<uint16_t>(program, options);
+        break;
+    case 32:
+        optInterp2<uint32_t>(program, options);
+        break;
+    default:
+        optInterp2<uint8_t>(program, options);
+        break;
+    }
 
-    if (verbose)
+    if (options.verbose)
     {
         std::cout << "[<] Done (elapsed: " << t2.elapsed() << "s)\n";
     }
 
+    if (options.report_times)
+    {
+        report_phase_times();
+    }
+
     return 0;
 }
@@ -0,0 +1,115 @@
+// bfclient: runs a BF program on a bfserver, with stdin as its input.
+//
+// The program's output goes to stdout. If the run fails (bad program, tape
+// overflow, timeout, too much output), the reason goes to stderr and bfclient
+// exits with status 1.
+//
+// Build from the elijit directory:
+//
+// g++ -O2 server/bfclient.cpp server/protocol.cpp libbfir/utils.cpp -o server/bfclient
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "../libbfir/utils.h"
+
+namespace
+{
+
+    void usage_and_exit(const std::string &progname)
+    {
+        std::cout << "Expecting " << progname << " [--socket=PATH] <BF file>\n";
+        std::cout << "\nRuns the program on the bfserver listening on PATH (default\n";
+        std::cout << "/tmp/bfserver.sock), with stdin as its input.\n";
+        exit(EXIT_SUCCESS);
+    }
+
+    std::string read_all(std::istream &stream)
+    {
+        std::ostringstream contents;
+        contents << stream.rdbuf();
+        return contents.str();
+    }
+} // namespace
+
+int main(int argc, const char **argv)
+{
+    std::string socket_path = "/tmp/bfserver.sock";
+    std::string program_path;
+    for (int arg_i = 1; arg_i < argc; ++arg_i)
+    {
+        std::string arg = argv[arg_i];
+        if (arg.compare(0, 9, "--socket=") == 0)
+        {
+            socket_path = arg.substr(9);
+        }
+        else if (arg.compare(0, 2, "--") == 0 || !program_path.empty())
+        {
+            usage_and_exit(argv[0]);
+        }
+        else
+        {
+            program_path = arg;
+        }
+    }
+    if (program_path.empty())
+    {
+        usage_and_exit(argv[0]);
+    }
+
+    std::ifstream file(program_path);
+    if (!file)
+    {
+        DIE << "unable to open file " << program_path;
+    }
+    Request request;
+    request.program = read_all(file);
+    request.input = read_all(std::cin);
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path))
+    {
+        DIE << "socket path too long: " << socket_path;
+    }
+    strcpy(addr.sun_path, socket_path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+    {
+        DIE << "unable to connect to " << socket_path << ": " << strerror(errno);
+    }
+
+    Response response;
+    if (!write_request(fd, request) || !read_response(fd, &response))
+    {
+        DIE << "bfserver closed the connection (program or input too large?)";
+    }
+    close(fd);
+
+    std::cout.write(response.output.data(), response.output.size());
+    std::cout.flush();
+    if (response.status != RunStatus::kOk)
+    {
+        std::cerr << "bfclient: " << RunStatus_name(response.status);
+        if (!response.error.empty())
+        {
+            std::cerr << ": " << response.error;
+        }
+        std::cerr << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,342 @@
+// bfserver: runs BF programs for clients over a Unix socket, with the
+// optasmjit code generator behind a BfService.
+//
+// Every connection gets a reader thread that reads its requests (see
+// protocol.h) and writes the responses; the requests themselves are queued to
+// a pool of --workers threads that run them. An idle or slow client only
+// holds its own reader, never a worker. At most --max-connections clients are
+// served at once; further connections wait in the listen backlog until one
+// closes. Programs are compiled once and cached, so a client that runs the
+// same program repeatedly only pays for the compile on the first request.
+// bfclient is a small client.
+//
+// Build from the elijit directory:
+//
+// g++ -O2 server/bfserver.cpp server/bfservice.cpp server/protocol.cpp jit/optasmjit/codegen.cpp libbfir/*.cpp /usr/lib/libasmjit.so -lpthread -o server/bfserver
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "bfservice.h"
+#include "protocol.h"
+#include "../libbfir/utils.h"
+
+namespace
+{
+
+    struct ServerOptions
+    {
+        std::string socket_path = "/tmp/bfserver.sock";
+        int workers = std::max(1u, std::thread::hardware_concurrency());
+        int max_connections = 512;
+        ServiceOptions service;
+        RunLimits limits;
+        bool verbose = false;
+    };
+
+    void usage_and_exit(const std::string &progname)
+    {
+        std::cout << "Expecting " << progname << " [flags]\n";
+        std::cout << "\nSupported flags:\n";
+        std::cout << " --socket=PATH        Unix socket to listen on (default /tmp/bfserver.sock)\n";
+        std::cout << " --workers=N          programs run at once (default: one per CPU)\n";
+        std::cout << " --max-connections=N  clients served at once (default 512)\n";
+        std::cout << " --runtimes=N         JIT runtimes, i.e. code cache shards (default 4)\n";
+        std::cout << " --cache-size=N       compiled programs to keep (default 1024)\n";
+        std::cout << " --timeout=SECONDS    stop runs that take longer (default 10)\n";
+        std::cout << " --max-output=BYTES   stop runs that write more (default 16 MB)\n";
+        std::cout << " --cell-bits=N        width of a tape cell: 8, 16 or 32 (default 8)\n";
+        std::cout << " --verbose            log every request to stderr\n";
+        exit(EXIT_SUCCESS);
+    }
+
+    bool has_prefix(const std::string &s, const std::string &prefix)
+    {
+        return s.compare(0, prefix.size(), prefix) == 0;
+    }
+
+    long parse_count(const std::string &flag, const std::string &value, long min, long max)
+    {
+        char *end;
+        long n = strtol(value.c_str(), &end, 10);
+        if (value.empty() || *end || n < min || n > max)
+        {
+            DIE << flag << " expects a number from " << min << " to " << max << ", got '" << value
+                << "'";
+        }
+        return n;
+    }
+
+    ServerOptions parse_server_command_line(int argc, const char **argv)
+    {
+        ServerOptions options;
+        for (int arg_i = 1; arg_i < argc; ++arg_i)
+        {
+            std::string arg = argv[arg_i];
+            if (has_prefix(arg, "--socket="))
+            {
+                options.socket_path = arg.substr(9);
+            }
+            else if (has_prefix(arg, "--workers="))
+            {
+                options.workers = parse_count("--workers", arg.substr(10), 1, 1 << 16);
+            }
+            else if (has_prefix(arg, "--max-connections="))
+            {
+                options.max_connections =
+                    parse_count("--max-connections", arg.substr(18), 1, 1 << 20);
+            }
+            else if (has_prefix(arg, "--runtimes="))
+            {
+                options.service.runtimes = parse_count("--runtimes", arg.substr(11), 1, 64);
+            }
+            else if (has_prefix(arg, "--cache-size="))
+            {
+                options.service.max_cached_programs =
+                    parse_count("--cache-size", arg.substr(13), 1, 1 << 20);
+            }
+            else if (has_prefix(arg, "--timeout="))
+            {
+                options.limits.timeout_seconds = parse_count("--timeout", arg.substr(10), 1, 86400);
+            }
+            else if (has_prefix(arg, "--max-output="))
+            {
+                options.limits.max_output = parse_count("--max-output", arg.substr(13), 0, 1L << 30);
+            }
+            else if (has_prefix(arg, "--cell-bits="))
+            {
+                options.service.cell_bits = parse_count("--cell-bits", arg.substr(12), 8, 32);
+            }
+            else if (arg == "--verbose")
+            {
+                options.verbose = true;
+            }
+            else
+            {
+                usage_and_exit(argv[0]);
+            }
+        }
+        if (options.socket_path.size() >= sizeof(sockaddr_un::sun_path))
+        {
+            DIE << "socket path too long: " << options.socket_path;
+        }
+        return options;
+    }
+
+    // A request waiting for a worker. The connection's reader waits for the
+    // result; the worker takes the promise before running the program, so it
+    // never touches the job again once the result is set.
+
+    struct Job
+    {
+        Request request;
+        std::promise<RunResult> result;
+    };
+
+    class JobQueue
+    {
+    public:
+        void push(Job *job)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                jobs_.push_back(job);
+            }
+            ready_.notify_one();
+        }
+
+        Job *pop()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            ready_.wait(lock, [this] { return !jobs_.empty(); });
+            Job *job = jobs_.front();
+            jobs_.pop_front();
+            return job;
+        }
+
+    private:
+        std::mutex mutex_;
+        std::condition_variable ready_;
+        std::deque<Job *> jobs_;
+    };
+
+    void run_jobs(JobQueue *queue, BfService *service, const ServerOptions &options)
+    {
+        for (;;)
+        {
+            Job *job = queue->pop();
+            std::promise<RunResult> result = std::move(job->result);
+            result.set_value(service->run(job->request.program, job->request.input, options.limits));
+        }
+    }
+
+    // Counts the open connections. The accept loop takes a slot before it
+    // accepts, so it stops accepting while all of them are taken, and every
+    // reader gives its slot back once its connection is closed.
+
+    class ConnectionSlots
+    {
+    public:
+        explicit ConnectionSlots(int slots) : free_(slots)
+        {
+        }
+
+        void acquire()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            released_.wait(lock, [this] { return free_ > 0; });
+            --free_;
+        }
+
+        void release()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++free_;
+            }
+            released_.notify_one();
+        }
+
+    private:
+        std::mutex mutex_;
+        std::condition_variable released_;
+        int free_;
+    };
+
+    // The reader of a connection: queues its requests one at a time, and
+    // writes each response before reading the next request.
+
+    void serve_connection(int fd, JobQueue *queue, ConnectionSlots *slots,
+                          const ServerOptions &options)
+    {
+        for (;;)
+        {
+            Job job;
+            if (!read_request(fd, &job.request))
+            {
+                break;
+            }
+            std::future<RunResult> done = job.result.get_future();
+            queue->push(&job);
+            RunResult result = done.get();
+
+            if (options.verbose)
+            {
+                std::cerr << "bfserver: fd " << fd << ": " << RunStatus_name(result.status) << ", ";
+                if (result.cache_hit)
+                {
+                    std::cerr << "cached";
+                }
+                else
+                {
+                    std::cerr << "compiled in " << result.compile_seconds << "s";
+                }
+                std::cerr << ", ran in " << result.run_seconds << "s, " << result.output.size()
+                          << " bytes of output\n";
+            }
+
+            Response response;
+            response.status = result.status;
+            response.output = std::move(result.output);
+            response.error = std::move(result.error);
+            if (!write_response(fd, response))
+            {
+                break;
+            }
+        }
+        close(fd);
+        slots->release();
+    }
+} // namespace
+
+int main(int argc, const char **argv)
+{
+    ServerOptions options = parse_server_command_line(argc, argv);
+
+    // A client that hangs up early must not take the server down with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+    {
+        DIE << "socket: " << strerror(errno);
+    }
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, options.socket_path.c_str());
+    unlink(options.socket_path.c_str());
+    if (bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        listen(listen_fd, SOMAXCONN) != 0)
+    {
+        DIE << "unable to listen on " << options.socket_path << ": " << strerror(errno);
+    }
+
+    BfService service(options.service);
+    JobQueue queue;
+    std::vector<std::thread> workers;
+    for (int i = 0; i < options.workers; ++i)
+    {
+        workers.emplace_back(run_jobs, &queue, &service, std::cref(options));
+    }
+
+    std::cerr << "bfserver: listening on " << options.socket_path << " with " << options.workers
+              << " workers\n";
+
+    // Out of file descriptors or threads, the pending connection stays in the
+    // backlog and accepting again would fail right away; wait for some to be
+    // released instead of spinning.
+    const auto backoff = std::chrono::milliseconds(100);
+
+    ConnectionSlots slots(options.max_connections);
+    for (;;)
+    {
+        slots.acquire();
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            int error = errno;
+            slots.release();
+            if (error == EINTR || error == ECONNABORTED)
+            {
+                continue;
+            }
+            if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM)
+            {
+                std::cerr << "bfserver: accept: " << strerror(error) << "\n";
+                std::this_thread::sleep_for(backoff);
+                continue;
+            }
+            DIE << "accept: " << strerror(error);
+        }
+        try
+        {
+            std::thread(serve_connection, fd, &queue, &slots, std::cref(options)).detach();
+        }
+        catch (const std::system_error &e)
+        {
+            std::cerr << "bfserver: unable to start a reader: " << e.what() << "\n";
+            close(fd);
+            slots.release();
+            std::this_thread::sleep_for(backoff);
+        }
+    }
+}
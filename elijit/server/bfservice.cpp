@@ -0,0 +1,417 @@
+#include "bfservice.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#include <pthread.h>
+
+#include "../jit/optasmjit/codegen.h"
+#include "../libbfir/bfio.h"
+#include "../libbfir/bfir.h"
+#include "../libbfir/bytecode.h"
+#include "../libbfir/parser.h"
+#include "../libbfir/tape.h"
+#include "../libbfir/utils.h"
+
+const int kTimeoutSignal = SIGRTMIN + 1;
+
+namespace
+{
+
+    // Why a run was cut short, as passed to siglongjmp.
+
+    enum RunJump
+    {
+        kJumpTapeOverflow = kTapeOverflowJump,
+        kJumpTimedOut,
+        kJumpOutputLimit,
+    };
+
+    // Per-run state for the signal handlers and I/O callbacks, which run on
+    // the thread executing the program.
+    //
+    // While the thread is inside C++ code that mustn't be interrupted (the
+    // I/O callbacks allocate; the watchdog calls lock a mutex), in_callback
+    // is set and a timeout is only recorded in pending; the code jumps out
+    // itself once it is safe.
+
+    struct RunState
+    {
+        sigjmp_buf jump;
+        volatile sig_atomic_t armed = 0;
+        volatile sig_atomic_t in_callback = 0;
+        volatile sig_atomic_t pending = 0;
+        uint64_t watch_id = 0;
+    };
+
+    thread_local RunState *current_run = nullptr;
+
+    void jump_if_pending(RunState *state)
+    {
+        state->in_callback = 0;
+        if (state->pending)
+        {
+            siglongjmp(state->jump, state->pending);
+        }
+    }
+
+    void on_timeout_signal(int)
+    {
+        RunState *state = current_run;
+        if (!state || !state->armed)
+        {
+            return;
+        }
+        if (state->in_callback)
+        {
+            state->pending = kJumpTimedOut;
+            return;
+        }
+        siglongjmp(state->jump, kJumpTimedOut);
+    }
+
+    // Input comes from a string given up front; output is collected into
+    // another one.
+
+    struct CapturingIo : BfIo
+    {
+        std::string *output;
+        size_t max_output;
+    };
+
+    void capture_flush(BfIo *io)
+    {
+        CapturingIo *capturing = static_cast<CapturingIo *>(io);
+        RunState *state = current_run;
+        state->in_callback = 1;
+
+        size_t n = io->out_cursor - io->out_buffer;
+        if (capturing->output->size() + n > capturing->max_output)
+        {
+            state->in_callback = 0;
+            siglongjmp(state->jump, kJumpOutputLimit);
+        }
+        capturing->output->append(reinterpret_cast<const char *>(io->out_buffer), n);
+        io->out_cursor = io->out_buffer;
+
+        jump_if_pending(state);
+    }
+
+    int capture_refill(BfIo *io)
+    {
+        capture_flush(io);
+        return -1;
+    }
+
+    void install_timeout_handler()
+    {
+        static bool installed = [] {
+            struct sigaction action;
+            memset(&action, 0, sizeof(action));
+            action.sa_handler = on_timeout_signal;
+            sigemptyset(&action.sa_mask);
+            if (sigaction(kTimeoutSignal, &action, nullptr) != 0)
+            {
+                DIE << "sigaction failed: " << strerror(errno);
+            }
+            return true;
+        }();
+        (void)installed;
+    }
+
+    // Returns a description of the first unmatched bracket, or an empty
+    // string if they all match.
+
+    std::string check_brackets(const std::string &instructions)
+    {
+        std::vector<size_t> open;
+        for (size_t pc = 0; pc < instructions.size(); ++pc)
+        {
+            if (instructions[pc] == '[')
+            {
+                open.push_back(pc);
+            }
+            else if (instructions[pc] == ']')
+            {
+                if (open.empty())
+                {
+                    return "unmatched ']' at pc=" + std::to_string(pc);
+                }
+                open.pop_back();
+            }
+        }
+        if (!open.empty())
+        {
+            return "unmatched '[' at pc=" + std::to_string(open.back());
+        }
+        return "";
+    }
+} // namespace
+
+// A compiled program. Runs hold a reference, so evicting it from the cache
+// never pulls code out from under a running thread.
+
+struct BfService::CompiledProgram
+{
+    std::shared_ptr<asmjit::JitRuntime> runtime;
+    JittedFunc func = nullptr;
+
+    ~CompiledProgram()
+    {
+        // JitRuntime's allocator does its own locking.
+        if (func)
+        {
+            runtime->release(func);
+        }
+    }
+};
+
+struct BfService::Shard
+{
+    struct Entry
+    {
+        std::shared_ptr<CompiledProgram> program;
+        std::list<const std::string *>::iterator lru_position;
+    };
+
+    std::mutex mutex;
+    std::shared_ptr<asmjit::JitRuntime> runtime = std::make_shared<asmjit::JitRuntime>();
+    std::unordered_map<std::string, Entry> programs;
+
+    // Keys of programs, most recently used first.
+    std::list<const std::string *> lru;
+    size_t capacity = 0;
+};
+
+// Interrupts runs that overrun their deadline with kTimeoutSignal.
+
+class BfService::Watchdog
+{
+public:
+    Watchdog() : thread_([this] { loop(); }) {}
+
+    ~Watchdog()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wakeup_.notify_one();
+        thread_.join();
+    }
+
+    uint64_t watch(pthread_t thread, double seconds)
+    {
+        auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                            std::chrono::duration<double>(seconds));
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t id = next_id_++;
+        watched_[id] = {thread, deadline};
+        wakeup_.notify_one();
+        return id;
+    }
+
+    void unwatch(uint64_t id)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        watched_.erase(id);
+    }
+
+private:
+    struct Watched
+    {
+        pthread_t thread;
+        std::chrono::steady_clock::time_point deadline;
+        bool signalled = false;
+    };
+
+    void loop()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stop_)
+        {
+            auto now = std::chrono::steady_clock::now();
+            auto next = now + std::chrono::seconds(1);
+            for (auto &entry : watched_)
+            {
+                Watched &w = entry.second;
+                if (w.signalled)
+                {
+                    continue;
+                }
+                if (w.deadline <= now)
+                {
+                    pthread_kill(w.thread, kTimeoutSignal);
+                    w.signalled = true;
+                }
+                else
+                {
+                    next = std::min(next, w.deadline);
+                }
+            }
+            wakeup_.wait_until(lock, next);
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::map<uint64_t, Watched> watched_;
+    uint64_t next_id_ = 1;
+    bool stop_ = false;
+
+    // Last, so that everything above is initialized when it starts.
+    std::thread thread_;
+};
+
+BfService::BfService(const ServiceOptions &options) : options_(options)
+{
+    if (options_.cell_bits != 8 && options_.cell_bits != 16 && options_.cell_bits != 32)
+    {
+        DIE << "cell_bits must be 8, 16 or 32, got " << options_.cell_bits;
+    }
+    if (options_.runtimes < 1)
+    {
+        DIE << "need at least one JitRuntime";
+    }
+
+    install_timeout_handler();
+
+    for (int i = 0; i < options_.runtimes; ++i)
+    {
+        shards_.emplace_back(new Shard);
+        shards_.back()->capacity =
+            std::max<size_t>(1, options_.max_cached_programs / options_.runtimes);
+    }
+    watchdog_.reset(new Watchdog);
+}
+
+BfService::~BfService() = default;
+
+size_t BfService::cached_programs() const
+{
+    size_t count = 0;
+    for (const auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        count += shard->programs.size();
+    }
+    return count;
+}
+
+std::shared_ptr<BfService::CompiledProgram>
+BfService::lookup_or_compile(const std::string &instructions, RunResult *result)
+{
+    // Compiling under the shard lock keeps concurrent requests for the same
+    // program from compiling it twice; other shards are unaffected.
+
+    Shard &shard = *shards_[std::hash<std::string>()(instructions) % shards_.size()];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto it = shard.programs.find(instructions);
+    if (it != shard.programs.end())
+    {
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru_position);
+        result->cache_hit = true;
+        return it->second.program;
+    }
+
+    Timer t;
+    Program p;
+    p.instructions = instructions;
+    Bytecode bytecode = encode_bytecode(compile_to_ops(p, kDefaultOptLevel, false));
+
+    std::shared_ptr<CompiledProgram> program = std::make_shared<CompiledProgram>();
+    program->runtime = shard.runtime;
+    program->func = compile_function(*shard.runtime, bytecode, 0, bytecode.code.size(),
+                                     options_.cell_bits / 8);
+    result->compile_seconds = t.elapsed();
+
+    auto inserted = shard.programs.emplace(instructions, Shard::Entry{program, {}}).first;
+    shard.lru.push_front(&inserted->first);
+    inserted->second.lru_position = shard.lru.begin();
+
+    while (shard.programs.size() > shard.capacity)
+    {
+        shard.programs.erase(*shard.lru.back());
+        shard.lru.pop_back();
+    }
+    return program;
+}
+
+RunResult BfService::run(const std::string &program_text, const std::string &input,
+                         const RunLimits &limits)
+{
+    RunResult result;
+
+    std::istringstream text(program_text);
+    std::string instructions = parse_from_stream(text).instructions;
+    result.error = check_brackets(instructions);
+    if (!result.error.empty())
+    {
+        result.status = RunStatus::kBadProgram;
+        return result;
+    }
+
+    std::shared_ptr<CompiledProgram> program = lookup_or_compile(instructions, &result);
+
+    Tape tape(options_.cell_bits / 8, max_pointer_move(instructions));
+    std::unique_ptr<CapturingIo> io(new CapturingIo);
+    bfio_init(io.get());
+    io->flush = capture_flush;
+    io->refill = capture_refill;
+    io->in_cursor = reinterpret_cast<const uint8_t *>(input.data());
+    io->in_end = io->in_cursor + input.size();
+    io->in_eof = true;
+    io->output = &result.output;
+    io->max_output = limits.max_output;
+
+    RunState state;
+    current_run = &state;
+    set_tape_overflow_jump(&state.jump);
+
+    Timer t;
+    int jump = sigsetjmp(state.jump, 1);
+    if (jump == 0)
+    {
+        state.in_callback = 1;
+        state.watch_id = watchdog_->watch(pthread_self(), limits.timeout_seconds);
+        state.armed = 1;
+        jump_if_pending(&state);
+
+        program->func(reinterpret_cast<uint64_t>(tape.data()), io.get());
+        io->flush(io.get());
+    }
+
+    state.in_callback = 1;
+    state.armed = 0;
+    watchdog_->unwatch(state.watch_id);
+    set_tape_overflow_jump(nullptr);
+    current_run = nullptr;
+    result.run_seconds = t.elapsed();
+
+    switch (jump)
+    {
+    case 0:
+        result.status = RunStatus::kOk;
+        break;
+    case kJumpTapeOverflow:
+        result.status = RunStatus::kTapeOverflow;
+        break;
+    case kJumpTimedOut:
+        result.status = RunStatus::kTimedOut;
+        break;
+    case kJumpOutputLimit:
+        result.status = RunStatus::kOutputLimit;
+        break;
+    }
+    return result;
+}
@@ -0,0 +1,125 @@
+#ifndef BFSERVICE_H
+#define BFSERVICE_H
+
+// In-process API for running many BF programs with the optasmjit code
+// generator, without paying for a process and a compile per run.
+//
+// A BfService compiles each distinct program once and keeps the compiled
+// function in a cache keyed by the program text. The cache is split into
+// shards, each with its own asmjit::JitRuntime and lock, so that compiles of
+// unrelated programs don't serialize on one allocator. Runs are independent:
+// each gets a fresh tape and in-memory I/O, and any number of threads may
+// call run() at once.
+//
+// A run that overflows the tape, exceeds its time limit or produces too much
+// output is stopped and reported in its RunResult; the process carries on.
+// Time limits are enforced by a watchdog thread that interrupts the running
+// thread with kTimeoutSignal.
+
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// SIGRTMIN + 1; hosts must leave it alone.
+
+extern const int kTimeoutSignal;
+
+struct ServiceOptions
+{
+    // Width of a tape cell in bits: 8, 16 or 32.
+    int cell_bits = 8;
+
+    // Number of JitRuntimes, i.e. cache shards.
+    int runtimes = 4;
+
+    // Compiled programs kept across all shards; least recently used ones are
+    // dropped first.
+    size_t max_cached_programs = 1024;
+};
+
+struct RunLimits
+{
+    double timeout_seconds = 10;
+    size_t max_output = 16 << 20;
+};
+
+enum class RunStatus : uint32_t
+{
+    kOk = 0,
+    kBadProgram = 1,
+    kTapeOverflow = 2,
+    kTimedOut = 3,
+    kOutputLimit = 4,
+};
+
+// Inline so that clients can use it without linking the JIT.
+
+inline const char *RunStatus_name(RunStatus status)
+{
+    switch (status)
+    {
+    case RunStatus::kOk:
+        return "ok";
+    case RunStatus::kBadProgram:
+        return "bad program";
+    case RunStatus::kTapeOverflow:
+        return "tape overflow";
+    case RunStatus::kTimedOut:
+        return "timed out";
+    case RunStatus::kOutputLimit:
+        return "output limit exceeded";
+    }
+    return "unknown";
+}
+
+struct RunResult
+{
+    RunStatus status = RunStatus::kOk;
+
+    // What the program wrote; on failure, the output up to that point.
+    std::string output;
+
+    // Details for kBadProgram.
+    std::string error;
+
+    bool cache_hit = false;
+    double compile_seconds = 0;
+    double run_seconds = 0;
+};
+
+class BfService
+{
+public:
+    explicit BfService(const ServiceOptions &options = ServiceOptions());
+    ~BfService();
+
+    BfService(const BfService &) = delete;
+    BfService &operator=(const BfService &) = delete;
+
+    // Runs program_text (any text; non-BF characters are ignored) on input.
+    // Thread-safe.
+
+    RunResult run(const std::string &program_text, const std::string &input,
+                  const RunLimits &limits = RunLimits());
+
+    // Programs currently cached.
+
+    size_t cached_programs() const;
+
+private:
+    struct CompiledProgram;
+    struct Shard;
+    class Watchdog;
+
+    std::shared_ptr<CompiledProgram> lookup_or_compile(const std::string &instructions,
+                                                       RunResult *result);
+
+    ServiceOptions options_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::unique_ptr<Watchdog> watchdog_;
+};
+
+#endif /*BFSERVICE_H*/
@@ -0,0 +1,124 @@
+#include "protocol.h"
+
+#include <cerrno>
+
+#include <unistd.h>
+
+namespace
+{
+
+    bool read_exact(int fd, void *buf, size_t size)
+    {
+        char *p = static_cast<char *>(buf);
+        while (size > 0)
+        {
+            ssize_t n = read(fd, p, size);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return false;
+            }
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    bool write_all(int fd, const void *buf, size_t size)
+    {
+        const char *p = static_cast<const char *>(buf);
+        while (size > 0)
+        {
+            ssize_t n = write(fd, p, size);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return false;
+            }
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    void put_u32(std::string *out, uint32_t value)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            out->push_back(static_cast<char>(value >> (8 * i)));
+        }
+    }
+
+    // Reads count 32-bit integers into values.
+
+    bool read_u32s(int fd, uint32_t *values, int count)
+    {
+        uint8_t bytes[16];
+        if (!read_exact(fd, bytes, 4 * count))
+        {
+            return false;
+        }
+        for (int i = 0; i < count; ++i)
+        {
+            const uint8_t *b = bytes + 4 * i;
+            values[i] = b[0] | b[1] << 8 | b[2] << 16 | static_cast<uint32_t>(b[3]) << 24;
+        }
+        return true;
+    }
+
+    bool read_string(int fd, uint32_t size, std::string *s)
+    {
+        s->resize(size);
+        return size == 0 || read_exact(fd, &(*s)[0], size);
+    }
+} // namespace
+
+bool read_request(int fd, Request *request)
+{
+    uint32_t sizes[2];
+    return read_u32s(fd, sizes, 2) && sizes[0] <= kMaxProgramSize && sizes[1] <= kMaxInputSize &&
+           read_string(fd, sizes[0], &request->program) &&
+           read_string(fd, sizes[1], &request->input);
+}
+
+bool write_request(int fd, const Request &request)
+{
+    std::string message;
+    put_u32(&message, request.program.size());
+    put_u32(&message, request.input.size());
+    message += request.program;
+    message += request.input;
+    return write_all(fd, message.data(), message.size());
+}
+
+bool read_response(int fd, Response *response)
+{
+    uint32_t fields[3];
+    if (!read_u32s(fd, fields, 3))
+    {
+        return false;
+    }
+    response->status = static_cast<RunStatus>(fields[0]);
+    return read_string(fd, fields[1], &response->output) &&
+           read_string(fd, fields[2], &response->error);
+}
+
+bool write_response(int fd, const Response &response)
+{
+    std::string header;
+    put_u32(&header, static_cast<uint32_t>(response.status));
+    put_u32(&header, response.output.size());
+    put_u32(&header, response.error.size());
+
+    // The output can be large; send it as is rather than copying it into
+    // one message.
+    return write_all(fd, header.data(), header.size()) &&
+           write_all(fd, response.output.data(), response.output.size()) &&
+           write_all(fd, response.error.data(), response.error.size());
+}
@@ -0,0 +1,45 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+// Wire format between bfserver and its clients, over a Unix stream socket.
+// A connection carries any number of request/response pairs, one at a time.
+// All integers are 32-bit little-endian.
+//
+//   request:  program_size input_size <program> <input>
+//   response: status output_size error_size <output> <error>
+//
+// status is a RunStatus; the program and input are raw bytes, and the program
+// may contain any text (non-BF characters are ignored as usual).
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "bfservice.h"
+
+constexpr uint32_t kMaxProgramSize = 1 << 20;
+constexpr uint32_t kMaxInputSize = 16 << 20;
+
+struct Request
+{
+    std::string program;
+    std::string input;
+};
+
+struct Response
+{
+    RunStatus status = RunStatus::kOk;
+    std::string output;
+    std::string error;
+};
+
+// Each returns false if the peer closed the connection or sent something
+// malformed, and true otherwise. Errors on fd are treated as a closed
+// connection.
+
+bool read_request(int fd, Request *request);
+bool write_request(int fd, const Request &request);
+bool read_response(int fd, Response *response);
+bool write_response(int fd, const Response &response);
+
+#endif /*PROTOCOL_H*/